@@ -37,7 +37,7 @@
  * 大部分节点对下一个视图达成一致。Paxos 日志包含所有商定的值（即视图）。
  */
 // The RSM module informs config to add nodes. The config module
-// runs a heartbeater thread that checks in with nodes.  If a node
+// runs a heartbeater timer that checks in with nodes.  If a node
 // doesn't respond, the config module will invoke Paxos's proposer to
 // remove the node.  Higher layers will learn about this change when a
 // Paxos acceptor accepts the new proposed value through
@@ -60,19 +60,17 @@
  * 其他节点可以更新重新连接的节点。
  */
 
-static void *
-heartbeatthread(void *x)
+// a heartbeat round makes RPCs, so it runs on the timer_wheel's pool
+void
+config::heartbeat_timer::expire()
 {
-  config *r = (config *) x;
-  r->heartbeater();
-  return 0;
+  cfg->heartbeater();
 }
 
 config::config(std::string _first, std::string _me, config_view_change *_vc) 
   : myvid (0), first (_first), me (_me), vc (_vc)
 {
   VERIFY (pthread_mutex_init(&cfg_mutex, NULL) == 0);
-  VERIFY(pthread_cond_init(&config_cond, NULL) == 0);  
 
   std::ostringstream ost;
   ost << me;
@@ -89,8 +87,8 @@ config::config(std::string _first, std::string _me, config_view_change *_vc)
 
       reconstruct();
 
-      pthread_t th;
-      VERIFY (pthread_create(&th, NULL, &heartbeatthread, (void *) this) == 0);
+      hbtimer.cfg = this;
+      timer_wheel::instance()->schedule(&hbtimer, heartbeat_ms, true);
   }
 }
 
@@ -254,34 +252,21 @@ config::remove_wo(std::string m)
 void
 config::heartbeater()
 {
-  struct timeval now;
-  struct timespec next_timeout;
   std::string m;
   heartbeat_t h;
   bool stable;
   unsigned vid;
   std::vector<std::string> cmems;
   ScopedLock ml(&cfg_mutex);
-  
-  while (1) {
-
-    // 3 秒一次心跳
-    gettimeofday(&now, NULL);
-    next_timeout.tv_sec = now.tv_sec + 3;
-    next_timeout.tv_nsec = 0;
-    tprintf("heartbeater: go to sleep\n");
-    pthread_cond_timedwait(&config_cond, &cfg_mutex, &next_timeout);
-
-    stable = true;
-    vid = myvid;
-    cmems = get_view_wo(vid);
-    tprintf("heartbeater: current membership %s\n", print_members(cmems).c_str());
 
-    if (!isamember(me, cmems)) {
-      tprintf("heartbeater: not member yet; skip hearbeat\n");
-      continue;
-    }
+  stable = true;
+  vid = myvid;
+  cmems = get_view_wo(vid);
+  tprintf("heartbeater: current membership %s\n", print_members(cmems).c_str());
 
+  if (!isamember(me, cmems)) {
+    tprintf("heartbeater: not member yet; skip hearbeat\n");
+  } else {
     // find the node with the smallest id
     m = me;
     for (unsigned i = 0; i < cmems.size(); i++) {
@@ -314,6 +299,10 @@ config::heartbeater()
       remove_wo(m);
     }
   }
+
+  // 3 秒一次心跳
+  tprintf("heartbeater: go to sleep\n");
+  timer_wheel::instance()->schedule(&hbtimer, heartbeat_ms, true);
 }
 
 paxos_protocol::status
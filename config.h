@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include "paxos.h"
+#include "timer_wheel.h"
 
 class config_view_change {
  public:
@@ -23,7 +24,13 @@ class config : public paxos_change {
   std::vector<std::string> mems;
   pthread_mutex_t cfg_mutex;
   pthread_cond_t heartbeat_cond;
-  pthread_cond_t config_cond;
+  // runs heartbeater() every heartbeat_ms
+  struct heartbeat_timer : public timer_wheel::timer {
+    config *cfg;
+    void expire();
+  };
+  heartbeat_timer hbtimer;
+  enum { heartbeat_ms = 3000 };
   paxos_protocol::status heartbeat(std::string m, unsigned instance, int &r);
   std::string value(std::vector<std::string> mems);
   std::vector<std::string> members(std::string v);
@@ -11,9 +11,11 @@
 
 extent_client::extent_client(std::string dst)
 {
-  sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
+  sockaddr_storage dstsock;
+  socklen_t len;
+  make_sockaddr(dst.c_str(), &dstsock, &len); // host:port, or unix:path
+  cl = new rpcc((sockaddr *)&dstsock, len);
+  cl->use_compact(true);
   if (cl->bind() != 0) {
     printf("extent_client: bind failed\n");
   }
@@ -41,7 +43,7 @@ extent_client::put(extent_protocol::extentid_t eid, std::string buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
   int r;
-  ret = cl->call(extent_protocol::put, eid, buf, r);
+  ret = cl->call(extent_protocol::put, eid, bytes_ref(buf), r);
   return ret;
 }
 
@@ -177,7 +177,8 @@ extent_client_cache::flush(extent_protocol::extentid_t eid) {
       case UPDATED: // 已经是最新的文件不用刷新
         break;
       case MODIFIED: // 已修改的文件将修改后内容提交到文件服务器
-        ret = cl->call(extent_protocol::put, eid, extent.data, r);
+        // 文件内容直接从缓存发送，不再复制到 marshall 中
+        ret = cl->call(extent_protocol::put, eid, bytes_ref(extent.data), r);
         break;
       case REMOVED: // 被删除的文件请求文件服务器正式删除
         ret = cl->call(extent_protocol::remove, eid);
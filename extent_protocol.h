@@ -26,24 +26,6 @@ class extent_protocol {
   };
 };
 
-inline unmarshall &
-operator>>(unmarshall &u, extent_protocol::attr &a)
-{
-  u >> a.atime;
-  u >> a.mtime;
-  u >> a.ctime;
-  u >> a.size;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, extent_protocol::attr a)
-{
-  m << a.atime;
-  m << a.mtime;
-  m << a.ctime;
-  m << a.size;
-  return m;
-}
+RPC_FIELDS(extent_protocol::attr, atime, mtime, ctime, size)
 
 #endif 
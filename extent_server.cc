@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 #include <sstream>
+#include <utility>
 
 extent_server::extent_server() {
   pthread_mutex_init(&map_mutex, NULL);
@@ -27,12 +28,20 @@ int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &) {
     attr.ctime = file_map[id].attr.atime;
   }
   attr.size = buf.size();
-  file_map[id].data = buf;
+  file_map[id].data = std::move(buf);
   file_map[id].attr = attr;
 
   return extent_protocol::OK;
 }
 
+void extent_server::stats(std::map<std::string, std::string> *kv) {
+  ScopedLock _l(&map_mutex);
+  unsigned long long bytes = 0;
+  for (auto &f : file_map) bytes += f.second.data.size();
+  (*kv)["extent.files"] = std::to_string(file_map.size());
+  (*kv)["extent.bytes"] = std::to_string(bytes);
+}
+
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf) {
   ScopedLock _l(&map_mutex);
 
@@ -10,7 +10,7 @@
 /**
  * 文件存储服务，模拟远程磁盘，提供以 i-number 标识的文件操作
  */
-class extent_server {
+class extent_server : public rpc_stats_provider {
 
  public:
   struct extent { // 文件类型
@@ -25,10 +25,14 @@ class extent_server {
   extent_server();
 
   /* 对文件的操作 */
+  // buf 按值传入：rpc 层把请求里的数据移动进来，put 再把它移动进 file_map
   int put(extent_protocol::extentid_t id, std::string, int &);
   int get(extent_protocol::extentid_t id, std::string &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+
+  // extent.files, extent.bytes for rpc_const::stats
+  void stats(std::map<std::string, std::string> *kv);
 };
 
 #endif 
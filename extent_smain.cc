@@ -1,4 +1,5 @@
 #include <arpa/inet.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,24 +13,29 @@ int main(int argc, char *argv[]) {
   int count = 0;
 
   if (argc != 2) {
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+    fprintf(stderr, "Usage: %s [port | unix:path]\n", argv[0]);
     exit(1);
   }
 
   setvbuf(stdout, NULL, _IONBF, 0);
+  // kill -USR1 prints per-procedure rpc statistics to stderr
+  rpc_stats_on_signal(SIGUSR1);
+  // kill -USR2 writes the trace rings to /tmp/rpc-trace.<pid>
+  rpc_trace_on_signal(SIGUSR2);
 
   char *count_env = getenv("RPC_COUNT");
   if (count_env != NULL) {
     count = atoi(count_env);
   }
 
-  rpcs server(atoi(argv[1]), count);
+  rpcs server(argv[1], count);
   extent_server ls;
   // 给 rpc 服务器注册请求处理函数
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.add_stats(&ls);
 
   while (1) sleep(1000);
 }
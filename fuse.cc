@@ -12,11 +12,13 @@
 #include <strings.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include "lang/verify.h"
 #include "yfs_client.h"
+#include "trace.h"
 
 int myid;
 yfs_client *yfs;
@@ -472,6 +474,8 @@ main(int argc, char *argv[])
   int fd;
 
   setvbuf(stdout, NULL, _IONBF, 0);
+  // kill -USR2 writes the trace rings to /tmp/rpc-trace.<pid>
+  rpc_trace_on_signal(SIGUSR2);
 
   if(argc != 4){
     fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server> <port-lock-server>\n");
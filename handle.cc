@@ -20,9 +20,10 @@ handle::safebind()
   if (h->cl) // 返回已连接到 rpc client
     return h->cl;
   // 否则，新建一个 rpc client
-  sockaddr_in dstsock;
-  make_sockaddr(h->m.c_str(), &dstsock);
-  rpcc *cl = new rpcc(dstsock);
+  sockaddr_storage dstsock;
+  socklen_t len;
+  make_sockaddr(h->m.c_str(), &dstsock, &len);
+  rpcc *cl = new rpcc((sockaddr *)&dstsock, len);
   // tprintf("handler_mgr::get_handle trying to bind...%s\n", h->m.c_str());
   int ret;
   // Starting with lab 6, our test script assumes that the failure
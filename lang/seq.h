@@ -0,0 +1,23 @@
+// compile time index sequences, for expanding a std::tuple into
+// an argument list (std::index_sequence is C++14)
+
+#ifndef seq_h
+#define seq_h
+
+template <unsigned... I>
+struct seq
+{
+};
+
+template <unsigned N, unsigned... I>
+struct gen_seq : gen_seq<N - 1, N - 1, I...>
+{
+};
+
+template <unsigned... I>
+struct gen_seq<0, I...>
+{
+    typedef seq<I...> type;
+};
+
+#endif
@@ -13,6 +13,9 @@ lock_client::lock_client(std::string dst)
   sockaddr_in dstsock;
   make_sockaddr(dst.c_str(), &dstsock); // 建立 socket 连接
   cl = new rpcc(dstsock); // 新建一个 rpc 客户端
+  // lock calls are a few small numbers and an id: varints and an
+  // interned id make them a few bytes
+  cl->use_compact(true);
   if (cl->bind() < 0) {
     printf("lock_client: call bind\n");
   }
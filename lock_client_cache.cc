@@ -23,12 +23,14 @@ lock_client_cache::lock_client_cache(std::string xdst,
   std::ostringstream host;
   host << hname << ":" << rlsrpc->port();
   id = host.str();
+  iid = cl->intern(id);
   pthread_mutex_init(&map_mutex, NULL);
 }
 
 lock_protocol::status lock_client_cache::acquire(lock_protocol::lockid_t lid) {
   int r;
   lock_protocol::status ret = lock_protocol::OK;
+  rpc_span sp("acquire");
   pthread_mutex_lock(&map_mutex);
   auto iter = lockid_lock.find(lid);
   if(iter == lockid_lock.end()) {
@@ -41,7 +43,7 @@ lock_protocol::status lock_client_cache::acquire(lock_protocol::lockid_t lid) {
         lock.state = ACQUIRING;
         lock.retry = false;
         pthread_mutex_unlock(&map_mutex);
-        ret = cl->call(lock_protocol::acquire, lid, id, r);
+        ret = cl->call(lock_protocol::acquire, lid, iid, r);
         pthread_mutex_lock(&map_mutex);
         if (ret == lock_protocol::OK) {  // 成功从锁服务获取到锁
           lock.state = LOCKED;
@@ -63,7 +65,7 @@ lock_protocol::status lock_client_cache::acquire(lock_protocol::lockid_t lid) {
         if (lock.retry) {  // 已收到 重试 请求，重新获取锁
           lock.retry = false;
           pthread_mutex_unlock(&map_mutex);
-          ret = cl->call(lock_protocol::acquire, lid, id, r);
+          ret = cl->call(lock_protocol::acquire, lid, iid, r);
           pthread_mutex_lock(&map_mutex);
           if (ret == lock_protocol::OK) {
             lock.state = LOCKED;
@@ -111,7 +113,7 @@ lock_protocol::status lock_client_cache::release(lock_protocol::lockid_t lid) {
     pthread_mutex_unlock(&map_mutex); // rpc 请求不应该发生在持有本地锁的时候
     // 释放锁之前，刷新当前锁对应文件的缓存，其他客户端在获取文件时先获取锁，触发锁的释放，刷新文件，保证分布式系统的文件一致性
     lu->dorelease(lid);
-    ret = cl->call(lock_protocol::release, lid, id, r);
+    ret = cl->call(lock_protocol::release, lid, iid, r);
     pthread_mutex_lock(&map_mutex);
 
     lock.state = NONE; // 锁服务进行释放后，锁不属于该客户端了
@@ -151,7 +153,7 @@ rlock_protocol::status lock_client_cache::revoke_handler(
     pthread_mutex_unlock(&map_mutex); // rpc 请求不应该发生在持有本地锁的时候
     // 释放锁之前，刷新当前锁对应文件的缓存，其他客户端在获取文件时先获取锁，触发锁的释放，刷新文件，保证分布式系统的文件一致性
     lu->dorelease(lid);
-    ret = cl->call(lock_protocol::release, lid, id, r);
+    ret = cl->call(lock_protocol::release, lid, iid, r);
     pthread_mutex_lock(&map_mutex);
 
     lock.state = NONE; // 锁服务进行释放后，锁不属于该客户端了
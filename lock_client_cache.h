@@ -41,6 +41,7 @@ class lock_client_cache : public lock_client {
   int rlock_port;
   std::string hostname;
   std::string id;
+  interned_str iid; // id, as acquire and release send it
   std::map<lock_protocol::lockid_t, lock> lockid_lock; // 记录客户端持有的所有锁
   pthread_mutex_t map_mutex;
   
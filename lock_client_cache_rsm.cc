@@ -7,6 +7,7 @@
 #include <iostream>
 #include <stdio.h>
 #include "tprintf.h"
+#include "trace.h"
 
 #include "rsm_client.h"
 
@@ -38,6 +39,9 @@ lock_client_cache_rsm::lock_client_cache_rsm(std::string xdst,
   rpcs *rlsrpc = new rpcs(rlock_port);
   rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache_rsm::revoke_handler);
   rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache_rsm::retry_handler);
+  // lock traffic goes ahead of bulk data on a shared connection
+  set_rpc_priority(rlock_protocol::revoke, connection::prio_control);
+  set_rpc_priority(rlock_protocol::retry, connection::prio_control);
   xid = 1;
   // You fill this in Step Two, Lab 7
   // - Create rsmc, and use the object to do RPC 
@@ -60,12 +64,14 @@ lock_client_cache_rsm::releaser()
   // send a release RPC.
   int r;
   lock_protocol::status ret = lock_protocol::OK;
-  map<lock_protocol::lockid_t, lock>::iterator iter;
+  release_job j;
   while(1) {
-    releasing_lock.deq(&iter);
+    releasing_lock.deq(&j);
+    rpc_span_scope in(j.span);
+    rpc_span sp("release");
 
     pthread_mutex_lock(&map_mutex);
-    auto &lock  = iter->second;
+    auto &lock  = j.iter->second;
     lock.has_revoked = false;
     pthread_mutex_unlock(&map_mutex); // rpc 请求不应该发生在持有本地锁的时候
 
@@ -95,9 +101,8 @@ lock_protocol::status
 lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid)
 {
   int r;
-  struct timeval now;
-  struct timespec next_timeout;
   lock_protocol::status ret = lock_protocol::OK;
+  rpc_span sp("acquire");
   pthread_mutex_lock(&map_mutex);
   auto iter = lockid_lock.find(lid);
   if(iter == lockid_lock.end()) {
@@ -129,14 +134,11 @@ lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid)
              * 如果 master 在处理 release 时崩溃，可能会没有发送 retry 
              * 每隔 3s 自动重新请求锁
              */
-            gettimeofday(&now, NULL);
-            next_timeout.tv_sec = now.tv_sec + 3;
-            next_timeout.tv_nsec = 0;
-
-            pthread_cond_timedwait(&lock.retry_queue, &map_mutex, &next_timeout);
+            timer_wheel::instance()->cond_timedwait(&lock.retry_queue,
+                                                    &map_mutex, 3000);
             if (!lock.retry) {
-              printf(
-                  "lock_client_cache_rsm::acquire timeout wakeup retry_queue "
+              rpc_trace(
+                  2, "lock_client_cache_rsm::acquire timeout wakeup retry_queue "
                   "lid %llu [%s]%llu\n",
                   lid, id.c_str(), xid);
               lock.retry = true;
@@ -157,14 +159,11 @@ lock_client_cache_rsm::acquire(lock_protocol::lockid_t lid)
             goto out;
           } else if (ret == lock_protocol::RETRY) {
             if (!lock.retry) {
-              gettimeofday(&now, NULL);
-              next_timeout.tv_sec = now.tv_sec + 3;
-              next_timeout.tv_nsec = 0;
-
-              pthread_cond_timedwait(&lock.retry_queue, &map_mutex, &next_timeout);
+              timer_wheel::instance()->cond_timedwait(&lock.retry_queue,
+                                                      &map_mutex, 3000);
               if (!lock.retry) {
-                printf(
-                    "lock_client_cache_rsm::acquire timeout wakeup retry_queue "
+                rpc_trace(
+                    2, "lock_client_cache_rsm::acquire timeout wakeup retry_queue "
                     "lid %llu [%s]%llu\n",
                     lid, id.c_str(), xid);
                 lock.retry = true;
@@ -210,7 +209,7 @@ lock_client_cache_rsm::release(lock_protocol::lockid_t lid)
   lock &lock = iter->second;
   if(lock.has_revoked) { // 已经接收到锁服务的撤销请求，需要真正请求锁服务释放锁
     lock.state = RELEASING; // 当前锁正在被释放
-    releasing_lock.enq(iter);
+    releasing_lock.enq(release_job{iter, lock.revoked_in});
   } else { // 否则不需要真的在服务端释放锁
     lock.state = FREE;
     // 从该锁的等待队列中唤醒一个
@@ -245,9 +244,10 @@ lock_client_cache_rsm::revoke_handler(lock_protocol::lockid_t lid,
 
   if(lock.state == FREE) { // 当前锁空闲，可以直接请求锁服务释放
     lock.state = RELEASING; // 当前锁正在被释放
-    releasing_lock.enq(iter);
+    releasing_lock.enq(release_job{iter, rpc_span_cur});
   } else { // 否则标记当前锁需要撤销，在下一次客户端释放锁时，请求锁服务释放
     lock.has_revoked = true;
+    lock.revoked_in = rpc_span_cur;
   } 
 
   return ret;
@@ -44,6 +44,7 @@ class lock_client_cache_rsm : public lock_client {
     pthread_cond_t
         release_queue;  // 客户端正在释放锁时，有其他线程获取锁，等待释放后重新请求锁
     pthread_cond_t retry_queue;  // 服务端的锁已被其他客户端占用，等待重新请求锁
+    rpc_span_ctx revoked_in;  // 撤销请求所在的 trace，之后的释放也算在其中
     lock(lock_protocol::lockid_t lid) : lid(lid), has_revoked(false), retry(false), state(NONE) {
       pthread_cond_init(&wait_queue, NULL);
       pthread_cond_init(&release_queue, NULL);
@@ -61,7 +62,12 @@ class lock_client_cache_rsm : public lock_client {
   lock_protocol::xid_t xid; // 请求服务的编号
   std::map<lock_protocol::lockid_t, lock> lockid_lock; // 记录客户端持有的所有锁
   pthread_mutex_t map_mutex;
-  fifo<std::map<lock_protocol::lockid_t, lock>::iterator> releasing_lock; // 正在释放的锁队列
+  // 待释放的锁，以及引起释放的请求所在的 trace
+  struct release_job {
+    std::map<lock_protocol::lockid_t, lock>::iterator iter;
+    rpc_span_ctx span;
+  };
+  fifo<release_job> releasing_lock; // 正在释放的锁队列
   lock_protocol::xid_t nextXid() {
     // 必须持有锁
     return xid++;
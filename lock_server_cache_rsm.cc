@@ -41,6 +41,9 @@ lock_server_cache_rsm::lock_server_cache_rsm(class rsm *_rsm)
   VERIFY (r == 0);
   pthread_mutex_init(&map_mutex, NULL);
   rsm->set_state_transfer(this);
+  // lock traffic goes ahead of bulk data on a shared connection
+  set_rpc_priority(rlock_protocol::revoke, connection::prio_control);
+  set_rpc_priority(rlock_protocol::retry, connection::prio_control);
 }
 
 void
@@ -51,14 +54,15 @@ lock_server_cache_rsm::revoker()
   // messages to lock holders whenever another client wants the
   // same lock
   int r;
-  map<lock_protocol::lockid_t, lock>::iterator iter;
+  lock_job j;
   while(1) {
-    revoking_locks.deq(&iter);
+    revoking_locks.deq(&j);
     // 只有 master 才需要给客户端发送 RPC
     if(!rsm->amiprimary()) continue;
+    rpc_span_scope in(j.span);
     
     pthread_mutex_lock(&map_mutex);
-    auto &lock = iter->second;
+    auto &lock = j.iter->second;
     auto h = handle(lock.owner);
     pthread_mutex_unlock(&map_mutex);
 
@@ -77,14 +81,15 @@ lock_server_cache_rsm::retryer()
   // to be released and then sending retry messages to those who
   // are waiting for it.
   int r;
-  map<lock_protocol::lockid_t, lock>::iterator iter;
+  lock_job j;
   while (1) {
-    retring_locks.deq(&iter);
+    retring_locks.deq(&j);
     // 只有 master 才需要给客户端发送 RPC
     if(!rsm->amiprimary()) continue;
+    rpc_span_scope in(j.span);
 
     pthread_mutex_lock(&map_mutex);
-    auto &lock = iter->second;
+    auto &lock = j.iter->second;
     string client_need_retry = *lock.waiters.begin();  // 需要发送重试请求的客户端
     auto h = handle(client_need_retry);
     pthread_mutex_unlock(&map_mutex);
@@ -120,7 +125,7 @@ int lock_server_cache_rsm::acquire(lock_protocol::lockid_t lid, std::string id,
           "[%s]%llu\n",
           lid, id.c_str(), xid);
 
-      revoking_locks.enq(iter);
+      revoking_locks.enq(lock_job{iter, rpc_span_cur});
     }
 
     return lr.lastRet;
@@ -178,7 +183,7 @@ int lock_server_cache_rsm::acquire(lock_protocol::lockid_t lid, std::string id,
   lr.xid = xid;
   lr.lastRet = ret;
   if (lr.needRevoke) {
-    revoking_locks.enq(iter);
+    revoking_locks.enq(lock_job{iter, rpc_span_cur});
   }
 
   return ret;
@@ -244,7 +249,7 @@ lock_server_cache_rsm::release(lock_protocol::lockid_t lid, std::string id,
       lock.owner = "";
       lr.xid = 0;
       // 触发等待的锁客户端进行 retry
-      retring_locks.enq(iter);
+      retring_locks.enq(lock_job{iter, rpc_span_cur});
       break;
 
     default:
@@ -346,3 +351,20 @@ lock_server_cache_rsm::stat(lock_protocol::lockid_t lid, int &r)
   return lock_protocol::OK;
 }
 
+
+void
+lock_server_cache_rsm::stats(std::map<std::string, std::string> *kv)
+{
+  ScopedLock _l(&map_mutex);
+  size_t held = 0, waiters = 0, revoking = 0;
+  for (auto &it : lockid_lock) {
+    const lock &l = it.second;
+    if (l.state != FREE) held++;
+    if (l.revoked) revoking++;
+    waiters += l.waiters.size();
+  }
+  (*kv)["lock.locks"] = std::to_string(lockid_lock.size());
+  (*kv)["lock.held"] = std::to_string(held);
+  (*kv)["lock.waiters"] = std::to_string(waiters);
+  (*kv)["lock.revoking"] = std::to_string(revoking);
+}
@@ -11,7 +11,8 @@
 #include "rsm_state_transfer.h"
 #include "rsm.h"
 
-class lock_server_cache_rsm : public rsm_state_transfer {
+class lock_server_cache_rsm : public rsm_state_transfer,
+                              public rpc_stats_provider {
   enum lock_state {FREE, LOCKED, LOCKED_AND_WAIT, RETRYING};
   struct last_request {
     lock_protocol::xid_t xid; // 最后一次请求的序号
@@ -56,12 +57,20 @@ class lock_server_cache_rsm : public rsm_state_transfer {
   std::map<lock_protocol::lockid_t, lock> lockid_lock; // 锁id => 锁，保存系统中所有锁的状态
   pthread_mutex_t map_mutex; // 互斥量保护多线程访问 map
   class rsm *rsm;
-  fifo<std::map<lock_protocol::lockid_t, lock>::iterator> revoking_locks;
-  fifo<std::map<lock_protocol::lockid_t, lock>::iterator> retring_locks;
+  // a lock to revoke or retry, and the trace of the request that
+  // made it so; the revoker and retryer carry the trace on
+  struct lock_job {
+    std::map<lock_protocol::lockid_t, lock>::iterator iter;
+    rpc_span_ctx span;
+  };
+  fifo<lock_job> revoking_locks;
+  fifo<lock_job> retring_locks;
  public:
   lock_server_cache_rsm(class rsm *rsm = 0);
   lock_protocol::status stat(lock_protocol::lockid_t, int &);
   void revoker();
+  // lock.* for rpc_const::stats: the lock table and who waits
+  void stats(std::map<std::string, std::string> *kv);
   void retryer();
 
   /* 序列化和反序列化锁服务器的状态 */
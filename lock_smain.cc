@@ -26,6 +26,10 @@ main(int argc, char *argv[])
   // Force the lock_server to exit after 20 minutes
   signal(SIGALRM, force_exit);
   alarm(20 * 60);
+  // kill -USR1 prints per-procedure rpc statistics to stderr
+  rpc_stats_on_signal(SIGUSR1);
+  // kill -USR2 writes the trace rings to /tmp/rpc-trace.<pid>
+  rpc_trace_on_signal(SIGUSR2);
 
   setvbuf(stdout, NULL, _IONBF, 0);
   setvbuf(stderr, NULL, _IONBF, 0);
@@ -57,6 +61,7 @@ main(int argc, char *argv[])
   server.reg(lock_protocol::acquire, &ls, &lock_server_cache_rsm::acquire);
   server.reg(lock_protocol::release, &ls, &lock_server_cache_rsm::release);
   server.reg(lock_protocol::stat, &ls, &lock_server_cache_rsm::stat);
+  server.add_stats(&ls);
 #else
   rsm rsm(argv[1], argv[2]);
   lock_server_cache_rsm ls(&rsm);
@@ -65,6 +70,7 @@ main(int argc, char *argv[])
   rsm.reg(lock_protocol::acquire, &ls, &lock_server_cache_rsm::acquire);
   rsm.reg(lock_protocol::release, &ls, &lock_server_cache_rsm::release);
   rsm.reg(lock_protocol::stat, &ls, &lock_server_cache_rsm::stat);
+  rsm.add_stats(&ls);
 #endif // STEP_ONE
 #endif // RSM
 
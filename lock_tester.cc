@@ -164,6 +164,8 @@ main(int argc, char *argv[])
     setvbuf(stdout, NULL, _IONBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
     srandom(getpid());
+    // kill -USR2 writes the trace rings to /tmp/rpc-trace.<pid>
+    rpc_trace_on_signal(SIGUSR2);
 
     //jsl_set_debug(2);
 
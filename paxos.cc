@@ -310,6 +310,16 @@ acceptor::acceptor(class paxos_change *_cfg, bool _first, std::string _me,
   pxs->reg(paxos_protocol::preparereq, this, &acceptor::preparereq);
   pxs->reg(paxos_protocol::acceptreq, this, &acceptor::acceptreq);
   pxs->reg(paxos_protocol::decidereq, this, &acceptor::decidereq);
+  pxs->add_stats(this);
+}
+
+void
+acceptor::stats(std::map<std::string, std::string> *kv)
+{
+  ScopedLock ml(&pxs_mutex);
+  (*kv)["paxos.instance"] = std::to_string(instance_h);
+  (*kv)["paxos.n_h"] = std::to_string(n_h.n) + ":" + n_h.m;
+  (*kv)["paxos.n_a"] = std::to_string(n_a.n) + ":" + n_a.m;
 }
 
 paxos_protocol::status
@@ -358,7 +368,7 @@ acceptor::acceptreq(std::string src, paxos_protocol::acceptarg a, bool &r)
     // 收到一个等于 last_rnd 的写入请求
     // 接受写入
     n_a = a.n;
-    v_a = a.v;
+    v_a = std::move(a.v);
     r = true;
     l->logaccept(n_a, v_a);
   } else {
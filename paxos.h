@@ -14,7 +14,7 @@ class paxos_change {
   virtual ~paxos_change() {};
 };
 
-class acceptor {
+class acceptor : public rpc_stats_provider {
  private:
   class log *l;
   rpcs *pxs;
@@ -65,6 +65,8 @@ class acceptor {
   rpcs *get_rpcs() { return pxs; };
   prop_t get_n_h() { return n_h; };
   unsigned get_instance_h() { return instance_h; };
+  // paxos.instance and the proposals, for rpc_const::stats
+  void stats(std::map<std::string, std::string> *kv);
 };
 
 extern bool isamember(std::string m, const std::vector<std::string> &nodes);
@@ -1,13 +1,17 @@
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <netinet/tcp.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "method_thread.h"
 #include "connection.h"
+#include "marshall.h"
 #include "slock.h"
 #include "pollmgr.h"
 #include "jsl_log.h"
@@ -18,8 +22,12 @@
 
 
 connection::connection(chanmgr *m1, int f1, int l1) 
-: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1)
+: mgr_(m1), fd_(f1), dead_(false), rd_blocked_(false), next_id_(1),
+	writing_(false), wr_blocked_(false), rhdr_got_(0), rleft_(-1), rid_(0),
+	rlast_(false), backlog_(0), refno_(1), lossy_(l1)
 {
+	for (int p = 0; p < nprio; p++)
+		started_[p] = 0;
 
 	int flags = fcntl(fd_, F_GETFL, NULL);
 	flags |= O_NONBLOCK;
@@ -28,7 +36,6 @@ connection::connection(chanmgr *m1, int f1, int l1)
 	signal(SIGPIPE, SIG_IGN);
 	VERIFY(pthread_mutex_init(&m_,0)==0);
 	VERIFY(pthread_mutex_init(&ref_m_,0)==0);
-	VERIFY(pthread_cond_init(&send_wait_,0)==0);
 	VERIFY(pthread_cond_init(&send_complete_,0)==0);
  
         VERIFY(gettimeofday(&create_time_, NULL) == 0); 
@@ -41,11 +48,15 @@ connection::~connection()
 	VERIFY(dead_);
 	VERIFY(pthread_mutex_destroy(&m_)== 0);
 	VERIFY(pthread_mutex_destroy(&ref_m_)== 0);
-	VERIFY(pthread_cond_destroy(&send_wait_) == 0);
 	VERIFY(pthread_cond_destroy(&send_complete_) == 0);
 	if (rpdu_.buf)
 		free(rpdu_.buf);
-	VERIFY(!wpdu_.buf);
+	std::map<unsigned int, charbuf>::iterator i;
+	for (i = rpartial_.begin(); i != rpartial_.end(); i++)
+		free(i->second.buf);
+	for (int p = 0; p < nprio; p++)
+		VERIFY(sendq_[p].empty());
+	VERIFY(!wframe_.msg);
 	close(fd_);
 }
 
@@ -71,6 +82,7 @@ connection::closeconn()
 		if (!dead_) {
 			dead_ = true;
 			shutdown(fd_,SHUT_RDWR);
+			VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
 		}else{
 			return;
 		}
@@ -121,20 +133,36 @@ connection::compare(connection *another)
 }
 
 bool
-connection::send(char *b, int sz)
+connection::send(char *b, int sz, int prio)
 {
+	struct iovec iov;
+	iov.iov_base = b;
+	iov.iov_len = sz;
+	return send(&iov, 1, prio);
+}
+
+// the sender that finds nobody writing writes frames, its own and
+// others', until its pdu is out or the socket is full; then the
+// next one waiting takes over. m_ is let go around writev(), so
+// that other senders can queue pdus between frames.
+bool
+connection::send(const struct iovec *iov, int cnt, int prio)
+{
+	VERIFY(cnt > 0 && iov[0].iov_len >= sizeof(int));
+	VERIFY(prio >= 0 && prio < nprio);
+	outmsg m;
+	m.pdu.iov.assign(iov, iov+cnt);
+	for (int i = 0; i < cnt; i++)
+		m.pdu.sz += iov[i].iov_len;
+	m.done = false;
+	int sz = htonl(m.pdu.sz);
+	bcopy(&sz, iov[0].iov_base, sizeof(sz));
+	backlog_ += m.pdu.sz;
+
 	ScopedLock ml(&m_);
-	waiters_++;
-	while (!dead_ && wpdu_.buf) {
-		VERIFY(pthread_cond_wait(&send_wait_, &m_)==0);
-	}
-	waiters_--;
-	if (dead_) {
-		return false;
-	}
-	wpdu_.buf = b;
-	wpdu_.sz = sz;
-	wpdu_.solong = 0;
+	m.id = next_id_++;
+	if (!dead_)
+		sendq_[prio].push_back(&m);
 
 	if (lossy_) {
 		if ((random()%100) < lossy_) {
@@ -143,28 +171,43 @@ connection::send(char *b, int sz)
 		}
 	}
 
-	if (!writepdu()) { // 尝试写
-		dead_ = true;
-		VERIFY(pthread_mutex_unlock(&m_) == 0);
-		PollMgr::Instance()->block_remove_fd(fd_);
-		VERIFY(pthread_mutex_lock(&m_) == 0);
-	}else{ // 写成功
-		if (wpdu_.solong == wpdu_.sz) { // 全部写完了
-		}else{ // 写了一部分
-			//should be rare to need to explicitly add write callback
-			// 注册监听可写事件，并同步等待到数据写完
-			PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
-			while (!dead_ && wpdu_.solong >= 0 && wpdu_.solong < wpdu_.sz) {
-				VERIFY(pthread_cond_wait(&send_complete_,&m_) == 0);
-			}
+	while (!m.done && !dead_) {
+		if (writing_ || wr_blocked_) {
+			VERIFY(pthread_cond_wait(&send_complete_, &m_) == 0);
+			continue;
 		}
+		writing_ = true;
+		bool ok = writepdu(&m);
+		writing_ = false;
+		if (!ok && !dead_) {
+			dead_ = true;
+			VERIFY(pthread_mutex_unlock(&m_) == 0);
+			PollMgr::Instance()->block_remove_fd(fd_);
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+		}
+		VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
+	}
+	// the writer may still be copying a frame of m out
+	while (writing_ && wframe_.msg == &m)
+		VERIFY(pthread_cond_wait(&send_complete_, &m_) == 0);
+	if (!m.done)
+		fail_sends();
+	backlog_ -= m.pdu.sz;
+	return m.done;
+}
+
+// m_ held and the connection dead: drop the pdus still queued.
+// their senders see dead_ and return false.
+void
+connection::fail_sends()
+{
+	VERIFY(dead_);
+	for (int p = 0; p < nprio; p++) {
+		sendq_[p].clear();
+		started_[p] = 0;
 	}
-	bool ret = (!dead_ && wpdu_.solong == wpdu_.sz);
-	wpdu_.solong = wpdu_.sz = 0;
-	wpdu_.buf = NULL;
-	if (waiters_ > 0)
-		pthread_cond_broadcast(&send_wait_);
-	return ret;
+	if (!writing_)
+		wframe_.msg = NULL;
 }
 
 //fd_ is ready to be written
@@ -172,22 +215,13 @@ void
 connection::write_cb(int s)
 {
 	ScopedLock ml(&m_);
-	VERIFY(!dead_);
 	VERIFY(fd_ == s);
-	if (wpdu_.sz == 0) {
-		PollMgr::Instance()->del_callback(fd_,CB_WRONLY);
+	if (dead_)
 		return;
-	}
-	if (!writepdu()) {
-		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
-		dead_ = true;
-	}else{
-		VERIFY(wpdu_.solong >= 0);
-		if (wpdu_.solong < wpdu_.sz) {
-			return;
-		}
-	} 
-	pthread_cond_signal(&send_complete_);
+	// hand the socket back to the senders
+	wr_blocked_ = false;
+	PollMgr::Instance()->del_callback(fd_, CB_WRONLY);
+	VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
 }
 
 //fd_ is ready to be read
@@ -201,109 +235,271 @@ connection::read_cb(int s)
 	}
 
 	bool succ = true;
-	if (!rpdu_.buf || rpdu_.solong < rpdu_.sz) {
+	if (!rpdu_.buf) {
 		succ = readpdu(); // 将 socket 消息读取到读缓冲区
 	}
 
 	if (!succ) {
 		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
 		dead_ = true;
-		pthread_cond_signal(&send_complete_);
+		VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
 	}
 
-	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
+	if (rpdu_.buf) {
 		// 将消息作为包装成事件传递给线程池处理
 		if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
 			//chanmgr has successfully consumed the pdu
 			rpdu_.buf = NULL;
 			rpdu_.sz = rpdu_.solong = 0;
+		} else if (!dead_) {
+			// chanmgr is overloaded; leave the rest in the socket
+			// buffer, so tcp flow control slows the peer down,
+			// until chanmgr calls resume_read()
+			rd_blocked_ = true;
+			PollMgr::Instance()->del_callback(fd_, CB_RDONLY);
 		}
 	}
 }
 
+void
+connection::resume_read()
+{
+	ScopedLock ml(&m_);
+	if (!rd_blocked_ || dead_)
+		return;
+	VERIFY(rpdu_.buf && rpdu_.sz == rpdu_.solong);
+	if (!mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz))
+		return;
+	rpdu_.buf = NULL;
+	rpdu_.sz = rpdu_.solong = 0;
+	rd_blocked_ = false;
+	PollMgr::Instance()->add_callback(fd_, CB_RDONLY, this);
+}
+
+// m_ held. pick the pdu to take the next frame from.
 bool
-connection::writepdu()
+connection::next_frame()
 {
-	VERIFY(wpdu_.solong >= 0);
-	if (wpdu_.solong == wpdu_.sz)
+	for (int p = 0; p < nprio; p++) {
+		// the first pdu that has begun, or may begin
+		std::deque<outmsg *>::iterator i = sendq_[p].begin();
+		while (i != sendq_[p].end() && (*i)->pdu.solong == 0 &&
+				started_[p] >= frame_streams)
+			i++;
+		if (i == sendq_[p].end())
+			continue;
+		outmsg *o = *i;
+		sendq_[p].erase(i);
+		if (o->pdu.solong == 0)
+			started_[p]++;
+		int len = o->pdu.sz - o->pdu.solong;
+		if (len > frame_payload)
+			len = frame_payload;
+		wframe_.msg = o;
+		wframe_.off = o->pdu.solong;
+		wframe_.len = len;
+		wframe_.solong = 0;
+		o->pdu.solong += len;
+		wframe_.last = (o->pdu.solong == o->pdu.sz);
+		if (!wframe_.last)
+			sendq_[p].push_back(o);
+		else
+			started_[p]--;
+
+		unsigned int w[2];
+		w[0] = htonl(len | (wframe_.last ? frame_last : 0));
+		w[1] = htonl(o->id);
+		bcopy(w, wframe_.hdr, sizeof(w));
 		return true;
-
-	if (wpdu_.solong == 0) {
-		int sz = htonl(wpdu_.sz);
-		bcopy(&sz,wpdu_.buf,sizeof(sz));
 	}
-	int n = write(fd_, wpdu_.buf + wpdu_.solong, (wpdu_.sz-wpdu_.solong));
-	if (n < 0) {
-		if (errno != EAGAIN) {
-			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, errno);
-			wpdu_.solong = -1;
-			wpdu_.sz = 0;
+	return false;
+}
+
+// m_ held, and writing_ set so that no one else writes. write frames
+// until mine has gone out or the socket is full; false if the
+// connection failed.
+bool
+connection::writepdu(outmsg *mine)
+{
+	while (!mine->done && !dead_) {
+		if (!wframe_.msg && !next_frame())
+			break;
+
+		// what is left of the header, then of the payload
+		struct iovec iov[IOV_MAX];
+		int cnt = 0, off = wframe_.solong;
+		if (off < frame_hdr) {
+			iov[cnt].iov_base = wframe_.hdr + off;
+			iov[cnt].iov_len = frame_hdr - off;
+			cnt++;
+			off = 0;
+		} else {
+			off -= frame_hdr;
+		}
+		int left = wframe_.len - off;
+		off += wframe_.off;
+		std::vector<struct iovec> &v = wframe_.msg->pdu.iov;
+		for (unsigned i = 0; i < v.size() && left > 0 && cnt < IOV_MAX; i++) {
+			int len = v[i].iov_len;
+			if (off >= len) {
+				off -= len;
+				continue;
+			}
+			iov[cnt].iov_base = (char *)v[i].iov_base + off;
+			iov[cnt].iov_len = len - off < left ? len - off : left;
+			left -= iov[cnt].iov_len;
+			off = 0;
+			cnt++;
+		}
+
+		VERIFY(pthread_mutex_unlock(&m_) == 0);
+		int n = writev(fd_, iov, cnt);
+		int err = errno;
+		VERIFY(pthread_mutex_lock(&m_) == 0);
+		if (n < 0) {
+			if (err == EAGAIN) {
+				//should be rare to need to explicitly add write callback
+				wr_blocked_ = true;
+				PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
+				return true;
+			}
+			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, err);
+			return false;
+		}
+		wframe_.solong += n;
+		if (wframe_.solong == frame_hdr + wframe_.len) {
+			if (wframe_.last) {
+				wframe_.msg->done = true;
+				VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
+			}
+			wframe_.msg = NULL;
 		}
-		return (errno == EAGAIN);
 	}
-	wpdu_.solong += n;
 	return true;
 }
 
+// m_ held. check the header in rhdr_ and set up for its payload.
 bool
-connection::readpdu()
+connection::start_frame()
 {
-	if (!rpdu_.sz) {
-		int sz, sz1;
-		// 先读取本次消息长度，处理粘包问题
-		int n = read(fd_, &sz1, sizeof(sz1));
+	unsigned int w[2];
+	bcopy(rhdr_, w, sizeof(w));
+	int len = ntohl(w[0]) & ~frame_last;
+	rlast_ = (ntohl(w[0]) & frame_last) != 0;
+	rid_ = ntohl(w[1]);
+	if (len > frame_payload) {
+		jsl_log(JSL_DBG_2, "connection::readpdu frame TOO BIG %d\n", len);
+		return false;
+	}
 
-		if (n == 0) {
+	std::map<unsigned int, charbuf>::iterator it = rpartial_.find(rid_);
+	if (it == rpartial_.end()) {
+		// the first frame of a pdu, which starts with its size
+		int sz, sz1;
+		bcopy(rhdr_ + frame_hdr, &sz1, sizeof(sz1));
+		sz = ntohl(sz1);
+		if (sz > MAX_PDU || sz < (int)sizeof(sz) || len < (int)sizeof(sz)) {
+			jsl_log(JSL_DBG_2, "connection::readpdu bad pdu size %d in frame of %d\n",
+					sz, len);
 			return false;
 		}
-
-		if (n < 0) {
-			VERIFY(errno!=EAGAIN);
+		if (rpartial_.size() >= nprio * frame_streams) {
+			jsl_log(JSL_DBG_1, "connection::readpdu more than %d pdus begun, "
+					"closing\n", nprio * frame_streams);
+			shutdown(fd_, SHUT_RDWR);
 			return false;
 		}
+		// the buffer grows as frames come, so a pdu costs what the
+		// peer has sent of it, not what it says it will send
+		charbuf b((char *)malloc(len), sz); // 分配本次消息的缓冲区
+		VERIFY(b.buf);
+		b.cap = len;
+		bcopy(&sz1, b.buf, sizeof(sz));
+		b.solong = sizeof(sz);
+		it = rpartial_.insert(std::make_pair(rid_, b)).first;
+		len -= sizeof(sz);
+	}
+	charbuf &b = it->second;
+	if (b.solong + len > b.sz || rlast_ != (b.solong + len == b.sz)) {
+		jsl_log(JSL_DBG_2, "connection::readpdu frame of %d does not fit pdu %u\n",
+				len, rid_);
+		return false;
+	}
+	if (b.solong + len > b.cap) {
+		int cap = b.cap < b.sz / 2 ? b.cap * 2 : b.sz;
+		if (cap < b.solong + len)
+			cap = b.solong + len;
+		b.buf = (char *)realloc(b.buf, cap);
+		VERIFY(b.buf);
+		b.cap = cap;
+	}
+	rleft_ = len;
+	return true;
+}
 
-		if (n >0 && n!= sizeof(sz)) {
-			jsl_log(JSL_DBG_OFF, "connection::readpdu short read of sz\n");
-			return false;
+// read frames until a whole pdu is in rpdu_ or the socket has no
+// more data. false if the connection has failed.
+bool
+connection::readpdu()
+{
+	while (!rpdu_.buf) {
+		if (rleft_ < 0) {
+			int want = frame_hdr;
+			if (rhdr_got_ >= frame_hdr) {
+				unsigned int id;
+				bcopy(rhdr_ + sizeof(int), &id, sizeof(id));
+				if (!rpartial_.count(ntohl(id)))
+					want += sizeof(int);
+			}
+			if (rhdr_got_ < want) {
+				int n = read(fd_, rhdr_ + rhdr_got_, want - rhdr_got_);
+				if (n <= 0)
+					return n < 0 && errno == EAGAIN;
+				rhdr_got_ += n;
+				continue;
+			}
+			if (!start_frame())
+				return false;
 		}
 
-		sz = ntohl(sz1);
-
-		if (sz > MAX_PDU) {
-			char *tmpb = (char *)&sz1;
-			jsl_log(JSL_DBG_2, "connection::readpdu read pdu TOO BIG %d network order=%x %x %x %x %x\n", sz, 
-					sz1, tmpb[0],tmpb[1],tmpb[2],tmpb[3]);
-			return false;
+		// 读取消息体
+		charbuf &b = rpartial_[rid_];
+		if (rleft_ > 0) {
+			int n = read(fd_, b.buf + b.solong, rleft_);
+			if (n <= 0)
+				return n < 0 && errno == EAGAIN;
+			b.solong += n;
+			rleft_ -= n;
+			rpc_pdu_sum(b.buf, b.solong, &b.summed, &b.crc);
+			if (rleft_ > 0)
+				continue;
+		}
+		rleft_ = -1;
+		rhdr_got_ = 0;
+		if (rlast_) {
+			bool intact = rpc_pdu_intact(b.buf, b.sz, b.summed, b.crc);
+			if (!intact) {
+				jsl_log(JSL_DBG_1, "connection::readpdu bad checksum on "
+						"%d byte pdu, closing\n", b.sz);
+				free(b.buf);
+			} else {
+				rpdu_ = b;
+			}
+			rpartial_.erase(rid_);
+			if (!intact) {
+				// so that the peer sees it too, and sends again
+				// on a new connection
+				shutdown(fd_, SHUT_RDWR);
+				return false;
+			}
 		}
-
-		rpdu_.sz = sz;
-		VERIFY(rpdu_.buf == NULL);
-		rpdu_.buf = (char *)malloc(sz+sizeof(sz)); // 分配本次消息的缓冲区，大小为一开始读出的 n
-		VERIFY(rpdu_.buf);
-		bcopy(&sz1,rpdu_.buf,sizeof(sz));
-		rpdu_.solong = sizeof(sz);
-	}
-	// 读取消息体
-	int n = read(fd_, rpdu_.buf + rpdu_.solong, rpdu_.sz - rpdu_.solong);
-	if (n <= 0) {
-		if (errno == EAGAIN) // 读完了
-			return true;
-		if (rpdu_.buf)
-			free(rpdu_.buf);
-		rpdu_.buf = NULL;
-		rpdu_.sz = rpdu_.solong = 0;
-		return (errno == EAGAIN);
 	}
-	rpdu_.solong += n;
 	return true;
 }
 
 tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest) 
 : mgr_(m1), lossy_(lossytest)
 {
-
-	VERIFY(pthread_mutex_init(&m_,NULL) == 0);
-
 	struct sockaddr_in sin;
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
@@ -324,17 +520,50 @@ tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest)
 		VERIFY(0);
 	}
 
-	if(listen(tcp_, 1000) < 0) {
-		perror("tcpsconn::tcpsconn listen:");
-		VERIFY(0);
-	}
-
         socklen_t addrlen = sizeof(sin);
         VERIFY(getsockname(tcp_, (sockaddr *)&sin, &addrlen) == 0);
         port_ = ntohs(sin.sin_port);
 
 	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d %d\n", port_, 
 		sin.sin_port);
+	start();
+}
+
+// a socket file left behind by an earlier server is replaced
+tcpsconn::tcpsconn(chanmgr *m1, const char *path, int lossytest)
+: port_(0), path_(path), mgr_(m1), lossy_(lossytest)
+{
+	struct sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	VERIFY(path_.size() < sizeof(sun.sun_path));
+	strcpy(sun.sun_path, path);
+
+	tcp_ = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(tcp_ < 0){
+		perror("tcpsconn::tcpsconn accept_loop socket:");
+		VERIFY(0);
+	}
+
+	unlink(path);
+	if(bind(tcp_, (sockaddr *)&sun, sizeof(sun)) < 0){
+		perror("accept_loop unix bind:");
+		VERIFY(0);
+	}
+
+	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on unix:%s\n", path);
+	start();
+}
+
+void
+tcpsconn::start()
+{
+	VERIFY(pthread_mutex_init(&m_,NULL) == 0);
+
+	if(listen(tcp_, 1000) < 0) {
+		perror("tcpsconn::tcpsconn listen:");
+		VERIFY(0);
+	}
 
 	if (pipe(pipe_) < 0) {
 		perror("accept_loop pipe:");
@@ -353,6 +582,8 @@ tcpsconn::~tcpsconn()
 {
 	VERIFY(close(pipe_[1]) == 0);
 	VERIFY(pthread_join(th_, NULL) == 0);
+	if (!path_.empty())
+		unlink(path_.c_str());
 
 	//close all the active connections
 	std::map<int, connection *>::iterator i;
@@ -363,21 +594,22 @@ tcpsconn::~tcpsconn()
 }
 
 void tcpsconn::process_accept() {
-  sockaddr_in sin;
-  socklen_t slen = sizeof(sin);
+  sockaddr_storage sa;
+  socklen_t slen = sizeof(sa);
 	// 接收新连接
-  int s1 = accept(tcp_, (sockaddr *)&sin, &slen);
+  int s1 = accept(tcp_, (sockaddr *)&sa, &slen);
   if (s1 < 0) {
     perror("tcpsconn::accept_conn error");
     pthread_exit(NULL);
   }
 
-  jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n", s1,
-          inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+  jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s\n", s1,
+          path_.empty() ? sockaddr_str((sockaddr *)&sa).c_str() : path_.c_str());
 	// 创建新的连接，并添加到事件循环中
   connection *ch = new connection(mgr_, s1, lossy_);
 
   // garbage collect all dead connections with refcount of 1
+  ScopedLock ml(&m_);
   std::map<int, connection *>::iterator i;
   for (i = conns_.begin(); i != conns_.end();) {
     if (i->second->isdead() && i->second->ref() == 1) {
@@ -396,6 +628,18 @@ void tcpsconn::process_accept() {
   conns_[ch->channo()] = ch;
 }
 
+int
+tcpsconn::nconns()
+{
+	ScopedLock ml(&m_);
+	int n = 0;
+	std::map<int, connection *>::iterator i;
+	for (i = conns_.begin(); i != conns_.end(); i++)
+		if (!i->second->isdead())
+			n++;
+	return n;
+}
+
 // 用一个单独的 select 监听新链接
 void
 tcpsconn::accept_conn()
@@ -436,18 +680,37 @@ tcpsconn::accept_conn()
 connection *
 connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
 {
-	int s= socket(AF_INET, SOCK_STREAM, 0);
+	return connect_to_dst((const sockaddr *)&dst, sizeof(dst), mgr, lossy);
+}
+
+connection *
+connect_to_dst(const sockaddr *dst, socklen_t len, chanmgr *mgr, int lossy)
+{
+	int s= socket(dst->sa_family, SOCK_STREAM, 0);
 	int yes = 1;
-	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
-	if(connect(s, (sockaddr*)&dst, sizeof(dst)) < 0) {
-		jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s:%d\n", 
-				inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
+	if (dst->sa_family == AF_INET)
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	if(connect(s, dst, len) < 0) {
+		jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s\n", 
+				sockaddr_str(dst).c_str());
 		close(s);
 		return NULL;
 	}
-	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s:%d\n",
-			s, inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
+	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s\n",
+			s, sockaddr_str(dst).c_str());
 	return new connection(mgr, s, lossy);
 }
 
-
+std::string
+sockaddr_str(const sockaddr *a)
+{
+	char buf[256];
+	if (a->sa_family == AF_UNIX) {
+		snprintf(buf, sizeof(buf), "unix:%s", ((const sockaddr_un *)a)->sun_path);
+	} else {
+		const sockaddr_in *sin = (const sockaddr_in *)a;
+		snprintf(buf, sizeof(buf), "%s:%d", inet_ntoa(sin->sin_addr),
+				(int)ntohs(sin->sin_port));
+	}
+	return buf;
+}
@@ -3,11 +3,17 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <cstddef>
 
 #include <map>
+#include <string>
+#include <atomic>
+#include <deque>
+#include <vector>
 
 #include "pollmgr.h"
 
@@ -22,13 +28,40 @@ class chanmgr {
 class connection : public aio_callback {
 	public:
 		struct charbuf {
-			charbuf(): buf(NULL), sz(0), solong(0) {}
-			charbuf (char *b, int s) : buf(b), sz(s), solong(0){}
+			charbuf(): buf(NULL), sz(0), solong(0), cap(0), summed(0),
+				crc(0) {}
+			charbuf (char *b, int s) : buf(b), sz(s), solong(0), cap(s),
+				summed(0), crc(0) {}
 			char *buf; // 缓冲区，每次有新消息都重新分配
 			int sz; // 缓冲区大小
 			int solong; // 已经使用的缓冲区大小
+			int cap; // allocated, which grows to sz as frames arrive
+			int summed; // checksummed as it came, see rpc_pdu_sum()
+			uint32_t crc;
 		};
 
+		// an outgoing pdu, possibly scattered over several buffers
+		struct iobuf {
+			iobuf(): sz(0), solong(0) {}
+			std::vector<struct iovec> iov; // 待发送的缓冲区列表
+			int sz; // 总大小
+			int solong; // 已经发送的大小
+		};
+
+		// on the wire a pdu goes out as frames of at most
+		// frame_payload bytes, each after an 8 byte header: the
+		// payload length, with frame_last set on a pdu's last frame,
+		// and an id that tells the pdus being sent at the same time
+		// apart. frames of different pdus interleave, so a small pdu
+		// waits for one frame of a large one, not all of it. the next
+		// frame is taken from the highest priority class with pdus
+		// waiting, round robin among at most frame_streams of the
+		// class's pdus at a time; a peer that has more than
+		// nprio * frame_streams pdus begun loses the connection.
+		enum { frame_payload = 64 << 10, frame_hdr = 8, frame_streams = 8 };
+		enum { frame_last = 0x80000000 };
+		enum prio { prio_control, prio_normal, prio_bulk, nprio };
+
 		connection(chanmgr *m1, int f1, int lossytest=0);
 		~connection();
 
@@ -36,49 +69,99 @@ class connection : public aio_callback {
 		bool isdead();
 		void closeconn();
 		// 发送缓冲区 b 中的数据
-		bool send(char *b, int sz);
+		bool send(char *b, int sz, int prio = prio_normal);
+		// send the pdu made of iov[0..cnt); the first 4 bytes of
+		// iov[0] are reserved for the pdu size. returns when all of
+		// it is written or the connection has failed.
+		bool send(const struct iovec *iov, int cnt, int prio = prio_normal);
 		// 本链接注册在事件循环中的回调函数
 		void write_cb(int s);
 		void read_cb(int s);
+		// deliver the pdu that chanmgr::got_pdu() refused and, if it
+		// is taken now, start reading again
+		void resume_read();
 
 		void incref();
 		void decref();
 		int ref();
+
+		// size of the pdus that send() is writing or waiting to
+		// write
+		int backlog() { return backlog_; }
                 
                 int compare(connection *another);
 	private:
+		// a pdu that send() has queued; pdu.solong counts the bytes
+		// already put in frames
+		struct outmsg {
+			iobuf pdu;
+			unsigned int id;
+			bool done;
+		};
+
+		// the frame being written
+		struct frame {
+			frame(): msg(NULL), off(0), len(0), solong(0), last(false) {}
+			outmsg *msg;
+			char hdr[frame_hdr];
+			int off; // of the payload in msg
+			int len; // payload
+			int solong; // header and payload written so far
+			bool last;
+		};
 
 		bool readpdu();
-		bool writepdu();
+		bool start_frame();
+		bool writepdu(outmsg *mine);
+		bool next_frame();
+		void fail_sends();
 
 		chanmgr *mgr_; // 所属事件循环
 		const int fd_;
 		bool dead_;
-
-		charbuf wpdu_; // 写缓冲区
-		charbuf rpdu_; // 读缓冲区
+		bool rd_blocked_; // not reading: got_pdu() refused rpdu_
+
+		std::deque<outmsg *> sendq_[nprio];
+		int started_[nprio]; // pdus in sendq_ with frames sent
+		frame wframe_;
+		unsigned int next_id_;
+		bool writing_; // a send() is writing frames
+		bool wr_blocked_; // waiting for write_cb()
+
+		charbuf rpdu_; // 读缓冲区: a whole pdu, not yet delivered
+		// the frame being read: its header, and then its payload
+		// into the pdu it belongs to. a frame that starts a pdu
+		// carries the pdu size in the 4 bytes after the header.
+		char rhdr_[frame_hdr + sizeof(int)];
+		int rhdr_got_;
+		int rleft_; // payload still to read, or -1 in the header
+		unsigned int rid_;
+		bool rlast_;
+		std::map<unsigned int, charbuf> rpartial_; // pdus being read
                 
                 struct timeval create_time_;
 
-		int waiters_;
+		std::atomic<int> backlog_;
 		int refno_;
 		const int lossy_;
 
 		pthread_mutex_t m_;
 		pthread_mutex_t ref_m_;
-		pthread_cond_t send_complete_;
-		pthread_cond_t send_wait_;
+		pthread_cond_t send_complete_; // a pdu is out, or it is a new writer's turn
 };
 
-// 用来监听新链接的 tcp 套接字
+// 用来监听新链接的 tcp 套接字, or a unix domain socket at path
 class tcpsconn {
 	public:
 		tcpsconn(chanmgr *m1, int port, int lossytest=0);
+		tcpsconn(chanmgr *m1, const char *path, int lossytest=0);
 		~tcpsconn();
                 inline int port() { return port_; }
+		int nconns(); // accepted connections still open
 		void accept_conn();
 	private:
                 int port_;
+		std::string path_; // unix domain sockets only
 		pthread_mutex_t m_;
 		pthread_t th_;
 		int pipe_[2]; // 用来监听关闭
@@ -88,6 +171,7 @@ class tcpsconn {
 		std::map<int, connection *> conns_;
 
 		void process_accept();
+		void start();
 };
 
 struct bundle {
@@ -99,4 +183,9 @@ struct bundle {
 
 void start_accept_thread(chanmgr *mgr, int port, pthread_t *th, int *fd = NULL, int lossy=0);
 connection *connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy=0);
+// dst is a sockaddr_in or a sockaddr_un
+connection *connect_to_dst(const sockaddr *dst, socklen_t len, chanmgr *mgr,
+		int lossy=0);
+// host:port, or unix:path
+std::string sockaddr_str(const sockaddr *a);
 #endif
@@ -0,0 +1,165 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+// reflected Castagnoli polynomial
+static const uint32_t poly = 0x82f63b78;
+
+// table[k][b] is the crc of byte b followed by k zero bytes
+static uint32_t table[8][256];
+static bool have_hw;
+static pthread_once_t crc32c_is_initialized = PTHREAD_ONCE_INIT;
+
+// the instruction takes 3 cycles but can start every cycle, so long
+// runs are done as three streams of this many bytes, whose crcs are
+// then combined
+enum { stream = 8192 };
+// multipliers that append stream and 2*stream zero bytes to a crc
+static uint32_t shift1, shift2;
+
+// a * b modulo the polynomial, reflected (as in zlib's crc32_combine)
+static uint32_t
+multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31, p = 0;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ poly : b >> 1;
+	}
+	return p;
+}
+
+// x^(8n) modulo the polynomial: what appending n zero bytes
+// multiplies a crc by
+static uint32_t
+zeros(size_t n)
+{
+	uint32_t p = (uint32_t)1 << 31;  // 1
+	uint32_t x2k = (uint32_t)1 << 23; // x^8
+	for (; n; n >>= 1) {
+		if (n & 1)
+			p = multmodp(x2k, p);
+		x2k = multmodp(x2k, x2k);
+	}
+	return p;
+}
+
+static void
+crc32c_init()
+{
+	for (int b = 0; b < 256; b++) {
+		uint32_t c = b;
+		for (int i = 0; i < 8; i++)
+			c = (c >> 1) ^ (c & 1 ? poly : 0);
+		table[0][b] = c;
+	}
+	for (int b = 0; b < 256; b++)
+		for (int k = 1; k < 8; k++)
+			table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+	shift1 = zeros(stream);
+	shift2 = zeros(2 * stream);
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	have_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t
+crc32c_sw(uint32_t crc, const void *p, size_t n)
+{
+	pthread_once(&crc32c_is_initialized, crc32c_init);
+	const unsigned char *s = (const unsigned char *)p;
+	uint32_t c = ~crc;
+	while (n > 0 && ((uintptr_t)s & 7)) {
+		c = (c >> 8) ^ table[0][(c ^ *s++) & 0xff];
+		n--;
+	}
+	// eight bytes a step, one table lookup each; little-endian only,
+	// as is the rest of the wire format's host side
+	while (n >= 8) {
+		uint64_t w;
+		memcpy(&w, s, 8);
+		w ^= c;
+		c = table[7][w & 0xff] ^
+			table[6][(w >> 8) & 0xff] ^
+			table[5][(w >> 16) & 0xff] ^
+			table[4][(w >> 24) & 0xff] ^
+			table[3][(w >> 32) & 0xff] ^
+			table[2][(w >> 40) & 0xff] ^
+			table[1][(w >> 48) & 0xff] ^
+			table[0][w >> 56];
+		s += 8;
+		n -= 8;
+	}
+	while (n > 0) {
+		c = (c >> 8) ^ table[0][(c ^ *s++) & 0xff];
+		n--;
+	}
+	return ~c;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const void *p, size_t n)
+{
+	const unsigned char *s = (const unsigned char *)p;
+	uint64_t c = ~crc;
+	while (n > 0 && ((uintptr_t)s & 7)) {
+		c = __builtin_ia32_crc32qi(c, *s++);
+		n--;
+	}
+	// c goes on through the first stream; the others start from
+	// zero, and are shifted into place after
+	while (n >= 3 * stream) {
+		uint64_t c1 = 0, c2 = 0;
+		for (int i = 0; i < stream; i += 8) {
+			uint64_t w0, w1, w2;
+			memcpy(&w0, s + i, 8);
+			memcpy(&w1, s + stream + i, 8);
+			memcpy(&w2, s + 2 * stream + i, 8);
+			c = __builtin_ia32_crc32di(c, w0);
+			c1 = __builtin_ia32_crc32di(c1, w1);
+			c2 = __builtin_ia32_crc32di(c2, w2);
+		}
+		c = multmodp(shift2, c) ^ multmodp(shift1, c1) ^ (uint32_t)c2;
+		s += 3 * stream;
+		n -= 3 * stream;
+	}
+	while (n >= 8) {
+		uint64_t w;
+		memcpy(&w, s, 8);
+		c = __builtin_ia32_crc32di(c, w);
+		s += 8;
+		n -= 8;
+	}
+	while (n > 0) {
+		c = __builtin_ia32_crc32qi(c, *s++);
+		n--;
+	}
+	return ~(uint32_t)c;
+}
+#endif
+
+uint32_t
+crc32c(uint32_t crc, const void *p, size_t n)
+{
+	pthread_once(&crc32c_is_initialized, crc32c_init);
+#if defined(__x86_64__)
+	if (have_hw)
+		return crc32c_sse42(crc, p, n);
+#endif
+	return crc32c_sw(crc, p, n);
+}
+
+bool
+crc32c_hw()
+{
+	pthread_once(&crc32c_is_initialized, crc32c_init);
+	return have_hw;
+}
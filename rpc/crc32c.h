@@ -0,0 +1,22 @@
+#ifndef crc32c_h
+#define crc32c_h
+
+// CRC32C (Castagnoli), the checksum of iSCSI and ext4. crc32c()
+// uses the SSE4.2 crc32 instruction when the CPU has it, and
+// slicing-by-8 tables otherwise; both give the same result.
+//
+// crc is the result over the bytes before p, 0 to start, so
+//   crc32c(crc32c(0, a, n), b, m) == crc32c(0, ab, n + m)
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c(uint32_t crc, const void *p, size_t n);
+
+// the table version, whatever the CPU has
+uint32_t crc32c_sw(uint32_t crc, const void *p, size_t n);
+
+// whether crc32c() uses the instruction
+bool crc32c_hw();
+
+#endif
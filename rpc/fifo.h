@@ -3,92 +3,287 @@
 
 // fifo template
 // blocks enq() and deq() when queue is FULL or EMPTY
+//
+// a bounded ring of cells (Dmitry Vyukov's MPMC queue): every cell
+// carries a sequence number that says whether it is ready for the
+// next enq() or the next deq() at its position, so producers and
+// consumers only race on a compare-and-swap of their own position
+// counter, and nothing is allocated after construction. threads
+// that must block sleep on an event word (a futex on linux) that
+// the other side bumps only when it knows someone is waiting.
 
 #include <errno.h>
-#include <list>
+#include <atomic>
+#include <stdint.h>
 #include <sys/time.h>
 #include <time.h>
-#include <errno.h>
 #include "slock.h"
 #include "lang/verify.h"
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// a word that threads can sleep on until it changes. on linux the
+// low bit of the word says that someone sleeps in futex(2), so that
+// bump() makes a system call only when it has someone to wake.
+class fifo_event {
+	public:
+		fifo_event();
+		~fifo_event();
+		int get() { return v_.load() & ~1; }
+		// sleep unless the word no longer holds old; may return early
+		void wait(int old);
+		// change the word and wake up the sleepers
+		void bump();
+	private:
+		std::atomic<int> v_;
+#ifndef __linux__
+		pthread_mutex_t m_;
+		pthread_cond_t c_;
+#endif
+};
+
+#ifdef __linux__
+inline fifo_event::fifo_event() : v_(0) {}
+inline fifo_event::~fifo_event() {}
+
+inline void
+fifo_event::wait(int old)
+{
+	int cur = old;
+	if (!v_.compare_exchange_strong(cur, old | 1) && cur != (old | 1))
+		return;
+	syscall(SYS_futex, (int *)&v_, FUTEX_WAIT_PRIVATE, old | 1, NULL, NULL, 0);
+}
+
+inline void
+fifo_event::bump()
+{
+	int cur = v_.load();
+	while (!v_.compare_exchange_weak(cur, (cur & ~1) + 2))
+		;
+	if (cur & 1)
+		syscall(SYS_futex, (int *)&v_, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+#else
+inline fifo_event::fifo_event() : v_(0)
+{
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+	VERIFY(pthread_cond_init(&c_, 0) == 0);
+}
+
+inline fifo_event::~fifo_event()
+{
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+	VERIFY(pthread_cond_destroy(&c_) == 0);
+}
+
+inline void
+fifo_event::wait(int old)
+{
+	ScopedLock ml(&m_);
+	while (v_ == old)
+		VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+}
+
+inline void
+fifo_event::bump()
+{
+	ScopedLock ml(&m_);
+	// by 2, as above, since get() hides the low bit
+	v_ += 2;
+	VERIFY(pthread_cond_broadcast(&c_) == 0);
+}
+#endif
+
+static inline void
+fifo_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
 template<class T>
 class fifo {
 	public:
-		fifo(int m=0);
+		// a ring needs a bound; limit 0 gets a default one
+		fifo(int limit=0);
 		~fifo();
 		bool enq(T, bool blocking=true);
 		void deq(T *);
-		bool size();
+		bool deq(T *, bool blocking);
+		int size();
+
+		enum { default_limit = 1024 };
+		// failed tries before a blocking enq()/deq() goes to sleep
+		enum { spin_limit = 100 };
 
 	private:
-		std::list<T> q_;
-		pthread_mutex_t m_;
-		pthread_cond_t non_empty_c_; // q went non-empty
-		pthread_cond_t has_space_c_; // q is not longer overfull
-		unsigned int max_; //maximum capacity of the queue, block enq threads if exceeds this limit
+		struct cell {
+			std::atomic<uint64_t> seq;
+			T e;
+		};
+
+		bool try_enq(const T &e);
+		bool try_deq(T *e);
+
+		cell *ring_;
+		const uint64_t max_; //maximum capacity of the queue, block enq threads if exceeds this limit
+
+		// positions of the next enq() and deq(), on separate cache lines
+		char pad0_[64];
+		std::atomic<uint64_t> enq_pos_;
+		char pad1_[64];
+		std::atomic<uint64_t> deq_pos_;
+		char pad2_[64];
+
+		fifo_event non_empty_; // bumped by enq() if deq_waiters_
+		fifo_event has_space_; // bumped by deq() if enq_waiters_
+		std::atomic<int> deq_waiters_;
+		std::atomic<int> enq_waiters_;
 };
 
 template<class T>
-fifo<T>::fifo(int limit) : max_(limit)
+fifo<T>::fifo(int limit)
+: max_(limit > 0 ? limit : default_limit), enq_pos_(0), deq_pos_(0),
+	deq_waiters_(0), enq_waiters_(0)
 {
-	VERIFY(pthread_mutex_init(&m_, 0) == 0);
-	VERIFY(pthread_cond_init(&non_empty_c_, 0) == 0);
-	VERIFY(pthread_cond_init(&has_space_c_, 0) == 0);
+	ring_ = new cell[max_];
+	for (uint64_t i = 0; i < max_; i++)
+		ring_[i].seq.store(i, std::memory_order_relaxed);
 }
 
 template<class T>
 fifo<T>::~fifo()
 {
 	//fifo is to be deleted only when no threads are using it!
-	VERIFY(pthread_mutex_destroy(&m_)==0);
-	VERIFY(pthread_cond_destroy(&non_empty_c_) == 0);
-	VERIFY(pthread_cond_destroy(&has_space_c_) == 0);
+	delete[] ring_;
 }
 
-template<class T> bool
+// only a snapshot when other threads are using the fifo
+template<class T> int
 fifo<T>::size()
 {
-	ScopedLock ml(&m_);
-	return q_.size();
+	uint64_t d = deq_pos_.load();
+	uint64_t e = enq_pos_.load();
+	return e > d ? (int)(e - d) : 0;
 }
 
+// a cell at position pos is free for enq when its seq is pos, and
+// holds an element for deq when its seq is pos+1. deq hands it to
+// the enq one lap later by setting seq to pos+max_.
 template<class T> bool
-fifo<T>::enq(T e, bool blocking)
+fifo<T>::try_enq(const T &e)
 {
-	ScopedLock ml(&m_);
+	uint64_t pos = enq_pos_.load(std::memory_order_relaxed);
+	cell *c;
 	while (1) {
-		if (!max_ || q_.size() < max_) {
-			q_.push_back(e);
-			break;
+		c = &ring_[pos % max_];
+		uint64_t seq = c->seq.load(std::memory_order_acquire);
+		int64_t dif = (int64_t)seq - (int64_t)pos;
+		if (dif == 0) {
+			if (enq_pos_.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			return false; // full
+		} else {
+			pos = enq_pos_.load(std::memory_order_relaxed);
 		}
-		if (blocking)
-			VERIFY(pthread_cond_wait(&has_space_c_, &m_) == 0);
-		else
-			return false;
 	}
-	VERIFY(pthread_cond_signal(&non_empty_c_) == 0);
+	c->e = e;
+	c->seq.store(pos + 1, std::memory_order_release);
 	return true;
 }
 
-template<class T> void
-fifo<T>::deq(T *e)
+template<class T> bool
+fifo<T>::try_deq(T *e)
 {
-	ScopedLock ml(&m_);
-
-	while(1) {
-		if(q_.empty()){
-			VERIFY (pthread_cond_wait(&non_empty_c_, &m_) == 0);
+	uint64_t pos = deq_pos_.load(std::memory_order_relaxed);
+	cell *c;
+	while (1) {
+		c = &ring_[pos % max_];
+		uint64_t seq = c->seq.load(std::memory_order_acquire);
+		int64_t dif = (int64_t)seq - (int64_t)(pos + 1);
+		if (dif == 0) {
+			if (deq_pos_.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			return false; // empty
 		} else {
-			*e = q_.front();
-			q_.pop_front();
-			if (max_ && q_.size() < max_) {
-				VERIFY(pthread_cond_signal(&has_space_c_)==0);
-			}
+			pos = deq_pos_.load(std::memory_order_relaxed);
+		}
+	}
+	*e = c->e;
+	c->seq.store(pos + max_, std::memory_order_release);
+	return true;
+}
+
+// a waiter reads the event, announces itself and retries before it
+// sleeps; the other side fences after its operation and then checks
+// for waiters. so either the retry succeeds or the waiter is seen
+// and the event moves on from the value the waiter sleeps on.
+template<class T> bool
+fifo<T>::enq(T e, bool blocking)
+{
+	for (int spin = 0; !try_enq(e); spin++) {
+		if (!blocking)
+			return false;
+		if (spin < spin_limit) {
+			fifo_relax();
+			continue;
+		}
+		int ev = has_space_.get();
+		enq_waiters_++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (try_enq(e)) {
+			enq_waiters_--;
+			break;
+		}
+		has_space_.wait(ev);
+		enq_waiters_--;
+	}
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (deq_waiters_ > 0)
+		non_empty_.bump();
+	return true;
+}
+
+template<class T> bool
+fifo<T>::deq(T *e, bool blocking)
+{
+	for (int spin = 0; !try_deq(e); spin++) {
+		if (!blocking)
+			return false;
+		if (spin < spin_limit) {
+			fifo_relax();
+			continue;
+		}
+		int ev = non_empty_.get();
+		deq_waiters_++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (try_deq(e)) {
+			deq_waiters_--;
 			break;
 		}
+		non_empty_.wait(ev);
+		deq_waiters_--;
 	}
-	return;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (enq_waiters_ > 0)
+		has_space_.bump();
+	return true;
+}
+
+template<class T> void
+fifo<T>::deq(T *e)
+{
+	deq(e, true);
 }
 
 #endif
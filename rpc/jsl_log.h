@@ -1,6 +1,9 @@
 #ifndef __JSL_LOG_H__
 #define __JSL_LOG_H__ 1
 
+#include <stdio.h>
+#include "trace.h"
+
 enum dbcode {
 	JSL_DBG_OFF = 0,
 	JSL_DBG_1 = 1, // Critical
@@ -11,13 +14,13 @@ enum dbcode {
 
 extern int JSL_DEBUG_LEVEL;
 
-#define jsl_log(level,...)                                    \
+// into the calling thread's trace ring (see trace.h), and printed too
+// at JSL_DEBUG_LEVEL and above
+#define jsl_log(level, fmt, ...)                                    \
 	do {                                                        \
-		if(JSL_DEBUG_LEVEL < abs(level))			      							\
-		{;}                                                       \
-		else {                                                    \
-			{ printf(__VA_ARGS__);}														\
-		}                                                         \
+		rpc_trace(level, fmt, ##__VA_ARGS__);                   \
+		if(JSL_DEBUG_LEVEL >= (level))                          \
+			printf(fmt, ##__VA_ARGS__);                         \
 	} while(0)
 
 void jsl_set_debug(int level);
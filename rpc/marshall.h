@@ -10,6 +10,10 @@
 #include <string.h>
 #include <cstddef>
 #include <inttypes.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <type_traits>
+#include <atomic>
 #include "lang/verify.h"
 #include "lang/algorithm.h"
 
@@ -29,12 +33,22 @@ struct reply_header {
 	int ret;
 };
 
+// 1 to leave room in every pdu header for a checksum (see
+// marshall::seal()); both ends must agree
+#ifndef RPC_CHECKSUMMING
+#define RPC_CHECKSUMMING 0
+#endif
+
 typedef uint64_t rpc_checksum_t;
 typedef int rpc_sz_t;
 
 enum {
 	//size of initial buffer allocation 
 	DEFAULT_RPC_SZ = 1024,
+	//strings at least this big are referenced by marshall, not copied
+	//(see bytes_ref); smaller ones are cheaper to memcpy than to send
+	//as a separate iovec
+	RPC_REF_MIN = 16384,
 #if RPC_CHECKSUMMING
 	//size of rpc_header includes a 4-byte int to be filled by tcpchan and uint64_t checksum
 	RPC_HEADER_SZ = static_max<sizeof(req_header), sizeof(reply_header)>::value + sizeof(rpc_sz_t) + sizeof(rpc_checksum_t)
@@ -43,18 +57,186 @@ enum {
 #endif
 };
 
+// with RPC_CHECKSUMMING, a sealed pdu's checksum slot holds
+// RPC_SEALED and then the CRC32C of everything after the slot, both
+// big-endian. the slot of an unsealed pdu is zero.
+enum { RPC_SEALED = 0x43524331 }; // "CRC1"
+
+// false if the pdu is sealed and its checksum doesn't match
+bool rpc_pdu_intact(const char *pdu, int sz);
+// the same a piece at a time, summing what has just arrived while it
+// is still in the cache: rpc_pdu_sum() each time the first n bytes
+// are in, with *summed and *crc starting at 0, then rpc_pdu_intact()
+// with what they came to.
+void rpc_pdu_sum(const char *pdu, int n, int *summed, uint32_t *crc);
+bool rpc_pdu_intact(const char *pdu, int sz, int summed, uint32_t crc);
+
+// the wire format of a type whose values all take the same number of
+// bytes: fixed is true, size is that number, and put() and get()
+// store and load a value at p, big-endian, without checking bounds.
+// for any other type fixed is false and size is a lower bound.
+template<class T, class = void>
+struct wire {
+	static constexpr bool fixed = false;
+	static constexpr int size = 0;
+};
+
+template<class T, int N = sizeof(T)>
+struct wire_int;
+
+template<class T>
+struct wire_int<T, 1> {
+	static constexpr bool fixed = true;
+	static constexpr int size = 1;
+	static void put(char *p, T x) { *p = (char)x; }
+	static void get(const char *p, T &x) { x = (T)*p; }
+};
+
+template<class T>
+struct wire_int<T, 2> {
+	static constexpr bool fixed = true;
+	static constexpr int size = 2;
+	static void put(char *p, T x) {
+		uint16_t v = htons((uint16_t)x);
+		memcpy(p, &v, 2);
+	}
+	static void get(const char *p, T &x) {
+		uint16_t v;
+		memcpy(&v, p, 2);
+		x = (T)ntohs(v);
+	}
+};
+
+template<class T>
+struct wire_int<T, 4> {
+	static constexpr bool fixed = true;
+	static constexpr int size = 4;
+	static void put(char *p, T x) {
+		uint32_t v = htonl((uint32_t)x);
+		memcpy(p, &v, 4);
+	}
+	static void get(const char *p, T &x) {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		x = (T)ntohl(v);
+	}
+};
+
+template<class T>
+struct wire_int<T, 8> {
+	static constexpr bool fixed = true;
+	static constexpr int size = 8;
+	static void put(char *p, T x) {
+		uint32_t v[2] = { htonl((uint32_t)((uint64_t)x >> 32)),
+			htonl((uint32_t)x) };
+		memcpy(p, v, 8);
+	}
+	static void get(const char *p, T &x) {
+		uint32_t v[2];
+		memcpy(v, p, 8);
+		x = (T)(((uint64_t)ntohl(v[0]) << 32) | ntohl(v[1]));
+	}
+};
+
+template<> struct wire<char> : wire_int<char> {};
+template<> struct wire<unsigned char> : wire_int<unsigned char> {};
+template<> struct wire<short> : wire_int<short> {};
+template<> struct wire<unsigned short> : wire_int<unsigned short> {};
+template<> struct wire<int> : wire_int<int> {};
+template<> struct wire<unsigned int> : wire_int<unsigned int> {};
+template<> struct wire<unsigned long long> : wire_int<unsigned long long> {};
+
+template<>
+struct wire<bool> {
+	static constexpr bool fixed = true;
+	static constexpr int size = 1;
+	static void put(char *p, bool x) { *p = x; }
+	static void get(const char *p, bool &x) { x = *p != 0; }
+};
+
+// ends a list of types
+template<>
+struct wire<void> {
+	static constexpr bool fixed = true;
+	static constexpr int size = 0;
+};
+
+// fixed and size of a run of types, e.g. the fields of a struct
+template<class... T>
+struct wire_sum {
+	static constexpr bool fixed = true;
+	static constexpr int size = 0;
+};
+
+template<class T, class... R>
+struct wire_sum<T, R...> {
+	static constexpr bool fixed = wire<T>::fixed && wire_sum<R...>::fixed;
+	static constexpr int size = wire<T>::size + wire_sum<R...>::size;
+};
+
+// in compact mode (see rpcc::use_compact()) integers wider than a
+// byte are LEB128 varints, signed ones zigzagged first so that small
+// negative numbers stay short too
+template<class T> inline uint64_t
+wire_varint(T x)
+{
+	if (std::is_signed<T>::value) {
+		int64_t v = x;
+		return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+	}
+	return (uint64_t)x;
+}
+
+// false if v doesn't fit in a T
+template<class T> inline bool
+wire_from_varint(uint64_t v, T *x)
+{
+	if (std::is_signed<T>::value) {
+		int64_t d = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+		*x = (T)d;
+		return (int64_t)*x == d;
+	}
+	*x = (T)v;
+	return (uint64_t)*x == v;
+}
+
 class marshall {
 	private:
+		// a run of bytes owned by the caller that logically follows
+		// _buf[0.._pos) in the marshalled message
+		struct seg {
+			int pos;
+			const char *p;
+			int n;
+		};
+
 		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
 		int _capa;      // Capacity of the buffer
 		int _ind;       // Read/write head position
+		std::vector<seg> _segs; // referenced (not copied) payloads, by pos
+		int _segsz;     // total size of _segs
+		bool _compact;  // varints and interned strings, see wire_varint()
+		bool _interned; // interned strings go by index
+
+		// copy referenced segments into _buf so that it holds the
+		// whole message contiguously
+		void flatten();
+		// make room for n more bytes
+		void grow(int n);
 
 	public:
-		marshall() {
-			_buf = (char *) malloc(sizeof(char)*DEFAULT_RPC_SZ);
+		// hint is how many bytes of content to make room for up
+		// front, see wire_hints()
+		explicit marshall(int hint = 0) {
+			_capa = RPC_HEADER_SZ + hint;
+			if (_capa < DEFAULT_RPC_SZ)
+				_capa = DEFAULT_RPC_SZ;
+			_buf = (char *) malloc(sizeof(char)*_capa);
 			VERIFY(_buf);
-			_capa = DEFAULT_RPC_SZ;
 			_ind = RPC_HEADER_SZ;
+			_segsz = 0;
+			_compact = false;
+			_interned = true;
 		}
 
 		~marshall() { 
@@ -62,14 +244,52 @@ class marshall {
 				free(_buf); 
 		}
 
-		int size() { return _ind;}
-		char *cstr() { return _buf;}
+		int size() { return _ind + _segsz;}
+		char *cstr() { flatten(); return _buf;}
 
+		// append n bytes for the caller to fill in
+		char *claim(int n) {
+			if (_ind + n > _capa)
+				grow(n);
+			char *p = _buf + _ind;
+			_ind += n;
+			return p;
+		}
+		// append v as a LEB128 varint
+		void varint(uint64_t v) {
+			if (_ind + 10 > _capa)
+				grow(10);
+			char *p = _buf + _ind;
+			while (v >= 0x80) {
+				*p++ = (char)(v | 0x80);
+				v >>= 7;
+			}
+			*p++ = (char)v;
+			_ind = p - _buf;
+		}
+		// set before anything is marshalled; the request header
+		// tells the server. interned says whether interned_strs go
+		// by index.
+		void set_compact(bool c, bool interned = true) {
+			_compact = c;
+			_interned = interned;
+		}
+		bool compact() const { return _compact; }
+		bool interned() const { return _compact && _interned; }
 		void rawbyte(unsigned char);
 		void rawbytes(const char *, int);
+		// like rawbytes(), but large runs are only referenced; the
+		// bytes must stay valid until the marshall is sent or destroyed
+		void rawbytes_ref(const char *, int);
+
+		// describe the whole message (header included) as iovecs,
+		// without copying referenced segments. the iovecs point into
+		// this marshall and become invalid once it is modified.
+		void iov(std::vector<struct iovec> *v);
 
 		// Return the current content (excluding header) as a string
 		std::string get_content() { 
+			flatten();
 			return std::string(_buf+RPC_HEADER_SZ,_ind-RPC_HEADER_SZ);
 		}
 
@@ -85,6 +305,7 @@ class marshall {
 			//leave the first 4-byte empty for channel to fill size of pdu
 			_ind = sizeof(rpc_sz_t); 
 #if RPC_CHECKSUMMING
+			memset(_buf + _ind, 0, sizeof(rpc_checksum_t));
 			_ind += sizeof(rpc_checksum_t);
 #endif
 			pack(h.xid);
@@ -100,6 +321,7 @@ class marshall {
 			//leave the first 4-byte empty for channel to fill size of pdu
 			_ind = sizeof(rpc_sz_t); 
 #if RPC_CHECKSUMMING
+			memset(_buf + _ind, 0, sizeof(rpc_checksum_t));
 			_ind += sizeof(rpc_checksum_t);
 #endif
 			pack(h.xid);
@@ -107,7 +329,13 @@ class marshall {
 			_ind = saved_sz;
 		}
 
+		// checksum the whole message into its slot; after the header
+		// is packed and before it is sent. does nothing without
+		// RPC_CHECKSUMMING.
+		void seal();
+
 		void take_buf(char **b, int *s) {
+			flatten();
 			*b = _buf;
 			*s = _ind;
 			_buf = NULL;
@@ -115,15 +343,62 @@ class marshall {
 			return;
 		}
 };
-marshall& operator<<(marshall &, bool);
-marshall& operator<<(marshall &, unsigned int);
-marshall& operator<<(marshall &, int);
-marshall& operator<<(marshall &, unsigned char);
-marshall& operator<<(marshall &, char);
-marshall& operator<<(marshall &, unsigned short);
-marshall& operator<<(marshall &, short);
-marshall& operator<<(marshall &, unsigned long long);
+
+// bytes_ref(s) marshals exactly like s, but lets marshall send large
+// strings straight from s (scatter-gather) instead of copying them into
+// the message buffer. s must outlive the marshall, which is the case
+// for arguments passed to rpcc::call():
+//
+//   cl->call(extent_protocol::put, eid, bytes_ref(buf), r);
+struct bytes_ref {
+	explicit bytes_ref(const std::string &s) : s(s) {}
+	const std::string &s;
+};
+
+template<class T> inline marshall &
+wire_put(marshall &m, const T &x)
+{
+	if (wire<T>::size > 1 && m.compact())
+		m.varint(wire_varint(x));
+	else
+		wire<T>::put(m.claim(wire<T>::size), x);
+	return m;
+}
+
+inline marshall& operator<<(marshall &m, bool x) { return wire_put(m, x); }
+inline marshall& operator<<(marshall &m, unsigned int x) { return wire_put(m, x); }
+inline marshall& operator<<(marshall &m, int x) { return wire_put(m, x); }
+inline marshall& operator<<(marshall &m, unsigned char x) { return wire_put(m, x); }
+inline marshall& operator<<(marshall &m, char x) { return wire_put(m, x); }
+inline marshall& operator<<(marshall &m, unsigned short x) { return wire_put(m, x); }
+inline marshall& operator<<(marshall &m, short x) { return wire_put(m, x); }
+inline marshall& operator<<(marshall &m, unsigned long long x) { return wire_put(m, x); }
 marshall& operator<<(marshall &, const std::string &);
+marshall& operator<<(marshall &, const bytes_ref &);
+
+// a string the server was told about once, by rpcc::intern(). a
+// compact call sends it as its index in the server's table; any
+// other call sends the string. either way the handler gets a
+// std::string. only for calls through the rpcc that interned it.
+struct interned_str {
+	interned_str() : id(-1) {}
+	std::string s;
+	int id; // in the server's intern_table, or -1
+};
+marshall& operator<<(marshall &, const interned_str &);
+
+// the strings one client has interned with a server (see
+// rpcc::intern()), which its compact requests name by index.
+// append-only and bounded, so readers take no lock.
+struct intern_table {
+	enum { max = 64 };
+	intern_table() : n(0) {}
+	const std::string *get(unsigned int i) const {
+		return i < n.load(std::memory_order_acquire) ? &s[i] : NULL;
+	}
+	std::string s[max];
+	std::atomic<unsigned int> n;
+};
 
 class unmarshall {
 	private:
@@ -131,10 +406,13 @@ class unmarshall {
 		int _sz;
 		int _ind;
 		bool _ok;
+		bool _compact;
+		const intern_table *_strs;
+		bool _unknown; // named an interned string not in _strs
 	public:
-		unmarshall(): _buf(NULL),_sz(0),_ind(0),_ok(false) {}
-		unmarshall(char *b, int sz): _buf(b),_sz(sz),_ind(),_ok(true) {}
-		unmarshall(const std::string &s) : _buf(NULL),_sz(0),_ind(0),_ok(false) 
+		unmarshall(): _buf(NULL),_sz(0),_ind(0),_ok(false),_compact(false),_strs(NULL),_unknown(false) {}
+		unmarshall(char *b, int sz): _buf(b),_sz(sz),_ind(),_ok(true),_compact(false),_strs(NULL),_unknown(false) {}
+		unmarshall(const std::string &s) : _buf(NULL),_sz(0),_ind(0),_ok(false),_compact(false),_strs(NULL),_unknown(false) 
 		{
 			//take the content which does not exclude a RPC header from a string
 			take_content(s);
@@ -159,11 +437,62 @@ class unmarshall {
 		bool ok() { return _ok; }
 		char *cstr() { return _buf;}
 		bool okdone();
+		// consume the next n bytes; NULL (and !ok()) if there
+		// aren't that many
+		const char *take(unsigned int n) {
+			if (!_ok || _ind + n > (unsigned)_sz) {
+				_ok = false;
+				return NULL;
+			}
+			const char *p = _buf + _ind;
+			_ind += n;
+			return p;
+		}
+		// cut the last n bytes off the message and return them;
+		// NULL (and !ok()) if there aren't that many left
+		const char *untail(unsigned int n) {
+			if (!_ok || _ind + n > (unsigned)_sz) {
+				_ok = false;
+				return NULL;
+			}
+			_sz -= n;
+			return _buf + _sz;
+		}
+		// the next LEB128 varint; false (and !ok()) if it's cut off
+		bool varint(uint64_t *v) {
+			uint64_t x = 0;
+			for (int shift = 0; _ok && _ind < _sz && shift < 64; shift += 7) {
+				unsigned char b = _buf[_ind++];
+				x |= (uint64_t)(b & 0x7f) << shift;
+				if (!(b & 0x80)) {
+					*v = x;
+					return true;
+				}
+			}
+			_ok = false;
+			return false;
+		}
+		// decode varints and interned strings, the latter from strs
+		void set_compact(bool c, const intern_table *strs = NULL) {
+			_compact = c;
+			_strs = strs;
+		}
+		bool compact() const { return _compact; }
+		// the size of the string that comes next, or in compact mode
+		// possibly an interned string in its place (*in)
+		bool strhead(unsigned int *n, const std::string **in);
+		// failed on an interned string the table doesn't have
+		bool unknown_interned() const { return _unknown; }
+		void fail() { _ok = false; }
 		unsigned int rawbyte();
 		void rawbytes(std::string &s, unsigned int n);
+		// point *p at the next n bytes of the buffer instead of copying
+		void rawbytes_view(const char **p, unsigned int n);
 
 		int ind() { return _ind;}
 		int size() { return _sz;}
+		// the sender sealed this pdu (see marshall::seal())
+		bool sealed();
 		void unpack(int *); //non-const ref
 		void take_buf(char **b, int *sz) {
 			*b = _buf;
@@ -198,18 +527,49 @@ class unmarshall {
 		}
 };
 
-unmarshall& operator>>(unmarshall &, bool &);
-unmarshall& operator>>(unmarshall &, unsigned char &);
-unmarshall& operator>>(unmarshall &, char &);
-unmarshall& operator>>(unmarshall &, unsigned short &);
-unmarshall& operator>>(unmarshall &, short &);
-unmarshall& operator>>(unmarshall &, unsigned int &);
-unmarshall& operator>>(unmarshall &, int &);
-unmarshall& operator>>(unmarshall &, unsigned long long &);
+template<class T> inline unmarshall &
+wire_get(unmarshall &u, T &x)
+{
+	if (wire<T>::size > 1 && u.compact()) {
+		uint64_t v;
+		if (!u.varint(&v) || !wire_from_varint(v, &x)) {
+			u.fail();
+			x = T();
+		}
+		return u;
+	}
+	const char *p = u.take(wire<T>::size);
+	if (p)
+		wire<T>::get(p, x);
+	else
+		x = T();
+	return u;
+}
+
+inline unmarshall& operator>>(unmarshall &u, bool &x) { return wire_get(u, x); }
+inline unmarshall& operator>>(unmarshall &u, unsigned char &x) { return wire_get(u, x); }
+inline unmarshall& operator>>(unmarshall &u, char &x) { return wire_get(u, x); }
+inline unmarshall& operator>>(unmarshall &u, unsigned short &x) { return wire_get(u, x); }
+inline unmarshall& operator>>(unmarshall &u, short &x) { return wire_get(u, x); }
+inline unmarshall& operator>>(unmarshall &u, unsigned int &x) { return wire_get(u, x); }
+inline unmarshall& operator>>(unmarshall &u, int &x) { return wire_get(u, x); }
+inline unmarshall& operator>>(unmarshall &u, unsigned long long &x) { return wire_get(u, x); }
 unmarshall& operator>>(unmarshall &, std::string &);
 
+// a string unmarshalled in place: data points into the unmarshall's
+// buffer (the received PDU), so it is only valid while that unmarshall
+// is alive. wire format is the same as std::string, so a handler may
+// take a bytes_view where the client sends a std::string or bytes_ref.
+struct bytes_view {
+	bytes_view() : data(NULL), size(0) {}
+	const char *data;
+	unsigned int size;
+	std::string str() const { return std::string(data, size); }
+};
+unmarshall& operator>>(unmarshall &, bytes_view &);
+
 template <class C> marshall &
-operator<<(marshall &m, std::vector<C> v)
+operator<<(marshall &m, const std::vector<C> &v)
 {
 	m << (unsigned int) v.size();
 	for(unsigned i = 0; i < v.size(); i++)
@@ -259,4 +619,186 @@ operator>>(unmarshall &u, std::map<A,B> &d) {
 	return u;
 }
 
+// a struct whose fields go on the wire one after another, described
+// once after it is declared:
+//
+//   struct attr { unsigned int size; int mode; std::string name; };
+//   RPC_FIELDS(attr, size, mode, name)
+//
+// defines operator<< and operator>> for it. wire<attr> is worked out
+// from the fields' types at compile time, so a struct of fixed-size
+// fields (or of such structs) is packed with one bounds check, and
+// rpcc::call() sizes its request buffer without a realloc.
+template<class T, class = void>
+struct wire_fields {
+};
+
+// the wire format of a described struct: its fields in order
+template<class T>
+struct wire<T, typename wire_fields<T>::described> {
+	static constexpr bool fixed = wire_fields<T>::sum::fixed;
+	static constexpr int size = wire_fields<T>::sum::size;
+
+	struct putter {
+		char *p;
+		template<class F> void operator()(const F &f) {
+			wire<F>::put(p, f);
+			p += wire<F>::size;
+		}
+	};
+	struct getter {
+		const char *p;
+		template<class F> void operator()(F &f) {
+			wire<F>::get(p, f);
+			p += wire<F>::size;
+		}
+	};
+	static void put(char *p, const T &x) {
+		putter w = { p };
+		wire_fields<T>::each(x, w);
+	}
+	static void get(const char *p, T &x) {
+		getter w = { p };
+		wire_fields<T>::each(x, w);
+	}
+};
+
+struct wire_marshaller {
+	marshall &m;
+	template<class F> void operator()(const F &f) { m << f; }
+};
+
+struct wire_unmarshaller {
+	unmarshall &u;
+	template<class F> void operator()(F &f) { u >> f; }
+};
+
+template<class T> inline marshall &
+wire_marshall(marshall &m, const T &x, std::false_type);
+
+template<class T> inline marshall &
+wire_marshall(marshall &m, const T &x, std::true_type)
+{
+	if (m.compact())
+		return wire_marshall(m, x, std::false_type());
+	wire<T>::put(m.claim(wire<T>::size), x);
+	return m;
+}
+
+template<class T> inline marshall &
+wire_marshall(marshall &m, const T &x, std::false_type)
+{
+	wire_marshaller w = { m };
+	wire_fields<T>::each(x, w);
+	return m;
+}
+
+template<class T> inline unmarshall &
+wire_unmarshall(unmarshall &u, T &x, std::false_type);
+
+template<class T> inline unmarshall &
+wire_unmarshall(unmarshall &u, T &x, std::true_type)
+{
+	if (u.compact())
+		return wire_unmarshall(u, x, std::false_type());
+	const char *p = u.take(wire<T>::size);
+	if (p)
+		wire<T>::get(p, x);
+	else
+		x = T();
+	return u;
+}
+
+template<class T> inline unmarshall &
+wire_unmarshall(unmarshall &u, T &x, std::false_type)
+{
+	wire_unmarshaller w = { u };
+	wire_fields<T>::each(x, w);
+	return u;
+}
+
+#define RPC_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, N, ...) N
+#define RPC_NARGS(...) \
+	RPC_NARGS_(__VA_ARGS__, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define RPC_CAT_(a, b) a##b
+#define RPC_CAT(a, b) RPC_CAT_(a, b)
+
+// M(T, f) for each field f
+#define RPC_EACH_1(M, T, f) M(T, f)
+#define RPC_EACH_2(M, T, f, ...) M(T, f) RPC_EACH_1(M, T, __VA_ARGS__)
+#define RPC_EACH_3(M, T, f, ...) M(T, f) RPC_EACH_2(M, T, __VA_ARGS__)
+#define RPC_EACH_4(M, T, f, ...) M(T, f) RPC_EACH_3(M, T, __VA_ARGS__)
+#define RPC_EACH_5(M, T, f, ...) M(T, f) RPC_EACH_4(M, T, __VA_ARGS__)
+#define RPC_EACH_6(M, T, f, ...) M(T, f) RPC_EACH_5(M, T, __VA_ARGS__)
+#define RPC_EACH_7(M, T, f, ...) M(T, f) RPC_EACH_6(M, T, __VA_ARGS__)
+#define RPC_EACH_8(M, T, f, ...) M(T, f) RPC_EACH_7(M, T, __VA_ARGS__)
+#define RPC_EACH_9(M, T, f, ...) M(T, f) RPC_EACH_8(M, T, __VA_ARGS__)
+#define RPC_EACH_10(M, T, f, ...) M(T, f) RPC_EACH_9(M, T, __VA_ARGS__)
+#define RPC_EACH_11(M, T, f, ...) M(T, f) RPC_EACH_10(M, T, __VA_ARGS__)
+#define RPC_EACH_12(M, T, f, ...) M(T, f) RPC_EACH_11(M, T, __VA_ARGS__)
+#define RPC_EACH(M, T, ...) \
+	RPC_CAT(RPC_EACH_, RPC_NARGS(__VA_ARGS__))(M, T, __VA_ARGS__)
+
+#define RPC_FIELD_TYPE_(T, f) decltype(T::f),
+#define RPC_FIELD_VISIT_(T, f) fn(x.f);
+
+// at global scope, after T; at most 12 fields
+#define RPC_FIELDS(T, ...) \
+	template<> \
+	struct wire_fields<T> { \
+		typedef void described; \
+		typedef wire_sum<RPC_EACH(RPC_FIELD_TYPE_, T, __VA_ARGS__) \
+			void> sum; \
+		template<class X, class F> static void each(X &x, F &fn) { \
+			RPC_EACH(RPC_FIELD_VISIT_, T, __VA_ARGS__) \
+		} \
+	}; \
+	inline marshall &operator<<(marshall &m, const T &x) { \
+		return wire_marshall(m, x, \
+				std::integral_constant<bool, wire<T>::fixed>()); \
+	} \
+	inline unmarshall &operator>>(unmarshall &u, T &x) { \
+		return wire_unmarshall(u, x, \
+				std::integral_constant<bool, wire<T>::fixed>()); \
+	}
+
+// about how many bytes marshalling the values takes, to size a
+// marshall up front. large bytes_refs are not copied, so they don't
+// count.
+template<class T> inline int
+wire_hint(const T &)
+{
+	return wire<T>::size;
+}
+
+inline int
+wire_hint(const std::string &s)
+{
+	return 4 + s.size();
+}
+
+inline int
+wire_hint(const bytes_ref &r)
+{
+	return 4 + (r.s.size() < RPC_REF_MIN ? r.s.size() : 0);
+}
+
+inline int
+wire_hint(const interned_str &i)
+{
+	return wire_hint(i.s);
+}
+
+inline int
+wire_hints()
+{
+	return 0;
+}
+
+template<class A, class... R> inline int
+wire_hints(const A &a, const R &... r)
+{
+	return wire_hint(a) + wire_hints(r...);
+}
+
 #endif
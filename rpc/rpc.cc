@@ -61,9 +61,12 @@
  */
 
 #include "rpc.h"
+#include "crc32c.h"
 #include "method_thread.h"
 #include "slock.h"
+#include "sigthread.h"
 
+#include <algorithm>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
@@ -75,14 +78,48 @@
 #include "gettime.h"
 #include "lang/verify.h"
 
+// a traced request ends with its trace and rpcc span ids, after any
+// bytes_ref payload, so that untraced requests are as they were
+static void
+put_span(marshall &req, const rpc_span_ctx &s)
+{
+	typedef wire<unsigned long long> w;
+	char *p = req.claim(2 * w::size);
+	w::put(p, s.trace);
+	w::put(p + w::size, s.span);
+}
+
+static bool
+get_span(unmarshall &req, rpc_span_ctx *s)
+{
+	typedef wire<unsigned long long> w;
+	const char *p = req.untail(2 * w::size);
+	if (!p)
+		return false;
+	unsigned long long trace, span;
+	w::get(p, trace);
+	w::get(p + w::size, span);
+	*s = rpc_span_ctx(trace, span);
+	return true;
+}
+
 const rpcc::TO rpcc::to_max = { 120000 };
 const rpcc::TO rpcc::to_min = { 1000 };
+const rpcc::TO rpcc::rto_min = { 2 };
 
-rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
-: xid(xxid), un(xun), done(false)
+rpcc::caller::caller(unsigned int xxid, unmarshall *xun, callback *xcb)
+: xid(xxid), un(xun), done(false), cb(xcb), proc(0), ch(NULL), curr_to(0),
+	deadline(0), timer(NULL), nsent(0), compact(false), sealed(false),
+	span_parent(0),
+	span_start(0)
 {
 	VERIFY(pthread_mutex_init(&m,0) == 0);
-	VERIFY(pthread_cond_init(&c, 0) == 0);
+	// call1() waits on c with deadlines from timer_wheel::now_ms()
+	pthread_condattr_t ca;
+	VERIFY(pthread_condattr_init(&ca) == 0);
+	VERIFY(pthread_condattr_setclock(&ca, CLOCK_MONOTONIC) == 0);
+	VERIFY(pthread_cond_init(&c, &ca) == 0);
+	VERIFY(pthread_condattr_destroy(&ca) == 0);
 }
 
 rpcc::caller::~caller()
@@ -91,6 +128,14 @@ rpcc::caller::~caller()
 	VERIFY(pthread_cond_destroy(&c) == 0);
 }
 
+static time_t
+mono_secs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
 inline
 void set_rand_seed()
 {
@@ -99,12 +144,30 @@ void set_rand_seed()
 	srandom((int)ts.tv_nsec^((int)getpid()));
 }
 
-rpcc::rpcc(sockaddr_in d, bool retrans) : 
-	dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0), 
-	retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false), xid_rep_done_(-1)
+// every rpcs and rpcc in the process, for rpc_stats_dump() and
+// rpc_const::stats
+static std::list<rpcs *> all_rpcs;
+static std::list<rpcc *> all_rpcc;
+static pthread_mutex_t all_m = PTHREAD_MUTEX_INITIALIZER;
+static void client_stats(std::vector<rpcc_report> *v);
+
+rpcc::rpcc(sockaddr_in d, bool retrans) : rpcc((sockaddr *)&d, sizeof(d), retrans)
+{
+}
+
+rpcc::rpcc(const sockaddr *d, socklen_t len, bool retrans) : 
+	srtt_us_(0), rttvar_us_(0), rtt_samples_(0), rtt_timeouts_(0),
+	rtt_retrans_(0), dst_len_(len), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0), 
+	retrans_(retrans), reachable_(true), chans_(default_conns, NULL),
+	use_checksums_(false), checksums_(false), use_compact_(false), compact_(false), interned_lost_(false),
+	destroy_wait_ (false),
+	async_calls_(0), async_timers_(0), xid_rep_done_(-1)
 {
+	VERIFY(len <= sizeof(dst_));
+	memcpy(&dst_, d, len);
 	VERIFY(pthread_mutex_init(&m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&stats_m_, 0) == 0);
 	VERIFY(pthread_cond_init(&destroy_wait_c_, 0) == 0);
 
 	if(retrans){
@@ -121,27 +184,55 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
 	if(loss_env != NULL){
 		lossytest_ = atoi(loss_env);
 	}
+	char *crc_env = getenv("RPC_CHECKSUM");
+	if(crc_env != NULL){
+		use_checksums_ = atoi(crc_env) != 0;
+	}
+	char *compact_env = getenv("RPC_COMPACT");
+	if(compact_env != NULL){
+		use_compact_ = atoi(compact_env) != 0;
+	}
 
 	// xid starts with 1 and latest received reply starts with 0
 	xid_rep_window_.push_back(0);
 
 	jsl_log(JSL_DBG_2, "rpcc::rpcc cltn_nonce is %d lossy %d\n", 
 			clt_nonce_, lossytest_); 
+
+	ScopedLock al(&all_m);
+	all_rpcc.push_back(this);
 }
 
 // IMPORTANT: destruction should happen only when no external threads
 // are blocked inside rpcc or will use rpcc in the future
 rpcc::~rpcc()
 {
-	jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n", 
-			clt_nonce_, chan_?chan_->channo():-1); 
-	if(chan_){
-		chan_->closeconn();
-		chan_->decref();
+	jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d conns=%d\n", 
+			clt_nonce_, nconns()); 
+	{
+		ScopedLock al(&all_m);
+		all_rpcc.remove(this);
+	}
+	{
+		// timers of completed async calls may still be queued
+		ScopedLock ml(&m_);
+		while(async_timers_ > 0)
+			VERIFY(pthread_cond_wait(&destroy_wait_c_, &m_) == 0);
+	}
+	for(unsigned i = 0; i < chans_.size(); i++){
+		if(chans_[i]){
+			chans_[i]->closeconn();
+			chans_[i]->decref();
+		}
 	}
 	VERIFY(calls_.size() == 0);
+	std::map<unsigned int, rpcc_proc_stats *>::iterator i;
+	for(i = pstats_.begin(); i != pstats_.end(); i++)
+		delete i->second;
 	VERIFY(pthread_mutex_destroy(&m_) == 0);
 	VERIFY(pthread_mutex_destroy(&chan_m_) == 0);
+	VERIFY(pthread_mutex_destroy(&stats_m_) == 0);
+	VERIFY(pthread_cond_destroy(&destroy_wait_c_) == 0);
 }
 
 int
@@ -150,26 +241,97 @@ rpcc::bind(TO to)
 	int r;
 	int ret = call(rpc_const::bind, 0, r, to); // 绑定的方法是直接发送一个 bind 类型 rpc
 	if(ret == 0){
-		ScopedLock ml(&m_);
-		bind_done_ = true;
-		srv_nonce_ = r;
+		{
+			ScopedLock ml(&m_);
+			bind_done_ = true;
+			srv_nonce_ = r;
+		}
+		if(use_checksums_ && (ret = checksum_bind(to.to)) != 0){
+			// the server may have agreed, and would refuse our
+			// unsealed requests
+			ScopedLock ml(&m_);
+			bind_done_ = false;
+			return ret;
+		}
+		if(use_compact_)
+			compact_bind(to.to);
 	} else {
 		jsl_log(JSL_DBG_2, "rpcc::bind %s failed %d\n", 
-				inet_ntoa(dst_.sin_addr), ret);
+				sockaddr_str((sockaddr *)&dst_).c_str(), ret);
 	}
 	return ret;
 };
 
+int
+rpcc::checksum_bind(int to_ms)
+{
+	int r = 0;
+	int ret = call(rpc_const::checksum_bind, 1, r, rpcc::to(to_ms));
+	ScopedLock ml(&m_);
+	checksums_ = RPC_CHECKSUMMING && ret == 0 && r == 1;
+	jsl_log(JSL_DBG_2, "rpcc::checksum_bind %s checksums %d\n",
+			sockaddr_str((sockaddr *)&dst_).c_str(), checksums_);
+	return ret;
+}
+
+void
+rpcc::compact_bind(int to_ms)
+{
+	int r = 0;
+	int ret = call(rpc_const::compact_bind, 1, r, rpcc::to(to_ms));
+	ScopedLock ml(&m_);
+	compact_ = ret == 0 && r == 1;
+	jsl_log(JSL_DBG_2, "rpcc::compact_bind %s compact %d\n",
+			sockaddr_str((sockaddr *)&dst_).c_str(), compact_);
+}
+
+interned_str
+rpcc::intern(const std::string &s, TO to)
+{
+	interned_str i;
+	i.s = s;
+	{
+		ScopedLock ml(&m_);
+		if(!compact_ || clt_nonce_ == 0 || interned_lost_)
+			return i;
+		std::map<std::string, int>::iterator it = interned_.find(s);
+		if(it != interned_.end()){
+			i.id = it->second;
+			return i;
+		}
+	}
+	// the server gives two racing intern()s of s the same index
+	int r = -1;
+	if(call(rpc_const::intern, clt_nonce_, s, r, to) == 0 && r >= 0){
+		ScopedLock ml(&m_);
+		interned_[s] = r;
+		i.id = r;
+	}
+	return i;
+}
+
 // Cancel all outstanding calls
 void
 rpcc::cancel(void)
 {
   ScopedLock ml(&m_);
   printf("rpcc::cancel: force callers to fail\n");
+  std::vector<caller *> async;
   std::map<int,caller*>::iterator iter;
-  for(iter = calls_.begin(); iter != calls_.end(); iter++){
+  for(iter = calls_.begin(); iter != calls_.end(); ){
     caller *ca = iter->second;
 
+    if (ca->cb) {
+      // nobody waits for an async caller, complete it here
+      async.push_back(ca);
+      calls_.erase(iter++);
+      update_xid_rep(ca->xid);
+      async_calls_--;
+      drop_timer(ca);
+      continue;
+    }
+    iter++;
+
     jsl_log(JSL_DBG_2, "rpcc::cancel: force caller to fail\n");
     {
       ScopedLock cl(&ca->m);
@@ -179,6 +341,15 @@ rpcc::cancel(void)
     }
   }
 
+  if (async.size()) {
+    VERIFY(pthread_mutex_unlock(&m_) == 0);
+    for (unsigned i = 0; i < async.size(); i++) {
+      unmarshall rep;
+      finish_async(async[i], rpc_const::cancel_failure, rep);
+    }
+    VERIFY(pthread_mutex_lock(&m_) == 0);
+  }
+
   while (calls_.size () > 0){
     destroy_wait_ = true;
     VERIFY(pthread_cond_wait(&destroy_wait_c_,&m_) == 0);
@@ -190,6 +361,15 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep, TO to) {
 
   caller ca(0, &rep);
   int xid_rep;
+  TO curr_to;
+  bool seal;
+  // in a trace, the call is a span of its own
+  rpc_span_ctx parent = rpc_span_cur;
+  if (parent.trace) {
+    ca.span = rpc_span_ctx(parent.trace, rpc_span_id());
+    ca.span_start = rpc_trace_ns();
+    put_span(req, ca.span);
+  }
   {
     ScopedLock ml(&m_);
 
@@ -207,21 +387,32 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep, TO to) {
     ca.xid = xid_++;
     calls_[ca.xid] = &ca;
 
-    req_header h(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep_window_.front());
+    ca.compact = req.compact();
+    req_header h(ca.xid, proc | (ca.compact ? rpc_const::compact_flag : 0) |
+                 (ca.span.trace ? rpc_const::trace_flag : 0),
+                 clt_nonce_, srv_nonce_, xid_rep_window_.front());
     req.pack_req_header(h);
     xid_rep = xid_rep_window_.front();
+    curr_to.to = rto();
+    seal = ca.sealed = checksums_;
   }
+  if (seal)
+    req.seal();
 
-  TO curr_to;
-  struct timespec now, nextdeadline, finaldeadline;
-
-  clock_gettime(CLOCK_REALTIME, &now);
-  add_timespec(now, to.to, &finaldeadline);
-  curr_to.to = to_min.to;
+  // deadlines in timer_wheel::now_ms()
+  uint64_t nextdeadline, finaldeadline = timer_wheel::now_ms() + to.to;
+  bool last = false;
+  struct timespec sent;
+  int nsent = 0;
 
   bool transmit = true;
   connection *ch = NULL;
 
+  // large arguments passed as bytes_ref go out straight from the
+  // caller's buffers
+  std::vector<struct iovec> iov;
+  req.iov(&iov);
+
   while (1) {
     if (transmit) {
       get_refconn(&ch);
@@ -236,8 +427,15 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep, TO to) {
             }
           }
           if (forgot.isvalid())
-            ch->send((char *)forgot.buf.c_str(), forgot.buf.size());
-          ch->send(req.cstr(), req.size());
+            ch->send((char *)forgot.buf.c_str(), forgot.buf.size(),
+                     rpc_priority(proc, forgot.buf.size()));
+          if (nsent++ == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &sent);
+          } else {
+            ScopedLock ml(&m_);
+            rtt_retrans_++;
+          }
+          ch->send(&iov[0], iov.size(), rpc_priority(proc, req.size()));
         } else
           jsl_log(JSL_DBG_1, "not reachable\n");
         jsl_log(JSL_DBG_2,
@@ -247,21 +445,25 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep, TO to) {
       transmit = false; // only send once on a given channel
     }
 
-    if (!finaldeadline.tv_sec)
+    if (last)
       break;
 
-    clock_gettime(CLOCK_REALTIME, &now);
-    add_timespec(now, curr_to.to, &nextdeadline);
-    if (cmp_timespec(nextdeadline, finaldeadline) > 0) {
+    nextdeadline = timer_wheel::now_ms() + curr_to.to;
+    if (nextdeadline >= finaldeadline) {
       nextdeadline = finaldeadline;
-      finaldeadline.tv_sec = 0;
+      last = true;
     }
 
     {
+      // a plain timed wait: every call going through the shared
+      // timer_wheel would meet every other on its lock
+      struct timespec ts;
+      ts.tv_sec = nextdeadline / 1000;
+      ts.tv_nsec = (nextdeadline % 1000) * 1000000;
       ScopedLock cal(&ca.m);
       while (!ca.done) {
         jsl_log(JSL_DBG_2, "rpcc:call1: wait\n");
-        if (pthread_cond_timedwait(&ca.c, &ca.m, &nextdeadline) == ETIMEDOUT) {
+        if (pthread_cond_timedwait(&ca.c, &ca.m, &ts) == ETIMEDOUT) {
           jsl_log(JSL_DBG_2, "rpcc::call1: timeout\n");
           break;
         }
@@ -272,6 +474,11 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep, TO to) {
       }
     }
 
+    {
+      ScopedLock ml(&m_);
+      rtt_timeouts_++;
+    }
+
     if (retrans_ && (!ch || ch->isdead())) {
       // since connection is dead, retransmit
       // on the new connection
@@ -289,10 +496,16 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep, TO to) {
     // I don't think there's any harm in maybe doing it twice
     update_xid_rep(ca.xid);
 
+    if (ca.done && nsent == 1)
+      rtt_sample(sent);
+
     if (destroy_wait_) {
       VERIFY(pthread_cond_signal(&destroy_wait_c_) == 0);
     }
   }
+  record(proc, ca.done ? ca.intret : rpc_const::timeout_failure, nsent, sent);
+  if (ca.span.trace)
+    rpc_span_rpcc(ca.span, parent.span, ca.span_start, proc);
 
   if (ca.done && lossytest_) {
     ScopedLock ml(&m_);
@@ -307,10 +520,10 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep, TO to) {
   ScopedLock cal(&ca.m);
 
   jsl_log(JSL_DBG_2,
-          "rpcc::call1 %u call done for req proc %x xid %u %s:%d done? %d ret "
+          "rpcc::call1 %u call done for req proc %x xid %u %s done? %d ret "
           "%d \n",
-          clt_nonce_, proc, ca.xid, inet_ntoa(dst_.sin_addr),
-          ntohs(dst_.sin_port), ca.done, ca.intret);
+          clt_nonce_, proc, ca.xid, sockaddr_str((sockaddr *)&dst_).c_str(),
+          ca.done, ca.intret);
 
   if (ch)
     ch->decref();
@@ -319,24 +532,469 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep, TO to) {
   return (ca.done ? ca.intret : rpc_const::timeout_failure);
 }
 
+// Asynchronous calls share xid space, calls_ and at-most-once
+// bookkeeping with call1(), but no thread waits on them.  got_pdu()
+// completes them on the PollMgr thread, and a timer_wheel timer per
+// call does what call1's loop does for a blocked caller: retransmit
+// on a new connection if the old one died and fail the call at its
+// deadline.  The request is copied, so
+// bytes_ref arguments need not outlive call_async().
+int
+rpcc::call_async(unsigned int proc, marshall &req, callback *cb, TO to)
+{
+	int xid = start_async(proc, req, cb, to.to, NULL);
+	if(xid < 0)
+		return xid;
+	// ca may complete (and be freed) as soon as it is in calls_,
+	// so from here on refer to it only by xid.
+	send_async(xid);
+	return 0;
+}
+
+// put an async call in calls_ with its timer running, ready for
+// send_async(). returns its xid, or the error that cb has already
+// been completed with. *pdu, if given, gets the request.
+int
+rpcc::start_async(unsigned int proc, marshall &req, callback *cb,
+		int to_ms, std::shared_ptr<std::string> *pdu)
+{
+	caller *ca = new caller(0, NULL, cb);
+	ca->proc = proc;
+	int ret = 0;
+	unsigned int xid = 0;
+	{
+		ScopedLock ml(&m_);
+
+		if((proc != rpc_const::bind && !bind_done_) ||
+				(proc == rpc_const::bind && bind_done_)){
+			jsl_log(JSL_DBG_1, "rpcc::call_async rpcc has not been bound "
+					"to dst or binding twice\n");
+			ret = rpc_const::bind_failure;
+		} else if(destroy_wait_){
+			ret = rpc_const::cancel_failure;
+		} else {
+			ca->xid = xid = xid_++;
+			ca->compact = req.compact();
+			if(rpc_span_cur.trace){
+				ca->span = rpc_span_ctx(rpc_span_cur.trace, rpc_span_id());
+				ca->span_parent = rpc_span_cur.span;
+				ca->span_start = rpc_trace_ns();
+				put_span(req, ca->span);
+			}
+			req_header h(ca->xid, proc |
+					(ca->compact ? rpc_const::compact_flag : 0) |
+					(ca->span.trace ? rpc_const::trace_flag : 0),
+					clt_nonce_, srv_nonce_, xid_rep_window_.front());
+			req.pack_req_header(h);
+			ca->sealed = checksums_;
+			if(ca->sealed)
+				req.seal();
+			ca->req.reset(new std::string(req.cstr(), req.size()));
+			if(pdu)
+				*pdu = ca->req;
+
+			ca->deadline = timer_wheel::now_ms() + to_ms;
+			ca->curr_to = rto();
+			ca->timer = new async_timer;
+			ca->timer->cl = this;
+			ca->timer->xid = ca->xid;
+			async_timers_++;
+
+			calls_[ca->xid] = ca;
+			async_calls_++;
+			// the timer may retransmit, so it runs on the wheel's pool
+			timer_wheel::instance()->schedule(ca->timer,
+					ca->curr_to < to_ms ? ca->curr_to : to_ms, true);
+		}
+	}
+
+	if(ret < 0){
+		unmarshall rep;
+		finish_async(ca, ret, rep);
+		return ret;
+	}
+
+	// the timer may already have ca, so use xid
+	jsl_log(JSL_DBG_2, "rpcc::start_async %u req proc %x xid %u\n",
+			clt_nonce_, proc, xid);
+	return xid;
+}
+
+// (re)transmit an async call unless it has completed meanwhile.
+// a retry goes out only if the connection it was sent on has died.
+// isdead() takes the connection's lock, which read_cb() holds while
+// got_pdu() waits for m_, so it is checked without m_.
+void
+rpcc::send_async(unsigned int xid, bool retry)
+{
+	if(retry){
+		connection *old = NULL;
+		{
+			ScopedLock ml(&m_);
+			std::map<int, caller *>::iterator it = calls_.find(xid);
+			if(it == calls_.end())
+				return;
+			old = it->second->ch;
+			if(old)
+				old->incref();
+		}
+		bool dead = !old || old->isdead();
+		if(old)
+			old->decref();
+		if(!dead)
+			return;
+	}
+
+	connection *ch = NULL;
+	get_refconn(&ch);
+	if(!ch)
+		return;
+
+	std::shared_ptr<std::string> req;
+	unsigned int proc;
+	{
+		ScopedLock ml(&m_);
+		std::map<int, caller *>::iterator it = calls_.find(xid);
+		if(it == calls_.end()){
+			ch->decref();
+			return;
+		}
+		caller *ca = it->second;
+		proc = ca->proc;
+		if(ca->ch)
+			ca->ch->decref();
+		ca->ch = ch;
+		ch->incref();
+		req = ca->req;
+		if(reachable_ && ca->nsent++ == 0)
+			clock_gettime(CLOCK_MONOTONIC, &ca->sent);
+		else if(reachable_)
+			rtt_retrans_++;
+	}
+
+	if(reachable_)
+		ch->send((char *)req->data(), req->size(),
+				rpc_priority(proc, req->size()));
+	else
+		jsl_log(JSL_DBG_1, "not reachable\n");
+	ch->decref();
+}
+
+// start each of calls as call_async() would, and send their request
+// pdus inside one pdu of proc rpc_const::batch. only this first
+// transmission is shared; a call that needs another goes out alone
+// from its timer.
+int
+rpcc::send_batch(std::vector<batch_call> &calls, int to_ms)
+{
+	int ret = 0;
+	int prio = connection::nprio;
+	std::vector<unsigned int> xids;
+	std::vector<std::shared_ptr<std::string> > pdus;
+	for (unsigned i = 0; i < calls.size(); i++) {
+		std::shared_ptr<std::string> pdu;
+		int xid = start_async(calls[i].proc, *calls[i].req, calls[i].cb,
+				to_ms, &pdu);
+		if(xid < 0){
+			if(ret == 0)
+				ret = xid;
+		} else {
+			xids.push_back(xid);
+			pdus.push_back(pdu);
+			int p = rpc_priority(calls[i].proc, pdu->size());
+			if(p < prio)
+				prio = p;
+		}
+		delete calls[i].req;
+	}
+	calls.clear();
+
+	if(xids.size() < 2){
+		if(xids.size() == 1)
+			send_async(xids[0]);
+		return ret;
+	}
+
+	marshall m;
+	bool seal;
+	m << (unsigned int) pdus.size();
+	for (unsigned i = 0; i < pdus.size(); i++)
+		m << bytes_ref(*pdus[i]);
+	{
+		ScopedLock ml(&m_);
+		// at-most-once is up to the calls inside, so no clt_nonce
+		req_header h(0, rpc_const::batch, 0, srv_nonce_, 0);
+		m.pack_req_header(h);
+		seal = checksums_;
+	}
+	if(seal)
+		m.seal();
+
+	// with no connection, the timers send the calls one by one
+	connection *ch = NULL;
+	get_refconn(&ch);
+	if(!ch)
+		return ret;
+	{
+		ScopedLock ml(&m_);
+		for (unsigned i = 0; i < xids.size(); i++) {
+			std::map<int, caller *>::iterator it = calls_.find(xids[i]);
+			if(it == calls_.end())
+				continue;
+			caller *ca = it->second;
+			if(ca->ch)
+				ca->ch->decref();
+			ca->ch = ch;
+			ch->incref();
+			if(reachable_ && ca->nsent++ == 0)
+				clock_gettime(CLOCK_MONOTONIC, &ca->sent);
+		}
+	}
+	jsl_log(JSL_DBG_2, "rpcc::send_batch %u %d calls, xid %u..%u\n",
+			clt_nonce_, (int)xids.size(), xids.front(), xids.back());
+
+	if(reachable_){
+		std::vector<struct iovec> iov;
+		m.iov(&iov);
+		ch->send(&iov[0], iov.size(), prio);
+	} else
+		jsl_log(JSL_DBG_1, "not reachable\n");
+	ch->decref();
+	return ret;
+}
+
+// count a call that has completed with ret after nsent transmissions,
+// the first at sent
+void
+rpcc::record(unsigned int proc, int ret, int nsent,
+		const struct timespec &sent)
+{
+	rpcc_proc_stats *ps;
+	{
+		ScopedLock sl(&stats_m_);
+		rpcc_proc_stats *&p = pstats_[proc];
+		if(!p)
+			p = new rpcc_proc_stats;
+		ps = p;
+	}
+	if(nsent > 1)
+		ps->retransmits.fetch_add(nsent - 1, std::memory_order_relaxed);
+	if(ret < 0 || nsent == 0)
+		ps->failures.fetch_add(1, std::memory_order_relaxed);
+	else
+		ps->latency_us.add(rpc_now_us() - rpc_us(sent));
+}
+
+void
+rpcc::stats(rpcc_report *r)
+{
+	r->dst = sockaddr_str((sockaddr *)&dst_);
+	r->procs.clear();
+	ScopedLock sl(&stats_m_);
+	std::map<unsigned int, rpcc_proc_stats *>::iterator i;
+	for(i = pstats_.begin(); i != pstats_.end(); i++){
+		rpcc_proc_report p;
+		p.proc = i->first;
+		p.failures = i->second->failures.load(std::memory_order_relaxed);
+		p.retransmits = i->second->retransmits.load(std::memory_order_relaxed);
+		i->second->latency_us.get(&p.latency_us);
+		r->procs.push_back(p);
+	}
+}
+
+// ca has already been taken out of calls_; must not hold m_.
+void
+rpcc::finish_async(caller *ca, int ret, unmarshall &rep)
+{
+	jsl_log(JSL_DBG_2, "rpcc::finish_async %u req proc %x xid %u ret %d\n",
+			clt_nonce_, ca->proc, ca->xid, ret);
+	record(ca->proc, ret, ca->nsent, ca->sent);
+	if(ca->span.trace)
+		rpc_span_rpcc(ca->span, ca->span_parent, ca->span_start, ca->proc);
+	ca->cb->done(ret, rep);
+	if(ca->ch)
+		ca->ch->decref();
+	delete ca;
+}
+
+void
+rpcc::async_timer::expire()
+{
+	cl->async_expired(this);
+}
+
+// m_ held; ca has just been taken out of calls_. a pending timer
+// goes with it. a running one will find ca gone and free itself.
+void
+rpcc::drop_timer(caller *ca)
+{
+	if(ca->timer && timer_wheel::instance()->cancel(ca->timer)){
+		delete ca->timer;
+		async_timers_--;
+		VERIFY(pthread_cond_broadcast(&destroy_wait_c_) == 0);
+	}
+	ca->timer = NULL;
+}
+
+// an async call's timer went off: back off and retransmit, or fail
+// the call if it is past its deadline.
+void
+rpcc::async_expired(async_timer *t)
+{
+	caller *ca = NULL;
+	bool keep = false, resend = false;
+	unsigned int xid = t->xid;
+	{
+		ScopedLock ml(&m_);
+		std::map<int, caller *>::iterator it = calls_.find(t->xid);
+		if(it != calls_.end() && it->second->timer == t){
+			ca = it->second;
+			uint64_t now = timer_wheel::now_ms();
+			if(now < ca->deadline){
+				keep = true;
+				rtt_timeouts_++;
+				resend = retrans_;
+				ca->curr_to <<= 1;
+				uint64_t left = ca->deadline - now;
+				timer_wheel::instance()->schedule(t,
+						(uint64_t)ca->curr_to < left ? ca->curr_to : left, true);
+			} else {
+				calls_.erase(it);
+				update_xid_rep(ca->xid);
+				async_calls_--;
+				ca->timer = NULL;
+			}
+		}
+		if(!keep){
+			// done with, by us or by whoever completed the call
+			delete t;
+			async_timers_--;
+			VERIFY(pthread_cond_broadcast(&destroy_wait_c_) == 0);
+		}
+	}
+
+	if(resend){
+		send_async(xid, true);
+	} else if(!keep && ca){
+		unmarshall rep;
+		finish_async(ca, rpc_const::timeout_failure, rep);
+	}
+}
+
+// m_ held. a call that went out more than once can't tell which
+// transmission the reply answers, so callers pass only calls sent once.
+void
+rpcc::rtt_sample(const struct timespec &sent)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long r = (now.tv_sec - sent.tv_sec) * 1000000L +
+		(now.tv_nsec - sent.tv_nsec) / 1000;
+	if(r < 0)
+		r = 0;
+	if(r > to_max.to * 1000L)
+		r = to_max.to * 1000L;
+
+	if(rtt_samples_++ == 0){
+		srtt_us_ = r;
+		rttvar_us_ = r / 2;
+	} else {
+		long err = r - srtt_us_;
+		srtt_us_ += err / 8;
+		rttvar_us_ += ((err < 0 ? -err : err) - rttvar_us_) / 4;
+	}
+}
+
+// m_ held. the first retransmission timer of a new call, in ms;
+// to_min until there is a sample. call1() and async_expired()
+// double it on every expiry, up to the call's own TO.
+int
+rpcc::rto()
+{
+	if(rtt_samples_ == 0)
+		return to_min.to;
+	int ms = (srtt_us_ + 4 * rttvar_us_ + 999) / 1000;
+	if(ms < rto_min.to)
+		ms = rto_min.to;
+	if(ms > to_max.to)
+		ms = to_max.to;
+	return ms;
+}
+
+rpcc::rtt_stats
+rpcc::rtt()
+{
+	ScopedLock ml(&m_);
+	rtt_stats st;
+	st.srtt_us = srtt_us_;
+	st.rttvar_us = rttvar_us_;
+	st.rto_ms = rto();
+	st.samples = rtt_samples_;
+	st.timeouts = rtt_timeouts_;
+	st.retransmits = rtt_retrans_;
+	return st;
+}
+
+// the live connection with the least backlog; a new one in a free
+// slot if none is idle.
 void
 rpcc::get_refconn(connection **ch)
 {
 	ScopedLock ml(&chan_m_);
-	if(!chan_ || chan_->isdead()){
-		if(chan_)
-			chan_->decref();
-		chan_ = connect_to_dst(dst_, this, lossytest_);
+	connection *best = NULL;
+	int slot = -1;
+	for(unsigned i = 0; i < chans_.size(); i++){
+		connection *c = chans_[i];
+		if(!c || c->isdead()){
+			if(slot < 0)
+				slot = i;
+			continue;
+		}
+		if(!best || c->backlog() < best->backlog())
+			best = c;
+	}
+	if((!best || best->backlog() > 0) && slot >= 0){
+		if(chans_[slot])
+			chans_[slot]->decref();
+		chans_[slot] = connect_to_dst((sockaddr *)&dst_, dst_len_, this,
+				lossytest_);
+		if(chans_[slot])
+			best = chans_[slot];
 	}
-	if(ch && chan_){
+	if(ch && best){
 		if(*ch){
 			(*ch)->decref();
 		}
-		*ch = chan_;
+		*ch = best;
 		(*ch)->incref();
 	}
 }
 
+void
+rpcc::set_max_conns(int n)
+{
+	VERIFY(n > 0);
+	ScopedLock ml(&chan_m_);
+	for(unsigned i = n; i < chans_.size(); i++){
+		if(chans_[i]){
+			chans_[i]->closeconn();
+			chans_[i]->decref();
+		}
+	}
+	chans_.resize(n, NULL);
+}
+
+int
+rpcc::nconns()
+{
+	ScopedLock ml(&chan_m_);
+	int n = 0;
+	for(unsigned i = 0; i < chans_.size(); i++)
+		if(chans_[i] && !chans_[i]->isdead())
+			n++;
+	return n;
+}
+
 // PollMgr's thread is being used to 
 // make this upcall from connection object to rpcc. 
 // this funtion must not block.
@@ -354,17 +1012,62 @@ rpcc::got_pdu(connection *c, char *b, int sz)
 		return true;
 	}
 
-	ScopedLock ml(&m_);
+	caller *ca;
+	{
+		ScopedLock ml(&m_);
+
+		// a call that went out sealed wants a sealed reply: if its
+		// checksum slot was damaged, readpdu() couldn't check it. it
+		// is dropped before anything in it is believed, and the call
+		// retransmitted.
+		if(checksums_ && !rep.sealed()){
+			std::map<int, caller *>::iterator it = calls_.find(h.xid);
+			if(it == calls_.end() || it->second->sealed){
+				jsl_log(JSL_DBG_1, "rpcc::got_pdu: unsealed reply for "
+						"xid %d, dropped\n", h.xid);
+				return true;
+			}
+		}
+
+		update_xid_rep(h.xid);
+		if(h.ret == rpc_const::intern_failure && !interned_lost_){
+			jsl_log(JSL_DBG_1, "rpcc::got_pdu: server forgot our strings\n");
+			interned_lost_ = true;
+			interned_.clear();
+		}
 
-	update_xid_rep(h.xid);
+		if(calls_.find(h.xid) == calls_.end()){
+			jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
+			return true;
+		}
+		ca = calls_[h.xid];
+		if(!ca->cb)
+			VERIFY(pthread_mutex_lock(&ca->m) == 0);
+		else {
+			// an async caller is completed right here, on the
+			// PollMgr thread, once it is out of calls_
+			calls_.erase(h.xid);
+			async_calls_--;
+			drop_timer(ca);
+			if(ca->nsent == 1)
+				rtt_sample(ca->sent);
+			if (destroy_wait_)
+				VERIFY(pthread_cond_signal(&destroy_wait_c_) == 0);
+		}
+	}
 
-	if(calls_.find(h.xid) == calls_.end()){
-		jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
+	rep.set_compact(ca->compact);
+	if(ca->cb){
+		if(h.ret < 0){
+			jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
+					h.xid, h.ret);
+		}
+		finish_async(ca, h.ret, rep);
 		return true;
 	}
-	caller *ca = calls_[h.xid];
 
-	ScopedLock cl(&ca->m);
+	// ca->m is held; the waiting caller can't remove ca from calls_
+	// before it gets ca->m.
 	if(!ca->done){
 		ca->un->take_in(rep);
 		ca->intret = h.ret;
@@ -375,6 +1078,7 @@ rpcc::got_pdu(connection *c, char *b, int sz)
 		ca->done = 1;
 	}
 	VERIFY(pthread_cond_broadcast(&ca->c) == 0);
+	VERIFY(pthread_mutex_unlock(&ca->m) == 0);
 	return true;
 }
 
@@ -405,13 +1109,79 @@ compress:
 }
 
 
-rpcs::rpcs(unsigned int p1, int count)
-  : port_(p1), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true)
+rpcc::future::future()
+: done_(false), ret_(0)
+{
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+	VERIFY(pthread_cond_init(&c_, 0) == 0);
+}
+
+rpcc::future::~future()
+{
+	{
+		ScopedLock ml(&m_);
+		VERIFY(done_);
+	}
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+	VERIFY(pthread_cond_destroy(&c_) == 0);
+}
+
+void
+rpcc::future::done(int ret, unmarshall &rep)
+{
+	ScopedLock ml(&m_);
+	if(ret >= 0)
+		rep_.take_in(rep);
+	ret_ = ret;
+	done_ = true;
+	VERIFY(pthread_cond_broadcast(&c_) == 0);
+}
+
+int
+rpcc::future::wait()
+{
+	ScopedLock ml(&m_);
+	while(!done_)
+		VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+	return ret_;
+}
+
+bool
+rpcc::future::ready()
+{
+	ScopedLock ml(&m_);
+	return done_;
+}
+
+rpcs::rpcs(unsigned int p1, int count) : rpcs(p1, NULL, count)
+{
+}
+
+static bool
+is_unix_addr(const char *a)
+{
+	return strncmp(a, "unix:", 5) == 0;
+}
+
+rpcs::rpcs(const std::string &addr, int count)
+  : rpcs(is_unix_addr(addr.c_str()) ? 0 : atoi(addr.c_str()),
+		is_unix_addr(addr.c_str()) ? addr.c_str() + 5 : NULL, count)
+{
+}
+
+rpcs::rpcs(unsigned int p1, const char *path, int count)
+  : port_(p1), reply_bytes_(0), sweeper_stop_(false),
+    sweep_soon_(false), counting_(count),
+    curr_counts_(count), lossytest_(0), reachable_ (true), nblocked_(0)
 {
 	VERIFY(pthread_mutex_init(&procs_m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&count_m_, 0) == 0);
-	VERIFY(pthread_mutex_init(&reply_window_m_, 0) == 0);
+	for (int i = 0; i < reply_shards; i++)
+		VERIFY(pthread_mutex_init(&reply_shard_[i].m, 0) == 0);
+	VERIFY(pthread_mutex_init(&sweeper_m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&conss_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&blocked_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&intern_m_, 0) == 0);
 
 	set_rand_seed();
 	nonce_ = random();
@@ -423,17 +1193,59 @@ rpcs::rpcs(unsigned int p1, int count)
 	}
 
 	reg(rpc_const::bind, this, &rpcs::rpcbind);
-	dispatchpool_ = new ThrPool(6,false);
+	reg(rpc_const::checksum_bind, this, &rpcs::checksumbind);
+	reg(rpc_const::compact_bind, this, &rpcs::compactbind);
+	reg(rpc_const::intern, this, &rpcs::internstr);
+	reg(rpc_const::stats, this, &rpcs::statsrpc);
+	int nthreads = 6;
+	char *threads_env = getenv("RPC_THREADS");
+	if(threads_env != NULL && atoi(threads_env) > 0){
+		nthreads = atoi(threads_env);
+	}
+	dispatchpool_ = new ThrPool(nthreads,false);
+
+	sweeper_.srv = this;
+	timer_wheel::instance()->schedule(&sweeper_, sweep_ms, true);
+
+	if(path)
+		listener_ = new tcpsconn(this, path, lossytest_);
+	else
+		listener_ = new tcpsconn(this, port_, lossytest_);
 
-	listener_ = new tcpsconn(this, port_, lossytest_);
+	ScopedLock al(&all_m);
+	all_rpcs.push_back(this);
 }
 
 rpcs::~rpcs()
 {
+	{
+		ScopedLock al(&all_m);
+		all_rpcs.remove(this);
+	}
+	{
+		ScopedLock sl(&sweeper_m_);
+		sweeper_stop_ = true;
+	}
+	timer_wheel::instance()->cancel_sync(&sweeper_);
+	VERIFY(pthread_mutex_destroy(&sweeper_m_) == 0);
+
 	// must delete listener before dispatchpool
 	delete listener_;
 	delete dispatchpool_;
 	free_reply_window();
+	for (int i = 0; i < reply_shards; i++)
+		VERIFY(pthread_mutex_destroy(&reply_shard_[i].m) == 0);
+
+	std::list<connection *>::iterator i;
+	for (i = blocked_.begin(); i != blocked_.end(); i++)
+		(*i)->decref();
+	VERIFY(pthread_mutex_destroy(&blocked_m_) == 0);
+
+	VERIFY(pthread_mutex_destroy(&intern_m_) == 0);
+
+	std::map<int, rpcs_proc_stats *>::iterator ps;
+	for (ps = pstats_.begin(); ps != pstats_.end(); ps++)
+		delete ps->second;
 }
 
 bool
@@ -444,23 +1256,61 @@ rpcs::got_pdu(connection *c, char *b, int sz)
             return true;
         }
 
-	djob_t *j = new djob_t(c, b, sz);
+	djob_t *j = new djob_t(this, c, b, sz);
 	c->incref();
 	// 将本次的事件放入线程池处理
-	bool succ = dispatchpool_->addObjJob(this, &rpcs::dispatch, j);
-	if(!succ || !reachable_){
+	bool succ = dispatchpool_->addJob(j);
+	if(!succ){
+		// the pool is full. c keeps the pdu and stops reading until
+		// a worker finds the pool drained and calls resume_blocked().
+		// try once more after c is on blocked_, in case the pool
+		// drained before any worker could see c there.
+		{
+			ScopedLock bl(&blocked_m_);
+			c->incref();
+			blocked_.push_back(c);
+			nblocked_++;
+		}
+		succ = dispatchpool_->addJob(j);
+	}
+	if(!succ){
 		c->decref();
 		delete j;
 	}
 	return succ; 
 }
 
+// dispatch threads call this after each rpc: once the pool is half
+// empty, hand the held pdus of blocked connections to it again.
+void
+rpcs::resume_blocked()
+{
+	if(nblocked_ == 0 ||
+			dispatchpool_->pending() > dispatchpool_->capacity() / 2)
+		return;
+
+	std::list<connection *> l;
+	{
+		ScopedLock bl(&blocked_m_);
+		l.swap(blocked_);
+		nblocked_ = 0;
+	}
+	std::list<connection *>::iterator i;
+	for (i = l.begin(); i != l.end(); i++) {
+		jsl_log(JSL_DBG_2, "rpcs::resume_blocked: resume chan %d\n",
+				(*i)->channo());
+		(*i)->resume_read();
+		(*i)->decref();
+	}
+}
+
 void
 rpcs::reg1(unsigned int proc, handler *h)
 {
 	ScopedLock pl(&procs_m_);
 	VERIFY(procs_.count(proc) == 0);
 	procs_[proc] = h;
+	pstats_[proc] = new rpcs_proc_stats;
 	VERIFY(procs_.count(proc) >= 1);
 }
 
@@ -478,17 +1328,20 @@ rpcs::updatestat(unsigned int proc)
 		}
 		printf("\n");
 
-		ScopedLock rwl(&reply_window_m_);
-		std::map<unsigned int,std::list<reply_t> >::iterator clt;
-
-		unsigned int totalrep = 0, maxrep = 0;
-		for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-			totalrep += clt->second.size();
-			if(clt->second.size() > maxrep)
-				maxrep = clt->second.size();
+		unsigned int clients = 0, totalrep = 0, maxrep = 0;
+		for (int i = 0; i < reply_shards; i++){
+			ScopedLock rwl(&reply_shard_[i].m);
+			std::unordered_map<unsigned int, reply_window_t>::iterator clt;
+			clients += reply_shard_[i].clients.size();
+			for (clt = reply_shard_[i].clients.begin();
+					clt != reply_shard_[i].clients.end(); clt++){
+				totalrep += clt->second.used;
+				if(clt->second.used > maxrep)
+					maxrep = clt->second.used;
+			}
 		}
 		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %d total reply %d max per client %d\n", 
-                        (int) reply_window_.size(), totalrep, maxrep);
+                        (int) clients, totalrep, maxrep);
 		curr_counts_ = counting_;
 	}
 }
@@ -498,11 +1351,19 @@ rpcs::dispatch(djob_t *j)
 {
 	connection *c = j->conn;
 	unmarshall req(j->buf, j->sz);
+	uint64_t arrived = j->arrived;
 	delete j;
 
 	req_header h;
 	req.unpack_req_header(&h);
-	int proc = h.proc;
+	bool compact = h.proc & rpc_const::compact_flag;
+	int proc = h.proc & ~(rpc_const::compact_flag | rpc_const::trace_flag);
+	// a client that seals its requests gets sealed replies
+	bool seal = req.sealed();
+	// the caller's trace, and the rpcc span this handler is a child of
+	rpc_span_ctx from;
+	if(h.proc & rpc_const::trace_flag)
+		get_span(req, &from);
 
 	if(!req.ok()){
 		jsl_log(JSL_DBG_1, "rpcs:dispatch unmarshall header failed!!!\n");
@@ -514,21 +1375,38 @@ rpcs::dispatch(djob_t *j)
 			"rpcs::dispatch: rpc %u (proc %x, last_rep %u) from clt %u for srv instance %u \n",
 			h.xid, proc, h.xid_rep, h.clt_nonce, h.srv_nonce);
 
+	// the requests inside check the server instance themselves
+	if(proc == rpc_const::batch){
+		dispatch_batch(c, req, arrived, seal);
+		c->decref();
+		return;
+	}
+
 	marshall rep;
 	reply_header rh(h.xid,0);
+	// held until the handler has its arguments
+	std::shared_ptr<intern_table> strs;
+	if(compact){
+		strs = interned(h.clt_nonce);
+		req.set_compact(true, strs.get());
+		rep.set_compact(true);
+	}
 
 	// is client sending to an old instance of server?
 	if(h.srv_nonce != 0 && h.srv_nonce != nonce_){
 		jsl_log(JSL_DBG_2,
 				"rpcs::dispatch: rpc for an old server instance %u (current %u) proc %x\n",
-				h.srv_nonce, nonce_, h.proc);
+				h.srv_nonce, nonce_, proc);
 		rh.ret = rpc_const::oldsrv_failure;
 		rep.pack_reply_header(rh);
-		c->send(rep.cstr(),rep.size());
+		if(seal)
+			rep.seal();
+		c->send(rep.cstr(),rep.size(), rpc_priority(proc, rep.size()));
 		return;
 	}
 
 	handler *f;
+	rpcs_proc_stats *ps;
 	// is RPC proc a registered procedure?
 	{
 		ScopedLock pl(&procs_m_);
@@ -541,25 +1419,16 @@ rpcs::dispatch(djob_t *j)
 		}
 
 		f = procs_[proc];
+		ps = pstats_[proc];
 	}
 
 	rpcs::rpcstate_t stat;
 	char *b1;
 	int sz1;
+	uint64_t start;
+	rpc_span_ctx span;  // the rpcs span
 
 	if(h.clt_nonce){
-		// have i seen this client before?
-		{
-			ScopedLock rwl(&reply_window_m_);
-			// if we don't know about this clt_nonce, create a cleanup object
-			if(reply_window_.find(h.clt_nonce) == reply_window_.end()){
-				VERIFY (reply_window_[h.clt_nonce].size() == 0); // create
-				jsl_log(JSL_DBG_2,
-						"rpcs::dispatch: new client %u xid %d chan %d, total clients %d\n", 
-						h.clt_nonce, h.xid, c->channo(), (int)reply_window_.size());
-			}
-		}
-
 		// save the latest good connection to the client
 		{
 			ScopedLock rwl(&conss_m_);
@@ -573,8 +1442,11 @@ rpcs::dispatch(djob_t *j)
 			}
 		}
 
+		// checksum_bind itself goes unsealed, retries too
 		stat = checkduplicate_and_update(h.clt_nonce, h.xid,
-                                                 h.xid_rep, &b1, &sz1);
+                                                 h.xid_rep,
+                                                 seal || proc == rpc_const::checksum_bind,
+                                                 &b1, &sz1);
 	} else {
 		// this client does not require at most once logic
 		stat = NEW;
@@ -585,8 +1457,43 @@ rpcs::dispatch(djob_t *j)
 			if(counting_){
 				updatestat(proc);
 			}
+			start = rpc_now_us();
+			ps->queue_us.add(start - arrived);
+			ps->req_bytes.add(req.size());
+			if(from.trace)
+				span = rpc_span_ctx(from.trace, rpc_span_id());
+
+			if(rpcs::deferred_handler *df =
+					dynamic_cast<rpcs::deferred_handler *>(f)){
+				// the handler replies later through the token
+				reply_token *t = new reply_token(this, c, h.clt_nonce,
+						h.xid, proc, seal, compact, ps, start);
+				t->span_ = span;
+				t->span_parent_ = from.span;
+				t->span_start_ = arrived * 1000;
+				rpc_span_scope in(span);
+				if(df->fn_deferred(req, t) == rpc_const::unmarshal_args_failure){
+					if(req.unknown_interned()){
+						t->reply(rpc_const::intern_failure);
+						break;
+					}
+					fprintf(stderr, "rpcs::dispatch: failed to"
+							" unmarshall the arguments. You are"
+							" probably calling RPC 0x%x with wrong"
+							" types of arguments.\n", proc);
+					VERIFY(0);
+				}
+				break;
+			}
 
-			rh.ret = f->fn(req, rep);
+			{
+				rpc_span_scope in(span);
+				rh.ret = f->fn(req, rep);
+			}
+			// a string the client interned before we forgot it
+			if (rh.ret == rpc_const::unmarshal_args_failure &&
+					req.unknown_interned())
+				rh.ret = rpc_const::intern_failure;
                         if (rh.ret == rpc_const::unmarshal_args_failure) {
                                 fprintf(stderr, "rpcs::dispatch: failed to"
                                        " unmarshall the arguments. You are"
@@ -594,125 +1501,355 @@ rpcs::dispatch(djob_t *j)
                                        " types of arguments.\n", proc);
                                 VERIFY(0);
                         }
-			VERIFY(rh.ret >= 0);
-
-			rep.pack_reply_header(rh);
-			rep.take_buf(&b1,&sz1);
+			VERIFY(rh.ret >= 0 || rh.ret == rpc_const::intern_failure);
+			ps->run_us.add(rpc_now_us() - start);
+			ps->rep_bytes.add(rep.size());
 
-			jsl_log(JSL_DBG_2,
-					"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
-					sz1, h.xid, proc, rh.ret, h.clt_nonce);
-
-			if(h.clt_nonce > 0){
-				// only record replies for clients that require at-most-once logic
-				add_reply(h.clt_nonce, h.xid, b1, sz1);
-			}
-
-			// get the latest connection to the client
-			{
-				ScopedLock rwl(&conss_m_);
-				if(c->isdead() && c != conns_[h.clt_nonce]){
-					c->decref();
-					c = conns_[h.clt_nonce];
-					c->incref();
-				}
-			}
-
-			c->send(b1, sz1);
-			if(h.clt_nonce == 0){
-				// reply is not added to at-most-once window, free it
-				free(b1);
-			}
+			send_reply(c, h.clt_nonce, h.xid, proc, rh.ret, rep, seal);
+			if(span.trace)
+				rpc_span_rpcs(span, from.span, arrived * 1000, proc);
 			break;
 		case INPROGRESS: // server is working on this request
 			break;
 		case DONE: // duplicate and we still have the response
-			c->send(b1, sz1);
+			c->send(b1, sz1, rpc_priority(proc, sz1));
+			free(b1);
 			break;
 		case FORGOTTEN: // very old request and we don't have the response anymore
 			jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n", 
 					h.xid, h.clt_nonce);
 			rh.ret = rpc_const::atmostonce_failure;
 			rep.pack_reply_header(rh);
-			c->send(rep.cstr(),rep.size());
+			if(seal)
+				rep.seal();
+			c->send(rep.cstr(),rep.size(), rpc_priority(proc, rep.size()));
+			break;
+		case UNSEALED: // its checksum slot is damaged, or it's forged
+			jsl_log(JSL_DBG_1, "rpcs::dispatch: unsealed rpc %u from %u, "
+					"which seals, closing\n", h.xid, h.clt_nonce);
+			// as for a bad checksum, so that the client sends again
+			// on a new connection
+			c->closeconn();
+			break;
+	}
+	c->decref();
+}
+
+// split a batch pdu into its requests, and dispatch each as if it
+// had arrived by itself. the last one, and any the full pool won't
+// take, run on this thread.
+void
+rpcs::dispatch_batch(connection *c, unmarshall &req, uint64_t arrived,
+		bool sealed)
+{
+	unsigned int n = 0;
+	req >> n;
+	std::vector<djob_t *> jobs;
+	for (unsigned i = 0; req.ok() && i < n; i++) {
+		bytes_view v;
+		req >> v;
+		if(!req.ok() || v.size < RPC_HEADER_SZ)
 			break;
+		// the batch's own checksum covers the requests in it; without
+		// one, a request that says it is sealed has to be checked
+		if(!sealed && !rpc_pdu_intact(v.data, v.size)){
+			jsl_log(JSL_DBG_1, "rpcs::dispatch_batch: bad checksum, "
+					"closing\n");
+			c->closeconn();
+			break;
+		}
+		char *b = (char *)malloc(v.size);
+		VERIFY(b);
+		memcpy(b, v.data, v.size);
+		c->incref();
+		jobs.push_back(new djob_t(this, c, b, v.size));
+		jobs.back()->arrived = arrived;
+	}
+	if(jobs.size() != n)
+		jsl_log(JSL_DBG_1, "rpcs::dispatch_batch: bad batch, %d of %u "
+				"requests\n", (int)jobs.size(), n);
+
+	for (unsigned i = 0; i < jobs.size(); i++) {
+		if(i + 1 < jobs.size() && dispatchpool_->addJob(jobs[i]))
+			continue;
+		dispatch(jobs[i]);
+	}
+}
+
+// pack and send the reply to a NEW rpc, keeping a copy for
+// at-most-once. if c has died meanwhile, the reply goes out on the
+// latest connection from the client instead.
+void
+rpcs::send_reply(connection *c, unsigned int clt_nonce, unsigned int xid,
+		unsigned int proc, int ret, marshall &rep, bool seal)
+{
+	reply_header rh(xid, ret);
+	char *b1;
+	int sz1;
+
+	rep.pack_reply_header(rh);
+	if(seal)
+		rep.seal();
+	rep.take_buf(&b1,&sz1);
+
+	jsl_log(JSL_DBG_2,
+			"rpcs::send_reply: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
+			sz1, xid, proc, ret, clt_nonce);
+
+	// only record replies for clients that require at-most-once logic
+	bool kept = clt_nonce > 0 && add_reply(clt_nonce, xid, b1, sz1);
+
+	// get the latest connection to the client
+	c->incref();
+	if(clt_nonce > 0){
+		ScopedLock rwl(&conss_m_);
+		if(c->isdead() && c != conns_[clt_nonce]){
+			c->decref();
+			c = conns_[clt_nonce];
+			c->incref();
+		}
 	}
+
+	c->send(b1, sz1, rpc_priority(proc, sz1));
 	c->decref();
+	if(kept){
+		// the window may have dropped it while it was going out
+		reply_sent(clt_nonce, xid, b1);
+	} else {
+		// reply is not added to at-most-once window, free it
+		free(b1);
+	}
+}
+
+rpcs::reply_token::reply_token(rpcs *s, connection *c, unsigned int clt_nonce,
+		unsigned int xid, unsigned int proc, bool seal, bool compact,
+		rpcs_proc_stats *ps, uint64_t start)
+	: srv_(s), c_(c), clt_nonce_(clt_nonce), xid_(xid), proc_(proc),
+	seal_(seal), compact_(compact), ps_(ps), start_(start), span_parent_(0),
+	span_start_(0)
+{
+	c_->incref();
+}
+
+rpcs::reply_token::~reply_token()
+{
+	c_->decref();
+}
+
+void
+rpcs::reply_token::reply(int ret)
+{
+	marshall rep;
+	reply1(ret, rep);
+}
+
+void
+rpcs::reply_token::reply1(int ret, marshall &rep)
+{
+	ps_->run_us.add(rpc_now_us() - start_);
+	ps_->rep_bytes.add(rep.size());
+	srv_->send_reply(c_, clt_nonce_, xid_, proc_, ret, rep, seal_);
+	if(span_.trace)
+		rpc_span_rpcs(span_, span_parent_, span_start_, proc_);
+	delete this;
 }
 
 // rpcs::dispatch calls this when an RPC request arrives.
 //
 // checks to see if an RPC with xid from clt_nonce has already been received.
-// if not, remembers the request in reply_window_.
+// if not, remembers the request in its client's reply window.
 //
-// deletes remembered requests with XIDs <= xid_rep; the client
+// deletes remembered requests with XIDs < xid_rep; the client
 // says it has received a reply for every RPC up through xid_rep.
 // frees the reply_t::buf of each such request.
 //
 // returns one of:
 //   NEW: never seen this xid before.
 //   INPROGRESS: seen this xid, and still processing it.
-//   DONE: seen this xid, previous reply returned in *b and *sz.
+//   DONE: seen this xid, a copy of the previous reply returned in *b
+//     and *sz; the caller frees it.
 //   FORGOTTEN: might have seen this xid, but deleted previous reply.
+//   UNSEALED: sealed is false, but the client agreed to checksums,
+//     so this pdu went unchecked; nothing was done with it.
+//
+// constant time, apart from freeing acknowledged replies and the
+// occasional doubling of a window.
 /**
  * @brief 判断当前请求的类别，处理重复的 rpc 请求
  * 
  * @param clt_nonce 客户端 id
  * @param xid 客户端请求的 id
  * @param xid_rep 客户端确认收到回复的 id
+ * @param sealed 请求带有校验和
  * @param b 
  * @param sz 
  * @return rpcs::rpcstate_t 
  */
 rpcs::rpcstate_t rpcs::checkduplicate_and_update(unsigned int clt_nonce,
                                                  unsigned int xid,
-                                                 unsigned int xid_rep, char **b,
+                                                 unsigned int xid_rep, bool sealed,
+                                                 char **b,
                                                  int *sz) {
-  ScopedLock rwl(&reply_window_m_);
-
-  auto iter = reply_window_[clt_nonce].begin();
-	// 遍历整个滑动窗口
-	while(iter != reply_window_[clt_nonce].end()) {
-		if (iter->xid < xid_rep && iter->cb_present) { // 比确认收到的请求id小的请求都可以释放
-			free(iter->buf);
-			iter = reply_window_[clt_nonce].erase(iter);
-			continue;
-		}	
-		if (xid == iter->xid) { // 找到id相同的请求
-			if(iter->cb_present) { // 已完成的请求，直接返回保存的返回值
-				*b = iter->buf;
-				*sz = iter->sz;
-				return DONE;
-			} else { // 未完成的请求
-				return INPROGRESS;
-			}
-		} 	
-		// 当前请求的id比滑动窗口最左边的还小，说明这是一个已经被确实收到过的请求
-		if(reply_window_[clt_nonce].front().xid > xid) 
+	reply_shard_t &sh = shard(clt_nonce);
+	ScopedLock rwl(&sh.m);
+
+	std::unordered_map<unsigned int, reply_window_t>::iterator it =
+		sh.clients.find(clt_nonce);
+	if(it == sh.clients.end()){
+		unsigned int base = xid_rep;
+		bool was_sealed = false;
+		std::unordered_map<unsigned int, reply_tombstone_t>::iterator e =
+			sh.expired.find(clt_nonce);
+		if(e != sh.expired.end()){
+			// an idle client we forgot: only xids beyond its old
+			// window are new
+			if(e->second.sealed && !sealed)
+				return UNSEALED;
+			base = e->second.top > xid_rep ? e->second.top : xid_rep;
+			was_sealed = e->second.sealed;
+			sh.expired.erase(e);
+		}
+		// a new client: nothing it has acknowledged can be asked for
+		it = sh.clients.insert(std::make_pair(clt_nonce, reply_window_t())).first;
+		it->second.base = it->second.top = it->second.oldest = base;
+		it->second.sealed = was_sealed;
+		jsl_log(JSL_DBG_2,
+				"rpcs::checkduplicate_and_update: new client %u xid %d\n",
+				clt_nonce, xid);
+	}
+	reply_window_t &w = it->second;
+	// nothing in the header can be trusted
+	if(w.sealed && !sealed)
+		return UNSEALED;
+	w.last_used = mono_secs();
+
+	reply_bytes_ -= w.release(xid_rep); // 释放客户端已经确认收到的回复
+
+	// 当前请求的id比滑动窗口最左边的还小，说明这是一个已经被确实收到过的请求
+	if(xid < w.base)
+		return FORGOTTEN;
+
+	if(xid - w.base >= w.ring.size()){
+		// a well-behaved client can't be this far ahead, and the
+		// ring for it could be huge
+		if(xid - w.base >= reply_limits_.max_window){
+			jsl_log(JSL_DBG_1, "rpcs::checkduplicate_and_update: client %u "
+					"xid %u too far past %u\n", clt_nonce, xid, w.base);
 			return FORGOTTEN;
-		iter++;
+		}
+		w.grow(xid);
 	}
 
-	// 这是一个新的请求，新建对应于该请求的回复对象
-	reply_t reply(xid);
-	// 因为较后发送的请求可能会比较早发出的请求先到达，所以需要遍历滑动窗口链表
-	for (iter = reply_window_[clt_nonce].begin(); iter != reply_window_[clt_nonce].end(); iter++) {
-		if(iter->xid > xid) {
-			reply_window_[clt_nonce].insert(iter, reply); // 前插
-			break;
-		}		
+	reply_t &r = w.slot(xid);
+	if(r.xid == xid){
+		if(!r.cb_present) // 未完成的请求
+			return INPROGRESS;
+		if(r.forgotten()) // 回复因为缓存限制被丢弃了
+			return FORGOTTEN;
+		// 已完成的请求，返回保存的返回值的拷贝：
+		// 回复在锁外发送时可能已经被释放
+		*b = (char *)malloc(r.sz);
+		VERIFY(*b);
+		memcpy(*b, r.buf, r.sz);
+		*sz = r.sz;
+		return DONE;
 	}
-	// 最后发出的请求，插入滑动窗口链表的最后面
-	if(iter == reply_window_[clt_nonce].end())
-		reply_window_[clt_nonce].push_back(reply);
+
+	// 这是一个新的请求，占用对应于该请求的回复对象
+	VERIFY(r.xid == 0);
+	r = reply_t(xid);
+	w.used++;
+	if(xid >= w.top)
+		w.top = xid + 1;
 	return NEW;
 }
 
+// free the replies the client has acknowledged, moving base up to
+// xid_rep. stops early at a request that is still in progress.
+// returns the number of reply bytes freed.
+size_t
+rpcs::reply_window_t::release(unsigned int xid_rep)
+{
+	size_t freed = 0;
+	if(used == 0 && xid_rep > base){
+		base = xid_rep;
+	}
+	while(base < xid_rep){
+		reply_t &r = slot(base);
+		// xid 0 is never a request, its slot just empty
+		if(r.xid == base && base != 0){
+			if(!r.cb_present)
+				break;
+			if(r.buf){
+				r.drop();
+				freed += r.sz;
+				bytes -= r.sz;
+				kept--;
+			}
+			r = reply_t(0);
+			used--;
+		}
+		base++;
+	}
+	if(oldest < base)
+		oldest = base;
+	return freed;
+}
+
+// free the oldest reply buffer other than keep_xid's; its xid stays
+// in the window, now FORGOTTEN. returns the bytes freed, 0 if none.
+size_t
+rpcs::reply_window_t::forget_oldest(unsigned int keep_xid)
+{
+	for(; oldest < top; oldest++){
+		reply_t &r = slot(oldest);
+		if(r.xid != oldest || !r.buf)
+			continue;
+		if(oldest == keep_xid)
+			return 0;
+		size_t n = r.sz;
+		r.drop();
+		bytes -= n;
+		kept--;
+		oldest++;
+		return n;
+	}
+	return 0;
+}
+
+size_t
+rpcs::reply_window_t::forget_all()
+{
+	size_t freed = 0, n;
+	while((n = forget_oldest(0)) > 0)
+		freed += n;
+	return freed;
+}
+
+// make room in the window for xid, keeping ring.size() a power of two
+void
+rpcs::reply_window_t::grow(unsigned int xid)
+{
+	size_t n = ring.size();
+	while(xid - base >= n)
+		n *= 2;
+	std::vector<reply_t> r(n, reply_t(0));
+	for(size_t i = 0; i < ring.size(); i++){
+		if(ring[i].xid)
+			r[ring[i].xid & (n - 1)] = ring[i];
+	}
+	ring.swap(r);
+}
+
 // rpcs::dispatch calls add_reply when it is sending a reply to an RPC,
 // and passes the return value in b and sz.
-// add_reply() should remember b and sz.
+// add_reply() should remember b and sz, and returns false if it
+// didn't, in which case the caller frees b.
 // free_reply_window() and checkduplicate_and_update is responsible for 
 // calling free(b).
+//
+// keeps the client within its reply_limits by forgetting its oldest
+// replies; the sweeper enforces the limit on all clients.
 /**
  * @brief 一个新的请求处理完毕，填充其在滑动窗口中的回复结构体
  * 
@@ -721,38 +1858,183 @@ rpcs::rpcstate_t rpcs::checkduplicate_and_update(unsigned int clt_nonce,
  * @param b 
  * @param sz 
  */
-void rpcs::add_reply(unsigned int clt_nonce, unsigned int xid, char *b,
+bool rpcs::add_reply(unsigned int clt_nonce, unsigned int xid, char *b,
                      int sz) {
-  ScopedLock rwl(&reply_window_m_);
-
-  auto clt = reply_window_.find(clt_nonce);
-  if (clt != reply_window_.end()) {
-		// 遍历滑动窗口链表，找到对应的回复结构体
-    for (auto iter = clt->second.begin(); iter != clt->second.end(); iter++) {
-      if (iter->xid == xid) {
-        iter->buf = b;
-        iter->sz = sz;
-        iter->cb_present = true; // 标记请求处理已经完成
-        break;
-      }
-    }
-  }
+	{
+		reply_shard_t &sh = shard(clt_nonce);
+		ScopedLock rwl(&sh.m);
+
+		std::unordered_map<unsigned int, reply_window_t>::iterator it =
+			sh.clients.find(clt_nonce);
+		if(it == sh.clients.end())
+			return false;
+		reply_window_t &w = it->second;
+		if(xid < w.base || xid - w.base >= w.ring.size())
+			return false;
+		reply_t &r = w.slot(xid);
+		if(r.xid != xid)
+			return false;
+		r.buf = b;
+		r.sz = sz;
+		r.sending = true;
+		r.cb_present = true; // 标记请求处理已经完成
+		w.kept++;
+		w.bytes += sz;
+		reply_bytes_ += sz;
+		if(xid < w.oldest)
+			w.oldest = xid;
+
+		while(w.bytes > reply_limits_.client_max_bytes ||
+				w.kept > reply_limits_.client_max_replies){
+			size_t n = w.forget_oldest(xid);
+			if(n == 0)
+				break;
+			reply_bytes_ -= n;
+		}
+	}
+
+	if(reply_bytes_ > reply_limits_.max_bytes){
+		ScopedLock sl(&sweeper_m_);
+		if(!sweeper_stop_ && !sweep_soon_){
+			sweep_soon_ = true;
+			timer_wheel::instance()->schedule(&sweeper_, 1, true);
+		}
+	}
+	return true;
 }
 
+// send_reply() is done sending b, the reply to xid that add_reply()
+// kept. if the window dropped it meanwhile, b is ours to free.
 void
-rpcs::free_reply_window(void)
+rpcs::reply_sent(unsigned int clt_nonce, unsigned int xid, char *b)
 {
-	std::map<unsigned int,std::list<reply_t> >::iterator clt;
-	std::list<reply_t>::iterator it;
+	reply_shard_t &sh = shard(clt_nonce);
+	ScopedLock rwl(&sh.m);
+	std::unordered_map<unsigned int, reply_window_t>::iterator it =
+		sh.clients.find(clt_nonce);
+	if(it != sh.clients.end()){
+		reply_window_t &w = it->second;
+		reply_t &r = w.slot(xid);
+		if(r.xid == xid && r.buf == b){
+			r.sending = false;
+			return;
+		}
+	}
+	free(b);
+}
+
+void
+rpcs::set_reply_limits(const reply_limits &l)
+{
+	ScopedLock sl(&sweeper_m_);
+	reply_limits_ = l;
+	if(!sweeper_stop_)
+		timer_wheel::instance()->schedule(&sweeper_, 1, true);
+}
 
-	ScopedLock rwl(&reply_window_m_);
-	for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-		for (it = clt->second.begin(); it != clt->second.end(); it++){
-			free((*it).buf);
+// forgets idle clients once a second, and trims the replies of the
+// least recently used clients when all replies together are over
+// reply_limits_.max_bytes.
+void
+rpcs::sweep_timer::expire()
+{
+	srv->reply_sweeper();
+}
+
+void
+rpcs::reply_sweeper()
+{
+	{
+		ScopedLock sl(&sweeper_m_);
+		sweep_soon_ = false;
+	}
+	expire_idle_clients(mono_secs());
+	if(reply_bytes_ > reply_limits_.max_bytes)
+		trim_lru_clients();
+
+	ScopedLock sl(&sweeper_m_);
+	if(!sweeper_stop_)
+		timer_wheel::instance()->schedule(&sweeper_, sweep_ms, true);
+}
+
+void
+rpcs::expire_idle_clients(time_t now)
+{
+	unsigned int max_expired = reply_limits_.max_expired / reply_shards + 1;
+	std::vector<unsigned int> gone;
+	for(int i = 0; i < reply_shards; i++){
+		reply_shard_t &sh = reply_shard_[i];
+		ScopedLock rwl(&sh.m);
+		std::unordered_map<unsigned int, reply_window_t>::iterator it;
+		for(it = sh.clients.begin(); it != sh.clients.end(); ){
+			reply_window_t &w = it->second;
+			if(now - w.last_used < reply_limits_.idle_secs){
+				it++;
+				continue;
+			}
+			jsl_log(JSL_DBG_2, "rpcs::expire_idle_clients: forget client %u "
+					"idle %ds\n", it->first, (int)(now - w.last_used));
+			for(size_t j = 0; j < w.ring.size(); j++)
+				w.ring[j].drop();
+			reply_bytes_ -= w.bytes;
+			while(sh.expired.size() >= max_expired)
+				sh.expired.erase(sh.expired.begin());
+			reply_tombstone_t &t = sh.expired[it->first];
+			t.top = w.top;
+			t.sealed = w.sealed;
+			gone.push_back(it->first);
+			it = sh.clients.erase(it);
+		}
+	}
+	drop_interned(gone);
+}
+
+void
+rpcs::trim_lru_clients()
+{
+	std::vector<std::pair<time_t, unsigned int> > lru;
+	for(int i = 0; i < reply_shards; i++){
+		ScopedLock rwl(&reply_shard_[i].m);
+		std::unordered_map<unsigned int, reply_window_t>::iterator it;
+		for(it = reply_shard_[i].clients.begin();
+				it != reply_shard_[i].clients.end(); it++){
+			if(it->second.kept)
+				lru.push_back(std::make_pair(it->second.last_used, it->first));
+		}
+	}
+	std::sort(lru.begin(), lru.end());
+
+	std::vector<unsigned int> trimmed;
+	for(size_t i = 0; i < lru.size() && reply_bytes_ > reply_limits_.max_bytes; i++){
+		reply_shard_t &sh = shard(lru[i].second);
+		ScopedLock rwl(&sh.m);
+		std::unordered_map<unsigned int, reply_window_t>::iterator it =
+			sh.clients.find(lru[i].second);
+		if(it == sh.clients.end())
+			continue;
+		jsl_log(JSL_DBG_2, "rpcs::trim_lru_clients: trim client %u %lu bytes\n",
+				it->first, (unsigned long)it->second.bytes);
+		reply_bytes_ -= it->second.forget_all();
+		trimmed.push_back(it->first);
+	}
+	drop_interned(trimmed);
+}
+
+void
+rpcs::free_reply_window(void)
+{
+	for (int i = 0; i < reply_shards; i++){
+		ScopedLock rwl(&reply_shard_[i].m);
+		std::unordered_map<unsigned int, reply_window_t>::iterator clt;
+		for (clt = reply_shard_[i].clients.begin();
+				clt != reply_shard_[i].clients.end(); clt++){
+			for (size_t j = 0; j < clt->second.ring.size(); j++)
+				free(clt->second.ring[j].buf);
 		}
-		clt->second.clear();
+		reply_shard_[i].clients.clear();
+		reply_shard_[i].expired.clear();
 	}
-	reply_window_.clear();
+	reply_bytes_ = 0;
 }
 
 // rpc handler
@@ -764,118 +2046,451 @@ rpcs::rpcbind(int a, int &r)
 	return 0;
 }
 
+// rpc handler: replies 1 if we check and send checksums, which a
+// client that wants them then turns on. from then on its unsealed
+// requests are refused (see checkduplicate_and_update()). want is
+// for clients that might one day ask for something else.
 void
-marshall::rawbyte(unsigned char x)
+rpcs::checksumbind(reply_token *t, int want)
+{
+	int r = RPC_CHECKSUMMING && want == 1 ? 1 : 0;
+	if(r && t->clt_nonce_){
+		reply_shard_t &sh = shard(t->clt_nonce_);
+		ScopedLock rwl(&sh.m);
+		std::unordered_map<unsigned int, reply_window_t>::iterator it =
+			sh.clients.find(t->clt_nonce_);
+		if(it != sh.clients.end())
+			it->second.sealed = true;
+		else
+			r = 0;
+	}
+	t->reply(0, r);
+}
+
+// rpc handler: r is 1 if we take compact requests (see
+// marshall::set_compact()), as every rpcs since they came in does
+int
+rpcs::compactbind(int want, int &r)
+{
+	r = want == 1 ? 1 : 0;
+	return 0;
+}
+
+// rpc handler: r is the index of s in clt_nonce's intern_table, -1
+// if the table is full
+int
+rpcs::internstr(unsigned int clt_nonce, std::string s, int &r)
+{
+	r = -1;
+	if(clt_nonce == 0)
+		return 0;
+	ScopedLock il(&intern_m_);
+	std::map<unsigned int, std::shared_ptr<intern_table> >::iterator it =
+		interned_.find(clt_nonce);
+	if(it == interned_.end()){
+		// not for a client we've forgotten, or one too many
+		if(intern_dropped_.count(clt_nonce) ||
+				interned_.size() >= reply_limits_.max_expired)
+			return 0;
+		it = interned_.insert(std::make_pair(clt_nonce,
+					std::make_shared<intern_table>())).first;
+	}
+	intern_table *t = it->second.get();
+	unsigned int n = t->n.load(std::memory_order_relaxed);
+	for (unsigned int i = 0; i < n; i++) {
+		if(t->s[i] == s){
+			r = i;
+			return 0;
+		}
+	}
+	if(n < intern_table::max){
+		t->s[n] = s;
+		t->n.store(n + 1, std::memory_order_release);
+		r = n;
+	}
+	return 0;
+}
+
+std::shared_ptr<intern_table>
+rpcs::interned(unsigned int clt_nonce)
 {
-	if(_ind >= _capa){
-		_capa *= 2;
-		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
+	ScopedLock il(&intern_m_);
+	std::map<unsigned int, std::shared_ptr<intern_table> >::iterator t =
+		interned_.find(clt_nonce);
+	return t == interned_.end() ? NULL : t->second;
+}
+
+// the clients' reply windows have gone, and their strings go too
+void
+rpcs::drop_interned(const std::vector<unsigned int> &clients)
+{
+	ScopedLock il(&intern_m_);
+	for(size_t i = 0; i < clients.size(); i++){
+		if(!interned_.erase(clients[i]))
+			continue;
+		while(intern_dropped_.size() >= reply_limits_.max_expired)
+			intern_dropped_.erase(intern_dropped_.begin());
+		intern_dropped_.insert(clients[i]);
 	}
-	_buf[_ind++] = x;
+}
+
+int
+rpcs::statsrpc(int clear, rpc_stats_report &r)
+{
+	stats(&r, clear != 0);
+	return 0;
+}
+
+void
+rpcs::stats(rpc_stats_report *r, bool clear)
+{
+	server_stats(r, clear);
+	lock_site_stats(&r->locks, clear);
+	ScopedLock al(&all_m);
+	client_stats(&r->clients);
+}
+
+void
+rpcs::add_stats(rpc_stats_provider *p)
+{
+	ScopedLock pl(&procs_m_);
+	providers_.push_back(p);
+}
+
+// everything in r but clients
+void
+rpcs::server_stats(rpc_stats_report *r, bool clear)
+{
+	r->now_us = rpc_now_us();
+	r->conns = listener_->nconns();
+	r->clients_seen = 0;
+	for (int i = 0; i < reply_shards; i++) {
+		ScopedLock rwl(&reply_shard_[i].m);
+		r->clients_seen += reply_shard_[i].clients.size();
+	}
+	r->reply_bytes = reply_bytes_;
+	r->queued = dispatchpool_->pending();
+	r->queue_max = dispatchpool_->capacity();
+	r->blocked = nblocked_;
+
+	r->server.clear();
+	r->service.clear();
+	std::list<rpc_stats_provider *> providers;
+	{
+		ScopedLock pl(&procs_m_);
+		providers = providers_;
+		std::map<int, rpcs_proc_stats *>::iterator i;
+		for (i = pstats_.begin(); i != pstats_.end(); i++) {
+			rpcs_proc_stats *ps = i->second;
+			if (ps->queue_us.count() == 0)
+				continue;
+			rpcs_proc_report p;
+			p.proc = i->first;
+			ps->queue_us.get(&p.queue_us);
+			ps->run_us.get(&p.run_us);
+			ps->req_bytes.get(&p.req_bytes);
+			ps->rep_bytes.get(&p.rep_bytes);
+			r->server.push_back(p);
+			if (clear) {
+				ps->queue_us.clear();
+				ps->run_us.clear();
+				ps->req_bytes.clear();
+				ps->rep_bytes.clear();
+			}
+		}
+	}
+	// not under procs_m_, which every dispatch takes: a provider
+	// may wait for a lock that a slow handler holds
+	std::list<rpc_stats_provider *>::iterator p;
+	for (p = providers.begin(); p != providers.end(); p++)
+		(*p)->stats(&r->service);
+}
+
+// all_m held
+static void
+client_stats(std::vector<rpcc_report> *v)
+{
+	v->clear();
+	std::list<rpcc *>::iterator c;
+	for (c = all_rpcc.begin(); c != all_rpcc.end(); c++) {
+		v->push_back(rpcc_report());
+		(*c)->stats(&v->back());
+	}
+}
+
+void
+rpc_stats_dump(FILE *f)
+{
+	ScopedLock al(&all_m);
+	rpc_stats_report r;
+	std::list<rpcs *>::iterator s;
+	for (s = all_rpcs.begin(); s != all_rpcs.end(); s++) {
+		(*s)->server_stats(&r, false);
+		char who[32];
+		snprintf(who, sizeof(who), "port %d", (*s)->port());
+		rpc_stats_print(f, who, r);
+	}
+	rpc_stats_report rc;
+	client_stats(&rc.clients);
+	lock_site_stats(&rc.locks, false);
+	rpc_stats_print(f, "", rc);
+}
+
+void
+rpc_stats_on_signal(int sig)
+{
+	rpc_on_signal(sig, [](){ rpc_stats_dump(stderr); });
+}
+
+void
+marshall::grow(int n)
+{
+	_capa = _capa > n? 2*_capa:(_capa+n);
+	if(_ind + n > _capa)
+		_capa = _ind + n;
+	VERIFY (_buf != NULL);
+	_buf = (char *)realloc(_buf, _capa);
+	VERIFY(_buf);
+}
+
+void
+marshall::rawbyte(unsigned char x)
+{
+	*claim(1) = x;
 }
 
 void
 marshall::rawbytes(const char *p, int n)
 {
-	if((_ind+n) > _capa){
-		_capa = _capa > n? 2*_capa:(_capa+n);
-		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
+	memcpy(claim(n), p, n);
+}
+
+void
+marshall::rawbytes_ref(const char *p, int n)
+{
+	if (n < RPC_REF_MIN) {
+		rawbytes(p, n);
+		return;
 	}
-	memcpy(_buf+_ind, p, n);
-	_ind += n;
+	seg sg;
+	sg.pos = _ind;
+	sg.p = p;
+	sg.n = n;
+	_segs.push_back(sg);
+	_segsz += n;
 }
 
-marshall &
-operator<<(marshall &m, bool x)
+void
+marshall::flatten()
 {
-	m.rawbyte(x);
-	return m;
+	if (_segs.empty())
+		return;
+	int sz = _ind + _segsz;
+	char *nb = (char *)malloc(sz);
+	VERIFY(nb);
+	int from = 0, to = 0;
+	for (unsigned i = 0; i < _segs.size(); i++) {
+		memcpy(nb+to, _buf+from, _segs[i].pos-from);
+		to += _segs[i].pos-from;
+		from = _segs[i].pos;
+		memcpy(nb+to, _segs[i].p, _segs[i].n);
+		to += _segs[i].n;
+	}
+	memcpy(nb+to, _buf+from, _ind-from);
+	free(_buf);
+	_buf = nb;
+	_capa = _ind = sz;
+	_segs.clear();
+	_segsz = 0;
 }
 
-marshall &
-operator<<(marshall &m, unsigned char x)
+void
+marshall::iov(std::vector<struct iovec> *v)
 {
-	m.rawbyte(x);
-	return m;
+	struct iovec e;
+	int from = 0;
+	v->clear();
+	for (unsigned i = 0; i < _segs.size(); i++) {
+		if (_segs[i].pos > from) {
+			e.iov_base = _buf+from;
+			e.iov_len = _segs[i].pos-from;
+			v->push_back(e);
+		}
+		from = _segs[i].pos;
+		e.iov_base = (void *)_segs[i].p;
+		e.iov_len = _segs[i].n;
+		v->push_back(e);
+	}
+	if (_ind > from || v->empty()) {
+		e.iov_base = _buf+from;
+		e.iov_len = _ind-from;
+		v->push_back(e);
+	}
 }
 
-marshall &
-operator<<(marshall &m, char x)
+void
+marshall::seal()
 {
-	m << (unsigned char) x;
-	return m;
+#if RPC_CHECKSUMMING
+	const int body = sizeof(rpc_sz_t) + sizeof(rpc_checksum_t);
+	std::vector<struct iovec> v;
+	iov(&v);
+	uint32_t crc = 0;
+	for (unsigned i = 0; i < v.size(); i++) {
+		const char *p = (const char *)v[i].iov_base;
+		size_t n = v[i].iov_len;
+		if (i == 0) {
+			VERIFY(n >= (size_t)body);
+			p += body;
+			n -= body;
+		}
+		crc = crc32c(crc, p, n);
+	}
+	uint32_t w[2] = { htonl(RPC_SEALED), htonl(crc) };
+	memcpy(_buf + sizeof(rpc_sz_t), w, sizeof(w));
+#endif
 }
 
+bool
+unmarshall::sealed()
+{
+#if RPC_CHECKSUMMING
+	uint32_t magic;
+	if (_sz < RPC_HEADER_SZ)
+		return false;
+	memcpy(&magic, _buf + sizeof(rpc_sz_t), sizeof(magic));
+	return ntohl(magic) == RPC_SEALED;
+#else
+	return false;
+#endif
+}
 
-marshall &
-operator<<(marshall &m, unsigned short x)
+bool
+rpc_pdu_intact(const char *pdu, int sz)
 {
-	m.rawbyte((x >> 8) & 0xff);
-	m.rawbyte(x & 0xff);
-	return m;
+#if RPC_CHECKSUMMING
+	const int body = sizeof(rpc_sz_t) + sizeof(rpc_checksum_t);
+	uint32_t w[2];
+	if (sz < body)
+		return true;
+	memcpy(w, pdu + sizeof(rpc_sz_t), sizeof(w));
+	if (ntohl(w[0]) != RPC_SEALED)
+		return true;
+	return ntohl(w[1]) == crc32c(0, pdu + body, sz - body);
+#else
+	return true;
+#endif
 }
 
-marshall &
-operator<<(marshall &m, short x)
+void
+rpc_pdu_sum(const char *pdu, int n, int *summed, uint32_t *crc)
 {
-	m << (unsigned short) x;
-	return m;
+#if RPC_CHECKSUMMING
+	const int body = sizeof(rpc_sz_t) + sizeof(rpc_checksum_t);
+	if (*summed < 0 || n <= body)
+		return;
+	if (*summed == 0) {
+		uint32_t magic;
+		memcpy(&magic, pdu + sizeof(rpc_sz_t), sizeof(magic));
+		if (ntohl(magic) != RPC_SEALED) {
+			// nothing to check
+			*summed = -1;
+			return;
+		}
+		*summed = body;
+	}
+	*crc = crc32c(*crc, pdu + *summed, n - *summed);
+	*summed = n;
+#endif
 }
 
-marshall &
-operator<<(marshall &m, unsigned int x)
+bool
+rpc_pdu_intact(const char *pdu, int sz, int summed, uint32_t crc)
 {
-	// network order is big-endian
-	m.rawbyte((x >> 24) & 0xff);
-	m.rawbyte((x >> 16) & 0xff);
-	m.rawbyte((x >> 8) & 0xff);
-	m.rawbyte(x & 0xff);
-	return m;
+#if RPC_CHECKSUMMING
+	if (summed != sz)
+		return rpc_pdu_intact(pdu, sz);
+	uint32_t w[2];
+	memcpy(w, pdu + sizeof(rpc_sz_t), sizeof(w));
+	return ntohl(w[1]) == crc;
+#else
+	return true;
+#endif
 }
 
+// in compact mode the low bit of a string's length says whether the
+// rest is an index into the server's intern_table instead
 marshall &
-operator<<(marshall &m, int x)
+operator<<(marshall &m, const std::string &s)
 {
-	m << (unsigned int) x;
+	if (m.compact())
+		m.varint((uint64_t)s.size() << 1);
+	else
+		m << (unsigned int) s.size();
+	m.rawbytes(s.data(), s.size());
 	return m;
 }
 
 marshall &
-operator<<(marshall &m, const std::string &s)
+operator<<(marshall &m, const bytes_ref &r)
 {
-	m << (unsigned int) s.size();
-	m.rawbytes(s.data(), s.size());
+	if (m.compact())
+		m.varint((uint64_t)r.s.size() << 1);
+	else
+		m << (unsigned int) r.s.size();
+	m.rawbytes_ref(r.s.data(), r.s.size());
 	return m;
 }
 
 marshall &
-operator<<(marshall &m, unsigned long long x)
+operator<<(marshall &m, const interned_str &i)
 {
-	m << (unsigned int) (x >> 32);
-	m << (unsigned int) x;
+	if (m.interned() && i.id >= 0)
+		m.varint((uint64_t)i.id << 1 | 1);
+	else
+		m << i.s;
 	return m;
 }
 
+// headers are fixed-width whatever the body is
 void
 marshall::pack(int x)
 {
-	rawbyte((x >> 24) & 0xff);
-	rawbyte((x >> 16) & 0xff);
-	rawbyte((x >> 8) & 0xff);
-	rawbyte(x & 0xff);
+	wire<int>::put(claim(wire<int>::size), x);
 }
 
 void
 unmarshall::unpack(int *x)
 {
-	(*x) = (rawbyte() & 0xff) << 24;
-	(*x) |= (rawbyte() & 0xff) << 16;
-	(*x) |= (rawbyte() & 0xff) << 8;
-	(*x) |= rawbyte() & 0xff;
+	const char *p = take(wire<int>::size);
+	if (p)
+		wire<int>::get(p, *x);
+}
+
+bool
+unmarshall::strhead(unsigned int *n, const std::string **in)
+{
+	*in = NULL;
+	if (!_compact) {
+		*this >> *n;
+		return _ok;
+	}
+	uint64_t tag;
+	if (!varint(&tag))
+		return false;
+	if (tag & 1) {
+		*in = _strs ? _strs->get(tag >> 1) : NULL;
+		if (!*in) {
+			_ok = false;
+			_unknown = true;
+		} else
+			*n = (*in)->size();
+	} else if ((tag >> 1) > 0xffffffffu) {
+		_ok = false;
+	} else {
+		*n = tag >> 1;
+	}
+	return _ok;
 }
 
 // take the contents from another unmarshall object
@@ -885,6 +2500,8 @@ unmarshall::take_in(unmarshall &another)
 	if(_buf)
 		free(_buf);
 	another.take_buf(&_buf, &_sz);
+	_compact = another._compact;
+	_strs = another._strs;
 	_ind = RPC_HEADER_SZ;
 	_ok = _sz >= RPC_HEADER_SZ?true:false;
 }
@@ -911,103 +2528,130 @@ unmarshall::rawbyte()
 }
 
 unmarshall &
-operator>>(unmarshall &u, bool &x)
+operator>>(unmarshall &u, std::string &s)
 {
-	x = (bool) u.rawbyte() ;
+	unsigned sz;
+	const std::string *in;
+	if(!u.strhead(&sz, &in))
+		return u;
+	if(in)
+		s = *in;
+	else
+		u.rawbytes(s, sz);
 	return u;
 }
 
 unmarshall &
-operator>>(unmarshall &u, unsigned char &x)
+operator>>(unmarshall &u, bytes_view &v)
 {
-	x = (unsigned char) u.rawbyte() ;
+	unsigned sz;
+	const std::string *in;
+	if(!u.strhead(&sz, &in))
+		return u;
+	if(in){
+		// interned strings live as long as the server
+		v.data = in->data();
+		v.size = sz;
+		return u;
+	}
+	u.rawbytes_view(&v.data, sz);
+	if(u.ok())
+		v.size = sz;
 	return u;
 }
 
-unmarshall &
-operator>>(unmarshall &u, char &x)
+void
+unmarshall::rawbytes_view(const char **p, unsigned int n)
 {
-	x = (char) u.rawbyte();
-	return u;
+	const char *b = take(n);
+	if(b)
+		*p = b;
 }
 
-
-unmarshall &
-operator>>(unmarshall &u, unsigned short &x)
+void
+unmarshall::rawbytes(std::string &ss, unsigned int n)
 {
-	x = (u.rawbyte() & 0xff) << 8;
-	x |= u.rawbyte() & 0xff;
-	return u;
+	const char *b = take(n);
+	if(b)
+		ss.assign(b, n);
 }
 
-unmarshall &
-operator>>(unmarshall &u, short &x)
-{
-	x = (u.rawbyte() & 0xff) << 8;
-	x |= u.rawbyte() & 0xff;
-	return u;
+bool operator<(const sockaddr_in &a, const sockaddr_in &b){
+	return ((a.sin_addr.s_addr < b.sin_addr.s_addr) ||
+			((a.sin_addr.s_addr == b.sin_addr.s_addr) &&
+			 ((a.sin_port < b.sin_port))));
 }
 
-unmarshall &
-operator>>(unmarshall &u, unsigned int &x)
-{
-	x = (u.rawbyte() & 0xff) << 24;
-	x |= (u.rawbyte() & 0xff) << 16;
-	x |= (u.rawbyte() & 0xff) << 8;
-	x |= u.rawbyte() & 0xff;
-	return u;
-}
+/*---------------priority classes--------------*/
+// what set_rpc_priority() was told, looked up on every pdu sent, so
+// without a lock: open addressed by proc, each slot one word holding
+// proc << 32 | (prio + 1), 0 when empty. a slot keeps its proc once
+// set, so a probe that meets an empty slot knows proc has none.
+enum { proc_prio_slots = 256 };
+static std::atomic<uint64_t> proc_prio[proc_prio_slots];
 
-unmarshall &
-operator>>(unmarshall &u, int &x)
+static unsigned int
+proc_prio_hash(unsigned int proc)
 {
-	x = (u.rawbyte() & 0xff) << 24;
-	x |= (u.rawbyte() & 0xff) << 16;
-	x |= (u.rawbyte() & 0xff) << 8;
-	x |= u.rawbyte() & 0xff;
-	return u;
+	return (unsigned int)(proc * 0x9e3779b97f4a7c15ULL >> 56);
 }
 
-unmarshall &
-operator>>(unmarshall &u, unsigned long long &x)
+void
+set_rpc_priority(unsigned int proc, int prio)
 {
-	unsigned int h, l;
-	u >> h;
-	u >> l;
-	x = l | ((unsigned long long) h << 32);
-	return u;
+	VERIFY(prio >= 0 && prio < connection::nprio);
+	uint64_t w = (uint64_t)proc << 32 | (uint64_t)(prio + 1);
+	unsigned int h = proc_prio_hash(proc);
+	for(unsigned int i = 0; i < proc_prio_slots; i++){
+		std::atomic<uint64_t> &s = proc_prio[(h + i) % proc_prio_slots];
+		uint64_t k = s.load();
+		if(k == 0 && s.compare_exchange_strong(k, w))
+			return;
+		if(k >> 32 == proc){
+			s = w;
+			return;
+		}
+	}
+	VERIFY(0); // more procs with a priority than slots
 }
 
-unmarshall &
-operator>>(unmarshall &u, std::string &s)
+int
+rpc_priority(unsigned int proc, int sz)
 {
-	unsigned sz;
-	u >> sz;
-	if(u.ok())
-		u.rawbytes(s, sz);
-	return u;
+	unsigned int h = proc_prio_hash(proc);
+	for(unsigned int i = 0; i < proc_prio_slots; i++){
+		uint64_t k = proc_prio[(h + i) % proc_prio_slots].load(
+				std::memory_order_acquire);
+		if(k == 0)
+			break;
+		if(k >> 32 == proc)
+			return (int)(k & 0xffffffff) - 1;
+	}
+	return sz > connection::frame_payload ? connection::prio_bulk :
+		connection::prio_normal;
 }
 
+/*---------------auxilary function--------------*/
 void
-unmarshall::rawbytes(std::string &ss, unsigned int n)
+make_sockaddr(const char *addr, struct sockaddr_storage *dst, socklen_t *len)
 {
-	if((_ind+n) > (unsigned)_sz){
-		_ok = false;
-	} else {
-		std::string tmps = std::string(_buf+_ind, n);
-		swap(ss, tmps);
-		VERIFY(ss.size() == n);
-		_ind += n;
+	bzero(dst, sizeof(*dst));
+	if(!is_unix_addr(addr)){
+		make_sockaddr(addr, (struct sockaddr_in *)dst);
+		*len = sizeof(struct sockaddr_in);
+		return;
 	}
+	struct sockaddr_un *sun = (struct sockaddr_un *)dst;
+	const char *path = addr + 5;
+	if(strlen(path) == 0 || strlen(path) >= sizeof(sun->sun_path)){
+		fprintf(stderr, "bad unix socket path %s\n", path);
+		exit(1);
+	}
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+	*len = sizeof(*sun);
 }
 
-bool operator<(const sockaddr_in &a, const sockaddr_in &b){
-	return ((a.sin_addr.s_addr < b.sin_addr.s_addr) ||
-			((a.sin_addr.s_addr == b.sin_addr.s_addr) &&
-			 ((a.sin_port < b.sin_port))));
-}
-
-/*---------------auxilary function--------------*/
 void
 make_sockaddr(const char *hostandport, struct sockaddr_in *dst){
 
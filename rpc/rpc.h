@@ -3,13 +3,25 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <atomic>
 #include <list>
 #include <map>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <tuple>
+#include <type_traits>
 #include <stdio.h>
 
+#include "slock.h"
 #include "thr_pool.h"
+#include "timer_wheel.h"
 #include "marshall.h"
 #include "connection.h"
+#include "rpc_stats.h"
+#include "trace.h"
+#include "span.h"
+#include "lang/seq.h"
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -19,6 +31,17 @@
 class rpc_const {
 	public:
 		static const unsigned int bind = 1;   // handler number reserved for bind
+		static const unsigned int batch = 3;  // reserved: several requests in one pdu
+		static const unsigned int checksum_bind = 4; // reserved: agree to seal pdus
+		static const unsigned int compact_bind = 5; // reserved: agree to compact bodies
+		static const unsigned int intern = 6; // reserved: intern a string
+		static const unsigned int stats = 7;  // reserved: rpc_stats_report
+		// or'd into req_header.proc of a request whose body, and
+		// so its reply's, is compact (see marshall::set_compact())
+		static const unsigned int compact_flag = 0x40000000;
+		// or'd into req_header.proc of a request that ends with its
+		// trace and rpcc span ids (see span.h)
+		static const unsigned int trace_flag = 0x20000000;
 		static const int timeout_failure = -1;
 		static const int unmarshal_args_failure = -2;
 		static const int unmarshal_reply_failure = -3;
@@ -26,6 +49,9 @@ class rpc_const {
 		static const int oldsrv_failure = -5;
 		static const int bind_failure = -6;
 		static const int cancel_failure = -7;
+		// the server has forgotten the client's interned strings
+		// (see rpcc::intern()); rpcc::call() sends them whole again
+		static const int intern_failure = -8;
 };
 
 // rpc client endpoint.
@@ -33,12 +59,35 @@ class rpc_const {
 // threaded: multiple threads can be sending RPCs,
 class rpcc : public chanmgr {
 
+	public:
+		// completion of an asynchronous call, see call_async().
+		// done() is invoked exactly once, from the PollMgr thread
+		// when the reply arrives, from the timeout thread, or from
+		// the calling thread if the call fails before it is sent.
+		// it must not block.
+		class callback {
+			public:
+				virtual ~callback() {}
+				virtual void done(int ret, unmarshall &rep) = 0;
+		};
+		class future;
+		class batch;
+
 	private:
 
+		// retransmits an asynchronous call, and fails it at its
+		// deadline. it frees itself: nothing waits for a running
+		// timer, least of all the PollMgr thread in got_pdu().
+		struct async_timer : public timer_wheel::timer {
+			rpcc *cl;
+			unsigned int xid;
+			void expire();
+		};
+
 		//manages per rpc info
 		// 一次 rpc 请求的上下文
 		struct caller {
-			caller(unsigned int xxid, unmarshall *un);
+			caller(unsigned int xxid, unmarshall *un, callback *cb = NULL);
 			~caller();
 
 			unsigned int xid;
@@ -47,13 +96,49 @@ class rpcc : public chanmgr {
 			bool done;
 			pthread_mutex_t m;
 			pthread_cond_t c;
+
+			// asynchronous calls only: nobody waits on c, the
+			// timer retransmits and expires the call.
+			callback *cb;
+			unsigned int proc;
+			std::shared_ptr<std::string> req; // request pdu, for retransmission
+			connection *ch;         // connection the request went out on
+			int curr_to;
+			uint64_t deadline;      // timer_wheel::now_ms()
+			async_timer *timer;
+			struct timespec sent;   // first transmission, CLOCK_MONOTONIC
+			int nsent;
+			bool compact;           // the reply is, as the request was
+			bool sealed;            // likewise
+			rpc_span_ctx span;      // the rpcc span, if in a trace
+			uint64_t span_parent, span_start;
 		};
 
 		void get_refconn(connection **ch);
 		void update_xid_rep(unsigned int xid);
-
-
-		sockaddr_in dst_;
+		int start_async(unsigned int proc, marshall &req, callback *cb,
+				int to_ms, std::shared_ptr<std::string> *pdu);
+		struct batch_call;
+		int send_batch(std::vector<batch_call> &calls, int to_ms);
+		void send_async(unsigned int xid, bool retry = false);
+		void finish_async(caller *ca, int ret, unmarshall &rep);
+		void async_expired(async_timer *t);
+		void drop_timer(caller *ca);
+
+		// round-trip time to dst_, smoothed as in Jacobson/Karels
+		// (RFC 6298) from calls that were sent only once (Karn's
+		// rule). the first retransmission timer of a call is the
+		// resulting rto(); m_ protects these.
+		int srtt_us_;
+		int rttvar_us_;
+		unsigned int rtt_samples_;
+		unsigned int rtt_timeouts_;
+		unsigned int rtt_retrans_;
+		void rtt_sample(const struct timespec &sent);
+		int rto();
+
+		sockaddr_storage dst_; // a sockaddr_in or a sockaddr_un
+		socklen_t dst_len_;
 		unsigned int clt_nonce_;
 		unsigned int srv_nonce_;
 		bool bind_done_;
@@ -62,7 +147,37 @@ class rpcc : public chanmgr {
 		bool retrans_;
 		bool reachable_;
 
-		connection *chan_; // 此次 rpc 使用的 tcp 连接
+		// tcp connections to dst_, opened as calls need them. a call
+		// goes out on the one with the least unsent data, and another
+		// is opened only when all of them are busy, so a large
+		// transfer doesn't hold up small calls behind it.
+		std::vector<connection *> chans_;
+
+		// seal requests with a checksum (see marshall::seal()); the
+		// server then seals its replies, and takes no unsealed
+		// request from us. bind() turns checksums_ on if
+		// use_checksums_ and the server agrees, and fails if it
+		// can't tell whether the server did.
+		bool use_checksums_;
+		bool checksums_;
+		int checksum_bind(int to_ms);
+
+		// marshall call bodies compactly, with strings from
+		// intern() sent by index. bind() turns compact_ on if
+		// use_compact_ and the server agrees; interned_ holds the
+		// indexes the server gave, under m_. once a call gets
+		// intern_failure, interned_lost_ keeps strings whole.
+		bool use_compact_;
+		bool compact_;
+		std::map<std::string, int> interned_;
+		std::atomic<bool> interned_lost_;
+		void compact_bind(int to_ms);
+
+		// per-procedure statistics, see rpc_stats.h
+		pthread_mutex_t stats_m_; // protects pstats_, not what's in it
+		std::map<unsigned int, rpcc_proc_stats *> pstats_;
+		void record(unsigned int proc, int ret, int nsent,
+				const struct timespec &sent);
 
 		pthread_mutex_t m_; // protect insert/delete to calls[]
 		pthread_mutex_t chan_m_;
@@ -72,6 +187,9 @@ class rpcc : public chanmgr {
 
 		std::map<int, caller *> calls_;
 		std::list<unsigned int> xid_rep_window_;
+
+		int async_calls_;         // outstanding callers with a cb
+		int async_timers_;        // their timers, which outlive them
                 
                 struct request {
                     request() { clear(); }
@@ -85,6 +203,8 @@ class rpcc : public chanmgr {
 	public:
 
 		rpcc(sockaddr_in d, bool retrans=true);
+		// d from make_sockaddr(), which also takes unix:path
+		rpcc(const sockaddr *d, socklen_t len, bool retrans=true);
 		~rpcc();
 
 		struct TO {
@@ -92,14 +212,54 @@ class rpcc : public chanmgr {
 		};
 		static const TO to_max;
 		static const TO to_min;
+		static const TO rto_min;
 		static TO to(int x) { TO t; t.to = x; return t;}
 
 		unsigned int id() { return clt_nonce_; }
 
 		int bind(TO to = to_max);
 
+		struct rtt_stats {
+			int srtt_us;
+			int rttvar_us;
+			int rto_ms;
+			unsigned int samples;
+			unsigned int timeouts;    // retransmission timers that expired
+			unsigned int retransmits; // requests sent again
+		};
+		rtt_stats rtt();
+
 		void set_reachable(bool r) { reachable_ = r; }
 
+		enum { default_conns = 4 };
+		// at most n connections to dst_; call before the first call
+		void set_max_conns(int n);
+		int nconns(); // live connections
+
+		// checksum every pdu to and from the server, if both were
+		// built with RPC_CHECKSUMMING; call before bind().
+		// RPC_CHECKSUM=1 in the environment turns it on for every
+		// rpcc. off by default: sealing reads every byte once more
+		// at each end, which costs about a third of the throughput
+		// of 1M calls over loopback (see rpctest's checksum_test).
+		void use_checksums(bool on) { use_checksums_ = on; }
+		bool checksums() { return checksums_; }
+
+		// send varint integers and interned strings, which small
+		// calls are mostly made of; call before bind().
+		// RPC_COMPACT=1 in the environment turns it on for every
+		// rpcc. headers stay fixed-width.
+		void use_compact(bool on) { use_compact_ = on; }
+		bool compact() { return compact_; }
+		// s as an argument that compact calls send as a small
+		// index into a table the server keeps for this client. the
+		// first intern() of each s is a round trip; after a
+		// failure, or without compact_, s just goes as a string.
+		interned_str intern(const std::string &s, TO to = to_max);
+
+		// what calls through this rpcc have seen, by procedure
+		void stats(rpcc_report *r);
+
 		void cancel();
                 
                 int islossy() { return lossytest_ > 0; }
@@ -107,151 +267,203 @@ class rpcc : public chanmgr {
 		int call1(unsigned int proc, 
 				marshall &req, unmarshall &rep, TO to);
 
+		// send req without waiting for the reply; cb->done() is
+		// called when it completes. returns 0, or the error that
+		// cb has already been completed with.
+		int call_async(unsigned int proc, marshall &req, callback *cb,
+				TO to = to_max);
+
+		template<class... Args>
+			int async(unsigned int proc, callback *cb, const Args &... args);
+		template<class... Args>
+			int async(unsigned int proc, TO to, callback *cb,
+					const Args &... args);
+
 		bool got_pdu(connection *c, char *b, int sz);
 
 
 		template<class R>
 			int call_m(unsigned int proc, marshall &req, R & r, TO to);
 
-		template<class R>
-			int call(unsigned int proc, R & r, TO to = to_max); 
-		template<class R, class A1>
-			int call(unsigned int proc, const A1 & a1, R & r, TO to = to_max); 
-		template<class R, class A1, class A2>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, R & r, 
-					TO to = to_max); 
-		template<class R, class A1, class A2, class A3>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					const A4 & a4, R & r, TO to = to_max);
-		template<class R, class A1, class A2, class A3, class A4, class A5>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					const A4 & a4, const A5 & a5, R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4, class A5,
-			class A6>
-				int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-						const A4 & a4, const A5 & a5, const A6 & a6,
-						R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4, class A5, 
-			class A6, class A7>
-				int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-						const A4 & a4, const A5 & a5, const A6 &a6, const A7 &a7,
-						R & r, TO to = to_max); 
+		// call(proc, a1, ..., an, r) or call(proc, a1, ..., an, r, to):
+		// marshall the arguments, wait for the reply and unmarshall
+		// it into r
+		template<class... Args>
+			int call(unsigned int proc, Args &&... args);
 
+	private:
+		template<class A, unsigned... I>
+			int call_t(unsigned int proc, A &a, TO to, seq<I...>);
+		template<class A>
+			static TO call_to(A &a, std::true_type) {
+				return std::get<std::tuple_size<A>::value - 1>(a);
+			}
+		template<class A>
+			static TO call_to(A &, std::false_type) { return to_max; }
 };
 
-template<class R> int 
-rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to) 
+// a callback that a thread can block on, so that one thread can
+// keep several calls in flight:
+//
+//   rpcc::future f1, f2;
+//   cl->async(proc, &f1, a1);
+//   cl->async(proc, &f2, a2);
+//   f1.get(r1); f2.get(r2);
+//
+// a future must not be destroyed while its call is outstanding.
+class rpcc::future : public rpcc::callback {
+	public:
+		future();
+		~future();
+		void done(int ret, unmarshall &rep);
+		// block until the call completes, return its result
+		int wait();
+		bool ready();
+		// wait and unmarshall the reply into r
+		template<class R> int get(R &r);
+	private:
+		pthread_mutex_t m_;
+		pthread_cond_t c_;
+		bool done_;
+		int ret_;
+		unmarshall rep_;
+};
+
+template<class R> int
+rpcc::future::get(R &r)
 {
-	unmarshall u;
-	int intret = call1(proc, req, u, to);
-	if (intret < 0) return intret;
-	u >> r;
-	if(u.okdone() != true) {
-                fprintf(stderr, "rpcc::call_m: failed to unmarshall the reply."
-                       "You are probably calling RPC 0x%x with wrong return "
-                       "type.\n", proc);
-                VERIFY(0);
+	int ret = wait();
+	if (ret < 0) return ret;
+	rep_ >> r;
+	if(rep_.okdone() != true) {
+		fprintf(stderr, "rpcc::future::get: failed to unmarshall the reply."
+		       "You are probably calling the RPC with wrong return type.\n");
+		VERIFY(0);
 		return rpc_const::unmarshal_reply_failure;
-        }
-	return intret;
+	}
+	return ret;
 }
 
-template<class R> int
-rpcc::call(unsigned int proc, R & r, TO to) 
+inline void
+marshall_args(marshall &)
 {
-	marshall m;
-	return call_m(proc, m, r, to);
 }
 
-template<class R, class A1> int
-rpcc::call(unsigned int proc, const A1 & a1, R & r, TO to) 
+template<class A, class... Args> void
+marshall_args(marshall &m, const A &a, const Args &... args)
 {
-	marshall m;
-	m << a1;
-	return call_m(proc, m, r, to);
+	m << a;
+	marshall_args(m, args...);
 }
 
-template<class R, class A1, class A2> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		R & r, TO to) 
+// one call in a batch, until the batch is sent
+struct rpcc::batch_call {
+	unsigned int proc;
+	callback *cb;
+	marshall *req;
+};
+
+// independent calls to the same server, sent together in one pdu:
+//
+//   rpcc::batch b(cl);
+//   rpcc::future f1, f2;
+//   b.add(proc1, &f1, a1);
+//   b.add(proc2, &f2, a2, a3);
+//   b.send();
+//   f1.get(r1); f2.get(r2);
+//
+// each call is an async() call in all else: it has its own xid,
+// reply and deadline, at-most-once holds for it alone, and it is
+// retransmitted by itself. the server runs them as if they had come
+// one by one, in no particular order. a batch must be sent before it
+// is destroyed.
+class rpcc::batch {
+	public:
+		batch(rpcc *cl) : cl_(cl) {}
+		~batch() { VERIFY(calls_.empty()); }
+		template<class... Args>
+			void add(unsigned int proc, callback *cb, const Args &... args);
+		int size() { return calls_.size(); }
+		// returns 0, or the error that calls which could not be sent
+		// have been completed with
+		int send(TO to = to_max) { return cl_->send_batch(calls_, to.to); }
+	private:
+		rpcc *cl_;
+		std::vector<batch_call> calls_;
+};
+
+template<class... Args> void
+rpcc::batch::add(unsigned int proc, callback *cb, const Args &... args)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	return call_m(proc, m, r, to);
+	batch_call c;
+	c.proc = proc;
+	c.cb = cb;
+	c.req = new marshall;
+	c.req->set_compact(cl_->compact_, !cl_->interned_lost_);
+	marshall_args(*c.req, args...);
+	calls_.push_back(c);
 }
 
-template<class R, class A1, class A2, class A3> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, R & r, TO to) 
+template<class... Args> int
+rpcc::async(unsigned int proc, callback *cb, const Args &... args)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	return call_m(proc, m, r, to);
+	return async(proc, to_max, cb, args...);
 }
 
-template<class R, class A1, class A2, class A3, class A4> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, R & r, TO to) 
+template<class... Args> int
+rpcc::async(unsigned int proc, TO to, callback *cb, const Args &... args)
 {
 	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	return call_m(proc, m, r, to);
+	m.set_compact(compact_, !interned_lost_);
+	marshall_args(m, args...);
+	return call_async(proc, m, cb, to);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, R & r, TO to) 
+template<class R> int 
+rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to) 
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	return call_m(proc, m, r, to);
+	unmarshall u;
+	int intret = call1(proc, req, u, to);
+	if (intret < 0) return intret;
+	u >> r;
+	if(u.okdone() != true) {
+                fprintf(stderr, "rpcc::call_m: failed to unmarshall the reply."
+                       "You are probably calling RPC 0x%x with wrong return "
+                       "type.\n", proc);
+                VERIFY(0);
+		return rpc_const::unmarshal_reply_failure;
+        }
+	return intret;
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-	class A6> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, 
-		const A6 & a6, R & r, TO to) 
+template<class... Args> int
+rpcc::call(unsigned int proc, Args &&... args)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	m << a6;
-	return call_m(proc, m, r, to);
+	static_assert(sizeof...(Args) > 0, "rpcc::call needs a reply");
+	typedef std::tuple<typename std::decay<Args>::type...> decayed;
+	typedef std::integral_constant<bool, std::is_same<TO,
+		typename std::tuple_element<sizeof...(Args) - 1, decayed>::type>::value>
+		has_to;
+	std::tuple<Args &&...> a(std::forward<Args>(args)...);
+	typedef typename gen_seq<sizeof...(Args) - 1 - has_to::value>::type idx;
+	return call_t(proc, a, call_to(a, has_to()), idx());
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-	class A6, class A7> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, 
-		const A6 & a6, const A7 & a7,
-		R & r, TO to) 
+// the arguments are a's first I, the reply the one after
+template<class A, unsigned... I> int
+rpcc::call_t(unsigned int proc, A &a, TO to, seq<I...>)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	m << a6;
-	m << a7;
-	return call_m(proc, m, r, to);
+	marshall m(wire_hints(std::get<I>(a)...));
+	m.set_compact(compact_, !interned_lost_);
+	marshall_args(m, std::get<I>(a)...);
+	int ret = call_m(proc, m, std::get<sizeof...(I)>(a), to);
+	if (ret != rpc_const::intern_failure)
+		return ret;
+	// the server didn't run it; again, with the strings whole
+	marshall m1(wire_hints(std::get<I>(a)...));
+	m1.set_compact(compact_, false);
+	marshall_args(m1, std::get<I>(a)...);
+	return call_m(proc, m1, std::get<sizeof...(I)>(a), to);
 }
 
 bool operator<(const sockaddr_in &a, const sockaddr_in &b);
@@ -272,24 +484,54 @@ class rpcs : public chanmgr {
 		INPROGRESS, // duplicate of an RPC we're still processing
 		DONE, // duplicate of an RPC we already replied to (have reply)
 		FORGOTTEN,  // duplicate of an old RPC whose reply we've forgotten
+		UNSEALED, // not sealed, from a client that agreed to seal all
 	} rpcstate_t;
 
+	public:
+	// bounds on the replies kept for at-most-once. a client whose
+	// replies are trimmed, or which is forgotten after idle_secs,
+	// gets rpc_const::atmostonce_failure if it retransmits one of
+	// those requests. so does a request max_window or more xids past
+	// the oldest one the client hasn't acknowledged.
+	struct reply_limits {
+		reply_limits() : max_bytes(64 << 20), client_max_bytes(16 << 20),
+			client_max_replies(4096), idle_secs(600),
+			max_expired(65536), max_window(8192) {}
+		size_t max_bytes;         // all clients; least recently used trimmed first
+		size_t client_max_bytes;  // one client; its oldest replies trimmed first
+		unsigned int client_max_replies;
+		int idle_secs;            // forget clients idle this long
+		unsigned int max_expired; // tombstones kept for forgotten clients
+		unsigned int max_window;  // xids one client's window may span
+	};
+
 	private:
 
         // state about an in-progress or completed RPC, for at-most-once.
         // if cb_present is true, then the RPC is complete and a reply
         // has been sent; in that case buf points to a copy of the reply,
-        // and sz holds the size of the reply.
+        // and sz holds the size of the reply, unless the reply cache
+        // limits made us forget it (buf is NULL).
 	struct reply_t { // rpc请求的回复
 		reply_t (unsigned int _xid) {
 			xid = _xid;
 			cb_present = false;
+			sending = false;
 			buf = NULL;
 			sz = 0;
 		}
+		bool forgotten() { return cb_present && !buf; }
+		// forget buf, freeing it unless send_reply() is still
+		// sending it, which then frees it itself
+		void drop() {
+			if(!sending)
+				free(buf);
+			buf = NULL;
+		}
 		unsigned int xid; // 回复的 rpc 请求 id
 		bool cb_present; // whether the reply buffer is valid
 										// true=返回值还未产生，正在处理请求；false=已有返回值，已经处理完毕的请求
+		bool sending;   // send_reply() is still sending buf
 		char *buf;      // the reply buffer，保存 rpc 请求的返回值
 		int sz;         // the size of reply buffer，返回值所占空间大小
 	};
@@ -299,14 +541,86 @@ class rpcs : public chanmgr {
 
 	// provide at most once semantics by maintaining a window of replies
 	// per client that that client hasn't acknowledged receiving yet.
-        // indexed by client nonce.
-	std::map<unsigned int, std::list<reply_t> > reply_window_;
+	// the reply to xid lives in ring[xid & (ring.size()-1)] while
+	// base <= xid < base + ring.size(); xids below base have been
+	// acknowledged and their replies freed. a slot with xid 0 is
+	// empty (rpcc never uses xid 0).
+	struct reply_window_t {
+		reply_window_t() : base(0), top(0), used(0), kept(0), bytes(0),
+			oldest(0), last_used(0), sealed(false), ring(16, reply_t(0)) {}
+		unsigned int base;
+		unsigned int top;  // highest xid seen + 1
+		unsigned int used; // non-empty slots
+		unsigned int kept; // slots holding a reply buffer
+		size_t bytes;      // size of those buffers
+		unsigned int oldest; // no reply buffer below this xid
+		time_t last_used;
+		bool sealed;       // the client agreed to checksums
+		std::vector<reply_t> ring;
+		reply_t &slot(unsigned int xid) {
+			return ring[xid & (ring.size() - 1)];
+		}
+		void grow(unsigned int xid);
+		size_t release(unsigned int xid_rep);
+		size_t forget_oldest(unsigned int keep_xid);
+		size_t forget_all();
+	};
+
+	// windows indexed by client nonce, spread over shards with a lock
+	// each, so that requests from different clients rarely contend.
+	enum { reply_shards = 16 };
+	// expired clients leave a tombstone with their window's top, so
+	// that a retry of an xid we may have executed gets FORGOTTEN
+	// while new xids from a merely idle client are still accepted,
+	// and whether it agreed to checksums.
+	struct reply_tombstone_t {
+		unsigned int top;
+		bool sealed;
+	};
+	struct reply_shard_t {
+		pthread_mutex_t m;
+		std::unordered_map<unsigned int, reply_window_t> clients;
+		std::unordered_map<unsigned int, reply_tombstone_t> expired;
+	};
+	reply_shard_t reply_shard_[reply_shards];
+	reply_shard_t &shard(unsigned int clt_nonce) {
+		return reply_shard_[clt_nonce % reply_shards];
+	}
+
+	reply_limits reply_limits_;
+	std::atomic<size_t> reply_bytes_; // all cached reply buffers
+	// runs reply_sweeper() once a second, or sooner when over
+	// max_bytes
+	struct sweep_timer : public timer_wheel::timer {
+		rpcs *srv;
+		void expire();
+	};
+	enum { sweep_ms = 1000 };
+	bool sweeper_stop_;
+	bool sweep_soon_;
+	sweep_timer sweeper_;
+	pthread_mutex_t sweeper_m_; // sweeper_stop_ and rescheduling
+	void reply_sweeper();
+	void expire_idle_clients(time_t now);
+	void trim_lru_clients();
+
+	// strings each client has interned, by clt_nonce; see
+	// rpcc::intern(). a client's table goes with its reply window,
+	// leaving a tombstone in intern_dropped_ so that it never gets a
+	// new table whose indexes its old interned_strs would misname.
+	// both are bounded by reply_limits_.max_expired.
+	std::map<unsigned int, std::shared_ptr<intern_table> > interned_;
+	std::unordered_set<unsigned int> intern_dropped_;
+	pthread_mutex_t intern_m_;
+	std::shared_ptr<intern_table> interned(unsigned int clt_nonce);
+	void drop_interned(const std::vector<unsigned int> &clients);
 
 	void free_reply_window(void);
-	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+	bool add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+	void reply_sent(unsigned int clt_nonce, unsigned int xid, char *b);
 
 	rpcstate_t checkduplicate_and_update(unsigned int clt_nonce, 
-			unsigned int xid, unsigned int rep_xid,
+			unsigned int xid, unsigned int rep_xid, bool sealed,
 			char **b, int *sz);
 
 	void updatestat(unsigned int proc);
@@ -322,24 +636,48 @@ class rpcs : public chanmgr {
 	int lossytest_; 
 	bool reachable_;
 
+	friend void rpc_stats_dump(FILE *f);
+	void server_stats(rpc_stats_report *r, bool clear);
+	std::list<rpc_stats_provider *> providers_; // under procs_m_
+
 	// map proc # to function
 	std::map<int, handler *> procs_;
+	// and to its statistics, which live as long as the rpcs
+	std::map<int, rpcs_proc_stats *> pstats_;
 
-	pthread_mutex_t procs_m_; // protect insert/delete to procs[]
+	pthread_mutex_t procs_m_; // protect insert/delete to procs[] and pstats_
 	pthread_mutex_t count_m_;  //protect modification of counts
-	pthread_mutex_t reply_window_m_; // protect reply window et al
 	pthread_mutex_t conss_m_; // protect conns_
 
+	// connections holding a pdu the full dispatch pool refused;
+	// they don't read until resume_blocked() takes the pdu.
+	std::list<connection *> blocked_;
+	std::atomic<int> nblocked_;
+	pthread_mutex_t blocked_m_;
+	void resume_blocked();
+
 
 	protected:
 
-	struct djob_t {
-		djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c) {}
+	struct djob_t : public ThrPool::job {
+		djob_t (rpcs *s, connection *c, char *b, int bsz)
+			: srv(s), buf(b), sz(bsz), conn(c), arrived(rpc_now_us()) {}
+		void run() {
+			rpcs *s = srv;
+			s->dispatch(this); // deletes this
+			s->resume_blocked();
+		}
+		rpcs *srv;
 		char *buf;
 		int sz;
 		connection *conn;
+		uint64_t arrived; // rpc_now_us()
 	};
 	void dispatch(djob_t *);
+	void dispatch_batch(connection *c, unmarshall &req, uint64_t arrived,
+			bool sealed);
+	void send_reply(connection *c, unsigned int clt_nonce, unsigned int xid,
+			unsigned int proc, int ret, marshall &rep, bool seal);
 
 	// internal handler registration
 	void reg1(unsigned int proc, handler *);
@@ -347,282 +685,217 @@ class rpcs : public chanmgr {
 	ThrPool* dispatchpool_;
 	tcpsconn* listener_;
 
+	rpcs(unsigned int port, const char *path, int counts);
+
 	public:
+	class reply_token;
+
+	// handlers run on 6 dispatch threads, or RPC_THREADS from the
+	// environment
 	rpcs(unsigned int port, int counts=0);
+	// listen on a port, or on a unix domain socket given as unix:path
+	rpcs(const std::string &addr, int counts=0);
 	~rpcs();
         inline int port() { return listener_->port(); }
+
+	void set_reply_limits(const reply_limits &l);
+	size_t reply_bytes() { return reply_bytes_; }
 	//RPC handler for clients binding
 	int rpcbind(int a, int &r);
+	void checksumbind(reply_token *t, int want);
+	int compactbind(int want, int &r);
+	int internstr(unsigned int clt_nonce, std::string s, int &r);
+	// r gets this server's statistics and those of every rpcc in
+	// the process; clear then starts the server's afresh
+	int statsrpc(int clear, rpc_stats_report &r);
+	void stats(rpc_stats_report *r, bool clear = false);
+	// have p add to the service section of stats(); p must live as
+	// long as the rpcs
+	void add_stats(rpc_stats_provider *p);
 
 	void set_reachable(bool r) { reachable_ = r; }
 
 	bool got_pdu(connection *c, char *b, int sz);
 
-	// register a handler
-	template<class S, class A1, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, R & r));
-	template<class S, class A1, class A2, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, const A2, 
-					R & r));
-	template<class S, class A1, class A2, class A3, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, const A4, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, const A4, const A5, 
-					R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-		class R>
-			void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-						const A3, const A4, const A5, 
-						const A6, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-		class A7, class R>
-			void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-						const A3, const A4, const A5, 
-						const A6, const A7,
-						R & r));
-};
-
-template<class S, class A1, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, R & r);
+	// a handler that doesn't reply before it returns: it is handed
+	// a reply_token for the rpc and completes it later, from any
+	// thread. returns unmarshal_args_failure or 0.
+	class deferred_handler : public handler {
 		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				R r;
-				args >> a1;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, r);
-				ret << r;
-				return b;
-			}
+			int fn(unmarshall &, marshall &) { VERIFY(0); return 0; }
+			virtual int fn_deferred(unmarshall &, reply_token *) = 0;
 	};
-	reg1(proc, new h1(sob, meth));
-}
 
-template<class S, class A1, class A2, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			R & r))
+	// register a handler, e.g.
+	//   int srv::put(std::string key, std::string val, int &r);
+	// the arguments are moved into the call, and r is the reply. a
+	// handler that keeps a payload takes it by value (or &&) and
+	// moves it on, so it is never copied after it is unmarshalled.
+	template<class S, class... P>
+		void reg(unsigned int proc, S*, int (S::*meth)(P...));
+
+	// register a deferred handler, e.g.
+	//   void srv::get(rpcs::reply_token *t, std::string key);
+	// its dispatch thread is free as soon as meth returns; meth or
+	// whoever it hands t to must eventually call t->reply().
+	template<class S, class... Args>
+		void reg(unsigned int proc, S*, void (S::*meth)(reply_token *, Args...));
+};
+
+// the pending reply to one rpc, see rpcs::deferred_handler.
+// at-most-once bookkeeping happens when reply() is called: until
+// then, retransmissions of the request are INPROGRESS duplicates.
+// reply() sends on the latest connection from the client and
+// deletes the token. all tokens must be replied to before the
+// rpcs is deleted.
+class rpcs::reply_token {
+	public:
+		template<class R> void reply(int ret, const R &r);
+		void reply(int ret);
+	private:
+		friend class rpcs;
+		reply_token(rpcs *s, connection *c, unsigned int clt_nonce,
+				unsigned int xid, unsigned int proc, bool seal,
+				bool compact, rpcs_proc_stats *ps, uint64_t start);
+		~reply_token();
+		void reply1(int ret, marshall &rep);
+
+		rpcs *srv_;
+		connection *c_;
+		unsigned int clt_nonce_;
+		unsigned int xid_;
+		unsigned int proc_;
+		bool seal_;
+		bool compact_;
+		rpcs_proc_stats *ps_;
+		uint64_t start_;  // when the handler was called
+		rpc_span_ctx span_;  // the rpcs span, if in a trace
+		uint64_t span_parent_, span_start_;
+};
+
+template<class R> void
+rpcs::reply_token::reply(int ret, const R &r)
 {
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				R r;
-				args >> a1;
-				args >> a2;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
+	marshall rep;
+	rep.set_compact(compact_);
+	rep << r;
+	reply1(ret, rep);
 }
 
-template<class S, class A1, class A2, class A3, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, R & r))
+// hands an unmarshalled argument to a handler: moved, unless the
+// handler takes it by reference
+template<class P, class T> inline
+typename std::conditional<std::is_lvalue_reference<P>::value, T &, T &&>::type
+handler_arg(T &x)
 {
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
+	return static_cast<typename std::conditional<
+		std::is_lvalue_reference<P>::value, T &, T &&>::type>(x);
 }
 
-template<class S, class A1, class A2, class A3, class A4, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, R & r))
-				: sob(xsob), meth(xmeth)  { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, r);
-				ret << r;
-				return b;
+template<class S, class... Args>
+class deferred_h : public rpcs::deferred_handler {
+	private:
+		typedef std::tuple<typename std::decay<Args>::type...> args_t;
+		S *sob;
+		void (S::*meth)(rpcs::reply_token *, Args...);
+
+		template<unsigned... I>
+			void unpack(unmarshall &args, args_t &a, seq<I...>) {
+				int x[] = { 0, ((void)(args >> std::get<I>(a)), 0)... };
+				(void)x;
 			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+		template<unsigned... I>
+			void call(rpcs::reply_token *t, args_t &a, seq<I...>) {
+				(sob->*meth)(t, handler_arg<Args>(std::get<I>(a))...);
+			}
+	public:
+		deferred_h(S *xsob, void (S::*xmeth)(rpcs::reply_token *, Args...))
+			: sob(xsob), meth(xmeth) { }
+		int fn_deferred(unmarshall &args, rpcs::reply_token *t) {
+			typedef typename gen_seq<sizeof...(Args)>::type idx;
+			args_t a;
+			unpack(args, a, idx());
+			if(!args.okdone())
+				return rpc_const::unmarshal_args_failure;
+			call(t, a, idx());
+			return 0;
+		}
+};
 
-template<class S, class A1, class A2, class A3, class A4, class A5, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, R & r))
+template<class S, class... Args> void
+rpcs::reg(unsigned int proc, S *sob, void (S::*meth)(reply_token *, Args...))
 {
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
+	reg1(proc, new deferred_h<S, Args...>(sob, meth));
 }
 
-template<class S, class A1, class A2, class A3, class A4, class A5, class A6, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, const A6 a6, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, const A6 a6, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, const A6 a6, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				args >> a6;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, r);
-				ret << r;
-				return b;
+// the handler rpcs::reg() makes for int (S::*)(A1, ..., An, R &)
+template<class S, class... P>
+class method_h : public handler {
+	private:
+		enum { nargs = sizeof...(P) - 1 };
+		typedef std::tuple<typename std::decay<P>::type...> args_t;
+		typedef typename std::tuple_element<nargs, std::tuple<P...> >::type
+			reply_t;
+		static_assert(std::is_lvalue_reference<reply_t>::value &&
+			!std::is_const<typename std::remove_reference<reply_t>::type>::value,
+			"the last parameter of an rpc handler is its reply, R &");
+		S *sob;
+		int (S::*meth)(P...);
+
+		template<unsigned... I>
+			void unpack(unmarshall &args, args_t &a, seq<I...>) {
+				int x[] = { 0, ((void)(args >> std::get<I>(a)), 0)... };
+				(void)x;
 			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+		template<unsigned... I>
+			int call(args_t &a, seq<I...>) {
+				return (sob->*meth)(handler_arg<typename std::tuple_element<I,
+						std::tuple<P...> >::type>(std::get<I>(a))...,
+						std::get<nargs>(a));
+			}
+	protected:
+		// what fn() returns when the arguments don't unmarshall
+		virtual int bad_args() { return rpc_const::unmarshal_args_failure; }
+	public:
+		method_h(S *xsob, int (S::*xmeth)(P...)) : sob(xsob), meth(xmeth) { }
+		int fn(unmarshall &args, marshall &ret) {
+			typedef typename gen_seq<nargs>::type idx;
+			args_t a;
+			unpack(args, a, idx());
+			if(!args.okdone())
+				return bad_args();
+			int b = call(a, idx());
+			ret << std::get<nargs>(a);
+			return b;
+		}
+};
 
-template<class S, class A1, class A2, class A3, class A4, class A5, 
-	class A6, class A7, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, const A6 a6,
-			const A7 a7, R & r))
+template<class S, class... P> void
+rpcs::reg(unsigned int proc, S *sob, int (S::*meth)(P...))
 {
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, const A6 a6, const A7 a7, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, const A6 a6,
-						const A7 a7, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				A7 a7;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				args >> a6;
-				args >> a7;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, a7, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
+	static_assert(sizeof...(P) > 0, "an rpc handler needs a reply");
+	reg1(proc, new method_h<S, P...>(sob, meth));
 }
 
 
+// requests and replies of proc go out in connection::prio class
+// prio. without one set, a pdu that takes more than one frame is
+// prio_bulk, and any other prio_normal.
+void set_rpc_priority(unsigned int proc, int prio);
+int rpc_priority(unsigned int proc, int sz);
+
 void make_sockaddr(const char *hostandport, struct sockaddr_in *dst);
+// also takes unix:path, for servers on the same host
+void make_sockaddr(const char *addr, struct sockaddr_storage *dst,
+		socklen_t *len);
 void make_sockaddr(const char *host, const char *port,
 		struct sockaddr_in *dst);
 
+// print the statistics of every rpcs and rpcc in this process
+void rpc_stats_dump(FILE *f);
+// and do so to stderr whenever the process gets sig, e.g. SIGUSR1
+void rpc_stats_on_signal(int sig);
+
 int cmp_timespec(const struct timespec &a, const struct timespec &b);
 void add_timespec(const struct timespec &a, int b, struct timespec *result);
 int diff_timespec(const struct timespec &a, const struct timespec &b);
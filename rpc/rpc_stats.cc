@@ -0,0 +1,188 @@
+#include "rpc_stats.h"
+#include "slock.h"
+
+rpc_hist::rpc_hist() : n_(0), sum_(0), max_(0)
+{
+	for (int i = 0; i < buckets; i++)
+		b_[i] = 0;
+}
+
+uint64_t
+rpc_hist::lowest(int b)
+{
+	if (b < sub)
+		return b;
+	int e = b / sub + sub_bits - 1;
+	return (uint64_t)(sub + b % sub) << (e - sub_bits);
+}
+
+uint64_t
+rpc_hist::highest(int b)
+{
+	return b + 1 < buckets ? lowest(b + 1) - 1 : ~0ULL;
+}
+
+void
+rpc_hist::get(rpc_hist_snap *s) const
+{
+	// n from the buckets, so that at() adds up
+	s->b.clear();
+	s->n = 0;
+	for (int i = 0; i < buckets; i++) {
+		uint64_t c = b_[i].load(std::memory_order_relaxed);
+		if (c) {
+			s->b[i] = c;
+			s->n += c;
+		}
+	}
+	s->sum = sum_.load(std::memory_order_relaxed);
+	s->max = max_.load(std::memory_order_relaxed);
+}
+
+void
+rpc_hist::clear()
+{
+	for (int i = 0; i < buckets; i++)
+		b_[i].store(0, std::memory_order_relaxed);
+	n_ = 0;
+	sum_ = 0;
+	max_ = 0;
+}
+
+unsigned long long
+rpc_hist_snap::at(double q) const
+{
+	if (n == 0)
+		return 0;
+	unsigned long long want = (unsigned long long)(q * n), seen = 0;
+	if (want >= n)
+		want = n - 1;
+	std::map<int, unsigned long long>::const_iterator i;
+	for (i = b.begin(); i != b.end(); i++) {
+		seen += i->second;
+		if (seen > want)
+			break;
+	}
+	if (i == b.end())
+		return max;
+	unsigned long long v = rpc_hist::highest(i->first);
+	return v < max ? v : max;
+}
+
+void
+rpc_hist_snap::merge(const rpc_hist_snap &o)
+{
+	n += o.n;
+	sum += o.sum;
+	if (o.max > max)
+		max = o.max;
+	std::map<int, unsigned long long>::const_iterator i;
+	for (i = o.b.begin(); i != o.b.end(); i++)
+		b[i->first] += i->second;
+}
+
+void
+rpc_hist_snap::minus(const rpc_hist_snap &earlier)
+{
+	n -= earlier.n < n ? earlier.n : n;
+	sum -= earlier.sum < sum ? earlier.sum : sum;
+	std::map<int, unsigned long long>::const_iterator i;
+	for (i = earlier.b.begin(); i != earlier.b.end(); i++) {
+		std::map<int, unsigned long long>::iterator j = b.find(i->first);
+		if (j == b.end())
+			continue;
+		if (j->second > i->second)
+			j->second -= i->second;
+		else
+			b.erase(j);
+	}
+}
+
+static void
+print_hist(FILE *f, const char *what, const rpc_hist_snap &h)
+{
+	fprintf(f, " %s %llu/%llu/%llu/%llu", what, h.at(0.5), h.at(0.9),
+			h.at(0.99), h.max);
+}
+
+void
+rpc_stats_print(FILE *f, const char *who, const rpc_stats_report &r)
+{
+	if (r.now_us)
+		fprintf(f, "rpcs %s: %u conns, %u clients, %d/%d queued, %d blocked, "
+				"%llu reply bytes\n", who, r.conns, r.clients_seen, r.queued,
+				r.queue_max, r.blocked, r.reply_bytes);
+	std::map<std::string, std::string>::const_iterator kv;
+	for (kv = r.service.begin(); kv != r.service.end(); kv++)
+		fprintf(f, "  %s %s\n", kv->first.c_str(), kv->second.c_str());
+	if (!r.server.empty())
+		fprintf(f, "rpcs %s: calls; p50/p90/p99/max of queue us, run us, "
+				"request and reply bytes\n", who);
+	for (unsigned i = 0; i < r.server.size(); i++) {
+		const rpcs_proc_report &p = r.server[i];
+		fprintf(f, "  proc %x: %llu", p.proc, p.run_us.n);
+		print_hist(f, "queue", p.queue_us);
+		print_hist(f, "run", p.run_us);
+		print_hist(f, "req", p.req_bytes);
+		print_hist(f, "rep", p.rep_bytes);
+		fprintf(f, "\n");
+	}
+	for (unsigned i = 0; i < r.clients.size(); i++) {
+		const rpcc_report &c = r.clients[i];
+		fprintf(f, "rpcc %s: replies, failures, retransmits; p50/p90/p99/max "
+				"of latency us\n", c.dst.c_str());
+		for (unsigned j = 0; j < c.procs.size(); j++) {
+			const rpcc_proc_report &p = c.procs[j];
+			fprintf(f, "  proc %x: %llu %llu %llu", p.proc, p.latency_us.n,
+					p.failures, p.retransmits);
+			print_hist(f, "latency", p.latency_us);
+			fprintf(f, "\n");
+		}
+	}
+	if (!r.locks.empty())
+		fprintf(f, "locks: acquisitions, contended, wait us, hold us\n");
+	for (unsigned i = 0; i < r.locks.size(); i++) {
+		const lock_site_report &l = r.locks[i];
+		fprintf(f, "  %s: %llu %llu %llu %llu\n", l.site.c_str(), l.acquires,
+				l.contended, l.wait_ns / 1000, l.hold_ns / 1000);
+	}
+}
+
+void
+lock_site_stats(std::vector<lock_site_report> *v, bool clear)
+{
+	v->clear();
+#if LOCKPROF
+	// a header's site can be in the table once per file that uses it
+	std::map<std::string, lock_site_report> by_site;
+	for (int i = 0; i < slock_nsites; i++) {
+		slock_site &s = slock_sites[i];
+		uint64_t key = s.key.load(std::memory_order_acquire);
+		if (key == 0)
+			continue;
+		char site[256];
+		snprintf(site, sizeof(site), "%s:%d",
+				(const char *)(uintptr_t)(key & ((1ULL << 48) - 1)),
+				(int)(key >> 48));
+		lock_site_report &l = by_site[site];
+		l.site = site;
+		if (clear) {
+			l.acquires += s.acquires.exchange(0);
+			l.contended += s.contended.exchange(0);
+			l.wait_ns += s.wait_ns.exchange(0);
+			l.hold_ns += s.hold_ns.exchange(0);
+		} else {
+			l.acquires += s.acquires;
+			l.contended += s.contended;
+			l.wait_ns += s.wait_ns;
+			l.hold_ns += s.hold_ns;
+		}
+	}
+	std::map<std::string, lock_site_report>::iterator i;
+	for (i = by_site.begin(); i != by_site.end(); i++)
+		if (i->second.acquires)
+			v->push_back(i->second);
+#else
+	(void)clear;
+#endif
+}
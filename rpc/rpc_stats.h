@@ -0,0 +1,175 @@
+#ifndef rpc_stats_h
+#define rpc_stats_h
+
+// per-procedure statistics that every rpcs and rpcc keep as calls go
+// by: how long requests wait for a worker and run, how big they are,
+// and how long clients wait and how often they retransmit. an rpcs
+// answers rpc_const::stats with them, and rpc_stats_on_signal() has
+// a process print them all when it gets a signal.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include "marshall.h"
+
+// microseconds on CLOCK_MONOTONIC
+inline uint64_t
+rpc_us(const struct timespec &t)
+{
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+inline uint64_t
+rpc_now_us()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return rpc_us(t);
+}
+
+// what a histogram held at some point, as it goes on the wire: only
+// the buckets that have something in them
+struct rpc_hist_snap {
+	rpc_hist_snap() : n(0), sum(0), max(0) {}
+	unsigned long long n, sum, max;
+	std::map<int, unsigned long long> b;
+
+	// the value a fraction q of the way up, to within its bucket
+	unsigned long long at(double q) const;
+	unsigned long long mean() const { return n ? sum / n : 0; }
+	void merge(const rpc_hist_snap &o);
+	// take away an earlier snapshot of the same histogram, leaving
+	// what was added since; max stays the greatest ever
+	void minus(const rpc_hist_snap &earlier);
+};
+RPC_FIELDS(rpc_hist_snap, n, sum, max, b)
+
+// a histogram of values that are mostly small but may be huge, such
+// as microseconds or bytes, after HdrHistogram: values below 2^sub_bits
+// have buckets of their own, and each power of two above that is cut
+// into 2^sub_bits buckets, so a bucket's values are within 1/8 of each
+// other. add() is a few relaxed atomic adds, and takes no lock; a
+// snapshot taken meanwhile may miss the adds in flight.
+class rpc_hist {
+	public:
+		enum { sub_bits = 3, sub = 1 << sub_bits,
+			buckets = (64 - sub_bits + 1) * sub };
+
+		rpc_hist();
+		void add(uint64_t v) {
+			b_[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+			n_.fetch_add(1, std::memory_order_relaxed);
+			sum_.fetch_add(v, std::memory_order_relaxed);
+			uint64_t m = max_.load(std::memory_order_relaxed);
+			while (v > m && !max_.compare_exchange_weak(m, v,
+						std::memory_order_relaxed))
+				;
+		}
+		uint64_t count() const { return n_.load(std::memory_order_relaxed); }
+		void get(rpc_hist_snap *s) const;
+		void clear();
+
+		static int bucket(uint64_t v) {
+			if (v < sub)
+				return v;
+			int e = 63 - __builtin_clzll(v);
+			return (e - sub_bits + 1) * sub + ((v >> (e - sub_bits)) & (sub - 1));
+		}
+		// the least and greatest values in bucket b
+		static uint64_t lowest(int b);
+		static uint64_t highest(int b);
+
+	private:
+		std::atomic<uint64_t> b_[buckets];
+		std::atomic<uint64_t> n_, sum_, max_;
+};
+
+// one procedure at an rpcs. calls is run_us.count().
+struct rpcs_proc_stats {
+	rpc_hist queue_us;  // from arrival until a worker took the request
+	rpc_hist run_us;    // from then until the reply, deferred or not
+	rpc_hist req_bytes;
+	rpc_hist rep_bytes;
+};
+
+// one procedure at an rpcc. latency_us has the calls that got a reply.
+struct rpcc_proc_stats {
+	rpcc_proc_stats() : failures(0), retransmits(0) {}
+	rpc_hist latency_us;  // from the first transmission to the reply
+	std::atomic<uint64_t> failures;    // timed out, or an rpc_const failure
+	std::atomic<uint64_t> retransmits; // requests sent more than once
+};
+
+struct rpcs_proc_report {
+	rpcs_proc_report() : proc(0) {}
+	unsigned int proc;
+	rpc_hist_snap queue_us, run_us, req_bytes, rep_bytes;
+};
+RPC_FIELDS(rpcs_proc_report, proc, queue_us, run_us, req_bytes, rep_bytes)
+
+struct rpcc_proc_report {
+	rpcc_proc_report() : proc(0), failures(0), retransmits(0) {}
+	unsigned int proc;
+	unsigned long long failures, retransmits;
+	rpc_hist_snap latency_us;
+};
+RPC_FIELDS(rpcc_proc_report, proc, failures, retransmits, latency_us)
+
+// one rpcc, by the server it calls
+struct rpcc_report {
+	std::string dst;
+	std::vector<rpcc_proc_report> procs;
+};
+RPC_FIELDS(rpcc_report, dst, procs)
+
+// a place in the source that takes a ScopedLock, in a LOCKPROF
+// build (see slock.h)
+struct lock_site_report {
+	lock_site_report() : acquires(0), contended(0), wait_ns(0), hold_ns(0) {}
+	std::string site;  // file:line
+	unsigned long long acquires, contended, wait_ns, hold_ns;
+};
+RPC_FIELDS(lock_site_report, site, acquires, contended, wait_ns, hold_ns)
+
+// the process's lock sites, those used at all; none unless LOCKPROF
+void lock_site_stats(std::vector<lock_site_report> *v, bool clear);
+
+// the reply to rpc_const::stats: the rpcs asked, and every rpcc and
+// lock site in its process
+struct rpc_stats_report {
+	rpc_stats_report() : now_us(0), conns(0), clients_seen(0),
+		reply_bytes(0), queued(0), queue_max(0), blocked(0) {}
+	unsigned long long now_us;      // rpc_now_us() at the server
+	unsigned int conns;             // open connections to the rpcs
+	unsigned int clients_seen;      // clients with a reply window
+	unsigned long long reply_bytes; // replies kept for at-most-once
+	int queued, queue_max;          // requests waiting for a worker
+	int blocked;                    // connections waiting for room
+	std::vector<rpcs_proc_report> server;
+	std::vector<rpcc_report> clients;
+	// what the rpcs's rpc_stats_providers add
+	std::map<std::string, std::string> service;
+	std::vector<lock_site_report> locks;
+};
+RPC_FIELDS(rpc_stats_report, now_us, conns, clients_seen, reply_bytes,
+		queued, queue_max, blocked, server, clients, service, locks)
+
+// a service built on an rpcs puts its own numbers, the size of a
+// lock table or the latest paxos instance, in that rpcs's
+// rpc_const::stats replies; see rpcs::add_stats()
+class rpc_stats_provider {
+	public:
+		virtual ~rpc_stats_provider() {}
+		// add name/value pairs to kv. runs on a dispatch thread,
+		// so it may take the service's locks.
+		virtual void stats(std::map<std::string, std::string> *kv) = 0;
+};
+
+// one line per procedure, with percentiles; who names the server
+void rpc_stats_print(FILE *f, const char *who, const rpc_stats_report &r);
+
+#endif
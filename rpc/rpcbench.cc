@@ -0,0 +1,395 @@
+// rpcbench: runs an echo server and its clients in this process and
+// measures them over every combination of the settings below, one
+// csv line (or json object) per combination, so a transport change
+// can be held up against the same numbers from before it.
+//
+//   sync   each client thread makes one call at a time
+//   async  each keeps -w calls in flight with rpcc::async()
+//   open   calls start at a fixed total rate (-r), on schedule whether
+//          or not earlier ones are done; latency runs from when a call
+//          was due, so a server that falls behind shows it
+//
+// usage: rpcbench [-t tcp,unix] [-m sync,async,open] [-s sizes]
+//                 [-c threads] [-k conns] [-p pool] [-l lossy] [-r rates]
+//                 [-w window] [-d secs] [-j]
+//   -t  transports: tcp on 127.0.0.1, a unix socket
+//   -s  request (and reply) payload bytes
+//   -c  client threads, sharing one rpcc
+//   -k  the rpcc's connections (rpcc::set_max_conns())
+//   -p  server dispatch threads (RPC_THREADS)
+//   -l  RPC_LOSSY: percent of pdus dropped
+//   -r  open loop: calls/s over all threads
+//   -w  async: calls in flight per thread
+//   -d  seconds measured per combination, after a tenth as long to warm up
+//   -j  json, one object per line, rather than csv
+// every list is comma-separated. defaults: -t tcp -m sync,async
+// -s 16,1024,65536 -c 1,4,16 -k 4 -p 6 -l 0 -r 10000 -w 16 -d 2
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "rpc.h"
+#include "slock.h"
+#include "lang/verify.h"
+
+enum { echo_proc = 0x100 };
+
+struct echo_srv {
+	int echo(std::string v, std::string &r) {
+		r.swap(v);
+		return 0;
+	}
+};
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static std::vector<std::string>
+split(const char *s)
+{
+	std::vector<std::string> v;
+	std::string cur;
+	for (; ; s++) {
+		if (*s == ',' || *s == '\0') {
+			if (!cur.empty())
+				v.push_back(cur);
+			cur.clear();
+			if (!*s)
+				break;
+		} else {
+			cur += *s;
+		}
+	}
+	return v;
+}
+
+static std::vector<int>
+split_ints(const char *s)
+{
+	std::vector<std::string> v = split(s);
+	std::vector<int> n;
+	for (unsigned i = 0; i < v.size(); i++)
+		n.push_back(atoi(v[i].c_str()));
+	return n;
+}
+
+struct config {
+	std::string transport, mode;
+	int size, threads, conns, pool, lossy, rate, window;
+	double secs;
+};
+
+// what one combination's threads share
+struct run {
+	const config *cf;
+	rpcc *cl;
+	std::string payload;
+	uint64_t rec_start, rec_end;  // calls begun in between count
+	rpc_hist lat_ns;
+	std::atomic<uint64_t> failures;
+	std::atomic<uint64_t> last_done;  // when the last of them finished
+	run() : failures(0), last_done(0) {}
+	void finished(uint64_t start, int ret) {
+		if (start < rec_start || start >= rec_end)
+			return;
+		uint64_t now = now_ns();
+		if (ret != 0)
+			failures++;
+		else
+			lat_ns.add(now - start);
+		uint64_t l = last_done;
+		while (l < now && !last_done.compare_exchange_weak(l, now))
+			;
+	}
+};
+
+struct client_thread;
+
+// an async call in flight, and a thread's slot for one
+struct slot : public rpcc::callback {
+	client_thread *t;
+	uint64_t start;
+	void done(int ret, unmarshall &rep);
+};
+
+struct client_thread {
+	run *r;
+	int me;
+	pthread_t th;
+	pthread_mutex_t m;
+	pthread_cond_t c;
+	std::vector<slot> slots;
+	std::vector<slot *> free_slots;  // under m
+
+	slot *take() {
+		ScopedLock ml(&m);
+		while (free_slots.empty())
+			VERIFY(pthread_cond_wait(&c, &m) == 0);
+		slot *s = free_slots.back();
+		free_slots.pop_back();
+		return s;
+	}
+	void give(slot *s) {
+		ScopedLock ml(&m);
+		free_slots.push_back(s);
+		VERIFY(pthread_cond_signal(&c) == 0);
+	}
+	void drain() {
+		ScopedLock ml(&m);
+		while (free_slots.size() < slots.size())
+			VERIFY(pthread_cond_wait(&c, &m) == 0);
+	}
+};
+
+void
+slot::done(int ret, unmarshall &)
+{
+	t->r->finished(start, ret);
+	t->give(this);
+}
+
+static void *
+client(void *x)
+{
+	client_thread *t = (client_thread *)x;
+	run *r = t->r;
+	const config &cf = *r->cf;
+	if (cf.mode == "sync") {
+		std::string rep;
+		uint64_t start;
+		while ((start = now_ns()) < r->rec_end)
+			r->finished(start, r->cl->call(echo_proc, r->payload, rep));
+		return 0;
+	}
+	// open loop: thread me's calls are due every threads/rate seconds,
+	// staggered against the others'
+	double gap = cf.rate > 0 ? 1e9 * cf.threads / cf.rate : 0;
+	uint64_t due = now_ns() + (uint64_t)(gap * t->me / cf.threads);
+	for (;;) {
+		slot *s = t->take();
+		uint64_t now = now_ns();
+		if (cf.mode == "open") {
+			if (due >= r->rec_end) {
+				t->give(s);
+				break;
+			}
+			if (due > now) {
+				usleep((due - now) / 1000);
+				now = now_ns();
+			}
+			s->start = due;
+			due += (uint64_t)gap;
+		} else {
+			if (now >= r->rec_end) {
+				t->give(s);
+				break;
+			}
+			s->start = now;
+		}
+		r->cl->async(echo_proc, s, r->payload);
+	}
+	t->drain();
+	return 0;
+}
+
+static void
+measure(const config &cf, bool json, bool *header)
+{
+	char v[16];
+	snprintf(v, sizeof(v), "%d", cf.lossy);
+	VERIFY(setenv("RPC_LOSSY", v, 1) == 0);
+	snprintf(v, sizeof(v), "%d", cf.pool);
+	VERIFY(setenv("RPC_THREADS", v, 1) == 0);
+
+	char addr[64];
+	if (cf.transport == "unix")
+		snprintf(addr, sizeof(addr), "unix:/tmp/rpcbench-%d.sock", (int)getpid());
+	rpcs *s = cf.transport == "unix" ? new rpcs(addr) : new rpcs(0);
+	if (cf.transport != "unix")
+		snprintf(addr, sizeof(addr), "127.0.0.1:%d", s->port());
+	echo_srv es;
+	s->reg(echo_proc, &es, &echo_srv::echo);
+
+	sockaddr_storage dst;
+	socklen_t len;
+	make_sockaddr(addr, &dst, &len);
+	rpcc *cl = new rpcc((sockaddr *)&dst, len);
+	cl->set_max_conns(cf.conns);
+	VERIFY(cl->bind() == 0);
+	VERIFY(unsetenv("RPC_LOSSY") == 0 && unsetenv("RPC_THREADS") == 0);
+
+	run r;
+	r.cf = &cf;
+	r.cl = cl;
+	r.payload = std::string(cf.size, 'x');
+	uint64_t warm = (uint64_t)(cf.secs * 1e8);
+	r.rec_start = now_ns() + warm;
+	r.rec_end = r.rec_start + (uint64_t)(cf.secs * 1e9);
+
+	std::vector<client_thread> th(cf.threads);
+	int per = cf.mode == "open" ? 4096 : cf.window;
+	for (int i = 0; i < cf.threads; i++) {
+		client_thread &t = th[i];
+		t.r = &r;
+		t.me = i;
+		VERIFY(pthread_mutex_init(&t.m, 0) == 0);
+		VERIFY(pthread_cond_init(&t.c, 0) == 0);
+		t.slots.resize(cf.mode == "sync" ? 0 : per);
+		for (unsigned j = 0; j < t.slots.size(); j++) {
+			t.slots[j].t = &t;
+			t.free_slots.push_back(&t.slots[j]);
+		}
+	}
+	for (int i = 0; i < cf.threads; i++)
+		VERIFY(pthread_create(&th[i].th, NULL, client, &th[i]) == 0);
+	for (int i = 0; i < cf.threads; i++)
+		VERIFY(pthread_join(th[i].th, NULL) == 0);
+
+	rpc_hist_snap h;
+	r.lat_ns.get(&h);
+	// calls that finished late, in an overloaded open loop, take
+	// their time
+	double secs = (std::max(r.last_done.load(), r.rec_end) - r.rec_start) / 1e9;
+	double calls_s = h.n / secs;
+	double mb_s = calls_s * cf.size * 2 / 1e6;
+	if (json) {
+		printf("{\"transport\":\"%s\",\"mode\":\"%s\",\"size\":%d,"
+				"\"threads\":%d,\"conns\":%d,\"pool\":%d,\"lossy\":%d,"
+				"\"rate\":%d,\"window\":%d,\"secs\":%.1f,\"calls\":%llu,"
+				"\"failures\":%llu,\"calls_per_s\":%.1f,\"mb_per_s\":%.2f,"
+				"\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+				"\"max_us\":%.1f}\n", cf.transport.c_str(), cf.mode.c_str(),
+				cf.size, cf.threads, cf.conns, cf.pool, cf.lossy, cf.rate,
+				cf.window, cf.secs, (unsigned long long)h.n,
+				(unsigned long long)r.failures.load(), calls_s, mb_s,
+				h.at(0.5) / 1e3, h.at(0.99) / 1e3, h.at(0.999) / 1e3,
+				h.max / 1e3);
+	} else {
+		if (!*header) {
+			printf("transport,mode,size,threads,conns,pool,lossy,rate,window,"
+					"secs,calls,failures,calls_per_s,mb_per_s,p50_us,p99_us,"
+					"p999_us,max_us\n");
+			*header = true;
+		}
+		printf("%s,%s,%d,%d,%d,%d,%d,%d,%d,%.1f,%llu,%llu,%.1f,%.2f,%.1f,"
+				"%.1f,%.1f,%.1f\n", cf.transport.c_str(), cf.mode.c_str(),
+				cf.size, cf.threads, cf.conns, cf.pool, cf.lossy, cf.rate,
+				cf.window, cf.secs, (unsigned long long)h.n,
+				(unsigned long long)r.failures.load(), calls_s, mb_s,
+				h.at(0.5) / 1e3, h.at(0.99) / 1e3, h.at(0.999) / 1e3,
+				h.max / 1e3);
+	}
+	fflush(stdout);
+
+	for (int i = 0; i < cf.threads; i++) {
+		VERIFY(pthread_mutex_destroy(&th[i].m) == 0);
+		VERIFY(pthread_cond_destroy(&th[i].c) == 0);
+	}
+	delete cl;
+	delete s;
+	if (cf.transport == "unix")
+		unlink(addr + 5);
+}
+
+int
+main(int argc, char *argv[])
+{
+	std::vector<std::string> transports = split("tcp");
+	std::vector<std::string> modes = split("sync,async");
+	std::vector<int> sizes = split_ints("16,1024,65536");
+	std::vector<int> threads = split_ints("1,4,16");
+	std::vector<int> conns = split_ints("4");
+	std::vector<int> pools = split_ints("6");
+	std::vector<int> lossy = split_ints("0");
+	std::vector<int> rates = split_ints("10000");
+	int window = 16;
+	double secs = 2;
+	bool json = false;
+
+	int ch;
+	bool bad = false;
+	while (!bad && (ch = getopt(argc, argv, "t:m:s:c:k:p:l:r:w:d:j")) != -1) {
+		switch (ch) {
+			case 't':
+				transports = split(optarg);
+				break;
+			case 'm':
+				modes = split(optarg);
+				break;
+			case 's':
+				sizes = split_ints(optarg);
+				break;
+			case 'c':
+				threads = split_ints(optarg);
+				break;
+			case 'k':
+				conns = split_ints(optarg);
+				break;
+			case 'p':
+				pools = split_ints(optarg);
+				break;
+			case 'l':
+				lossy = split_ints(optarg);
+				break;
+			case 'r':
+				rates = split_ints(optarg);
+				break;
+			case 'w':
+				window = atoi(optarg);
+				break;
+			case 'd':
+				secs = atof(optarg);
+				break;
+			case 'j':
+				json = true;
+				break;
+			default:
+				bad = true;
+				break;
+		}
+	}
+	for (unsigned i = 0; i < modes.size(); i++)
+		if (modes[i] != "sync" && modes[i] != "async" && modes[i] != "open")
+			bad = true;
+	for (unsigned i = 0; i < transports.size(); i++)
+		if (transports[i] != "tcp" && transports[i] != "unix")
+			bad = true;
+	if (bad || optind != argc || secs <= 0 || window < 1) {
+		fprintf(stderr, "usage: %s [-t tcp,unix] [-m sync,async,open] "
+				"[-s sizes] [-c threads] [-k conns] [-p pool] [-l lossy] "
+				"[-r rates] [-w window] [-d secs] [-j]\n", argv[0]);
+		exit(1);
+	}
+
+	bool header = false;
+	config cf;
+	cf.secs = secs;
+	for (unsigned a = 0; a < transports.size(); a++)
+	for (unsigned b = 0; b < modes.size(); b++)
+	for (unsigned c = 0; c < sizes.size(); c++)
+	for (unsigned d = 0; d < threads.size(); d++)
+	for (unsigned e = 0; e < conns.size(); e++)
+	for (unsigned f = 0; f < pools.size(); f++)
+	for (unsigned g = 0; g < lossy.size(); g++)
+	for (unsigned h = 0; h < (modes[b] == "open" ? rates.size() : 1); h++) {
+		cf.transport = transports[a];
+		cf.mode = modes[b];
+		cf.size = sizes[c];
+		cf.threads = threads[d];
+		cf.conns = conns[e];
+		cf.pool = pools[f];
+		cf.lossy = lossy[g];
+		cf.rate = modes[b] == "open" ? rates[h] : 0;
+		cf.window = modes[b] == "async" ? window : modes[b] == "sync";
+		measure(cf, json, &header);
+	}
+	return 0;
+}
@@ -0,0 +1,269 @@
+// rpcstat: polls a server's rpc_const::stats and shows, top-style,
+// what its procedures are doing, what the service says about itself,
+// the calls its process makes to other servers, and, built with
+// LOCKPROF, where its threads wait for locks. rates and percentiles
+// after the first screen are over the last interval.
+//
+// usage: rpcstat [-i secs] [-n screens] [-p] host:port | unix:path
+//   -i  seconds between polls, 2 by default
+//   -n  stop after this many screens
+//   -p  plain: don't clear the screen, for logs and pipes
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "rpc.h"
+#include "lang/verify.h"
+
+static std::string
+fmt_us(unsigned long long us)
+{
+	char b[32];
+	if (us < 1000)
+		snprintf(b, sizeof(b), "%lluus", us);
+	else if (us < 1000000)
+		snprintf(b, sizeof(b), "%.1fms", us / 1e3);
+	else
+		snprintf(b, sizeof(b), "%.2fs", us / 1e6);
+	return b;
+}
+
+static std::string
+fmt_bytes(unsigned long long n)
+{
+	char b[32];
+	if (n < 1024)
+		snprintf(b, sizeof(b), "%llu", n);
+	else if (n < 1024 * 1024)
+		snprintf(b, sizeof(b), "%.1fK", n / 1024.0);
+	else
+		snprintf(b, sizeof(b), "%.1fM", n / 1048576.0);
+	return b;
+}
+
+// h less what it held in the previous report, if there was one
+static rpc_hist_snap
+since(const rpc_hist_snap &h, const rpc_hist_snap *prev)
+{
+	rpc_hist_snap d = h;
+	if (prev)
+		d.minus(*prev);
+	return d;
+}
+
+struct srow {
+	const rpcs_proc_report *p;
+	rpc_hist_snap queue, run, req, rep;
+	double rate;
+};
+
+struct crow {
+	const rpcc_report *c;
+	const rpcc_proc_report *p;
+	rpc_hist_snap lat;
+	unsigned long long fail, retrans;
+	double rate;
+};
+
+struct lrow {
+	const lock_site_report *l;
+	unsigned long long acquires, contended, wait_ns, hold_ns;
+};
+
+static bool
+waited_more(const lrow &a, const lrow &b)
+{
+	return a.wait_ns > b.wait_ns;
+}
+
+template<class R> static bool
+busier(const R &a, const R &b)
+{
+	return a.rate > b.rate;
+}
+
+static void
+show(const char *addr, const rpc_stats_report &r, const rpc_stats_report *prev)
+{
+	double secs = prev ? (r.now_us - prev->now_us) / 1e6 : 0;
+	printf("rpcstat %s", addr);
+	if (prev)
+		printf(", last %.1f s", secs);
+	else
+		printf(", since start");
+	printf("\n%u conns  %u clients  %d/%d queued  %d blocked  %s reply cache\n",
+			r.conns, r.clients_seen, r.queued, r.queue_max, r.blocked,
+			fmt_bytes(r.reply_bytes).c_str());
+	std::map<std::string, std::string>::const_iterator kv;
+	for (kv = r.service.begin(); kv != r.service.end(); kv++)
+		printf("  %-24s %s\n", kv->first.c_str(), kv->second.c_str());
+
+	std::map<unsigned int, const rpcs_proc_report *> before;
+	if (prev)
+		for (unsigned i = 0; i < prev->server.size(); i++)
+			before[prev->server[i].proc] = &prev->server[i];
+	std::vector<srow> rows;
+	for (unsigned i = 0; i < r.server.size(); i++) {
+		const rpcs_proc_report &p = r.server[i];
+		const rpcs_proc_report *b = before.count(p.proc) ? before[p.proc] : NULL;
+		srow s;
+		s.p = &p;
+		s.queue = since(p.queue_us, b ? &b->queue_us : NULL);
+		s.run = since(p.run_us, b ? &b->run_us : NULL);
+		s.req = since(p.req_bytes, b ? &b->req_bytes : NULL);
+		s.rep = since(p.rep_bytes, b ? &b->rep_bytes : NULL);
+		s.rate = secs > 0 ? s.run.n / secs : s.run.n;
+		rows.push_back(s);
+	}
+	std::stable_sort(rows.begin(), rows.end(), busier<srow>);
+	printf("\n%-8s %9s %9s %9s %9s %9s %9s %7s %7s\n", "PROC",
+			prev ? "CALLS/S" : "CALLS", "TOTAL", "QUEUE p99", "RUN p50",
+			"RUN p99", "RUN max", "REQ", "REP");
+	for (unsigned i = 0; i < rows.size(); i++) {
+		const srow &s = rows[i];
+		printf("%-8x %9.1f %9llu %9s %9s %9s %9s %7s %7s\n", s.p->proc,
+				s.rate, s.p->run_us.n, fmt_us(s.queue.at(0.99)).c_str(),
+				fmt_us(s.run.at(0.5)).c_str(), fmt_us(s.run.at(0.99)).c_str(),
+				fmt_us(s.p->run_us.max).c_str(),
+				fmt_bytes(s.req.at(0.5)).c_str(),
+				fmt_bytes(s.rep.at(0.5)).c_str());
+	}
+
+	std::map<std::pair<std::string, unsigned int>, const rpcc_proc_report *> cbefore;
+	if (prev)
+		for (unsigned i = 0; i < prev->clients.size(); i++)
+			for (unsigned j = 0; j < prev->clients[i].procs.size(); j++)
+				cbefore[std::make_pair(prev->clients[i].dst,
+						prev->clients[i].procs[j].proc)] =
+					&prev->clients[i].procs[j];
+	std::vector<crow> crows;
+	for (unsigned i = 0; i < r.clients.size(); i++) {
+		for (unsigned j = 0; j < r.clients[i].procs.size(); j++) {
+			const rpcc_proc_report &p = r.clients[i].procs[j];
+			std::pair<std::string, unsigned int> k(r.clients[i].dst, p.proc);
+			const rpcc_proc_report *b = cbefore.count(k) ? cbefore[k] : NULL;
+			crow c;
+			c.c = &r.clients[i];
+			c.p = &p;
+			c.lat = since(p.latency_us, b ? &b->latency_us : NULL);
+			c.fail = p.failures - (b ? b->failures : 0);
+			c.retrans = p.retransmits - (b ? b->retransmits : 0);
+			c.rate = secs > 0 ? (c.lat.n + c.fail) / secs : c.lat.n + c.fail;
+			crows.push_back(c);
+		}
+	}
+	if (!crows.empty()) {
+		std::stable_sort(crows.begin(), crows.end(), busier<crow>);
+		printf("\n%-22s %-8s %9s %9s %7s %7s %9s %9s\n", "CALLS TO", "PROC",
+				prev ? "CALLS/S" : "CALLS", "TOTAL", "FAIL", "RETRANS",
+				"LAT p50", "LAT p99");
+		for (unsigned i = 0; i < crows.size(); i++) {
+			const crow &c = crows[i];
+			printf("%-22s %-8x %9.1f %9llu %7llu %7llu %9s %9s\n",
+					c.c->dst.c_str(), c.p->proc, c.rate,
+					c.p->latency_us.n + c.p->failures, c.fail, c.retrans,
+					fmt_us(c.lat.at(0.5)).c_str(), fmt_us(c.lat.at(0.99)).c_str());
+		}
+	}
+
+	std::map<std::string, const lock_site_report *> lbefore;
+	if (prev)
+		for (unsigned i = 0; i < prev->locks.size(); i++)
+			lbefore[prev->locks[i].site] = &prev->locks[i];
+	std::vector<lrow> lrows;
+	for (unsigned i = 0; i < r.locks.size(); i++) {
+		const lock_site_report &l = r.locks[i];
+		const lock_site_report *b = lbefore.count(l.site) ? lbefore[l.site] : NULL;
+		lrow w = { &l, l.acquires, l.contended, l.wait_ns, l.hold_ns };
+		if (b) {
+			w.acquires -= b->acquires;
+			w.contended -= b->contended;
+			w.wait_ns -= b->wait_ns;
+			w.hold_ns -= b->hold_ns;
+		}
+		if (w.acquires)
+			lrows.push_back(w);
+	}
+	if (lrows.empty())
+		return;
+	// the worst, by time spent waiting
+	std::stable_sort(lrows.begin(), lrows.end(), waited_more);
+	printf("\n%-32s %9s %6s %9s %9s %9s\n", "LOCK SITE",
+			prev ? "ACQ/S" : "ACQ", "CONT%", prev ? "WAIT/S" : "WAIT",
+			"WAIT avg", "HOLD avg");
+	for (unsigned i = 0; i < lrows.size() && i < 15; i++) {
+		const lrow &w = lrows[i];
+		double per = secs > 0 ? secs : 1;
+		printf("%-32s %9.1f %5.1f%% %9s %9s %9s\n", w.l->site.c_str(),
+				w.acquires / per, 100.0 * w.contended / w.acquires,
+				fmt_us(w.wait_ns / 1000 / per).c_str(),
+				fmt_us(w.contended ? w.wait_ns / 1000 / w.contended : 0).c_str(),
+				fmt_us(w.hold_ns / 1000 / w.acquires).c_str());
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	double interval = 2;
+	int screens = -1;
+	bool plain = !isatty(1);
+
+	int ch;
+	bool bad = false;
+	while (!bad && (ch = getopt(argc, argv, "i:n:p")) != -1) {
+		switch (ch) {
+			case 'i':
+				interval = atof(optarg);
+				break;
+			case 'n':
+				screens = atoi(optarg);
+				break;
+			case 'p':
+				plain = true;
+				break;
+			default:
+				bad = true;
+				break;
+		}
+	}
+	if (bad || optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-i secs] [-n screens] [-p] "
+				"host:port | unix:path\n", argv[0]);
+		exit(1);
+	}
+	const char *addr = argv[optind];
+
+	sockaddr_storage dst;
+	socklen_t len;
+	make_sockaddr(addr, &dst, &len);
+	rpcc cl((sockaddr *)&dst, len);
+	if (cl.bind(rpcc::to(3000)) != 0) {
+		fprintf(stderr, "rpcstat: can't bind to %s\n", addr);
+		exit(1);
+	}
+
+	rpc_stats_report prev;
+	bool have_prev = false;
+	for (int i = 0; screens < 0 || i < screens; i++) {
+		if (i > 0)
+			usleep((useconds_t)(interval * 1e6));
+		rpc_stats_report r;
+		int ret = cl.call(rpc_const::stats, 0, r, rpcc::to(3000));
+		if (!plain)
+			printf("\033[H\033[2J");
+		else if (i > 0)
+			printf("\n");
+		if (ret != 0) {
+			printf("rpcstat %s: no reply (%d)\n", addr, ret);
+			continue;
+		}
+		show(addr, r, have_prev ? &prev : NULL);
+		fflush(stdout);
+		prev = r;
+		have_prev = true;
+	}
+	return 0;
+}
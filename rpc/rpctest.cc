@@ -2,24 +2,62 @@
 // generates print statements on failures, but eventually says "rpctest OK"
 
 #include "rpc.h"
+#include "crc32c.h"
 #include <arpa/inet.h>
+#include <errno.h>
+#include <new>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <unistd.h>
 #include "jsl_log.h"
+#include "slock.h"
 #include "gettime.h"
 #include "lang/verify.h"
 
 #define NUM_CL 2
 
 rpcs *server;  // server rpc object
+int lossy_calls, lossy_worst_ms; // client2() under RPC_LOSSY
 rpcc *clients[NUM_CL];  // client rpc object
+rpcc *nested_cl; // handle_nested()'s client
 struct sockaddr_in dst; //server's ip address
 int port;
 pthread_attr_t attr;
 
+// allocations of at least big_alloc bytes, to count the copies an
+// rpc makes of a large payload
+enum { big_alloc = 1 << 20 };
+std::atomic<int> big_allocs;
+
+void *
+operator new(size_t n)
+{
+	if (n >= big_alloc)
+		big_allocs++;
+	void *p = malloc(n ? n : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+// std::stable_sort's buffer comes from here, and goes back through
+// the delete below
+void *
+operator new(size_t n, const std::nothrow_t &) noexcept
+{
+	if (n >= big_alloc)
+		big_allocs++;
+	return malloc(n ? n : 1);
+}
+
+void
+operator delete(void *p) noexcept
+{
+	free(p);
+}
+
 // server-side handlers. they must be methods of some class
 // to simplify rpcs::reg(). a server process can have handlers
 // from multiple classes.
@@ -29,6 +67,18 @@ class srv {
 		int handle_fast(const int a, int &r);
 		int handle_slow(const int a, int &r);
 		int handle_bigrep(const int a, std::string &r);
+		int handle_view(const bytes_view v, int &r);
+		int handle_keep(std::string v, int &r);
+		int handle_lock(const unsigned long long lid, const std::string id,
+				const int seq, int &r);
+		void handle_barrier(rpcs::reply_token *t, const int n);
+		int handle_nested(const int a, int &r);
+
+		srv() { VERIFY(pthread_mutex_init(&barrier_m, 0) == 0); }
+	private:
+		pthread_mutex_t barrier_m;
+		std::vector<rpcs::reply_token *> barrier;
+		std::string kept;
 };
 
 // a handler. a and b are arguments, r is the result.
@@ -67,6 +117,59 @@ srv::handle_bigrep(const int len, std::string &r)
 	return 0;
 }
 
+// the argument is not copied out of the request pdu; v points into it.
+int
+srv::handle_view(const bytes_view v, int &r)
+{
+	r = 0;
+	for (unsigned i = 0; i < v.size; i++)
+		r += (v.data[i] == 'y');
+	return 0;
+}
+
+// a deferred handler: nobody gets a reply until n calls have
+// arrived, which ties up no dispatch thread while they wait.
+// v is moved in from the request, and from v into kept
+int
+srv::handle_keep(std::string v, int &r)
+{
+	ScopedLock ml(&barrier_m);
+	kept = std::move(v);
+	r = kept.size();
+	return 0;
+}
+
+// shaped like lock_protocol::acquire: small numbers and a client id
+int
+srv::handle_lock(const unsigned long long lid, const std::string id,
+		const int seq, int &r)
+{
+	r = (int)lid + seq + id.size();
+	return 0;
+}
+
+void
+srv::handle_barrier(rpcs::reply_token *t, const int n)
+{
+	std::vector<rpcs::reply_token *> ready;
+	{
+		ScopedLock ml(&barrier_m);
+		barrier.push_back(t);
+		if ((int)barrier.size() < n)
+			return;
+		ready.swap(barrier);
+	}
+	for (unsigned i = 0; i < ready.size(); i++)
+		ready[i]->reply(0, (int)i);
+}
+
+// an rpc made from inside a handler, so part of the caller's trace
+int
+srv::handle_nested(const int a, int &r)
+{
+	return nested_cl->call(23, a, r);
+}
+
 srv service;
 
 void startserver()
@@ -76,6 +179,9 @@ void startserver()
 	server->reg(23, &service, &srv::handle_fast);
 	server->reg(24, &service, &srv::handle_slow);
 	server->reg(25, &service, &srv::handle_bigrep);
+	server->reg(26, &service, &srv::handle_view);
+	server->reg(27, &service, &srv::handle_barrier);
+	server->reg(28, &service, &srv::handle_keep);
 }
 
 void
@@ -109,6 +215,326 @@ testmarshall()
 	un >> s1;
 	VERIFY(un.okdone());
 	VERIFY(i1==i && l1==l && s1==s);
+
+	// large strings are referenced rather than copied, but marshall to
+	// the same bytes as a plain std::string
+	std::string big(3*RPC_REF_MIN, 'b');
+	marshall m1, m2;
+	m1.pack_req_header(rh);
+	m2.pack_req_header(rh);
+	m1 << i << big << s << bytes_ref(big) << l;
+	m2 << i << bytes_ref(big) << bytes_ref(s) << big << l;
+	VERIFY(m1.size() == m2.size());
+	std::vector<struct iovec> iov;
+	m2.iov(&iov);
+	VERIFY(iov.size() == 3);
+	std::string gathered;
+	for (unsigned j = 0; j < iov.size(); j++)
+		gathered.append((char *)iov[j].iov_base, iov[j].iov_len);
+	VERIFY((int)gathered.size() == m2.size());
+	VERIFY(memcmp(gathered.data(), m1.cstr(), m1.size()) == 0);
+	VERIFY(memcmp(m2.cstr(), m1.cstr(), m1.size()) == 0);
+
+	// bytes_view hands out the string in place
+	m1.take_buf(&b,&sz);
+	unmarshall un1(b,sz);
+	un1.unpack_req_header(&rh1);
+	bytes_view v;
+	un1 >> i1 >> v;
+	VERIFY(un1.ok() && v.size == big.size() && v.str() == big);
+	VERIFY(v.data > un1.cstr() && v.data < un1.cstr() + un1.size());
+}
+
+// described structs: one of fixed-size fields, which is packed in one
+// go, and one that holds a string and so goes field by field
+struct wire_pt {
+	unsigned int x;
+	short y;
+	unsigned long long z;
+	bool flag;
+	char c;
+};
+RPC_FIELDS(wire_pt, x, y, z, flag, c)
+
+struct wire_rec {
+	int id;
+	wire_pt at;
+	std::string name;
+	std::vector<wire_pt> path;
+};
+RPC_FIELDS(wire_rec, id, at, name, path)
+
+static_assert(wire<wire_pt>::fixed && wire<wire_pt>::size == 16,
+		"wire_pt is 16 fixed bytes");
+static_assert(!wire<wire_rec>::fixed && wire<wire_rec>::size == 20,
+		"wire_rec has 20 fixed bytes and a string");
+
+void
+wire_test()
+{
+	printf("wire_test\n");
+	wire_pt p = { 0xdeadbeef, -2, 0x0102030405060708ULL, true, 'q' };
+
+	// the struct marshals to the same bytes as its fields one by one
+	marshall m1, m2;
+	m1 << p;
+	m2 << p.x << p.y << p.z << p.flag << p.c;
+	VERIFY(m1.size() == RPC_HEADER_SZ + 16 && m1.str() == m2.str());
+
+	wire_rec r, r1;
+	r.id = -7;
+	r.at = p;
+	r.name = "rec";
+	r.path.push_back(p);
+	p.x = 1;
+	r.path.push_back(p);
+	marshall m3;
+	m3 << r;
+	unmarshall u(m3.str());
+	u >> r1;
+	VERIFY(u.okdone());
+	VERIFY(r1.id == r.id && r1.name == r.name && r1.path.size() == 2);
+	VERIFY(r1.at.x == 0xdeadbeef && r1.at.y == -2 && r1.at.flag &&
+			r1.at.z == 0x0102030405060708ULL && r1.at.c == 'q');
+	VERIFY(r1.path[1].x == 1 && r1.path[0].x == 0xdeadbeef);
+
+	// a short buffer fails and zeroes what it couldn't fill
+	unmarshall u1(m1.str().substr(0, 10));
+	wire_pt p1 = p;
+	u1 >> p1;
+	VERIFY(!u1.ok() && p1.x == 0 && p1.z == 0);
+
+	// compact: varints, zigzagged if signed, and the same values back
+	{
+		marshall mc;
+		mc.set_compact(true);
+		mc << 0 << -1 << 63 << -64 << 64 << 0x7fffffff << (int)0x80000000;
+		mc << 0xffffffffu << ~0ULL << (short)-32768 << (unsigned char)200;
+		mc << r;
+		unmarshall uc(mc.str());
+		uc.set_compact(true);
+		int a[7];
+		unsigned int b;
+		unsigned long long c;
+		short d;
+		unsigned char e;
+		uc >> a[0] >> a[1] >> a[2] >> a[3] >> a[4] >> a[5] >> a[6];
+		uc >> b >> c >> d >> e >> r1;
+		VERIFY(uc.okdone());
+		VERIFY(a[0] == 0 && a[1] == -1 && a[2] == 63 && a[3] == -64 &&
+				a[4] == 64 && a[5] == 0x7fffffff && a[6] == (int)0x80000000);
+		VERIFY(b == 0xffffffffu && c == ~0ULL && d == -32768 && e == 200);
+		VERIFY(r1.id == r.id && r1.name == r.name && r1.path.size() == 2);
+		VERIFY(r1.path[0].z == 0x0102030405060708ULL && r1.at.y == -2);
+
+		// one byte each up to 63 and down to -64
+		marshall ms;
+		ms.set_compact(true);
+		ms << 0 << -1 << 63 << -64;
+		VERIFY(ms.size() == RPC_HEADER_SZ + 4);
+
+		// a value too wide for what it is read into fails
+		unmarshall uw(mc.str());
+		uw.set_compact(true);
+		uw >> a[0] >> a[1] >> a[2] >> a[3] >> a[4] >> a[5] >> a[6] >> d;
+		VERIFY(!uw.ok());
+
+		// an interned string goes as its index, and needs the table
+		intern_table t;
+		t.s[0] = "client-1";
+		t.n = 1;
+		interned_str is;
+		is.s = t.s[0];
+		is.id = 0;
+		marshall mi;
+		mi.set_compact(true);
+		mi << is << std::string("x");
+		VERIFY(mi.size() == RPC_HEADER_SZ + 1 + 2);
+		std::string s1, s2;
+		unmarshall ui(mi.str());
+		ui.set_compact(true, &t);
+		ui >> s1 >> s2;
+		VERIFY(ui.okdone() && s1 == "client-1" && s2 == "x");
+		unmarshall un(mi.str());
+		un.set_compact(true);
+		un >> s1;
+		VERIFY(!un.ok());
+	}
+
+	// the cost of packing and unpacking a fixed struct whole or
+	// field by field
+	const int reps = 200000;
+	struct timespec start, end;
+	double ns[2];
+	for (int k = 0; k < 2; k++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < reps; i++) {
+			marshall m;
+			if (k)
+				m << p;
+			else
+				m << p.x << p.y << p.z << p.flag << p.c;
+			char *b;
+			int sz;
+			m.take_buf(&b, &sz);
+			unmarshall mu(b, sz);
+			reply_header h;
+			mu.unpack_reply_header(&h);
+			if (k)
+				mu >> p1;
+			else
+				mu >> p1.x >> p1.y >> p1.z >> p1.flag >> p1.c;
+			VERIFY(mu.okdone());
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns[k] = diff_timespec(end, start) * 1e6 / reps;
+	}
+	printf("   -- by field %.0f ns, whole %.0f ns .. ok\n", ns[0], ns[1]);
+	printf("wire_test OK\n");
+}
+
+void
+crc32c_test()
+{
+	printf("crc32c_test\n");
+	VERIFY(crc32c(0, "123456789", 9) == 0xe3069283);
+	VERIFY(crc32c_sw(0, "123456789", 9) == 0xe3069283);
+	VERIFY(crc32c(0, "", 0) == 0);
+
+	// every alignment and tail, and in pieces
+	std::string b(4096 + 64, 0);
+	for (unsigned i = 0; i < b.size(); i++)
+		b[i] = random();
+	for (int off = 0; off < 8; off++) {
+		for (int n = 0; n < 100; n++) {
+			uint32_t c = crc32c_sw(0, b.data() + off, n);
+			VERIFY(crc32c(0, b.data() + off, n) == c);
+			VERIFY(crc32c(crc32c(0, b.data() + off, n / 3),
+						b.data() + off + n / 3, n - n / 3) == c);
+		}
+	}
+	// and runs long enough to be split into streams
+	b.resize(100000);
+	for (unsigned i = 0; i < b.size(); i++)
+		b[i] = random();
+	for (int n = 24000; n < (int)b.size(); n += 7919)
+		VERIFY(crc32c(0, b.data() + 3, n) == crc32c_sw(0, b.data() + 3, n));
+
+	// a 1M pdu over and over, as it would be just after marshalling
+	std::string big(1 << 20, 'x');
+	const int reps = 256;
+	struct timespec start, end;
+	double gbs[2];
+	for (int k = 0; k < 2; k++) {
+		uint32_t c = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < reps; i++)
+			c ^= k ? crc32c(0, big.data(), big.size()) :
+				crc32c_sw(0, big.data(), big.size());
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		VERIFY(c == 0);
+		gbs[k] = reps * big.size() / 1e6 / (diff_timespec(end, start) + 1);
+	}
+	printf("   -- tables %.1f GB/s, %s %.1f GB/s .. ok\n", gbs[0],
+			crc32c_hw() ? "sse4.2" : "crc32c()", gbs[1]);
+	printf("crc32c_test OK\n");
+}
+
+struct test_timer : public timer_wheel::timer {
+	uint64_t due;
+	uint64_t fired;
+	void expire() { fired = timer_wheel::now_ms(); }
+};
+
+// a blocking timer stuck until released, as one sending to a slow
+// peer would be
+struct stuck_timer : public timer_wheel::timer {
+	pthread_mutex_t *m;
+	pthread_cond_t *c;
+	bool *go;
+	void expire() {
+		ScopedLock ml(m);
+		while (!*go)
+			VERIFY(pthread_cond_wait(c, m) == 0);
+	}
+};
+
+void
+timer_test()
+{
+	printf("timer_test\n");
+	timer_wheel *w = timer_wheel::instance();
+
+	// spread over the first two levels of the wheel; every other
+	// timer is cancelled, far enough ahead that none has fired yet
+	const int n = 1000;
+	test_timer *t = new test_timer[n];
+	for (int i = 0; i < n; i++) {
+		int ms = (i % 2 ? 100 : 1) + random() % 200;
+		t[i].due = timer_wheel::now_ms() + ms;
+		t[i].fired = 0;
+		w->schedule(&t[i], ms, i % 3 == 0);
+	}
+	for (int i = 1; i < n; i += 2)
+		VERIFY(w->cancel(&t[i]));
+	usleep(500 * 1000);
+	for (int i = 0; i < n; i++) {
+		w->cancel_sync(&t[i]);
+		if (i % 2)
+			VERIFY(t[i].fired == 0);
+		else
+			VERIFY(t[i].fired >= t[i].due && t[i].fired < t[i].due + 200);
+	}
+	delete[] t;
+	printf("   -- %d timers .. ok\n", n);
+
+	pthread_mutex_t m;
+	pthread_cond_t c;
+	VERIFY(pthread_mutex_init(&m, 0) == 0);
+	VERIFY(pthread_cond_init(&c, 0) == 0);
+	{
+		ScopedLock ml(&m);
+		uint64_t start = timer_wheel::now_ms();
+		VERIFY(w->cond_timedwait(&c, &m, 50) == ETIMEDOUT);
+		VERIFY(timer_wheel::now_ms() >= start + 50);
+	}
+	printf("   -- cond_timedwait .. ok\n");
+
+	// more stuck blocking timers than the pool has threads; the
+	// timers after them must still run on time
+	const int nstuck = 16;
+	stuck_timer stuck[nstuck];
+	bool go = false;
+	for (int i = 0; i < nstuck; i++) {
+		stuck[i].m = &m;
+		stuck[i].c = &c;
+		stuck[i].go = &go;
+		w->schedule(&stuck[i], 1, true);
+	}
+	usleep(20 * 1000);
+	test_timer after[2];
+	for (int i = 0; i < 2; i++) {
+		after[i].due = timer_wheel::now_ms() + 10;
+		after[i].fired = 0;
+		w->schedule(&after[i], 10, i == 0);
+	}
+	usleep(200 * 1000);
+	for (int i = 0; i < 2; i++) {
+		w->cancel_sync(&after[i]);
+		VERIFY(after[i].fired >= after[i].due &&
+				after[i].fired < after[i].due + 100);
+	}
+	{
+		ScopedLock ml(&m);
+		go = true;
+		VERIFY(pthread_cond_broadcast(&c) == 0);
+	}
+	for (int i = 0; i < nstuck; i++)
+		w->cancel_sync(&stuck[i]);
+	VERIFY(pthread_mutex_destroy(&m) == 0);
+	VERIFY(pthread_cond_destroy(&c) == 0);
+	printf("   -- %d stuck blocking timers .. ok\n", nstuck);
+	printf("timer_test OK\n");
 }
 
 void *
@@ -162,7 +588,14 @@ client2(void *xx)
 	while(time(0) - t1 < 10){
 		int arg = (random() % 2000);
 		std::string rep;
+		struct timespec start, end;
+		clock_gettime(CLOCK_REALTIME, &start);
 		int ret = clients[which_cl]->call(25, arg, rep);
+		clock_gettime(CLOCK_REALTIME, &end);
+		int diff = diff_timespec(end, start);
+		lossy_calls++;
+		if (diff > lossy_worst_ms)
+			lossy_worst_ms = diff;
 		if ((int)rep.size()!=arg) {
 			printf("ask for %d reply got %d ret %d\n",
                                arg, (int)rep.size(), ret);
@@ -245,6 +678,23 @@ simple_tests(rpcc *c)
 	VERIFY(rep.size() == 1000001);
 	printf("   -- huge 1M rpc request .. ok\n");
 
+	// huge RPC sent without copying the argument, received in place
+	big.replace(1000, 7, 7, 'y');
+	intret = c->call(22, bytes_ref(big), (std::string)"z", rep);
+	VERIFY(intret == 0 && rep == big + "z");
+	intret = c->call(26, bytes_ref(big), xx);
+	VERIFY(intret == 0 && xx == 7);
+	printf("   -- huge 1M scatter-gather request .. ok\n");
+
+	// a 2M payload taken by value and kept is allocated once on the
+	// server, by the unmarshall, and moved from there
+	std::string payload(2 * big_alloc, 'k');
+	int before = big_allocs;
+	intret = c->call(28, bytes_ref(payload), xx);
+	VERIFY(intret == 0 && xx == (int)payload.size());
+	VERIFY(big_allocs - before == 1);
+	printf("   -- 2M request moved into the handler .. ok\n");
+
 	// specify a timeout value to an RPC that should timeout (udp)
 	struct sockaddr_in non_existent;
 	memset(&non_existent, 0, sizeof(non_existent));
@@ -260,6 +710,971 @@ simple_tests(rpcc *c)
 	printf("simple_tests OK\n");
 }
 
+// counts completions; done() runs on the PollMgr thread
+class async_counter : public rpcc::callback {
+	public:
+		async_counter() : n(0), sum(0) {
+			VERIFY(pthread_mutex_init(&m, 0) == 0);
+		}
+		void done(int ret, unmarshall &rep) {
+			int r = 0;
+			if (ret == 0)
+				rep >> r;
+			ScopedLock ml(&m);
+			n++;
+			sum += r;
+		}
+		int n;
+		int sum;
+		pthread_mutex_t m;
+};
+
+void
+async_test(rpcc *c)
+{
+	printf("async_test\n");
+
+	// one thread, many calls in flight on one connection
+	const int n = 100;
+	rpcc::future f[n];
+	for (int i = 0; i < n; i++)
+		VERIFY(c->async(24, &f[i], i) == 0);
+	for (int i = n - 1; i >= 0; i--) {
+		int r;
+		VERIFY(f[i].get(r) == 0 && r == i + 2);
+	}
+	printf("   -- %d pipelined calls from one thread .. ok\n", n);
+
+	async_counter cnt;
+	for (int i = 0; i < n; i++)
+		VERIFY(c->async(23, &cnt, i) == 0);
+	rpcc::future last;
+	std::string rep;
+	VERIFY(c->async(22, &last, (std::string)"a", (std::string)"b") == 0);
+	VERIFY(last.get(rep) == 0 && rep == "ab");
+	while (1) {
+		ScopedLock ml(&cnt.m);
+		if (cnt.n == n)
+			break;
+		usleep(1000);
+	}
+	VERIFY(cnt.sum == n * (n + 1) / 2);
+	printf("   -- completion callbacks .. ok\n");
+
+	// a call that can't be sent completes its future right away
+	rpcc unbound(dst);
+	rpcc::future fb;
+	VERIFY(unbound.async(23, &fb, 1) == rpc_const::bind_failure);
+	VERIFY(fb.ready() && fb.wait() == rpc_const::bind_failure);
+	printf("   -- async call on unbound client .. failed ok\n");
+
+	// far more outstanding calls than the server has threads
+	int sum = 0;
+	rpcc::future held[n];
+	for (int i = 0; i < n; i++)
+		VERIFY(c->async(27, &held[i], n) == 0);
+	for (int i = 0; i < n; i++) {
+		int r;
+		VERIFY(held[i].get(r) == 0);
+		sum += r;
+	}
+	VERIFY(sum == n * (n - 1) / 2);
+	printf("   -- %d calls held by a deferred handler .. ok\n", n);
+
+	// more calls than the dispatch pool will queue: the server
+	// stops reading from the connection until it catches up
+	const int m = 1500;
+	rpcc::future *slow = new rpcc::future[m];
+	for (int i = 0; i < m; i++)
+		VERIFY(c->async(24, &slow[i], i) == 0);
+	for (int i = 0; i < m; i++) {
+		int r;
+		VERIFY(slow[i].get(r) == 0 && r == i + 2);
+	}
+	delete[] slow;
+	printf("   -- %d calls overflowing the dispatch pool .. ok\n", m);
+	printf("async_test OK\n");
+}
+
+void
+batch_test(rpcc *c)
+{
+	printf("batch_test\n");
+
+	const int n = 20;
+	rpcc::future f[n], cat;
+	rpcc::batch b(c);
+	for (int i = 0; i < n; i++)
+		b.add(23, &f[i], i);
+	b.add(22, &cat, (std::string)"a", (std::string)"b");
+	VERIFY(b.size() == n + 1);
+	VERIFY(b.send() == 0 && b.size() == 0);
+	std::string rep;
+	VERIFY(cat.get(rep) == 0 && rep == "ab");
+	for (int i = 0; i < n; i++) {
+		int r;
+		VERIFY(f[i].get(r) == 0 && r == i + 1);
+	}
+	printf("   -- %d calls in one batch .. ok\n", n + 1);
+
+	// calls in a batch are dispatched separately: these wait for
+	// each other in a deferred handler
+	rpcc::future held[n];
+	for (int i = 0; i < n; i++)
+		b.add(27, &held[i], n);
+	VERIFY(b.send() == 0);
+	int sum = 0;
+	for (int i = 0; i < n; i++) {
+		int r;
+		VERIFY(held[i].get(r) == 0);
+		sum += r;
+	}
+	VERIFY(sum == n * (n - 1) / 2);
+	printf("   -- a batch held by a deferred handler .. ok\n");
+
+	rpcc::future one;
+	b.add(23, &one, 7);
+	VERIFY(b.send() == 0 && b.send() == 0);
+	int r;
+	VERIFY(one.get(r) == 0 && r == 8);
+
+	rpcc unbound(dst);
+	rpcc::batch ub(&unbound);
+	rpcc::future fb[2];
+	ub.add(23, &fb[0], 1);
+	ub.add(23, &fb[1], 2);
+	VERIFY(ub.send() == rpc_const::bind_failure);
+	VERIFY(fb[0].wait() == rpc_const::bind_failure &&
+			fb[1].wait() == rpc_const::bind_failure);
+	printf("   -- batches of one, none, and unbound .. ok\n");
+
+	// small calls in bursts, sent one by one and in batches
+	const int bursts = 200, burst = 10;
+	struct timespec start, end;
+	int ms[2];
+	for (int k = 0; k < 2; k++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < bursts; i++) {
+			rpcc::future bf[burst];
+			for (int j = 0; j < burst; j++) {
+				if (k)
+					b.add(23, &bf[j], j);
+				else
+					VERIFY(c->async(23, &bf[j], j) == 0);
+			}
+			if (k)
+				VERIFY(b.send() == 0);
+			for (int j = 0; j < burst; j++)
+				VERIFY(bf[j].get(r) == 0 && r == j + 1);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ms[k] = diff_timespec(end, start);
+	}
+	printf("   -- %d bursts of %d: %d ms separately, %d ms batched .. ok\n",
+			bursts, burst, ms[0], ms[1]);
+	printf("batch_test OK\n");
+}
+
+struct big_calls {
+	rpcc *c;
+	std::string *big;
+	int n;
+};
+
+void *
+send_big(void *x)
+{
+	big_calls *b = (big_calls *)x;
+	for (int i = 0; i < b->n; i++) {
+		int r;
+		VERIFY(b->c->call(26, bytes_ref(*b->big), r) == 0);
+		VERIFY(r == (int)b->big->size());
+	}
+	return 0;
+}
+
+void
+conn_pool_test()
+{
+	printf("conn_pool_test\n");
+	rpcc c(dst);
+	VERIFY(c.bind() == 0);
+
+	// small calls get a connection of their own while a big
+	// transfer occupies another
+	std::string big(8 << 20, 'y');
+	big_calls b = { &c, &big, 10 };
+	pthread_t th;
+	VERIFY(pthread_create(&th, &attr, send_big, (void *)&b) == 0);
+	int worst = 0;
+	for (int i = 0; i < 200; i++) {
+		struct timespec start, end;
+		int r;
+		clock_gettime(CLOCK_REALTIME, &start);
+		VERIFY(c.call(23, i, r) == 0 && r == i + 1);
+		clock_gettime(CLOCK_REALTIME, &end);
+		int diff = diff_timespec(end, start);
+		worst = diff > worst ? diff : worst;
+	}
+	VERIFY(pthread_join(th, NULL) == 0);
+	VERIFY(c.nconns() > 1 && c.nconns() <= rpcc::default_conns);
+	printf("   -- small calls beside 8M transfers: slowest %d ms, %d connections .. ok\n",
+			worst, c.nconns());
+	printf("conn_pool_test OK\n");
+}
+
+int
+cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+void
+frame_test()
+{
+	printf("frame_test\n");
+
+	// a proc's own class, then the default by size; resetting one
+	// keeps its slot
+	VERIFY(rpc_priority(0x7fff0001, 10) == connection::prio_normal);
+	VERIFY(rpc_priority(0x7fff0001, 1 << 20) == connection::prio_bulk);
+	for(unsigned int p = 0x7fff0001; p < 0x7fff0041; p++)
+		set_rpc_priority(p, connection::prio_control);
+	set_rpc_priority(0x7fff0001, connection::prio_bulk);
+	VERIFY(rpc_priority(0x7fff0001, 10) == connection::prio_bulk);
+	VERIFY(rpc_priority(0x7fff0040, 10) == connection::prio_control);
+	VERIFY(rpc_priority(0x7fff0041, 10) == connection::prio_normal);
+
+	rpcc c(dst);
+	c.set_max_conns(1);
+	VERIFY(c.bind() == 0);
+
+	// small calls share the one connection with 8M requests, and
+	// with 4M replies coming back the other way
+	std::string big(8 << 20, 'y');
+	big_calls b = { &c, &big, 10 };
+	pthread_t th;
+	VERIFY(pthread_create(&th, &attr, send_big, (void *)&b) == 0);
+	const int n = 200;
+	int lat[n];
+	for (int i = 0; i < n; i++) {
+		struct timespec start, end;
+		int r;
+		std::string rep;
+		clock_gettime(CLOCK_REALTIME, &start);
+		if (i % 20 == 0) {
+			VERIFY(c.call(25, 4 << 20, rep) == 0 && rep.size() == 4 << 20);
+			continue;
+		}
+		VERIFY(c.call(23, i, r) == 0 && r == i + 1);
+		clock_gettime(CLOCK_REALTIME, &end);
+		lat[i] = diff_timespec(end, start);
+	}
+	VERIFY(pthread_join(th, NULL) == 0);
+	VERIFY(c.nconns() == 1);
+
+	int m = 0;
+	for (int i = 0; i < n; i++)
+		if (i % 20)
+			lat[m++] = lat[i];
+	qsort(lat, m, sizeof(lat[0]), cmp_int);
+	printf("   -- small calls beside 8M transfers on one connection: "
+			"p50 %d ms, p99 %d ms .. ok\n", lat[m / 2], lat[m * 99 / 100]);
+
+	// a pdu of exactly one frame, and one a byte over
+	std::string rep;
+	int sz = connection::frame_payload;
+	VERIFY(c.call(25, sz, rep) == 0 && (int)rep.size() == sz);
+	VERIFY(c.call(25, sz + 1, rep) == 0 && (int)rep.size() == sz + 1);
+
+	// more large pdus at once than one class interleaves
+	const int nb = connection::frame_streams + 4;
+	big_calls one = { &c, &big, 1 };
+	pthread_t bth[nb];
+	for (int i = 0; i < nb; i++)
+		VERIFY(pthread_create(&bth[i], &attr, send_big, (void *)&one) == 0);
+	for (int i = 0; i < nb; i++)
+		VERIFY(pthread_join(bth[i], NULL) == 0);
+	printf("   -- %d 8M calls at once .. ok\n", nb);
+
+	// a peer that begins more pdus than a sender would, each
+	// claiming to be 10M, is cut off
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	VERIFY(fd >= 0);
+	VERIFY(connect(fd, (sockaddr *)&dst, sizeof(dst)) == 0);
+	int streams = connection::nprio * connection::frame_streams;
+	for (int i = 0; i <= streams; i++) {
+		unsigned int f[3] = { htonl(4), htonl(100 + i), htonl(10 << 20) };
+		if (write(fd, f, sizeof(f)) != sizeof(f))
+			break;
+	}
+	char x;
+	VERIFY(read(fd, &x, 1) == 0);
+	close(fd);
+	int r;
+	VERIFY(c.call(23, 1, r) == 0 && r == 2);
+	printf("   -- %d pdus begun at once .. cut off ok\n", streams + 1);
+	printf("frame_test OK\n");
+}
+
+// calls/s of n small calls, and MB/s of 1M replies, on c
+void
+transport_rate(rpcc *c, int n, double *calls, double *mbs)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < n; i++) {
+		int r;
+		VERIFY(c->call(23, i, r) == 0 && r == i + 1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*calls = n * 1000.0 / (diff_timespec(end, start) + 1);
+
+	const int big = 1 << 20, m = 50;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < m; i++) {
+		std::string rep;
+		VERIFY(c->call(25, big, rep) == 0 && (int)rep.size() == big);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*mbs = m * 1000.0 / (diff_timespec(end, start) + 1);
+}
+
+void
+unix_test()
+{
+	printf("unix_test\n");
+	char path[64];
+	snprintf(path, sizeof(path), "unix:/tmp/rpctest-%d.sock", (int)getpid());
+	rpcs s(path);
+	s.reg(23, &service, &srv::handle_fast);
+	s.reg(25, &service, &srv::handle_bigrep);
+
+	sockaddr_storage a;
+	socklen_t len;
+	make_sockaddr(path, &a, &len);
+	rpcc uc((sockaddr *)&a, len);
+	VERIFY(uc.bind() == 0);
+	rpcc tc(dst);
+	VERIFY(tc.bind() == 0);
+
+	const int n = 5000;
+	double tcalls, tmbs, ucalls, umbs;
+	transport_rate(&tc, n, &tcalls, &tmbs);
+	transport_rate(&uc, n, &ucalls, &umbs);
+	printf("   -- tcp: %.0f calls/s, %.0f MB/s; unix: %.0f calls/s, %.0f MB/s .. ok\n",
+			tcalls, tmbs, ucalls, umbs);
+	printf("unix_test OK\n");
+}
+
+// takes the pdus of a raw connection
+struct pdu_sink : public chanmgr {
+	pdu_sink() : n(0), sealed(0), ret(0) {
+		VERIFY(pthread_mutex_init(&m, 0) == 0);
+	}
+	bool got_pdu(connection *c, char *b, int sz) {
+		ScopedLock ml(&m);
+		unmarshall u(b, sz);
+		n++;
+		sealed += u.sealed() && rpc_pdu_intact(b, sz);
+		reply_header rh;
+		u.unpack_reply_header(&rh);
+		ret = rh.ret;
+		return true;
+	}
+	pthread_mutex_t m;
+	int n, sealed;
+	int ret;  // the last reply's
+};
+
+void
+checksum_test()
+{
+	printf("checksum_test\n");
+	char path[64];
+	snprintf(path, sizeof(path), "unix:/tmp/rpctest-crc-%d.sock", (int)getpid());
+	rpcs s(path);
+	s.reg(22, &service, &srv::handle_22);
+	s.reg(23, &service, &srv::handle_fast);
+	s.reg(25, &service, &srv::handle_bigrep);
+	s.reg(27, &service, &srv::handle_barrier);
+
+	sockaddr_storage a;
+	socklen_t len;
+	make_sockaddr(path, &a, &len);
+	rpcc plain((sockaddr *)&a, len);
+	VERIFY(plain.bind() == 0 && !plain.checksums());
+	rpcc cc((sockaddr *)&a, len);
+	cc.use_checksums(true);
+	VERIFY(cc.bind() == 0);
+#if !RPC_CHECKSUMMING
+	VERIFY(!cc.checksums());
+	printf("   -- built without RPC_CHECKSUMMING .. ok\n");
+	printf("checksum_test OK\n");
+	return;
+#endif
+	VERIFY(cc.checksums());
+
+	// sealed both ways, referenced arguments, deferred replies
+	std::string big(3 << 20, 'q'), rep;
+	VERIFY(cc.call(22, bytes_ref(big), std::string("r"), rep) == 0);
+	VERIFY(rep == big + "r");
+	rpcc::future held[2];
+	VERIFY(cc.async(27, &held[0], 2) == 0 && cc.async(27, &held[1], 2) == 0);
+	int r;
+	VERIFY(held[0].get(r) == 0 && held[1].get(r) == 0);
+	printf("   -- sealed calls .. ok\n");
+
+	// a sealed request gets a sealed reply; a damaged one costs the
+	// sender its connection
+	pdu_sink sink;
+	connection *c = connect_to_dst((sockaddr *)&a, len, &sink, 0);
+	VERIFY(c);
+	for (int bad = 0; bad < 2; bad++) {
+		marshall m;
+		m << 41;
+		m.pack_req_header(req_header(1, 23, 0, 0, 0));
+		m.seal();
+		char *b;
+		int sz;
+		m.take_buf(&b, &sz);
+		VERIFY(rpc_pdu_intact(b, sz));
+		if (bad) {
+			b[sz - 1] ^= 1;
+			VERIFY(!rpc_pdu_intact(b, sz));
+		}
+		c->send(b, sz);
+		free(b);
+		for (int i = 0; i < 1000 && !(bad ? c->isdead() : sink.n); i++)
+			usleep(1000);
+	}
+	VERIFY(c->isdead());
+	VERIFY(sink.n == 1 && sink.sealed == 1);
+	c->closeconn();
+	c->decref();
+	printf("   -- damaged pdu .. dropped ok\n");
+
+	// once a client has agreed to checksums, a request of its whose
+	// marker is damaged, so that it looks unsealed, isn't run
+	pdu_sink agreed;
+	c = connect_to_dst((sockaddr *)&a, len, &agreed, 0);
+	VERIFY(c);
+	for (int step = 0; step < 2; step++) {
+		marshall m;
+		m << (step ? 41 : 1);
+		m.pack_req_header(req_header(step + 1,
+				step ? 23 : rpc_const::checksum_bind, 0x5eee, 0, 0));
+		char *b;
+		int sz;
+		if (step)
+			m.seal();
+		m.take_buf(&b, &sz);
+		if (step)
+			b[sizeof(rpc_sz_t)] ^= 1;
+		c->send(b, sz);
+		free(b);
+		for (int i = 0; i < 1000 && !(step ? c->isdead() : agreed.n); i++)
+			usleep(1000);
+	}
+	VERIFY(c->isdead());
+	VERIFY(agreed.n == 1 && agreed.ret == 0);
+	c->closeconn();
+	c->decref();
+	printf("   -- unsealed pdu from a sealing client .. dropped ok\n");
+
+	// what checking every byte costs
+	const int n = 3000;
+	double calls[2], mbs[2];
+	for (int k = 0; k < 2; k++)
+		transport_rate(k ? &cc : &plain, n, &calls[k], &mbs[k]);
+	printf("   -- plain %.0f calls/s, %.0f MB/s; checksums %.0f calls/s, "
+			"%.0f MB/s .. ok\n", calls[0], mbs[0], calls[1], mbs[1]);
+	printf("checksum_test OK\n");
+}
+
+// what compact bodies save on a call shaped like lock_protocol's
+// acquire, on the wire and in calls/s
+double
+lock_rate(rpcc *c, const interned_str &id, int n)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < n; i++) {
+		int r;
+		VERIFY(c->call(29, (unsigned long long)i % 100, id, i, r) == 0);
+		VERIFY(r == i % 100 + i + (int)id.s.size());
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return n * 1000.0 / (diff_timespec(end, start) + 1);
+}
+
+void
+compact_test()
+{
+	printf("compact_test\n");
+	char path[64];
+	snprintf(path, sizeof(path), "unix:/tmp/rpctest-cpt-%d.sock", (int)getpid());
+	rpcs s(path);
+	s.reg(22, &service, &srv::handle_22);
+	s.reg(23, &service, &srv::handle_fast);
+	s.reg(27, &service, &srv::handle_barrier);
+	s.reg(29, &service, &srv::handle_lock);
+
+	sockaddr_storage a;
+	socklen_t len;
+	make_sockaddr(path, &a, &len);
+	rpcc plain((sockaddr *)&a, len);
+	plain.use_compact(false); // whatever RPC_COMPACT says
+	VERIFY(plain.bind() == 0 && !plain.compact());
+	rpcc cc((sockaddr *)&a, len);
+	cc.use_compact(true);
+	VERIFY(cc.bind() == 0 && cc.compact());
+
+	// plain calls, negative numbers, deferred replies, batches
+	std::string rep;
+	VERIFY(cc.call(22, std::string("com"), std::string("pact"), rep) == 0);
+	VERIFY(rep == "compact");
+	int r;
+	VERIFY(cc.call(23, -100, r) == 0 && r == -99);
+	VERIFY(cc.call(23, 1 << 30, r) == 0 && r == (1 << 30) + 1);
+	rpcc::future held[2];
+	VERIFY(cc.async(27, &held[0], 2) == 0 && cc.async(27, &held[1], 2) == 0);
+	VERIFY(held[0].get(r) == 0 && held[1].get(r) == 0);
+	{
+		rpcc::batch b(&cc);
+		rpcc::future f1, f2;
+		b.add(23, &f1, -5);
+		b.add(22, &f2, std::string("a"), std::string("b"));
+		VERIFY(b.send() == 0);
+		VERIFY(f1.get(r) == 0 && r == -4 && f2.get(rep) == 0 && rep == "ab");
+	}
+	printf("   -- compact calls .. ok\n");
+
+	// the same string interns to the same index; the plain client
+	// just sends it
+	std::string cid = "127.0.0.1:23451-client";
+	interned_str id = cc.intern(cid), id2 = cc.intern(cid);
+	VERIFY(id.id >= 0 && id2.id == id.id);
+	VERIFY(plain.intern(cid).id < 0);
+	VERIFY(cc.call(22, id, std::string("!"), rep) == 0 && rep == cid + "!");
+	printf("   -- interned string .. ok\n");
+
+	// acquire(lid, id, seq) as each client marshals it
+	marshall mp, mc;
+	mc.set_compact(true);
+	mp << 7ULL << id << 42;
+	mc << 7ULL << id << 42;
+	const int n = 3000;
+	double rate[2];
+	rate[0] = lock_rate(&plain, plain.intern(cid), n);
+	rate[1] = lock_rate(&cc, id, n);
+	printf("   -- lock-like call: fixed %d bytes, %.0f calls/s; compact %d "
+			"bytes, %.0f calls/s .. ok\n", mp.size() - RPC_HEADER_SZ,
+			rate[0], mc.size() - RPC_HEADER_SZ, rate[1]);
+
+	// a client the server forgets loses its strings: a call naming
+	// one fails cleanly, and after that they go whole
+	rpcs::reply_limits l;
+	l.idle_secs = 1;
+	s.set_reply_limits(l);
+	sleep(3);
+	rpcc::future lost;
+	VERIFY(cc.async(22, &lost, id, std::string("?")) == 0);
+	VERIFY(lost.get(rep) == rpc_const::intern_failure);
+	VERIFY(cc.call(22, id, std::string("!"), rep) == 0 && rep == cid + "!");
+	VERIFY(cc.intern("other").id < 0);
+	printf("   -- forgotten strings .. ok\n");
+	printf("compact_test OK\n");
+}
+
+static pthread_barrier_t trace_barrier;
+
+static void *
+trace_thread(void *)
+{
+	for (int i = 0; i < 3000; i++)
+		rpc_trace(3, "trace_thread %d\n", i);
+	// an exited thread's ring goes to the next new thread
+	pthread_barrier_wait(&trace_barrier);
+	return 0;
+}
+
+// the trace rpc_trace_dump() wrote to path, or false
+static bool
+trace_from(const char *path, rpc_trace_file *t)
+{
+	VERIFY(rpc_trace_dump(path) == 0);
+	FILE *f = fopen(path, "r");
+	VERIFY(f);
+	bool ok = rpc_trace_read(f, t) == 0;
+	fclose(f);
+	unlink(path);
+	return ok;
+}
+
+void
+trace_test(rpcc *c)
+{
+	printf("trace_test\n");
+	rpc_trace_set_level(3);
+
+	// arguments come back as printf would have shown them
+	char args[44];
+	rpc_trace_buf b(args, sizeof(args));
+	rpc_trace_arg(&b, -5);
+	rpc_trace_arg(&b, 255u);
+	rpc_trace_arg(&b, "abc");
+	rpc_trace_arg(&b, 3.14159);
+	rpc_trace_arg(&b, (size_t)1 << 40);
+	VERIFY(rpc_trace_format("%d %x [%5s] %.2f %lu%%\n", args, sizeof(args)) ==
+			"-5 ff [  abc] 3.14 1099511627776%\n");
+	rpc_trace_buf b2(args, sizeof(args));
+	rpc_trace_arg(&b2, std::string(100, 'x').c_str());
+	rpc_trace_arg(&b2, 7);
+	VERIFY(rpc_trace_format("%s %d", args, sizeof(args)) ==
+			std::string(43, 'x') + " ?");
+
+	// each thread's ring keeps its newest records, in order
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/rpctest-trace-%d", (int)getpid());
+	pthread_t th[4];
+	VERIFY(pthread_barrier_init(&trace_barrier, NULL, 4) == 0);
+	for (int i = 0; i < 4; i++)
+		VERIFY(pthread_create(&th[i], NULL, trace_thread, NULL) == 0);
+	for (int i = 0; i < 4; i++)
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	VERIFY(pthread_barrier_destroy(&trace_barrier) == 0);
+	int r;
+	VERIFY(c->call(23, 1, r) == 0);
+	rpc_trace_file t;
+	VERIFY(trace_from(path, &t));
+	VERIFY(t.pid == getpid());
+	std::map<uint64_t, rpc_trace_file::site *> sites;
+	for (unsigned i = 0; i < t.sites.size(); i++)
+		sites[t.sites[i].id] = &t.sites[i];
+	std::map<int, std::vector<int> > seen;
+	bool call1 = false;
+	for (unsigned i = 0; i < t.recs.size(); i++) {
+		rpc_trace_file::site *s = sites[(uintptr_t)t.recs[i].site];
+		VERIFY(s);
+		VERIFY(i == 0 || t.recs[i - 1].ns <= t.recs[i].ns);
+		std::string m = rpc_trace_format(s->fmt.c_str(), t.recs[i].args,
+				sizeof(t.recs[i].args));
+		int n;
+		if (sscanf(m.c_str(), "trace_thread %d", &n) == 1)
+			seen[t.recs[i].tid].push_back(n);
+		if (m == "rpcc::call1: reply received\n")
+			call1 = true;
+	}
+	VERIFY(call1 && seen.size() == 4);
+	std::map<int, std::vector<int> >::iterator i;
+	for (i = seen.begin(); i != seen.end(); i++) {
+		// less the oldest, which the thread might have been overwriting
+		VERIFY(i->second.size() == rpc_trace_ring::size - 1);
+		for (unsigned j = 0; j < i->second.size(); j++)
+			VERIFY(i->second[j] == 3000 - (int)i->second.size() + (int)j);
+	}
+	printf("   -- %lu records, 4 rings wrapped .. ok\n", t.recs.size());
+
+	// a site above the level costs a compare; one at it, a record
+	const int n = 1000000;
+	struct timespec start, end;
+	double ns[2];
+	for (int level = 0; level < 2; level++) {
+		rpc_trace_set_level(level ? 3 : 0);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < n; i++)
+			rpc_trace(3, "trace_test %d %s\n", i, "x");
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns[level] = ((end.tv_sec - start.tv_sec) * 1e9 +
+				(end.tv_nsec - start.tv_nsec)) / n;
+	}
+	printf("   -- %.1f ns off, %.1f ns on .. ok\n", ns[0], ns[1]);
+	printf("trace_test OK\n");
+}
+
+static void *
+span_thread(void *x)
+{
+	rpc_span_scope in(*(rpc_span_ctx *)x);
+	rpc_span sp("test.kid");
+	return 0;
+}
+
+struct test_span {
+	uint64_t trace, parent;
+	std::string name;
+};
+
+void
+span_test()
+{
+	printf("span_test\n");
+	rpc_trace_set_level(3);
+	char path[64];
+	snprintf(path, sizeof(path), "unix:/tmp/rpctest-span-%d.sock", (int)getpid());
+	rpcs s(path);
+	s.reg(23, &service, &srv::handle_fast);
+	s.reg(27, &service, &srv::handle_barrier);
+	s.reg(30, &service, &srv::handle_nested);
+	sockaddr_storage a;
+	socklen_t len;
+	make_sockaddr(path, &a, &len);
+	rpcc c((sockaddr *)&a, len);
+	VERIFY(c.bind() == 0);
+	nested_cl = &c;
+
+	// outside any trace, nothing is recorded
+	int r;
+	VERIFY(c.call(23, 1, r) == 0 && r == 2);
+
+	// an operation: a nested call, a deferred reply, and work handed
+	// to another thread
+	rpc_span_ctx root;
+	{
+		rpc_span sp("test.op");
+		root = rpc_span_cur;
+		VERIFY(root.trace && root.span);
+		VERIFY(c.call(30, 5, r) == 0 && r == 6);
+		rpcc::future f;
+		VERIFY(c.async(27, &f, 1) == 0 && f.get(r) == 0);
+		pthread_t th;
+		VERIFY(pthread_create(&th, NULL, span_thread, &root) == 0);
+		VERIFY(pthread_join(th, NULL) == 0);
+	}
+	VERIFY(!rpc_span_cur.trace);
+
+	snprintf(path, sizeof(path), "/tmp/rpctest-span-%d", (int)getpid());
+	rpc_trace_file t;
+	VERIFY(trace_from(path, &t));
+	std::map<uint64_t, rpc_trace_file::site *> sites;
+	for (unsigned i = 0; i < t.sites.size(); i++)
+		sites[t.sites[i].id] = &t.sites[i];
+	std::map<uint64_t, test_span> spans;
+	std::map<std::string, uint64_t> ids;
+	for (unsigned i = 0; i < t.recs.size(); i++) {
+		rpc_trace_file::site *st = sites[(uintptr_t)t.recs[i].site];
+		std::string m = rpc_trace_format(st->fmt.c_str(), t.recs[i].args,
+				sizeof(t.recs[i].args));
+		unsigned long long tr, id, parent, dur;
+		char name[64];
+		if (sscanf(m.c_str(), "span %llx %llx %llx %llu %63[^\n]", &tr, &id,
+					&parent, &dur, name) != 5)
+			continue;
+		VERIFY(tr == root.trace && !spans.count(id) && !ids.count(name));
+		test_span ts = { tr, parent, name };
+		spans[id] = ts;
+		ids[name] = id;
+	}
+	VERIFY(spans.size() == 8);
+	VERIFY(ids["test.op"] == root.span && spans[root.span].parent == 0);
+	VERIFY(spans[ids["rpcc 1e"]].parent == root.span);
+	VERIFY(spans[ids["rpcs 1e"]].parent == ids["rpcc 1e"]);
+	VERIFY(spans[ids["rpcc 17"]].parent == ids["rpcs 1e"]);
+	VERIFY(spans[ids["rpcs 17"]].parent == ids["rpcc 17"]);
+	VERIFY(spans[ids["rpcc 1b"]].parent == root.span);
+	VERIFY(spans[ids["rpcs 1b"]].parent == ids["rpcc 1b"]);
+	VERIFY(spans[ids["test.kid"]].parent == root.span);
+	printf("   -- nested, deferred and handed-off spans .. ok\n");
+	printf("span_test OK\n");
+}
+
+static pthread_mutex_t contend_m = PTHREAD_MUTEX_INITIALIZER;
+static int contend_line;
+static volatile int contend_n;
+
+static void *
+contend_thread(void *)
+{
+	for (int i = 0; i < 20000; i++) {
+		contend_line = __LINE__ + 1;
+		ScopedLock ml(&contend_m);
+		contend_n++;
+	}
+	return 0;
+}
+
+struct test_provider : public rpc_stats_provider {
+	void stats(std::map<std::string, std::string> *kv) {
+		(*kv)["test.answer"] = "42";
+	}
+};
+
+void
+stats_test()
+{
+	printf("stats_test\n");
+	// a bucket holds one value below 8, and values within 1/8 of
+	// each other above
+	uint64_t vals[] = { 0, 1, 7, 8, 9, 15, 16, 17, 1000, 123456789, ~0ULL };
+	for (unsigned i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+		int b = rpc_hist::bucket(vals[i]);
+		VERIFY(b >= 0 && b < rpc_hist::buckets);
+		VERIFY(rpc_hist::lowest(b) <= vals[i] && vals[i] <= rpc_hist::highest(b));
+		VERIFY(rpc_hist::highest(b) - rpc_hist::lowest(b) <= rpc_hist::lowest(b) / 8);
+	}
+	rpc_hist h;
+	for (int i = 1; i <= 1000; i++)
+		h.add(i);
+	rpc_hist_snap hs;
+	h.get(&hs);
+	VERIFY(hs.n == 1000 && hs.max == 1000 && hs.mean() == 500);
+	VERIFY(hs.at(0.5) >= 500 && hs.at(0.5) <= 500 + 500 / 8);
+	VERIFY(hs.at(0.99) >= 990 && hs.at(1) == 1000);
+	// what came after an earlier snapshot
+	for (int i = 0; i < 100; i++)
+		h.add(5000);
+	rpc_hist_snap later;
+	h.get(&later);
+	later.minus(hs);
+	VERIFY(later.n == 100 && later.sum == 500000 && later.b.size() == 1);
+	VERIFY(later.at(0.5) >= 5000 && later.at(0.5) <= 5000 + 5000 / 8);
+
+	char path[64];
+	snprintf(path, sizeof(path), "unix:/tmp/rpctest-st-%d.sock", (int)getpid());
+	rpcs s(path);
+	s.reg(23, &service, &srv::handle_fast);
+	s.reg(24, &service, &srv::handle_slow);
+	s.reg(27, &service, &srv::handle_barrier);
+	test_provider tp;
+	s.add_stats(&tp);
+
+	sockaddr_storage a;
+	socklen_t len;
+	make_sockaddr(path, &a, &len);
+	rpcc c((sockaddr *)&a, len);
+	VERIFY(c.bind() == 0);
+	int r;
+	for (int i = 0; i < 50; i++)
+		VERIFY(c.call(23, i, r) == 0);
+	for (int i = 0; i < 20; i++)
+		VERIFY(c.call(24, i, r) == 0);
+	rpcc::future held[2];
+	VERIFY(c.async(27, &held[0], 2) == 0 && c.async(27, &held[1], 2) == 0);
+	VERIFY(held[0].get(r) == 0 && held[1].get(r) == 0);
+
+	// the server's side, and this process's clients, by rpc
+	rpc_stats_report rep;
+	VERIFY(c.call(rpc_const::stats, 0, rep) == 0);
+	std::map<unsigned int, rpcs_proc_report> sp;
+	for (unsigned i = 0; i < rep.server.size(); i++)
+		sp[rep.server[i].proc] = rep.server[i];
+	VERIFY(sp[23].run_us.n == 50 && sp[23].queue_us.n == 50);
+	VERIFY(sp[23].req_bytes.n == 50 && sp[23].rep_bytes.max > 0);
+	VERIFY(sp[24].run_us.n == 20 && sp[27].run_us.n == 2);
+	VERIFY(sp[(unsigned int)rpc_const::bind].run_us.n == 1);
+	VERIFY(rep.now_us > 0 && rep.conns == 1 && rep.clients_seen == 1);
+	VERIFY(rep.queue_max > 0 && rep.blocked == 0);
+	VERIFY(rep.service["test.answer"] == "42");
+	rpcc_report mine;
+	c.stats(&mine);
+	std::map<unsigned int, rpcc_proc_report> cp;
+	for (unsigned i = 0; i < rep.clients.size(); i++) {
+		if (rep.clients[i].dst != mine.dst)
+			continue;
+		for (unsigned j = 0; j < rep.clients[i].procs.size(); j++)
+			cp[rep.clients[i].procs[j].proc] = rep.clients[i].procs[j];
+	}
+	VERIFY(cp[23].latency_us.n == 50 && cp[23].failures == 0);
+	VERIFY(cp[24].latency_us.n == 20 && cp[24].retransmits == 0);
+	printf("   -- handle_slow: p50 queue %llu us, run %llu us; client p50 "
+			"%llu us .. ok\n", sp[24].queue_us.at(0.5), sp[24].run_us.at(0.5),
+			cp[24].latency_us.at(0.5));
+
+	// and as rpc_stats_on_signal() prints it
+	char *buf = NULL;
+	size_t sz = 0;
+	FILE *f = open_memstream(&buf, &sz);
+	VERIFY(f);
+	rpc_stats_dump(f);
+	fclose(f);
+	VERIFY(strstr(buf, "proc 17: 50") && strstr(buf, mine.dst.c_str()));
+	VERIFY(strstr(buf, "1 conns") && strstr(buf, "test.answer 42"));
+	free(buf);
+	printf("   -- dump .. ok\n");
+
+	// with LOCKPROF, where ScopedLocks waited
+	pthread_t th[4];
+	for (int i = 0; i < 4; i++)
+		VERIFY(pthread_create(&th[i], NULL, contend_thread, NULL) == 0);
+	for (int i = 0; i < 4; i++)
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	VERIFY(c.call(rpc_const::stats, 0, rep) == 0);
+#if LOCKPROF
+	char site[64];
+	snprintf(site, sizeof(site), "%s:%d", __FILE__, contend_line);
+	const lock_site_report *l = NULL;
+	for (unsigned i = 0; i < rep.locks.size(); i++)
+		if (rep.locks[i].site == site)
+			l = &rep.locks[i];
+	VERIFY(l && l->acquires == 80000 && l->contended > 0 && l->hold_ns > 0);
+	VERIFY(l->contended == 0 || l->wait_ns > 0);
+	printf("   -- %s: %llu of %llu contended, %llu us waiting .. ok\n",
+			site, l->contended, l->acquires, l->wait_ns / 1000);
+#else
+	VERIFY(rep.locks.empty());
+#endif
+	printf("stats_test OK\n");
+}
+
+void
+reply_cache_test(rpcc *c)
+{
+	printf("reply_cache_test\n");
+
+	rpcs::reply_limits l;
+	l.client_max_replies = 8;
+	server->set_reply_limits(l);
+
+	// many unacknowledged replies: the server keeps only the newest
+	const int n = 100, len = 1000;
+	rpcc::future f[n];
+	for (int i = 0; i < n; i++)
+		VERIFY(c->async(25, &f[i], len) == 0);
+	for (int i = 0; i < n; i++) {
+		std::string r;
+		VERIFY(f[i].get(r) == 0 && (int)r.size() == len);
+	}
+	// replies that complete out of order may briefly keep a few more
+	VERIFY(server->reply_bytes() < 20 * (len + 100));
+	printf("   -- %d replies cached in %d bytes .. ok\n", n,
+			(int)server->reply_bytes());
+
+	// idle clients are forgotten, but can still make new calls
+	l.idle_secs = 1;
+	server->set_reply_limits(l);
+	sleep(3);
+	VERIFY(server->reply_bytes() == 0);
+	int r;
+	VERIFY(c->call(23, 1, r) == 0 && r == 2);
+	printf("   -- idle client forgotten, calls again .. ok\n");
+
+	// an xid far past the client's window is refused, rather than
+	// grown into
+	pdu_sink sink;
+	connection *rc = connect_to_dst((sockaddr *)&dst, sizeof(dst), &sink, 0);
+	VERIFY(rc);
+	unsigned int xids[] = { 1, 1 + (1u << 31), 2 };
+	for (int i = 0; i < 3; i++) {
+		marshall m;
+		m << 41;
+		m.pack_req_header(req_header(xids[i], 23, 0x5eed, 0, 0));
+		int before = sink.n;
+		rc->send(m.cstr(), m.size());
+		for (int j = 0; j < 1000 && sink.n == before; j++)
+			usleep(1000);
+		VERIFY(sink.n == before + 1);
+		VERIFY(sink.ret == (i == 1 ? rpc_const::atmostonce_failure : 0));
+	}
+	rc->closeconn();
+	rc->decref();
+	VERIFY(c->call(23, 1, r) == 0 && r == 2);
+	printf("   -- xid 2^31 ahead refused .. ok\n");
+
+	server->set_reply_limits(rpcs::reply_limits());
+	printf("reply_cache_test OK\n");
+}
+
 void 
 concurrent_test(int nt)
 {
@@ -310,6 +1725,13 @@ lossy_test()
 	for(int i = 0; i < nt; i++){
 		VERIFY(pthread_join(th[i], NULL) == 0);
 	}
+
+	// a lost request is noticed after the measured rto, not after
+	// rpcc::to_min
+	rpcc::rtt_stats st = clients[0]->rtt();
+	VERIFY(st.samples > 0 && st.rto_ms < rpcc::to_min.to);
+	printf(" %d calls, slowest %d ms, srtt %d us rto %d ms ..",
+			lossy_calls, lossy_worst_ms, st.srtt_us, st.rto_ms);
 	printf(".. OK\n");
 	VERIFY(setenv("RPC_LOSSY", "0", 1) == 0);
 }
@@ -434,6 +1856,9 @@ main(int argc, char *argv[])
 	}
 
 	testmarshall();
+	wire_test();
+	crc32c_test();
+	timer_test();
 
 	pthread_attr_init(&attr);
 	// set stack size to 32K, so we don't run out of memory
@@ -463,6 +1888,20 @@ main(int argc, char *argv[])
 		}
 
 		simple_tests(clients[0]);
+		async_test(clients[0]);
+		batch_test(clients[0]);
+		conn_pool_test();
+		if (isserver)
+			reply_cache_test(clients[0]);
+		frame_test();
+		if (isserver) {
+			unix_test();
+			checksum_test();
+			compact_test();
+			stats_test();
+			span_test();
+		}
+		trace_test(clients[0]);
 		concurrent_test(10);
 		lossy_test();
 		if (isserver) {
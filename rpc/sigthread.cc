@@ -0,0 +1,69 @@
+#include "sigthread.h"
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include "lang/verify.h"
+
+// handlers write the signal number here, one byte each, and
+// sig_thread reads them
+static int sig_pipe[2];
+
+static std::atomic<void (*)()> sig_fns[NSIG];
+
+static void *
+sig_thread(void *)
+{
+	for (;;) {
+		unsigned char sig;
+		ssize_t n = read(sig_pipe[0], &sig, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		VERIFY(n == 1);
+		void (*fn)() = sig < NSIG ? sig_fns[sig].load() : NULL;
+		if (fn)
+			fn();
+	}
+	return NULL;
+}
+
+static void
+sig_handler(int sig)
+{
+	// a full pipe already has this signal waiting, so a failed
+	// write loses nothing worth having
+	int e = errno;
+	unsigned char c = sig;
+	ssize_t r = write(sig_pipe[1], &c, 1);
+	(void)r;
+	errno = e;
+}
+
+static void
+sig_init()
+{
+	VERIFY(pipe(sig_pipe) == 0);
+	for (int i = 0; i < 2; i++)
+		VERIFY(fcntl(sig_pipe[i], F_SETFD, FD_CLOEXEC) == 0);
+	VERIFY(fcntl(sig_pipe[1], F_SETFL, O_NONBLOCK) == 0);
+	pthread_t th;
+	VERIFY(pthread_create(&th, NULL, sig_thread, NULL) == 0);
+	VERIFY(pthread_detach(th) == 0);
+}
+
+void
+rpc_on_signal(int sig, void (*fn)())
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	VERIFY(sig > 0 && sig < NSIG && sig < 256);
+	VERIFY(pthread_once(&once, sig_init) == 0);
+	sig_fns[sig] = fn;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_handler;
+	sa.sa_flags = SA_RESTART;
+	VERIFY(sigaction(sig, &sa, NULL) == 0);
+}
@@ -0,0 +1,11 @@
+#ifndef rpc_sigthread_h
+#define rpc_sigthread_h
+
+// run fn each time the process gets sig, on a thread of the library's
+// own rather than in the handler, so fn may take locks, allocate and
+// write files. the handler only writes sig down a pipe; the thread
+// sleeps in read() on it, so nothing runs until a signal comes.
+// a later call for the same sig replaces its fn.
+void rpc_on_signal(int sig, void (*fn)());
+
+#endif
@@ -0,0 +1,30 @@
+#include "slock.h"
+
+#if LOCKPROF
+
+slock_site slock_sites[slock_nsites];
+
+// where sites go once the table is full
+static slock_site overflow;
+
+slock_site *
+slock_site_for(const char *file, int line)
+{
+	uint64_t key = (uint64_t)line << 48 | (uintptr_t)file;
+	uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+	for (unsigned i = 0; i < slock_nsites; i++) {
+		slock_site *s = &slock_sites[(h + i) % slock_nsites];
+		uint64_t k = s->key.load(std::memory_order_acquire);
+		if (k == key)
+			return s;
+		if (k == 0) {
+			if (s->key.compare_exchange_strong(k, key))
+				return s;
+			if (k == key)
+				return s;
+		}
+	}
+	return &overflow;
+}
+
+#endif
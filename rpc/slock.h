@@ -3,15 +3,72 @@
 
 #include <pthread.h>
 #include "lang/verify.h"
+
+#if LOCKPROF
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+// built with LOCKPROF=1 (see GNUmakefile), each place a ScopedLock is
+// made counts its acquisitions, the ones that found the mutex held,
+// and the time spent waiting for and holding it. hold time includes
+// any pthread_cond_wait() on the mutex. rpcs::stats() reports them.
+struct slock_site {
+	// (uint64_t)line << 48 | file, or 0 for an unused slot
+	std::atomic<uint64_t> key;
+	std::atomic<uint64_t> acquires, contended, wait_ns, hold_ns;
+};
+
+enum { slock_nsites = 4096 };
+extern slock_site slock_sites[slock_nsites];
+
+slock_site *slock_site_for(const char *file, int line);
+
+inline uint64_t
+slock_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
 struct ScopedLock {
 	private:
 		pthread_mutex_t *m_;
+#if LOCKPROF
+		slock_site *site_;
+		uint64_t locked_;
+#endif
 	public:
+#if LOCKPROF
+		// the defaults are the caller's file and line
+		ScopedLock(pthread_mutex_t *m, const char *file = __builtin_FILE(),
+				int line = __builtin_LINE())
+			: m_(m), site_(slock_site_for(file, line)) {
+			if (pthread_mutex_trylock(m_) == 0) {
+				locked_ = slock_ns();
+			} else {
+				uint64_t t = slock_ns();
+				VERIFY(pthread_mutex_lock(m_)==0);
+				locked_ = slock_ns();
+				site_->contended.fetch_add(1, std::memory_order_relaxed);
+				site_->wait_ns.fetch_add(locked_ - t, std::memory_order_relaxed);
+			}
+			site_->acquires.fetch_add(1, std::memory_order_relaxed);
+		}
+		~ScopedLock() {
+			site_->hold_ns.fetch_add(slock_ns() - locked_,
+					std::memory_order_relaxed);
+			VERIFY(pthread_mutex_unlock(m_)==0);
+		}
+#else
 		ScopedLock(pthread_mutex_t *m): m_(m) { // 在构造的时候锁定
 			VERIFY(pthread_mutex_lock(m_)==0);
 		}
 		~ScopedLock() { // 在析构的时候解锁
 			VERIFY(pthread_mutex_unlock(m_)==0);
 		}
+#endif
 };
 #endif  /*__SCOPED_LOCK__*/
@@ -0,0 +1,60 @@
+#include "span.h"
+#include <atomic>
+#include <unistd.h>
+
+__thread rpc_span_ctx rpc_span_cur;
+
+// the process's ids are a random base plus a count. the base is
+// from the clock and pid, so processes started together differ.
+static uint64_t
+id_base()
+{
+	uint64_t x = rpc_trace_ns() ^ ((uint64_t)getpid() << 40);
+	// splitmix64, to spread nearby seeds apart
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static std::atomic<uint64_t> next_id(id_base());
+
+uint64_t
+rpc_span_id()
+{
+	uint64_t id;
+	while ((id = next_id.fetch_add(1, std::memory_order_relaxed)) == 0)
+		;
+	return id;
+}
+
+// spantree finds spans by these formats
+void
+rpc_span_local(const rpc_span_ctx &s, uint64_t parent, uint64_t start_ns,
+		const char *name)
+{
+	rpc_trace(rpc_span_level, "span %llx %llx %llx %llu %s\n",
+			(unsigned long long)s.trace, (unsigned long long)s.span,
+			(unsigned long long)parent,
+			(unsigned long long)(rpc_trace_ns() - start_ns), name);
+}
+
+void
+rpc_span_rpcc(const rpc_span_ctx &s, uint64_t parent, uint64_t start_ns,
+		unsigned int proc)
+{
+	rpc_trace(rpc_span_level, "span %llx %llx %llx %llu rpcc %x\n",
+			(unsigned long long)s.trace, (unsigned long long)s.span,
+			(unsigned long long)parent,
+			(unsigned long long)(rpc_trace_ns() - start_ns), proc);
+}
+
+void
+rpc_span_rpcs(const rpc_span_ctx &s, uint64_t parent, uint64_t start_ns,
+		unsigned int proc)
+{
+	rpc_trace(rpc_span_level, "span %llx %llx %llx %llu rpcs %x\n",
+			(unsigned long long)s.trace, (unsigned long long)s.span,
+			(unsigned long long)parent,
+			(unsigned long long)(rpc_trace_ns() - start_ns), proc);
+}
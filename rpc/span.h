@@ -0,0 +1,82 @@
+#ifndef rpc_span_h
+#define rpc_span_h
+
+// distributed tracing on top of rpc_trace (trace.h). a trace follows
+// one operation, say a write() on a yfs mount, through every process
+// it reaches; a span is a piece of it: a local step, an rpc as its
+// caller waited for it (rpcc), or as its server ran it from arrival
+// to reply (rpcs). each span knows its trace and its parent span, and
+// goes into its thread's trace ring when it ends, so each process's
+// trace dump holds its spans and rpc/spantree puts a run together.
+//
+// a thread's current span, rpc_span_cur, goes with every rpc it makes
+// (see rpc_const::trace_flag), and the handler runs with the rpcs span
+// as its current one, so calls it makes join the trace. work handed to
+// another thread takes an rpc_span_ctx along and runs under an
+// rpc_span_scope.
+
+#include <stdint.h>
+#include "trace.h"
+
+struct rpc_span_ctx {
+	constexpr rpc_span_ctx() : trace(0), span(0) {}
+	rpc_span_ctx(uint64_t t, uint64_t s) : trace(t), span(s) {}
+	uint64_t trace;  // 0 when not in a trace
+	uint64_t span;
+};
+
+// spans are trace records at this level; below it no new traces
+// start, though a process still joins the ones its requests bring
+enum { rpc_span_level = 2 };
+
+extern __thread rpc_span_ctx rpc_span_cur;
+
+// an id no other span or trace will have
+uint64_t rpc_span_id();
+
+// record span s of its trace, a child of parent that began at
+// start_ns (rpc_trace_ns()) and has just ended. name is cut to 11
+// characters.
+void rpc_span_local(const rpc_span_ctx &s, uint64_t parent,
+		uint64_t start_ns, const char *name);
+void rpc_span_rpcc(const rpc_span_ctx &s, uint64_t parent,
+		uint64_t start_ns, unsigned int proc);
+void rpc_span_rpcs(const rpc_span_ctx &s, uint64_t parent,
+		uint64_t start_ns, unsigned int proc);
+
+// a step of the current trace, from construction to destruction, and
+// the current span meanwhile. outside any trace it starts a new one.
+class rpc_span {
+	public:
+		explicit rpc_span(const char *name) : name_(name), saved_(rpc_span_cur),
+			start_(0) {
+			if (!saved_.trace && rpc_trace_level < rpc_span_level)
+				return;
+			rpc_span_cur = rpc_span_ctx(saved_.trace ? saved_.trace :
+					rpc_span_id(), rpc_span_id());
+			start_ = rpc_trace_ns();
+		}
+		~rpc_span() {
+			if (!start_)
+				return;
+			rpc_span_local(rpc_span_cur, saved_.span, start_, name_);
+			rpc_span_cur = saved_;
+		}
+	private:
+		const char *name_;
+		rpc_span_ctx saved_;
+		uint64_t start_;
+};
+
+// carry on a trace that another thread started
+class rpc_span_scope {
+	public:
+		explicit rpc_span_scope(const rpc_span_ctx &c) : saved_(rpc_span_cur) {
+			rpc_span_cur = c;
+		}
+		~rpc_span_scope() { rpc_span_cur = saved_; }
+	private:
+		rpc_span_ctx saved_;
+};
+
+#endif
@@ -0,0 +1,218 @@
+// spantree: puts together the spans (see span.h) in trace dumps, one
+// from each process of a run, and says where each operation's time
+// went. a trace's critical path is found by sweeping over its root
+// span: each moment goes to the deepest span open then, the latest
+// begun if several are. time in an rpcc span but in no rpcs under it
+// was on the wire or in the server's queue.
+//
+// usage: spantree [-v] [-n top] file...
+//   -v  print every trace's spans as a tree too
+//   -n  how many of the biggest parts of each operation to list (8)
+
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "trace.h"
+
+struct span {
+	uint64_t trace, id, parent;
+	uint64_t start, end;  // wall-clock ns
+	std::string name;
+	int pid, tid;
+	int depth;
+	std::vector<span *> kids;
+};
+
+static bool
+by_start(const span *a, const span *b)
+{
+	return a->start < b->start;
+}
+
+static void
+set_depth(span *s, int d, std::vector<span *> *all)
+{
+	s->depth = d;
+	all->push_back(s);
+	std::sort(s->kids.begin(), s->kids.end(), by_start);
+	for (unsigned i = 0; i < s->kids.size(); i++)
+		set_depth(s->kids[i], d + 1, all);
+}
+
+static void
+print_tree(const span *s, uint64_t t0)
+{
+	printf("%*s%s  +%llu us  %llu us  %d/%d\n", 2 * s->depth, "",
+			s->name.c_str(), (unsigned long long)(s->start - t0) / 1000,
+			(unsigned long long)(s->end - s->start) / 1000, s->pid, s->tid);
+	for (unsigned i = 0; i < s->kids.size(); i++)
+		print_tree(s->kids[i], t0);
+}
+
+// how much of root's time each span name had on the critical path
+static void
+critical_path(const span *root, const std::vector<span *> &all,
+		std::map<std::string, uint64_t> *parts)
+{
+	std::vector<uint64_t> t;
+	for (unsigned i = 0; i < all.size(); i++) {
+		t.push_back(std::max(root->start, std::min(root->end, all[i]->start)));
+		t.push_back(std::max(root->start, std::min(root->end, all[i]->end)));
+	}
+	std::sort(t.begin(), t.end());
+	t.erase(std::unique(t.begin(), t.end()), t.end());
+	for (unsigned i = 0; i + 1 < t.size(); i++) {
+		const span *best = 0;
+		for (unsigned j = 0; j < all.size(); j++) {
+			const span *s = all[j];
+			if (s->start > t[i] || s->end < t[i + 1])
+				continue;
+			if (!best || s->depth > best->depth ||
+					(s->depth == best->depth && s->start > best->start))
+				best = s;
+		}
+		if (best)
+			(*parts)[best->name] += t[i + 1] - t[i];
+	}
+}
+
+struct op_stats {
+	unsigned n;
+	uint64_t total;
+	std::map<std::string, uint64_t> parts;
+	op_stats() : n(0), total(0) {}
+};
+
+static bool
+bigger(const std::pair<std::string, uint64_t> &a,
+		const std::pair<std::string, uint64_t> &b)
+{
+	return a.second > b.second;
+}
+
+int
+main(int argc, char *argv[])
+{
+	bool verbose = false;
+	unsigned top = 8;
+
+	int ch;
+	bool bad = false;
+	while (!bad && (ch = getopt(argc, argv, "vn:")) != -1) {
+		switch (ch) {
+			case 'v':
+				verbose = true;
+				break;
+			case 'n':
+				top = atoi(optarg);
+				break;
+			default:
+				bad = true;
+				break;
+		}
+	}
+	if (bad || optind >= argc) {
+		fprintf(stderr, "usage: %s [-v] [-n top] file...\n", argv[0]);
+		exit(1);
+	}
+
+	std::vector<span> spans;
+	for (int i = optind; i < argc; i++) {
+		FILE *f = fopen(argv[i], "r");
+		if (!f) {
+			perror(argv[i]);
+			exit(1);
+		}
+		rpc_trace_file tf;
+		if (rpc_trace_read(f, &tf) != 0) {
+			fprintf(stderr, "spantree: %s: not a trace\n", argv[i]);
+			exit(1);
+		}
+		fclose(f);
+		std::map<uint64_t, const rpc_trace_file::site *> sites;
+		for (unsigned j = 0; j < tf.sites.size(); j++)
+			if (tf.sites[j].fmt.compare(0, 5, "span ") == 0)
+				sites[tf.sites[j].id] = &tf.sites[j];
+		for (unsigned j = 0; j < tf.recs.size(); j++) {
+			const rpc_trace_rec &r = tf.recs[j];
+			std::map<uint64_t, const rpc_trace_file::site *>::iterator si =
+				sites.find((uintptr_t)r.site);
+			if (si == sites.end())
+				continue;
+			std::string msg = rpc_trace_format(si->second->fmt.c_str(),
+					r.args, sizeof(r.args));
+			unsigned long long tr, id, parent, dur;
+			char name[64];
+			if (sscanf(msg.c_str(), "span %llx %llx %llx %llu %63[^\n]",
+						&tr, &id, &parent, &dur, name) != 5)
+				continue;
+			span s;
+			s.trace = tr;
+			s.id = id;
+			s.parent = parent;
+			s.end = r.ns + tf.real_minus_mono_ns;
+			s.start = s.end - dur;
+			s.name = name;
+			s.pid = tf.pid;
+			s.tid = r.tid;
+			s.depth = 0;
+			spans.push_back(s);
+		}
+	}
+
+	// a span whose parent isn't among them, because it's outside any
+	// dump or was overwritten, is a root
+	std::map<uint64_t, std::map<uint64_t, span *> > traces;
+	for (unsigned i = 0; i < spans.size(); i++)
+		traces[spans[i].trace][spans[i].id] = &spans[i];
+	std::vector<span *> roots;
+	std::map<uint64_t, std::map<uint64_t, span *> >::iterator ti;
+	for (ti = traces.begin(); ti != traces.end(); ti++) {
+		std::map<uint64_t, span *>::iterator si;
+		for (si = ti->second.begin(); si != ti->second.end(); si++) {
+			span *s = si->second;
+			std::map<uint64_t, span *>::iterator p = ti->second.find(s->parent);
+			if (s->parent && p != ti->second.end())
+				p->second->kids.push_back(s);
+			else
+				roots.push_back(s);
+		}
+	}
+	std::sort(roots.begin(), roots.end(), by_start);
+
+	std::map<std::string, op_stats> ops;
+	for (unsigned i = 0; i < roots.size(); i++) {
+		span *r = roots[i];
+		std::vector<span *> all;
+		set_depth(r, 0, &all);
+		if (verbose) {
+			printf("trace %llx\n", (unsigned long long)r->trace);
+			print_tree(r, r->start);
+		}
+		op_stats &o = ops[r->name];
+		o.n++;
+		o.total += r->end - r->start;
+		critical_path(r, all, &o.parts);
+	}
+	if (verbose && !roots.empty())
+		printf("\n");
+
+	std::map<std::string, op_stats>::iterator oi;
+	for (oi = ops.begin(); oi != ops.end(); oi++) {
+		const op_stats &o = oi->second;
+		printf("%s  %u traces  mean %llu us\n", oi->first.c_str(), o.n,
+				(unsigned long long)(o.total / o.n / 1000));
+		std::vector<std::pair<std::string, uint64_t> > parts(o.parts.begin(),
+				o.parts.end());
+		std::sort(parts.begin(), parts.end(), bigger);
+		for (unsigned j = 0; j < parts.size() && j < top; j++)
+			printf("  %5.1f%%  %8llu us  %s\n",
+					o.total ? 100.0 * parts[j].second / o.total : 0.0,
+					(unsigned long long)(parts[j].second / o.n / 1000),
+					parts[j].first.c_str());
+	}
+	return 0;
+}
@@ -4,66 +4,158 @@
 #include <errno.h>
 #include "lang/verify.h"
 
+struct worker_arg {
+	ThrPool *tp;
+	int me;
+};
+
 static void *
 do_worker(void *arg)
 {
-	ThrPool *tp = (ThrPool *)arg;
-	while (1) {
-		ThrPool::job_t j;
-		if (!tp->takeJob(&j))
-			break; //die
+	worker_arg *wa = (worker_arg *)arg;
+	ThrPool *tp = wa->tp;
+	int me = wa->me;
+	delete wa;
 
-		(void)(j.f)(j.a);
-	}
+	tp->work(me);
 	pthread_exit(NULL);
 }
 
 //if blocking, then addJob() blocks when queue is full
 //otherwise, addJob() simply returns false when queue is full
 ThrPool::ThrPool(int sz, bool blocking)
-: nthreads_(sz),blockadd_(blocking),jobq_(100*sz) 
+: nthreads_(sz), blockadd_(blocking), max_(100*sz), q_(sz), next_(0),
+	pending_(0), sleepers_(0), adders_(0), stop_(false)
 {
+	VERIFY(pthread_mutex_init(&idle_m_, 0) == 0);
+	VERIFY(pthread_cond_init(&idle_c_, 0) == 0);
+	VERIFY(pthread_cond_init(&space_c_, 0) == 0);
+	for (int i = 0; i < sz; i++)
+		VERIFY(pthread_mutex_init(&q_[i].m, 0) == 0);
+
 	pthread_attr_init(&attr_);
 	pthread_attr_setstacksize(&attr_, 128<<10);
 
 	for (int i = 0; i < sz; i++) {
 		pthread_t t;
-		VERIFY(pthread_create(&t, &attr_, do_worker, (void *)this) ==0);
+		worker_arg *wa = new worker_arg;
+		wa->tp = this;
+		wa->me = i;
+		VERIFY(pthread_create(&t, &attr_, do_worker, (void *)wa) ==0);
 		th_.push_back(t);
 	}
 }
 
-//IMPORTANT: this function can be called only when no external thread 
+//IMPORTANT: this function can be called only when no external thread
 //will ever use this thread pool again or is currently blocking on it
+//
+//workers run the jobs still queued before they exit
 ThrPool::~ThrPool()
 {
-	for (int i = 0; i < nthreads_; i++) {
-		job_t j;
-		j.f = (void *(*)(void *))NULL; //poison pill to tell worker threads to exit
-		jobq_.enq(j);
+	{
+		ScopedLock il(&idle_m_);
+		stop_ = true;
+		VERIFY(pthread_cond_broadcast(&idle_c_) == 0);
 	}
 
 	for (int i = 0; i < nthreads_; i++) {
 		VERIFY(pthread_join(th_[i], NULL)==0);
 	}
 
+	for (int i = 0; i < nthreads_; i++)
+		VERIFY(pthread_mutex_destroy(&q_[i].m) == 0);
+	VERIFY(pthread_mutex_destroy(&idle_m_) == 0);
+	VERIFY(pthread_cond_destroy(&idle_c_) == 0);
+	VERIFY(pthread_cond_destroy(&space_c_) == 0);
 	VERIFY(pthread_attr_destroy(&attr_)==0);
 }
 
-bool 
-ThrPool::addJob(void *(*f)(void *), void *a)
+// the capacity check isn't atomic with the increment, so concurrent
+// adders may overshoot max_ by a few jobs.
+bool
+ThrPool::addJob(job *j)
 {
-	job_t j;
-	j.f = f;
-	j.a = a;
+	if (pending_ >= max_) {
+		if (!blockadd_)
+			return false;
+		ScopedLock il(&idle_m_);
+		adders_++;
+		while (pending_ >= max_)
+			VERIFY(pthread_cond_wait(&space_c_, &idle_m_) == 0);
+		adders_--;
+	}
+
+	// count the job before it becomes visible, so that pending_ never
+	// goes negative; a worker may briefly see pending_ > 0 and find
+	// no job, and then looks again.
+	pending_++;
 
-	return jobq_.enq(j,blockadd_);
+	wqueue *w = &q_[next_++ % nthreads_];
+	j->next_ = NULL;
+	{
+		ScopedLock ql(&w->m);
+		if (w->tail)
+			w->tail->next_ = j;
+		else
+			w->head = j;
+		w->tail = j;
+	}
+
+	// a worker about to sleep increments sleepers_ before it checks
+	// pending_, so one of us sees the other's increment.
+	if (sleepers_ > 0) {
+		ScopedLock il(&idle_m_);
+		VERIFY(pthread_cond_signal(&idle_c_) == 0);
+	}
+	return true;
 }
 
-bool 
-ThrPool::takeJob(job_t *j)
+ThrPool::job *
+ThrPool::pop(wqueue *w)
 {
-	jobq_.deq(j);
-	return (j->f!=NULL);
+	ScopedLock ql(&w->m);
+	job *j = w->head;
+	if (j) {
+		w->head = j->next_;
+		if (!w->head)
+			w->tail = NULL;
+	}
+	return j;
 }
 
+// own queue first, then steal from the others in turn; sleep when
+// the whole pool is empty. returns NULL when the pool is being
+// destroyed and has no jobs left.
+ThrPool::job *
+ThrPool::take(int me)
+{
+	while (1) {
+		for (int k = 0; k < nthreads_; k++) {
+			job *j = pop(&q_[(me + k) % nthreads_]);
+			if (j) {
+				pending_--;
+				if (adders_ > 0) {
+					ScopedLock il(&idle_m_);
+					VERIFY(pthread_cond_broadcast(&space_c_) == 0);
+				}
+				return j;
+			}
+		}
+
+		ScopedLock il(&idle_m_);
+		sleepers_++;
+		while (pending_ == 0 && !stop_)
+			VERIFY(pthread_cond_wait(&idle_c_, &idle_m_) == 0);
+		sleepers_--;
+		if (pending_ == 0 && stop_)
+			return NULL;
+	}
+}
+
+void
+ThrPool::work(int me)
+{
+	job *j;
+	while ((j = take(me)) != NULL)
+		j->run();
+}
@@ -2,58 +2,89 @@
 #define __THR_POOL__
 
 #include <pthread.h>
+#include <atomic>
 #include <vector>
 
-#include "fifo.h"
-
 /**
  * 线程池
+ *
+ * every worker has its own queue. addJob() spreads jobs over the
+ * queues round-robin, and a worker whose queue is empty steals from
+ * the others before it goes to sleep, so adders and workers rarely
+ * meet on the same lock. jobs are intrusive: a job is linked into a
+ * queue through its own next pointer, and queueing it allocates
+ * nothing.
+ *
+ * the pool holds about 100 queued jobs per thread. when it is full,
+ * addJob() blocks, or for a non-blocking pool returns false; such a
+ * caller can watch pending() to learn when the pool has drained.
  */
 class ThrPool {
 
-
 	public:
-		struct job_t {
-			void *(*f)(void *); //function point
-			void *a; //function arguments
+		class job {
+			public:
+				job() : next_(NULL) {}
+				virtual ~job() {}
+				virtual void run() = 0;
+			private:
+				friend class ThrPool;
+				job *next_;
 		};
 
 		ThrPool(int sz, bool blocking=true);
 		~ThrPool();
+		// the pool doesn't own j; j->run() may delete it
+		bool addJob(job *j);
 		template<class C, class A> bool addObjJob(C *o, void (C::*m)(A), A a);
-		void waitDone();
 
-		bool takeJob(job_t *j);
+		int pending() { return pending_; }
+		int capacity() { return max_; }
+
+		void work(int me);
 
 	private:
+		struct wqueue {
+			wqueue() : head(NULL), tail(NULL) {}
+			pthread_mutex_t m;
+			job *head;
+			job *tail;
+		};
+
 		pthread_attr_t attr_;
 		int nthreads_;
 		bool blockadd_;
+		const int max_;
 
-
-		fifo<job_t> jobq_; // 阻塞队列
+		std::vector<wqueue> q_;
 		std::vector<pthread_t> th_;
-
-		bool addJob(void *(*f)(void *), void *a);
+		std::atomic<unsigned> next_;  // queue for the next addJob()
+		std::atomic<int> pending_;    // jobs queued, not yet taken
+
+		// only for sleeping and waking
+		pthread_mutex_t idle_m_;
+		pthread_cond_t idle_c_;      // pending_ went non-zero, or stop_
+		pthread_cond_t space_c_;     // pending_ dropped below max_
+		std::atomic<int> sleepers_;
+		std::atomic<int> adders_;    // blocked in addJob()
+		bool stop_;
+
+		job *take(int me);
+		job *pop(wqueue *w);
 };
 
-	template <class C, class A> bool 
+	template <class C, class A> bool
 ThrPool::addObjJob(C *o, void (C::*m)(A), A a)
 {
 
-	class objfunc_wrapper {
+	class objfunc_wrapper : public job {
 		public:
 			C *o;
 			void (C::*m)(A a);
 			A a;
-			static void *func(void *vvv) {
-				objfunc_wrapper *x = (objfunc_wrapper*)vvv;
-				C *o = x->o;
-				void (C::*m)(A ) = x->m;
-				A a = x->a;
+			void run() {
 				(o->*m)(a);
-				delete x;
-				return 0;
+				delete this;
 			}
 	};
 
@@ -61,7 +92,11 @@ ThrPool::addObjJob(C *o, void (C::*m)(A), A a)
 	x->o = o;
 	x->m = m;
 	x->a = a;
-	return addJob(&objfunc_wrapper::func, (void *)x);
+	if (!addJob(x)) {
+		delete x;
+		return false;
+	}
+	return true;
 }
 
 
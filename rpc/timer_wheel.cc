@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <time.h>
+
+#include "slock.h"
+#include "method_thread.h"
+#include "lang/verify.h"
+#include "timer_wheel.h"
+
+// threads for timers scheduled with blocking=true
+static const int pool_threads = 4;
+
+timer_wheel *timer_wheel::instance_ = NULL;
+static pthread_once_t timer_wheel_is_initialized = PTHREAD_ONCE_INIT;
+
+// the timer whose expire() this thread is running
+static __thread timer_wheel::timer *current_timer;
+
+void
+timer_wheel::init()
+{
+	instance_ = new timer_wheel();
+}
+
+timer_wheel *
+timer_wheel::instance()
+{
+	pthread_once(&timer_wheel_is_initialized, init);
+	return instance_;
+}
+
+uint64_t
+timer_wheel::now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+timer_wheel::timer_wheel()
+: pool_(pool_threads, false), busy_(0), start_(now_ms()), cur_(0),
+	wake_(UINT64_MAX), npending_(0)
+{
+	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
+	pthread_condattr_t ca;
+	VERIFY(pthread_condattr_init(&ca) == 0);
+	VERIFY(pthread_condattr_setclock(&ca, CLOCK_MONOTONIC) == 0);
+	VERIFY(pthread_cond_init(&c_, &ca) == 0);
+	VERIFY(pthread_condattr_destroy(&ca) == 0);
+	VERIFY(pthread_cond_init(&idle_c_, NULL) == 0);
+
+	for (int l = 0; l < levels; l++)
+		for (int i = 0; i < slots; i++)
+			wheel_[l][i] = NULL;
+
+	VERIFY((th_ = method_thread(this, false, &timer_wheel::loop)) != 0);
+}
+
+timer_wheel::~timer_wheel()
+{
+	//never kill me!!!
+	VERIFY(0);
+}
+
+// m_ held. a timer goes into the lowest level whose turn covers
+// the time left, at the slot its expiry falls in.
+void
+timer_wheel::insert(timer *t)
+{
+	uint64_t when = t->when_ < cur_ ? cur_ : t->when_;
+	uint64_t delta = when - cur_;
+	const uint64_t reach = (uint64_t)1 << (slot_bits * levels);
+	if (delta >= reach)
+		when = cur_ + reach - 1;
+
+	int l = 0;
+	while (l < levels - 1 && delta >= ((uint64_t)1 << (slot_bits * (l + 1))))
+		l++;
+	timer **slot = &wheel_[l][(when >> (slot_bits * l)) & (slots - 1)];
+
+	t->prev_ = NULL;
+	t->next_ = *slot;
+	if (*slot)
+		(*slot)->prev_ = t;
+	*slot = t;
+	t->slot_ = slot;
+	npending_++;
+}
+
+// m_ held
+void
+timer_wheel::unlink(timer *t)
+{
+	VERIFY(t->slot_);
+	if (t->prev_)
+		t->prev_->next_ = t->next_;
+	else
+		*t->slot_ = t->next_;
+	if (t->next_)
+		t->next_->prev_ = t->prev_;
+	t->next_ = t->prev_ = NULL;
+	t->slot_ = NULL;
+	npending_--;
+}
+
+void
+timer_wheel::schedule(timer *t, int ms, bool blocking)
+{
+	if (ms < 1)
+		ms = 1;
+	ScopedLock ml(&m_);
+	if (t->slot_)
+		unlink(t);
+	uint64_t now = now_ms() - start_;
+	// the thread may have slept through many ticks of an empty wheel
+	if (npending_ == 0 && cur_ < now)
+		cur_ = now;
+	t->when_ = now + ms;
+	t->blocking_ = blocking;
+	insert(t);
+	if (t->when_ < wake_)
+		VERIFY(pthread_cond_signal(&c_) == 0);
+}
+
+bool
+timer_wheel::cancel(timer *t)
+{
+	ScopedLock ml(&m_);
+	if (!t->slot_)
+		return false;
+	unlink(t);
+	return true;
+}
+
+bool
+timer_wheel::cancel_sync(timer *t)
+{
+	ScopedLock ml(&m_);
+	if (t->slot_) {
+		unlink(t);
+		return true;
+	}
+	while (current_timer != t && running_.count(t))
+		VERIFY(pthread_cond_wait(&idle_c_, &m_) == 0);
+	return false;
+}
+
+// m_ held. the timer may already be gone: expire() can free it.
+void
+timer_wheel::done(timer *t)
+{
+	std::map<timer *, int>::iterator it = running_.find(t);
+	VERIFY(it != running_.end());
+	if (--it->second == 0)
+		running_.erase(it);
+	VERIFY(pthread_cond_broadcast(&idle_c_) == 0);
+}
+
+struct timer_job : public ThrPool::job {
+	timer_wheel *w;
+	timer_wheel::timer *t;
+	bool pooled;
+	void run() {
+		current_timer = t;
+		t->expire();
+		current_timer = NULL;
+		{
+			ScopedLock ml(&w->m_);
+			if (pooled)
+				w->busy_--;
+			w->done(t);
+		}
+		delete this;
+	}
+};
+
+// m_ held. every timer in a level 0 slot is due at cur_.
+void
+timer_wheel::run_slot(timer **slot)
+{
+	timer *t;
+	while ((t = *slot) != NULL) {
+		unlink(t);
+		running_[t]++;
+		timer_job *j = NULL;
+		bool pooled = false;
+		if (t->blocking_) {
+			j = new timer_job;
+			j->w = this;
+			j->t = t;
+			// an idle pool thread, or else a thread of its own; never
+			// a queue behind timers that may be blocked
+			j->pooled = pooled = busy_ < pool_threads;
+			if (pooled)
+				busy_++;
+		}
+		VERIFY(pthread_mutex_unlock(&m_) == 0);
+		if (pooled) {
+			VERIFY(pool_.addJob(j));
+		} else if (j) {
+			method_thread(j, true, &timer_job::run);
+		} else {
+			current_timer = t;
+			t->expire();
+			current_timer = NULL;
+		}
+		VERIFY(pthread_mutex_lock(&m_) == 0);
+		// a blocking timer is done() by its job
+		if (!j)
+			done(t);
+	}
+}
+
+// m_ held. move the timers in the slot of level l that cur_ has
+// reached down to the levels below.
+void
+timer_wheel::cascade(int l)
+{
+	timer **slot = &wheel_[l][(cur_ >> (slot_bits * l)) & (slots - 1)];
+	timer *t = *slot;
+	*slot = NULL;
+	while (t) {
+		timer *next = t->next_;
+		t->slot_ = NULL;
+		npending_--;
+		insert(t);
+		t = next;
+	}
+}
+
+// m_ held. the tick to wake up at: the next non-empty slot of level
+// 0 in this turn, or else the end of the turn, when the levels above
+// cascade.
+uint64_t
+timer_wheel::next_tick()
+{
+	if (npending_ == 0)
+		return UINT64_MAX;
+	for (uint64_t t = cur_; ; t++) {
+		if (wheel_[0][t & (slots - 1)])
+			return t;
+		if ((t & (slots - 1)) == slots - 1)
+			return t + 1;
+	}
+}
+
+void
+timer_wheel::loop()
+{
+	ScopedLock ml(&m_);
+	while (1) {
+		uint64_t now = now_ms() - start_;
+		while (cur_ <= now && npending_ > 0) {
+			int idx = cur_ & (slots - 1);
+			for (int l = 1; idx == 0 && l < levels; l++) {
+				cascade(l);
+				idx = (cur_ >> (slot_bits * l)) & (slots - 1);
+			}
+			run_slot(&wheel_[0][cur_ & (slots - 1)]);
+			cur_++;
+		}
+		if (npending_ == 0 && cur_ <= now)
+			cur_ = now + 1;
+
+		wake_ = next_tick();
+		if (wake_ == UINT64_MAX) {
+			VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+		} else {
+			uint64_t at = start_ + wake_;
+			struct timespec ts;
+			ts.tv_sec = at / 1000;
+			ts.tv_nsec = (at % 1000) * 1000000;
+			pthread_cond_timedwait(&c_, &m_, &ts);
+		}
+	}
+}
+
+int
+timer_wheel::cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m, int ms,
+		bool blocking)
+{
+	struct waker : public timer {
+		pthread_cond_t *c;
+		pthread_mutex_t *m;
+		void expire() {
+			ScopedLock ml(m);
+			VERIFY(pthread_cond_broadcast(c) == 0);
+		}
+	} w;
+	w.c = c;
+	w.m = m;
+	schedule(&w, ms, blocking);
+	VERIFY(pthread_cond_wait(c, m) == 0);
+	if (cancel(&w))
+		return 0;
+	// it fired, and needs m to finish
+	VERIFY(pthread_mutex_unlock(m) == 0);
+	cancel_sync(&w);
+	VERIFY(pthread_mutex_lock(m) == 0);
+	return ETIMEDOUT;
+}
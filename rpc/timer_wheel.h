@@ -0,0 +1,101 @@
+#ifndef timer_wheel_h
+#define timer_wheel_h
+
+// one thread that runs timers for the whole process, on
+// CLOCK_MONOTONIC with a 1 ms tick.
+//
+// pending timers live in a hierarchical wheel: four levels of 64
+// slots, each slot of a level spanning a whole turn of the level
+// below. adding or cancelling a timer is O(1); a timer is moved down
+// a level at most three times before it expires. timers further out
+// than the wheel reaches (about 4.6 hours) wait in the last slot and
+// are put back when they get there.
+//
+// expire() runs on the wheel's thread and must not block; a timer
+// scheduled with blocking=true runs on a small thread pool instead,
+// and may make RPCs or wait for locks. when all the pool's threads
+// are busy, it gets a thread of its own, so a timer stuck on a slow
+// peer holds up nobody else and the wheel's thread never waits.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include "thr_pool.h"
+
+class timer_wheel {
+	public:
+		class timer {
+			public:
+				timer() : next_(NULL), prev_(NULL), slot_(NULL), when_(0),
+					blocking_(false) {}
+				virtual ~timer() {}
+				virtual void expire() = 0;
+			private:
+				friend class timer_wheel;
+				timer *next_;
+				timer *prev_;
+				timer **slot_;    // while pending
+				uint64_t when_;   // tick it expires at
+				bool blocking_;
+		};
+
+		static timer_wheel *instance();
+
+		// run t->expire() ms milliseconds from now. a pending t is
+		// moved; t may be scheduled again from its own expire().
+		void schedule(timer *t, int ms, bool blocking = false);
+
+		// returns true if t was pending and now won't run. false
+		// means it has run, or is running now.
+		bool cancel(timer *t);
+
+		// cancel(), and then wait until t->expire() has returned,
+		// unless it is this thread that is running it. after this,
+		// the caller may free t.
+		bool cancel_sync(timer *t);
+
+		// pthread_cond_wait() on c that gives up after ms, like
+		// pthread_cond_timedwait(); m must be held. the wakeup takes
+		// m, so it runs on the pool unless m is only ever held
+		// briefly.
+		int cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m, int ms,
+				bool blocking = true);
+
+		// milliseconds on CLOCK_MONOTONIC
+		static uint64_t now_ms();
+
+		enum { levels = 4, slot_bits = 6, slots = 1 << slot_bits };
+
+	private:
+		timer_wheel();
+		~timer_wheel();
+
+		pthread_mutex_t m_;
+		pthread_cond_t c_;        // timers added sooner than we sleep
+		pthread_cond_t idle_c_;   // a running timer has returned
+		pthread_t th_;
+		ThrPool pool_;
+		int busy_;                // blocking timers given to pool_
+
+		timer *wheel_[levels][slots];
+		uint64_t start_;          // now_ms() at tick 0
+		uint64_t cur_;            // next tick to run
+		uint64_t wake_;           // tick the thread sleeps until
+		int npending_;
+		std::map<timer *, int> running_;
+
+		static timer_wheel *instance_;
+		static void init();
+
+		void insert(timer *t);
+		void unlink(timer *t);
+		void cascade(int level);
+		void run_slot(timer **slot);
+		void done(timer *t);
+		uint64_t next_tick();
+		void loop();
+
+		friend struct timer_job;
+};
+
+#endif
@@ -0,0 +1,294 @@
+#include "trace.h"
+#include <map>
+#include <set>
+#include <algorithm>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "sigthread.h"
+#include "slock.h"
+#include "lang/verify.h"
+
+static int
+initial_level()
+{
+	const char *e = getenv("RPC_TRACE");
+	return e ? atoi(e) : 3;
+}
+
+int rpc_trace_level = initial_level();
+__thread rpc_trace_ring *rpc_trace_mine;
+
+// every ring ever made. a thread's ring goes on the free list when it
+// exits, keeping its records until a new thread takes it over.
+static pthread_mutex_t rings_m = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<rpc_trace_ring *> rings;
+static std::vector<rpc_trace_ring *> free_rings;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static void
+ring_exit(void *p)
+{
+	ScopedLock ml(&rings_m);
+	free_rings.push_back((rpc_trace_ring *)p);
+}
+
+rpc_trace_ring *
+rpc_trace_new_ring()
+{
+	VERIFY(pthread_once(&ring_once, [](){
+		VERIFY(pthread_key_create(&ring_key, ring_exit) == 0);
+	}) == 0);
+	rpc_trace_ring *t;
+	{
+		ScopedLock ml(&rings_m);
+		if (!free_rings.empty()) {
+			t = free_rings.back();
+			free_rings.pop_back();
+		} else {
+			t = new rpc_trace_ring;
+			t->head = 0;
+			rings.push_back(t);
+		}
+	}
+	t->tid = syscall(SYS_gettid);
+	VERIFY(pthread_setspecific(ring_key, t) == 0);
+	rpc_trace_mine = t;
+	return t;
+}
+
+void
+rpc_trace_set_level(int level)
+{
+	rpc_trace_level = level;
+}
+
+static const char magic[8] = { 'r', 'p', 'c', 't', 'r', 'a', 'c', 'e' };
+enum { version = 1 };
+
+static uint64_t
+clock_ns(clockid_t c)
+{
+	struct timespec ts;
+	clock_gettime(c, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+put_str(FILE *f, const char *s)
+{
+	uint32_t n = strlen(s);
+	fwrite(&n, sizeof(n), 1, f);
+	fwrite(s, 1, n, f);
+}
+
+// the records a ring holds. the owner goes on writing meanwhile, so
+// this copies first and then drops any it may have been overwriting.
+static void
+ring_recs(rpc_trace_ring *t, std::vector<rpc_trace_rec> *out)
+{
+	uint64_t h1 = t->head.load(std::memory_order_acquire);
+	uint64_t from = h1 > rpc_trace_ring::size ? h1 - rpc_trace_ring::size : 0;
+	std::vector<rpc_trace_rec> got;
+	for (uint64_t i = from; i < h1; i++)
+		got.push_back(t->r[i % rpc_trace_ring::size]);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	uint64_t h2 = t->head.load(std::memory_order_relaxed);
+	// the owner may be in the middle of record h2, in slot h2 - size
+	uint64_t safe = h2 + 1 > rpc_trace_ring::size ? h2 + 1 - rpc_trace_ring::size : 0;
+	for (uint64_t i = from; i < h1; i++)
+		if (i >= safe)
+			out->push_back(got[i - from]);
+}
+
+int
+rpc_trace_dump(const char *path)
+{
+	std::vector<rpc_trace_rec> recs;
+	{
+		ScopedLock ml(&rings_m);
+		for (unsigned i = 0; i < rings.size(); i++)
+			ring_recs(rings[i], &recs);
+	}
+	std::set<const rpc_trace_site *> sites;
+	for (unsigned i = 0; i < recs.size(); i++)
+		sites.insert(recs[i].site);
+
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return -1;
+	uint32_t v = version, pid = getpid();
+	uint64_t mono = clock_ns(CLOCK_MONOTONIC);
+	int64_t off = (int64_t)(clock_ns(CLOCK_REALTIME) - mono);
+	fwrite(magic, sizeof(magic), 1, f);
+	fwrite(&v, sizeof(v), 1, f);
+	fwrite(&pid, sizeof(pid), 1, f);
+	fwrite(&off, sizeof(off), 1, f);
+	uint32_t n = sites.size();
+	fwrite(&n, sizeof(n), 1, f);
+	std::set<const rpc_trace_site *>::iterator s;
+	for (s = sites.begin(); s != sites.end(); s++) {
+		uint64_t id = (uintptr_t)*s;
+		int32_t level = (*s)->level, line = (*s)->line;
+		fwrite(&id, sizeof(id), 1, f);
+		fwrite(&level, sizeof(level), 1, f);
+		fwrite(&line, sizeof(line), 1, f);
+		put_str(f, (*s)->file);
+		put_str(f, (*s)->fmt);
+	}
+	n = recs.size();
+	fwrite(&n, sizeof(n), 1, f);
+	if (n)
+		fwrite(&recs[0], sizeof(rpc_trace_rec), n, f);
+	bool bad = ferror(f);
+	return fclose(f) == 0 && !bad ? 0 : -1;
+}
+
+static bool
+get_str(FILE *f, std::string *s)
+{
+	uint32_t n;
+	if (fread(&n, sizeof(n), 1, f) != 1 || n > (1 << 20))
+		return false;
+	s->resize(n);
+	return n == 0 || fread(&(*s)[0], 1, n, f) == n;
+}
+
+static bool
+by_time(const rpc_trace_rec &a, const rpc_trace_rec &b)
+{
+	return a.ns < b.ns;
+}
+
+int
+rpc_trace_read(FILE *f, rpc_trace_file *t)
+{
+	char m[sizeof(magic)];
+	uint32_t v, pid, n;
+	if (fread(m, sizeof(m), 1, f) != 1 || memcmp(m, magic, sizeof(m)) != 0 ||
+			fread(&v, sizeof(v), 1, f) != 1 || v != version ||
+			fread(&pid, sizeof(pid), 1, f) != 1 ||
+			fread(&t->real_minus_mono_ns, sizeof(int64_t), 1, f) != 1 ||
+			fread(&n, sizeof(n), 1, f) != 1)
+		return -1;
+	t->pid = pid;
+	t->sites.resize(n);
+	for (uint32_t i = 0; i < n; i++) {
+		rpc_trace_file::site &s = t->sites[i];
+		int32_t level, line;
+		if (fread(&s.id, sizeof(s.id), 1, f) != 1 ||
+				fread(&level, sizeof(level), 1, f) != 1 ||
+				fread(&line, sizeof(line), 1, f) != 1 ||
+				!get_str(f, &s.file) || !get_str(f, &s.fmt))
+			return -1;
+		s.level = level;
+		s.line = line;
+	}
+	if (fread(&n, sizeof(n), 1, f) != 1)
+		return -1;
+	t->recs.resize(n);
+	if (n && fread(&t->recs[0], sizeof(rpc_trace_rec), n, f) != n)
+		return -1;
+	std::stable_sort(t->recs.begin(), t->recs.end(), by_time);
+	return 0;
+}
+
+std::string
+rpc_trace_format(const char *fmt, const char *args, size_t n)
+{
+	std::string out;
+	const char *end = args + n;
+	char spec[32], buf[128];
+	for (const char *p = fmt; *p; p++) {
+		if (*p != '%') {
+			out += *p;
+			continue;
+		}
+		if (p[1] == '%') {
+			out += '%';
+			p++;
+			continue;
+		}
+		// flags, width and precision stay; the length goes, since
+		// every integer was kept as 8 bytes
+		size_t k = 0;
+		spec[k++] = '%';
+		p++;
+		while (*p && strchr("-+ #0123456789.", *p) && k < sizeof(spec) - 4)
+			spec[k++] = *p++;
+		// without one, the argument was an int
+		bool wide = false;
+		while (*p && strchr("hlLqjzt", *p))
+			wide |= *p++ != 'h';
+		char c = *p;
+		if (!c)
+			break;
+		if (c == 's') {
+			if (args >= end) {
+				out += "?";
+				continue;
+			}
+			size_t len = strnlen(args, end - args);
+			std::string s(args, len);
+			args += len + 1;
+			spec[k++] = 's';
+			spec[k] = '\0';
+			snprintf(buf, sizeof(buf), spec, s.c_str());
+			out += k == 2 ? s : std::string(buf);
+			continue;
+		}
+		uint64_t w;
+		if (end - args < 8) {
+			args = end;
+			out += "?";
+			continue;
+		}
+		memcpy(&w, args, 8);
+		args += 8;
+		if (strchr("di", c)) {
+			spec[k++] = 'l'; spec[k++] = 'l'; spec[k++] = c; spec[k] = '\0';
+			snprintf(buf, sizeof(buf), spec, wide ? (long long)w : (int)w);
+		} else if (strchr("uxXo", c)) {
+			spec[k++] = 'l'; spec[k++] = 'l'; spec[k++] = c; spec[k] = '\0';
+			snprintf(buf, sizeof(buf), spec,
+					wide ? (unsigned long long)w : (unsigned int)w);
+		} else if (strchr("feEgGaA", c)) {
+			double d;
+			memcpy(&d, &w, 8);
+			spec[k++] = c; spec[k] = '\0';
+			snprintf(buf, sizeof(buf), spec, d);
+		} else if (c == 'c') {
+			spec[k++] = c; spec[k] = '\0';
+			snprintf(buf, sizeof(buf), spec, (int)w);
+		} else if (c == 'p') {
+			snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)w);
+		} else {
+			snprintf(buf, sizeof(buf), "%%%c", c);
+		}
+		out += buf;
+	}
+	return out;
+}
+
+static void
+trace_dump_asked()
+{
+	char path[64];
+	const char *e = getenv("RPC_TRACE_FILE");
+	if (!e) {
+		snprintf(path, sizeof(path), "/tmp/rpc-trace.%d", (int)getpid());
+		e = path;
+	}
+	if (rpc_trace_dump(e) == 0)
+		fprintf(stderr, "rpc_trace: wrote %s\n", e);
+	else
+		perror(e);
+}
+
+void
+rpc_trace_on_signal(int sig)
+{
+	rpc_on_signal(sig, trace_dump_asked);
+}
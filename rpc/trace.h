@@ -0,0 +1,170 @@
+#ifndef rpc_trace_h
+#define rpc_trace_h
+
+// a flight recorder for the hot paths. rpc_trace(level, fmt, args...)
+// takes printf's arguments but formats nothing: it puts a timestamp,
+// a pointer to its call site's static description (level, file, line
+// and the format itself) and the raw arguments in a 64-byte record in
+// the calling thread's own ring. a record is a few stores and a
+// clock_gettime(), and takes no lock; a thread's ring keeps its last
+// rpc_trace_ring::size records.
+//
+// rpc_trace_dump() writes every ring, with the call sites they use,
+// to a file that rpc/tracedump decodes and merges by time, across
+// processes too. sites above rpc_trace_level, set from $RPC_TRACE
+// (3 by default) or rpc_trace_set_level(), cost one compare.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+struct rpc_trace_site {
+	int level;
+	const char *file;
+	int line;
+	const char *fmt;
+};
+
+struct rpc_trace_rec {
+	uint64_t ns;                 // CLOCK_MONOTONIC
+	const rpc_trace_site *site;
+	int32_t tid;
+	// the arguments in order: integers, pointers and doubles as 8
+	// bytes, strings up to their NUL; whatever doesn't fit is cut off
+	char args[44];
+};
+static_assert(sizeof(rpc_trace_rec) == 64, "a trace record is a cache line");
+
+struct rpc_trace_ring {
+	enum { size = 2048 };
+	std::atomic<uint64_t> head;  // records ever written
+	int32_t tid;
+	rpc_trace_rec r[size];
+};
+
+extern int rpc_trace_level;
+extern __thread rpc_trace_ring *rpc_trace_mine;
+rpc_trace_ring *rpc_trace_new_ring();
+
+struct rpc_trace_buf {
+	rpc_trace_buf(char *p, size_t n) : p_(p), end_(p + n) {}
+	void word(uint64_t w) {
+		if (end_ - p_ < 8) {
+			p_ = end_;
+			return;
+		}
+		memcpy(p_, &w, 8);
+		p_ += 8;
+	}
+	void str(const char *s) {
+		if (p_ == end_)
+			return;
+		if (!s)
+			s = "(null)";
+		size_t n = strnlen(s, end_ - p_ - 1);
+		memcpy(p_, s, n);
+		p_[n] = '\0';
+		p_ += n + 1;
+	}
+	private:
+		char *p_, *end_;
+};
+
+template<class T> inline typename std::enable_if<std::is_integral<T>::value ||
+	std::is_enum<T>::value>::type
+rpc_trace_arg(rpc_trace_buf *b, T v)
+{
+	b->word((uint64_t)v);
+}
+
+template<class T> inline typename std::enable_if<std::is_floating_point<T>::value>::type
+rpc_trace_arg(rpc_trace_buf *b, T v)
+{
+	double d = v;
+	uint64_t w;
+	memcpy(&w, &d, 8);
+	b->word(w);
+}
+
+inline void rpc_trace_arg(rpc_trace_buf *b, const char *s) { b->str(s); }
+inline void rpc_trace_arg(rpc_trace_buf *b, char *s) { b->str(s); }
+
+template<class T> inline void
+rpc_trace_arg(rpc_trace_buf *b, T *p)
+{
+	b->word((uintptr_t)p);
+}
+
+// the clock records are stamped with
+inline uint64_t
+rpc_trace_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+template<class... A> void
+rpc_trace_put(const rpc_trace_site *site, A... a)
+{
+	rpc_trace_ring *t = rpc_trace_mine ? rpc_trace_mine : rpc_trace_new_ring();
+	uint64_t h = t->head.load(std::memory_order_relaxed);
+	rpc_trace_rec &r = t->r[h % rpc_trace_ring::size];
+	r.ns = rpc_trace_ns();
+	r.site = site;
+	r.tid = t->tid;
+	rpc_trace_buf b(r.args, sizeof(r.args));
+	int unused[] = { 0, (rpc_trace_arg(&b, a), 0)... };
+	(void)unused;
+	t->head.store(h + 1, std::memory_order_release);
+}
+
+// never called; lets the compiler check the arguments against fmt
+inline void rpc_trace_check(const char *, ...) __attribute__((format(printf, 1, 2)));
+inline void rpc_trace_check(const char *, ...) {}
+
+#define rpc_trace(level, fmt, ...) do {                                    \
+	if ((level) <= rpc_trace_level) {                                      \
+		static const rpc_trace_site rpc_trace_site_ =                      \
+			{ (level), __FILE__, __LINE__, fmt };                          \
+		rpc_trace_put(&rpc_trace_site_, ##__VA_ARGS__);                    \
+	}                                                                      \
+	if (0)                                                                 \
+		rpc_trace_check(fmt, ##__VA_ARGS__);                               \
+} while (0)
+
+void rpc_trace_set_level(int level);
+
+// write every thread's ring to path; 0 on success
+int rpc_trace_dump(const char *path);
+
+// have sig write the rings to $RPC_TRACE_FILE, or to
+// /tmp/rpc-trace.<pid>
+void rpc_trace_on_signal(int sig);
+
+// a dump as rpc_trace_read() finds it. sites are by the address they
+// had in the process that wrote it; recs are in time order.
+struct rpc_trace_file {
+	struct site {
+		uint64_t id;
+		int level, line;
+		std::string file, fmt;
+	};
+	int pid;
+	int64_t real_minus_mono_ns;  // add to a record's ns for wall time
+	std::vector<site> sites;
+	std::vector<rpc_trace_rec> recs;
+};
+
+// 0 on success
+int rpc_trace_read(FILE *f, rpc_trace_file *t);
+
+// fmt filled in with a record's arguments, as printf would have
+std::string rpc_trace_format(const char *fmt, const char *args, size_t n);
+
+#endif
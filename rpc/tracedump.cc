@@ -0,0 +1,97 @@
+// tracedump: prints the records in files that rpc_trace_dump() wrote,
+// one line each, oldest first. records from several files, say one
+// from each process of a run, are merged by wall-clock time.
+//
+// usage: tracedump [-l level] [-t tid] file...
+//   -l  only records at this level or below
+//   -t  only this thread's records
+
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include "trace.h"
+
+struct line {
+	uint64_t real_ns;
+	const rpc_trace_file *f;
+	const rpc_trace_rec *r;
+	bool operator<(const line &o) const { return real_ns < o.real_ns; }
+};
+
+int
+main(int argc, char *argv[])
+{
+	int level = 1 << 30;
+	int tid = 0;
+
+	int ch;
+	bool bad = false;
+	while (!bad && (ch = getopt(argc, argv, "l:t:")) != -1) {
+		switch (ch) {
+			case 'l':
+				level = atoi(optarg);
+				break;
+			case 't':
+				tid = atoi(optarg);
+				break;
+			default:
+				bad = true;
+				break;
+		}
+	}
+	if (bad || optind >= argc) {
+		fprintf(stderr, "usage: %s [-l level] [-t tid] file...\n", argv[0]);
+		exit(1);
+	}
+
+	std::vector<rpc_trace_file> files(argc - optind);
+	std::vector<std::map<uint64_t, const rpc_trace_file::site *> > sites(files.size());
+	std::vector<line> lines;
+	for (unsigned i = 0; i < files.size(); i++) {
+		const char *path = argv[optind + i];
+		FILE *f = fopen(path, "r");
+		if (!f) {
+			perror(path);
+			exit(1);
+		}
+		if (rpc_trace_read(f, &files[i]) != 0) {
+			fprintf(stderr, "tracedump: %s: not a trace\n", path);
+			exit(1);
+		}
+		fclose(f);
+		for (unsigned j = 0; j < files[i].sites.size(); j++)
+			sites[i][files[i].sites[j].id] = &files[i].sites[j];
+	}
+	for (unsigned i = 0; i < files.size(); i++) {
+		for (unsigned j = 0; j < files[i].recs.size(); j++) {
+			const rpc_trace_rec &r = files[i].recs[j];
+			const rpc_trace_file::site *s = sites[i][(uintptr_t)r.site];
+			if (!s || s->level > level || (tid && r.tid != tid))
+				continue;
+			line l = { r.ns + files[i].real_minus_mono_ns, &files[i], &r };
+			lines.push_back(l);
+		}
+	}
+	std::stable_sort(lines.begin(), lines.end());
+
+	for (unsigned i = 0; i < lines.size(); i++) {
+		const line &l = lines[i];
+		unsigned fi = l.f - &files[0];
+		const rpc_trace_file::site *s = sites[fi][(uintptr_t)l.r->site];
+		time_t secs = l.real_ns / 1000000000;
+		struct tm tm;
+		localtime_r(&secs, &tm);
+		std::string msg = rpc_trace_format(s->fmt.c_str(), l.r->args,
+				sizeof(l.r->args));
+		while (!msg.empty() && msg[msg.size() - 1] == '\n')
+			msg.resize(msg.size() - 1);
+		printf("%02d:%02d:%02d.%06llu %d/%d %d %s:%d %s\n", tm.tm_hour,
+				tm.tm_min, tm.tm_sec,
+				(unsigned long long)(l.real_ns % 1000000000) / 1000, l.f->pid,
+				l.r->tid, s->level, s->file.c_str(), s->line, msg.c_str());
+	}
+	return 0;
+}
@@ -154,6 +154,14 @@ recoverythread(void *x)
   return 0;
 }
 
+static void *
+invokerthread(void *x)
+{
+  rsm *r = (rsm *) x;
+  r->invoker();
+  return 0;
+}
+
 rsm::rsm(std::string _first, std::string _me) 
   : stf(0), primary(_first), insync (false), inviewchange (true), vid_commit(0),
     partitioned (false), dopartition(false), break1(false), break2(false)
@@ -184,6 +192,7 @@ rsm::rsm(std::string _first, std::string _me)
   rsmrpc->reg(rsm_protocol::transferreq, this, &rsm::transferreq);
   rsmrpc->reg(rsm_protocol::transferdonereq, this, &rsm::transferdonereq);
   rsmrpc->reg(rsm_protocol::joinreq, this, &rsm::joinreq);
+  rsmrpc->add_stats(this);
 
   // tester must be on different port, otherwise it may partition itself
   testsvr = new rpcs(atoi(_me.c_str()) + 1);
@@ -196,6 +205,7 @@ rsm::rsm(std::string _first, std::string _me)
   {
       ScopedLock ml(&rsm_mutex);
       VERIFY(pthread_create(&th, NULL, &recoverythread, (void *) this) == 0);
+      VERIFY(pthread_create(&th, NULL, &invokerthread, (void *) this) == 0);
   }
 }
 
@@ -224,10 +234,11 @@ rsm::recovery()
         commit_change_wo(cfg->vid());
       } else {
         tprintf("recovery: join fail, wait for next turn\n");
-        
-        VERIFY(pthread_mutex_unlock(&rsm_mutex) == 0);
-        sleep(5);  // XXX make another node in cfg primary?
-        VERIFY(pthread_mutex_lock(&rsm_mutex) == 0);
+
+        // or until a view change is committed
+        // XXX make another node in cfg primary?
+        timer_wheel::instance()->cond_timedwait(&recovery_cond, &rsm_mutex,
+                                                5000);
       }
     }
     vid_insync = vid_commit;
@@ -288,8 +299,6 @@ rsm::sync_with_backups()
       break;
     }
   }
-  struct timeval now;
-  struct timespec next_timeout;
   // master 开始等待 slave 的同步请求
   while (!backups.empty()) {
     /**
@@ -309,10 +318,7 @@ rsm::sync_with_backups()
     tprintf("master begin wait for sync, backups: %s\n", b.c_str());
 
     // 每 3s 醒来一次，检查数据同步期间是否有 view 更改
-    gettimeofday(&now, NULL);
-    next_timeout.tv_sec = now.tv_sec + 3;
-    next_timeout.tv_nsec = 0;
-    pthread_cond_timedwait(&sync_cond, &rsm_mutex, &next_timeout);
+    timer_wheel::instance()->cond_timedwait(&sync_cond, &rsm_mutex, 3000);
   }
 
   insync = false;
@@ -496,9 +502,36 @@ rsm::execute(int procno, std::string req, std::string &r)
 // machine: the primary receives the request, assigns it a sequence
 // number, and invokes it on all members of the replicated state
 // machine.
-// 处理 rsm_client 发来的调用请求，开启一个 rsm 内的调用过程
+// 处理 rsm_client 发来的调用请求，交给 invoker 线程按序处理
+void
+rsm::client_invoke(rpcs::reply_token *t, int procno, std::string req)
+{
+  invoke_job *j = new invoke_job;
+  j->t = t;
+  j->procno = procno;
+  j->req = req;
+  j->span = rpc_span_cur;
+  invoke_q.enq(j);
+}
+
+// The invoker thread runs this function
+void
+rsm::invoker()
+{
+  while (1) {
+    invoke_job *j;
+    invoke_q.deq(&j);
+    rpc_span_scope in(j->span);
+    std::string r;
+    rsm_client_protocol::status ret = invoke1(j->procno, j->req, r);
+    j->t->reply(ret, r);
+    delete j;
+  }
+}
+
+// 开启一个 rsm 内的调用过程
 rsm_client_protocol::status
-rsm::client_invoke(int procno, std::string req, std::string &r)
+rsm::invoke1(int procno, std::string req, std::string &r)
 {
   int ret = rsm_client_protocol::OK;
   // 整个请求的处理期间都需要持有锁，保持请求的按序执行
@@ -755,6 +788,19 @@ rsm::amiprimary()
 }
 
 
+void
+rsm::stats(std::map<std::string, std::string> *kv)
+{
+  ScopedLock ml(&rsm_mutex);
+  (*kv)["rsm.view"] = std::to_string(vid_commit);
+  (*kv)["rsm.primary"] = primary;
+  (*kv)["rsm.role"] = inviewchange ? "viewchange" :
+    primary == cfg->myaddr() ? "primary" : insync ? "syncing" : "backup";
+  (*kv)["rsm.last"] = std::to_string(last_myvs.vid) + "." +
+    std::to_string(last_myvs.seqno);
+  (*kv)["rsm.backups_unsynced"] = std::to_string(backups.size());
+}
+
 // Testing server
 
 // Simulate partitions
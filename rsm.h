@@ -8,11 +8,12 @@
 #include "rsm_protocol.h"
 #include "rsm_state_transfer.h"
 #include "rpc.h"
+#include "fifo.h"
 #include <arpa/inet.h>
 #include "config.h"
 #include <unistd.h>
 
-class rsm : public config_view_change {
+class rsm : public config_view_change, public rpc_stats_provider {
  private:
   void reg1(int proc, handler *);
  protected:
@@ -56,8 +57,20 @@ class rsm : public config_view_change {
   pthread_cond_t recovery_cond; // 等待下一次进行状态恢复
   pthread_cond_t sync_cond; // master 等待 slave 同步成功
 
+  // client_invoke only queues the request; the invoker thread runs
+  // them one at a time and replies, so slow backups don't tie up
+  // the rpcs dispatch threads.
+  struct invoke_job {
+    rpcs::reply_token *t;
+    int procno;
+    std::string req;
+    rpc_span_ctx span; // the request's trace
+  };
+  fifo<invoke_job *> invoke_q;
+
   void execute(int procno, std::string req, std::string &r);
-  rsm_client_protocol::status client_invoke(int procno, std::string req, 
+  void client_invoke(rpcs::reply_token *t, int procno, std::string req);
+  rsm_client_protocol::status invoke1(int procno, std::string req,
               std::string &r);
   bool statetransfer(std::string m);
   bool statetransferdone(std::string m);
@@ -78,164 +91,31 @@ class rsm : public config_view_change {
   bool amiprimary();
   void set_state_transfer(rsm_state_transfer *_stf) { stf = _stf; };
   void recovery();
+  void invoker();
   void commit_change(unsigned vid);
 
-  template<class S, class A1, class R>
-    void reg(int proc, S*, int (S::*meth)(const A1 a1, R &));
-  template<class S, class A1, class A2, class R>
-    void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, R &));
-  template<class S, class A1, class A2, class A3, class R>
-    void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, 
-            const A3 a3, R &));
-  template<class S, class A1, class A2, class A3, class A4, class R>
-    void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, 
-            const A3 a3, const A4 a4, R &));
-  template<class S, class A1, class A2, class A3, class A4, class A5, class R>
-    void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, 
-            const A3 a3, const A4 a4, 
-            const A5 a5, R &));
+  template<class S, class... P>
+    void reg(int proc, S*, int (S::*meth)(P...));
+  // the replicated service's own numbers go in the same replies
+  void add_stats(rpc_stats_provider *p) { rsmrpc->add_stats(p); }
+  // rsm.view, rsm.primary and so on, for rpc_const::stats
+  void stats(std::map<std::string, std::string> *kv);
 };
 
-template<class S, class A1, class R> void
-  rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
-{
-  class h1 : public handler {
-  private:
-    S * sob;
-    int (S::*meth)(const A1 a1, R & r);
-  public:
-  h1(S *xsob, int (S::*xmeth)(const A1 a1, R & r))
-      : sob(xsob), meth(xmeth) { }
-    int fn(unmarshall &args, marshall &ret) {
-      A1 a1;
-      R r;
-      args >> a1;
-      VERIFY(args.okdone());
-      int b = (sob->*meth)(a1,r);
-      ret << r;
-      return b;
-    }
-  };
-  reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class R> void
-  rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, R & r))
-{
- class h1 : public handler {
-  private:
-    S * sob;
-    int (S::*meth)(const A1 a1, const A2 a2, R & r);
-  public:
-  h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R & r))
-    : sob(xsob), meth(xmeth) { }
-    int fn(unmarshall &args, marshall &ret) {
-      A1 a1;
-      A2 a2;
-      R r;
-      args >> a1;
-      args >> a2;
-      VERIFY(args.okdone());
-      int b = (sob->*meth)(a1,a2,r);
-      ret << r;
-      return b;
-    }
-  };
-  reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class R> void
-  rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-             const A3 a3, R & r))
-{
- class h1 : public handler {
-  private:
-    S * sob;
-    int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r);
-  public:
-  h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R & r))
-    : sob(xsob), meth(xmeth) { }
-    int fn(unmarshall &args, marshall &ret) {
-      A1 a1;
-      A2 a2;
-      A3 a3;
-      R r;
-      args >> a1;
-      args >> a2;
-      args >> a3;
-      VERIFY(args.okdone());
-      int b = (sob->*meth)(a1,a2,a3,r);
-      ret << r;
-      return b;
-    }
-  };
-  reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class A4, class R> void
-  rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-             const A3 a3, const A4 a4, R & r))
-{
- class h1 : public handler {
-  private:
-    S * sob;
-    int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R & r);
-  public:
-  h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-            const A4 a4, R & r))
-    : sob(xsob), meth(xmeth) { }
-    int fn(unmarshall &args, marshall &ret) {
-      A1 a1;
-      A2 a2;
-      A3 a3;
-      A4 a4;
-      R r;
-      args >> a1;
-      args >> a2;
-      args >> a3;
-      args >> a4;
-      VERIFY(args.okdone());
-      int b = (sob->*meth)(a1,a2,a3,a4,r);
-      ret << r;
-      return b;
-    }
-  };
-  reg1(proc, new h1(sob, meth));
-}
-
+// requests have already been checked by the primary, so arguments
+// that don't unmarshall are a bug
+template<class S, class... P>
+class rsm_method_h : public method_h<S, P...> {
+ protected:
+  int bad_args() { VERIFY(0); return rpc_const::unmarshal_args_failure; }
+ public:
+  rsm_method_h(S *sob, int (S::*meth)(P...)) : method_h<S, P...>(sob, meth) { }
+};
 
-template<class S, class A1, class A2, class A3, class A4, class A5, class R> void
-  rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-             const A3 a3, const A4 a4, 
-             const A5 a5, R & r))
+template<class S, class... P> void
+  rsm::reg(int proc, S*sob, int (S::*meth)(P...))
 {
- class h1 : public handler {
-  private:
-    S * sob;
-    int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-       const A5 a5, R & r);
-  public:
-  h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-            const A4 a4, const A5 a5, R & r))
-    : sob(xsob), meth(xmeth) { }
-    int fn(unmarshall &args, marshall &ret) {
-      A1 a1;
-      A2 a2;
-      A3 a3;
-      A4 a4;
-      A5 a5;
-      R r;
-      args >> a1;
-      args >> a2;
-      args >> a3;
-      args >> a4;
-      VERIFY(args.okdone());
-      int b = (sob->*meth)(a1,a2,a3,a4,a5,r);
-      ret << r;
-      return b;
-    }
-  };
-  reg1(proc, new h1(sob, meth));
+  reg1(proc, new rsm_method_h<S, P...>(sob, meth));
 }
 
 #endif /* rsm_h */
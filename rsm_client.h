@@ -28,25 +28,13 @@ class rsm_client {
   rsm_client(std::string dst, lock_client* user);
   rsm_protocol::status invoke(int proc, std::string req, std::string &rep);
 
-  template<class R, class A1>
-    int call(unsigned int proc, const A1 & a1, R &r);
-
-  template<class R, class A1, class A2>
-    int call(unsigned int proc, const A1 & a1, const A2 & a2, R &r);
-
-  template<class R, class A1, class A2, class A3>
-    int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-	     R &r);
-
-  template<class R, class A1, class A2, class A3, class A4>
-    int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-	     const A4 & a4, R &r);
-
-  template<class R, class A1, class A2, class A3, class A4, class A5>
-    int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-	     const A4 & a4, const A5 & a5, R &r);
+  // call(proc, a1, ..., an, r), as rpcc::call() without a timeout
+  template<class... Args>
+    int call(unsigned int proc, Args &&... args);
  private:
   template<class R> int call_m(unsigned int proc, marshall &req, R &r);
+  template<class A, unsigned... I>
+    int call_t(unsigned int proc, A &a, seq<I...>);
 };
 
 template<class R> int
@@ -84,64 +72,20 @@ rsm_client::call_m(unsigned int proc, marshall &req, R &r)
   return intret;
 }
 
-template<class R, class A1> int
-  rsm_client::call(unsigned int proc, const A1 & a1, R & r)
-{
-  marshall m;
-  m << a1;
-  return call_m(proc, m, r);
-}
-
-template<class R, class A1, class A2> int
-  rsm_client::call(unsigned int proc, const A1 & a1, const A2 & a2, R & r)
+template<class... Args> int
+  rsm_client::call(unsigned int proc, Args &&... args)
 {
-  marshall m;
-  m << a1;
-  m << a2;
-  return call_m(proc, m, r);
+  static_assert(sizeof...(Args) > 0, "rsm_client::call needs a reply");
+  std::tuple<Args &&...> a(std::forward<Args>(args)...);
+  return call_t(proc, a, typename gen_seq<sizeof...(Args) - 1>::type());
 }
 
-template<class R, class A1, class A2, class A3> int
-  rsm_client::call(unsigned int proc, const A1 & a1, 
-		const A2 & a2, const A3 & a3, R & r)
+template<class A, unsigned... I> int
+  rsm_client::call_t(unsigned int proc, A &a, seq<I...>)
 {
-  marshall m;
-  std::string rep;
-  std::string res;
-  m << a1;
-  m << a2;
-  m << a3;
-  return call_m(proc, m, r);
-}
-
-template<class R, class A1, class A2, class A3, class A4> int
-  rsm_client::call(unsigned int proc, const A1 & a1, 
-		   const A2 & a2, const A3 & a3, const A4 & a4, R & r)
-{
-  marshall m;
-  std::string rep;
-  std::string res;
-  m << a1;
-  m << a2;
-  m << a3;
-  m << a4;
-  return call_m(proc, m, r);
-}
-
-template<class R, class A1, class A2, class A3, class A4, class A5> int
-  rsm_client::call(unsigned int proc, const A1 & a1, 
-		   const A2 & a2, const A3 & a3, const A4 & a4, const A5 & a5,
-		   R & r)
-{
-  marshall m;
-  std::string rep;
-  std::string res;
-  m << a1;
-  m << a2;
-  m << a3;
-  m << a4;
-  m << a5;
-  return call_m(proc, m, r);
+  marshall m(wire_hints(std::get<I>(a)...));
+  marshall_args(m, std::get<I>(a)...);
+  return call_m(proc, m, std::get<sizeof...(I)>(a));
 }
 
 #endif 
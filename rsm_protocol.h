@@ -57,48 +57,9 @@ inline bool operator!=(viewstamp a, viewstamp b) {
   return a.vid != b.vid || a.seqno != b.seqno;
 }
 
-inline marshall& operator<<(marshall &m, viewstamp v)
-{
-  m << v.vid;
-  m << v.seqno;
-  return m;
-}
-
-inline unmarshall& operator>>(unmarshall &u, viewstamp &v) {
-  u >> v.vid;
-  u >> v.seqno;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, rsm_protocol::transferres r)
-{
-  m << r.state;
-  m << r.last;
-  return m;
-}
-
-inline unmarshall &
-operator>>(unmarshall &u, rsm_protocol::transferres &r)
-{
-  u >> r.state;
-  u >> r.last;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, rsm_protocol::joinres r)
-{
-  m << r.log;
-  return m;
-}
-
-inline unmarshall &
-operator>>(unmarshall &u, rsm_protocol::joinres &r)
-{
-  u >> r.log;
-  return u;
-}
+RPC_FIELDS(viewstamp, vid, seqno)
+RPC_FIELDS(rsm_protocol::transferres, state, last)
+RPC_FIELDS(rsm_protocol::joinres, log)
 
 class rsm_test_protocol {
  public:
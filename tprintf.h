@@ -1,6 +1,9 @@
 #ifndef TPRINTF_H
 #define TPRINTF_H
 
+#include <stdio.h>
+#include <sys/time.h>
+
 #define tprintf(args...) do { \
         struct timeval tv;     \
         gettimeofday(&tv, 0); \
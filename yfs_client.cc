@@ -2,6 +2,7 @@
 #include "yfs_client.h"
 #include "extent_client.h"
 #include "lock_client.h"
+#include "span.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
@@ -79,10 +80,11 @@ int
 yfs_client::getfile(inum inum, fileinfo &fin)
 {
   int r = OK;
+  rpc_span sp("yfs.getfile");
   // You modify this function for Lab 3
   // - hold and release the file lock
 
-  printf("getfile %016llx\n", inum);
+  rpc_trace(3, "getfile %016llx\n", inum);
   extent_protocol::attr a;
   // for lab5
   yfs_lock ylc(lc, inum);
@@ -95,7 +97,7 @@ yfs_client::getfile(inum inum, fileinfo &fin)
   fin.mtime = a.mtime;
   fin.ctime = a.ctime;
   fin.size = a.size;
-  printf("getfile %016llx -> sz %llu\n", inum, fin.size);
+  rpc_trace(3, "getfile %016llx -> sz %llu\n", inum, fin.size);
 
  release:
 
@@ -106,10 +108,11 @@ int
 yfs_client::getdir(inum inum, dirinfo &din)
 {
   int r = OK;
+  rpc_span sp("yfs.getdir");
   // You modify this function for Lab 3
   // - hold and release the directory lock
 
-  printf("getdir %016llx\n", inum);
+  rpc_trace(3, "getdir %016llx\n", inum);
   extent_protocol::attr a;
   // for lab5
   yfs_lock ylc(lc, inum);
@@ -147,6 +150,7 @@ int yfs_client::random_inum(bool isfile) {
  */
 int yfs_client::create(inum parent, const char* name, inum &inum) {
   int r = OK;
+  rpc_span sp("yfs.create");
   string dir_data;
   string file_name;
   yfs_lock ylc(lc, parent);
@@ -189,6 +193,7 @@ release:
  */
 int yfs_client::lookup(inum parent, const char *name, inum &inum, bool *found) {
   int r = OK;
+  rpc_span sp("yfs.lookup");
   size_t pos, end;
   string dir_data;   // 父目录的数据
   string file_name;  // 当前文件的文件名
@@ -231,6 +236,7 @@ release:
  */
 int yfs_client::readdir(inum inum, std::list<dirent> &dirents) {
   int r = OK;
+  rpc_span sp("yfs.readdir");
   string dir_data;
   size_t pos = 0, end;
   // for lab5
@@ -271,6 +277,7 @@ release:
  */
 int yfs_client::setattr(inum inum, struct stat *attr) {
   int r = OK;
+  rpc_span sp("yfs.setattr");
   size_t sz = attr->st_size;
   string file_data;
   yfs_lock ylc(lc, inum);
@@ -296,6 +303,7 @@ release:
  */
 int yfs_client::read(inum inum, off_t off, size_t sz, std::string &buf) {
   int r = OK;
+  rpc_span sp("yfs.read");
   string file_data;
   // for lab5
   yfs_lock ylc(lc, inum);
@@ -331,6 +339,7 @@ release:
  */
 int yfs_client::write(inum inum, off_t off, size_t sz, const char *buf) {
   int r = OK;
+  rpc_span sp("yfs.write");
   string file_data;
   yfs_lock ylc(lc, inum);
   if (ec->get(inum, file_data) != extent_protocol::OK) {
@@ -363,6 +372,7 @@ release:
  */
 int yfs_client::mkdir(inum parent, const char* name, mode_t mode, inum &inum) {
   int r = OK;
+  rpc_span sp("yfs.mkdir");
   string dir_data;
   string dir_name;
   yfs_lock ylc(lc, parent);
@@ -404,6 +414,7 @@ release:
  */
 int yfs_client::unlink(inum parent, const char *name) {
   int r = OK;
+  rpc_span sp("yfs.unlink");
   string dir_data;
   size_t pos, inum_start, end;
   inum inum;
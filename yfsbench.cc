@@ -0,0 +1,436 @@
+//
+// yfs workload benchmark: drives yfs_client directly, no fuse mount,
+// with each client on its own thread and its own yfs_client (so its
+// own extent cache and lock cache, as separate mounts would have).
+// the extent server and lock server run in this process unless -e
+// and -l name running ones.
+//
+// workloads, each run in phases, one csv line (or json object) per
+// phase:
+//   meta    mdtest-style: each client creates -n files in its own
+//           directory, then looks up and stats them, then unlinks them
+//   shared  the same, every client in one shared directory
+//   seq     each client writes a -s byte file in -b byte blocks, then
+//           reads it back
+//   rand    -o reads and writes, half each, of -i bytes at random
+//           offsets in a -s byte file of each client's
+//
+// usage: yfsbench [-w workloads] [-c clients] [-n files] [-s bytes]
+//                 [-b bytes] [-i bytes] [-o ops] [-e extent_dst]
+//                 [-l lock_dst] [-j]
+// -w and -c take comma-separated lists. defaults: -w meta,shared,seq,rand
+// -c 1,4 -n 200 -s 1048576 -b 65536 -i 4096 -o 500
+//
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "rpc.h"
+#include "yfs_client.h"
+#include "extent_server.h"
+#include "lock_server_cache.h"
+#include "lang/verify.h"
+
+struct options {
+  int files;
+  int size;
+  int block;
+  int io;
+  int ops;
+  bool json;
+};
+
+static options opt;
+static std::string extent_dst, lock_dst;
+static bool header;
+// yfs_client's lock and extent clients hold rpcs threads that don't
+// shut down, so clients are made once and kept for later runs; the
+// first does set up
+static std::vector<yfs_client *> pool;
+
+static uint64_t
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static std::vector<std::string>
+split(const char *s)
+{
+  std::vector<std::string> v;
+  std::string cur;
+  for (; ; s++) {
+    if (*s == ',' || *s == '\0') {
+      if (!cur.empty())
+        v.push_back(cur);
+      cur.clear();
+      if (!*s)
+        break;
+    } else {
+      cur += *s;
+    }
+  }
+  return v;
+}
+
+// one phase of a workload, as its clients go through it together
+struct phase {
+  const char *name;
+  rpc_hist lat_ns;
+  std::atomic<uint64_t> errors;
+  std::atomic<uint64_t> bytes;
+  // the first client's start and the last one's end
+  std::atomic<uint64_t> start, end;
+  phase(const char *n) : name(n), errors(0), bytes(0), start(~0ULL), end(0) {}
+};
+
+struct client {
+  int me;
+  yfs_client *yfs;
+  yfs_client::inum dir;   // this client's, or the shared one
+  yfs_client::inum file;  // seq and rand
+  unsigned int seed;
+};
+
+struct bench {
+  std::string workload;
+  int nclients;
+  pthread_barrier_t b;
+  std::vector<phase *> phases;
+  std::vector<client> clients;
+};
+
+// the clients wait for each other at a phase's start and end, and
+// stamp it themselves, since the main thread may be late waking up
+static void
+begin(bench *bn, phase *p)
+{
+  pthread_barrier_wait(&bn->b);
+  uint64_t t = now_ns(), s = p->start;
+  while (t < s && !p->start.compare_exchange_weak(s, t))
+    ;
+}
+
+static void
+finish(bench *bn, phase *p)
+{
+  uint64_t t = now_ns(), e = p->end;
+  while (t > e && !p->end.compare_exchange_weak(e, t))
+    ;
+  pthread_barrier_wait(&bn->b);
+}
+
+// run op, a yfs_client call, and time it into p; false if it failed
+template<class F> static bool
+timed(phase *p, F op)
+{
+  uint64_t t0 = now_ns();
+  if (op() != yfs_client::OK) {
+    p->errors++;
+    return false;
+  }
+  p->lat_ns.add(now_ns() - t0);
+  return true;
+}
+
+static void
+meta(bench *bn, client *c)
+{
+  phase *creates = bn->phases[0], *stats = bn->phases[1];
+  phase *unlinks = bn->phases[2];
+  std::vector<yfs_client::inum> inums(opt.files);
+  char name[64];
+
+  begin(bn, creates);
+  for (int i = 0; i < opt.files; i++) {
+    snprintf(name, sizeof(name), "f%d.%d", c->me, i);
+    timed(creates, [&]() { return c->yfs->create(c->dir, name, inums[i]); });
+  }
+  finish(bn, creates);
+
+  begin(bn, stats);
+  for (int i = 0; i < opt.files; i++) {
+    snprintf(name, sizeof(name), "f%d.%d", c->me, i);
+    yfs_client::inum ino;
+    bool found = false;
+    yfs_client::fileinfo fin;
+    uint64_t t0 = now_ns();
+    if (c->yfs->lookup(c->dir, name, ino, &found) == yfs_client::OK && found &&
+        c->yfs->getfile(ino, fin) == yfs_client::OK)
+      stats->lat_ns.add(now_ns() - t0);
+    else
+      stats->errors++;
+  }
+  finish(bn, stats);
+
+  begin(bn, unlinks);
+  for (int i = 0; i < opt.files; i++) {
+    snprintf(name, sizeof(name), "f%d.%d", c->me, i);
+    timed(unlinks, [&]() { return c->yfs->unlink(c->dir, name); });
+  }
+  finish(bn, unlinks);
+}
+
+static void
+seq_io(bench *bn, client *c)
+{
+  phase *writes = bn->phases[0], *reads = bn->phases[1];
+  std::string block(opt.block, 'a' + c->me % 26);
+
+  begin(bn, writes);
+  for (int off = 0; off < opt.size; off += opt.block) {
+    size_t n = std::min(opt.block, opt.size - off);
+    if (timed(writes,
+              [&]() { return c->yfs->write(c->file, off, n, block.data()); }))
+      writes->bytes += n;
+  }
+  finish(bn, writes);
+
+  begin(bn, reads);
+  for (int off = 0; off < opt.size; off += opt.block) {
+    std::string buf;
+    size_t n = std::min(opt.block, opt.size - off);
+    if (timed(reads, [&]() { return c->yfs->read(c->file, off, n, buf); }) &&
+        buf.size() == n)
+      reads->bytes += n;
+  }
+  finish(bn, reads);
+}
+
+static void
+rand_io(bench *bn, client *c)
+{
+  phase *rw = bn->phases[0];
+  std::string block(opt.io, 'r');
+  // the file, written before the clock starts
+  std::string fill(opt.size, 'f');
+  VERIFY(c->yfs->write(c->file, 0, fill.size(), fill.data()) == yfs_client::OK);
+
+  begin(bn, rw);
+  int span = std::max(1, opt.size - opt.io);
+  for (int i = 0; i < opt.ops; i++) {
+    off_t off = rand_r(&c->seed) % span;
+    if (rand_r(&c->seed) & 1) {
+      std::string buf;
+      if (timed(rw, [&]() { return c->yfs->read(c->file, off, opt.io, buf); }))
+        rw->bytes += buf.size();
+    } else {
+      if (timed(rw, [&]() {
+            return c->yfs->write(c->file, off, opt.io, block.data()); }))
+        rw->bytes += opt.io;
+    }
+  }
+  finish(bn, rw);
+}
+
+static void *
+client_thread(void *x)
+{
+  std::pair<bench *, client *> *a = (std::pair<bench *, client *> *)x;
+  bench *bn = a->first;
+  client *c = a->second;
+  if (bn->workload == "seq")
+    seq_io(bn, c);
+  else if (bn->workload == "rand")
+    rand_io(bn, c);
+  else
+    meta(bn, c);
+  return 0;
+}
+
+static void
+report(const bench &bn, const phase &p)
+{
+  rpc_hist_snap h;
+  p.lat_ns.get(&h);
+  double secs = (p.end - p.start) / 1e9;
+  double ops_s = secs > 0 ? h.n / secs : 0;
+  double mb_s = secs > 0 ? p.bytes / secs / 1e6 : 0;
+  if (opt.json) {
+    printf("{\"workload\":\"%s\",\"phase\":\"%s\",\"clients\":%d,"
+           "\"ops\":%llu,\"errors\":%llu,\"secs\":%.6f,\"ops_per_s\":%.1f,"
+           "\"mb_per_s\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+           "\"p999_us\":%.1f,\"max_us\":%.1f}\n", bn.workload.c_str(), p.name,
+           bn.nclients, (unsigned long long)h.n,
+           (unsigned long long)p.errors.load(), secs, ops_s, mb_s,
+           h.at(0.5) / 1e3, h.at(0.99) / 1e3, h.at(0.999) / 1e3, h.max / 1e3);
+  } else {
+    if (!header) {
+      printf("workload,phase,clients,ops,errors,secs,ops_per_s,mb_per_s,"
+             "p50_us,p99_us,p999_us,max_us\n");
+      header = true;
+    }
+    printf("%s,%s,%d,%llu,%llu,%.6f,%.1f,%.2f,%.1f,%.1f,%.1f,%.1f\n",
+           bn.workload.c_str(), p.name, bn.nclients, (unsigned long long)h.n,
+           (unsigned long long)p.errors.load(), secs, ops_s, mb_s,
+           h.at(0.5) / 1e3, h.at(0.99) / 1e3, h.at(0.999) / 1e3, h.max / 1e3);
+  }
+  fflush(stdout);
+}
+
+static void
+run(const std::string &workload, int nclients, int round)
+{
+  bench bn;
+  bn.workload = workload;
+  bn.nclients = nclients;
+  if (workload == "seq") {
+    bn.phases.push_back(new phase("write"));
+    bn.phases.push_back(new phase("read"));
+  } else if (workload == "rand") {
+    bn.phases.push_back(new phase("randrw"));
+  } else {
+    bn.phases.push_back(new phase("create"));
+    bn.phases.push_back(new phase("stat"));
+    bn.phases.push_back(new phase("unlink"));
+  }
+
+  // set up outside the clock: a client each, its directory (or the
+  // shared one) under a directory for this run, and its file. a new
+  // directory is only in its maker's extent cache, flushed when its
+  // lock is revoked, so whoever makes one takes its lock too, as
+  // fuse's getattr after mkdir would.
+  while (pool.size() < (size_t)nclients + 1)
+    pool.push_back(new yfs_client(extent_dst, lock_dst));
+  yfs_client *setup = pool[0];
+  yfs_client::dirinfo din;
+  char name[64];
+  yfs_client::inum top, shared = 0;
+  snprintf(name, sizeof(name), "yfsbench.%d.%d", (int)getpid(), round);
+  VERIFY(setup->mkdir(1, name, 0777, top) == yfs_client::OK);
+  VERIFY(setup->getdir(top, din) == yfs_client::OK);
+  if (workload == "shared") {
+    VERIFY(setup->mkdir(top, "shared", 0777, shared) == yfs_client::OK);
+    VERIFY(setup->getdir(shared, din) == yfs_client::OK);
+  }
+  bn.clients.resize(nclients);
+  for (int i = 0; i < nclients; i++) {
+    client &c = bn.clients[i];
+    c.me = i;
+    c.seed = i + 1;
+    c.yfs = pool[i + 1];
+    c.dir = shared;
+    c.file = 0;
+    snprintf(name, sizeof(name), "c%d", i);
+    if (!shared) {
+      VERIFY(c.yfs->mkdir(top, name, 0777, c.dir) == yfs_client::OK);
+      VERIFY(c.yfs->getdir(c.dir, din) == yfs_client::OK);
+    }
+    if (workload == "seq" || workload == "rand")
+      VERIFY(c.yfs->create(c.dir, "data", c.file) == yfs_client::OK);
+  }
+
+  VERIFY(pthread_barrier_init(&bn.b, NULL, nclients) == 0);
+  std::vector<pthread_t> th(nclients);
+  std::vector<std::pair<bench *, client *> > args(nclients);
+  for (int i = 0; i < nclients; i++) {
+    args[i] = std::make_pair(&bn, &bn.clients[i]);
+    VERIFY(pthread_create(&th[i], NULL, client_thread, &args[i]) == 0);
+  }
+  for (int i = 0; i < nclients; i++)
+    VERIFY(pthread_join(th[i], NULL) == 0);
+  VERIFY(pthread_barrier_destroy(&bn.b) == 0);
+
+  for (unsigned i = 0; i < bn.phases.size(); i++) {
+    report(bn, *bn.phases[i]);
+    delete bn.phases[i];
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  std::vector<std::string> workloads = split("meta,shared,seq,rand");
+  std::vector<std::string> nclients = split("1,4");
+  opt.files = 200;
+  opt.size = 1 << 20;
+  opt.block = 65536;
+  opt.io = 4096;
+  opt.ops = 500;
+  opt.json = false;
+
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  int ch;
+  bool bad = false;
+  while (!bad && (ch = getopt(argc, argv, "w:c:n:s:b:i:o:e:l:j")) != -1) {
+    switch (ch) {
+      case 'w':
+        workloads = split(optarg);
+        break;
+      case 'c':
+        nclients = split(optarg);
+        break;
+      case 'n':
+        opt.files = atoi(optarg);
+        break;
+      case 's':
+        opt.size = atoi(optarg);
+        break;
+      case 'b':
+        opt.block = atoi(optarg);
+        break;
+      case 'i':
+        opt.io = atoi(optarg);
+        break;
+      case 'o':
+        opt.ops = atoi(optarg);
+        break;
+      case 'e':
+        extent_dst = optarg;
+        break;
+      case 'l':
+        lock_dst = optarg;
+        break;
+      case 'j':
+        opt.json = true;
+        break;
+      default:
+        bad = true;
+        break;
+    }
+  }
+  for (unsigned i = 0; i < workloads.size(); i++)
+    if (workloads[i] != "meta" && workloads[i] != "shared" &&
+        workloads[i] != "seq" && workloads[i] != "rand")
+      bad = true;
+  if (bad || optind != argc || opt.files < 1 || opt.size < 1 || opt.block < 1 ||
+      opt.io < 1 || opt.io > opt.size) {
+    fprintf(stderr, "usage: %s [-w meta,shared,seq,rand] [-c clients] "
+            "[-n files] [-s bytes] [-b bytes] [-i bytes] [-o ops] "
+            "[-e extent_dst] [-l lock_dst] [-j]\n", argv[0]);
+    exit(1);
+  }
+
+  // the servers, unless they're elsewhere
+  if (extent_dst.empty()) {
+    rpcs *es = new rpcs(0);
+    extent_server *ls = new extent_server;
+    es->reg(extent_protocol::get, ls, &extent_server::get);
+    es->reg(extent_protocol::getattr, ls, &extent_server::getattr);
+    es->reg(extent_protocol::put, ls, &extent_server::put);
+    es->reg(extent_protocol::remove, ls, &extent_server::remove);
+    es->add_stats(ls);
+    extent_dst = "127.0.0.1:" + std::to_string(es->port());
+  }
+  if (lock_dst.empty()) {
+    rpcs *lrpc = new rpcs(0);
+    lock_server_cache *lsc = new lock_server_cache;
+    lrpc->reg(lock_protocol::acquire, lsc, &lock_server_cache::acquire);
+    lrpc->reg(lock_protocol::release, lsc, &lock_server_cache::release);
+    lrpc->reg(lock_protocol::stat, lsc, &lock_server_cache::stat);
+    lock_dst = "127.0.0.1:" + std::to_string(lrpc->port());
+  }
+
+  int round = 0;
+  for (unsigned i = 0; i < workloads.size(); i++)
+    for (unsigned j = 0; j < nclients.size(); j++)
+      run(workloads[i], atoi(nclients[j].c_str()), round++);
+  return 0;
+}